@@ -0,0 +1,363 @@
+#include "acl.h"
+
+#include "ip.h"
+#include "log.h"
+#include "net.h"
+#include "utils.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * ルールがフィールドで一致する値の範囲
+ * @param rule
+ * @param field
+ * @param min
+ * @param max
+ */
+void get_acl_rule_range(const acl_rule *rule, int field, uint64_t *min, uint64_t *max)
+{
+	uint32_t prefix, prefix_len;
+	switch (field)
+	{
+	case acl_field_src_addr:
+	case acl_field_dest_addr:
+	{
+		prefix = field == acl_field_src_addr ? rule->src_prefix : rule->dest_prefix;
+		prefix_len = field == acl_field_src_addr ? rule->src_prefix_len : rule->dest_prefix_len;
+		uint32_t mask = prefix_len == 0 ? 0 : 0xffffffff << (32 - prefix_len);
+		*min = prefix & mask;
+		*max = (prefix & mask) | ~mask;
+		return;
+	}
+	case acl_field_protocol:
+		*min = rule->protocol == 0 ? 0 : rule->protocol;
+		*max = rule->protocol == 0 ? 0xff : rule->protocol;
+		return;
+	case acl_field_src_port:
+		*min = rule->src_port_min;
+		*max = rule->src_port_max;
+		return;
+	case acl_field_dest_port:
+	default:
+		*min = rule->dest_port_min;
+		*max = rule->dest_port_max;
+		return;
+	}
+}
+
+int compare_acl_point(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * 値が含まれる区間を二分探索する
+ * @param field
+ * @param value
+ * @return 区間の番号
+ */
+uint32_t find_acl_interval(const acl_field *field, uint32_t value)
+{
+	// base[0] <= value を保ったまま範囲を半分にしていく
+	// 分岐予測が当たらないので、条件分岐ではなく条件付きの代入で書く
+	const uint32_t *base = field->bounds;
+	uint32_t count = field->interval_count;
+	while (count > 1)
+	{
+		uint32_t half = count / 2;
+		base = base[half] <= value ? base + half : base;
+		count -= half;
+	}
+	return base - field->bounds;
+}
+
+/**
+ * フィールドを区間に分け、区間ごとのビットベクタを作る
+ * @param acl
+ * @param field_index
+ * @return
+ */
+bool compile_acl_field(acl_table *acl, int field_index)
+{
+	acl_field *field = &acl->fields[field_index];
+
+	// ルールの範囲の始まりと終わりの次を区間の境界にする
+	auto *points = (uint64_t *)calloc(acl->rule_count * 2 + 1, sizeof(uint64_t));
+	if (points == nullptr)
+	{
+		return false;
+	}
+	uint32_t point_count = 0;
+	points[point_count++] = 0;
+	for (uint32_t i = 0; i < acl->rule_count; ++i)
+	{
+		uint64_t min, max;
+		get_acl_rule_range(&acl->rules[i], field_index, &min, &max);
+		points[point_count++] = min;
+		if (max < 0xffffffff)
+		{
+			points[point_count++] = max + 1;
+		}
+	}
+	qsort(points, point_count, sizeof(uint64_t), compare_acl_point);
+
+	field->bounds = (uint32_t *)calloc(point_count, sizeof(uint32_t));
+	if (field->bounds == nullptr)
+	{
+		free(points);
+		return false;
+	}
+	field->interval_count = 0;
+	for (uint32_t i = 0; i < point_count; ++i)
+	{
+		if (i == 0 or points[i] != points[i - 1])
+		{
+			field->bounds[field->interval_count++] = points[i];
+		}
+	}
+	free(points);
+
+	field->bitmaps = (uint64_t *)aligned_alloc(32, (size_t)field->interval_count * acl->word_count * sizeof(uint64_t));
+	if (field->bitmaps == nullptr)
+	{
+		return false;
+	}
+	memset(field->bitmaps, 0, (size_t)field->interval_count * acl->word_count * sizeof(uint64_t));
+
+	// 境界はルールの範囲の端なので、範囲に含まれる区間は連続している
+	for (uint32_t i = 0; i < acl->rule_count; ++i)
+	{
+		uint64_t min, max;
+		get_acl_rule_range(&acl->rules[i], field_index, &min, &max);
+		uint32_t first = find_acl_interval(field, min);
+		uint32_t last = find_acl_interval(field, max);
+		for (uint32_t interval = first; interval <= last; ++interval)
+		{
+			field->bitmaps[(size_t)interval * acl->word_count + i / 64] |= 1ull << (i % 64);
+		}
+	}
+
+	acl->memory_size += field->interval_count * sizeof(uint32_t) + (size_t)field->interval_count * acl->word_count * sizeof(uint64_t);
+	return true;
+}
+
+/**
+ * 各フィールドのビットベクタの AND をとり、最初に立っているビットを探す (スカラー版)
+ * @param rows
+ * @param word_count
+ * @return 一致したルールの番号。なければ -1
+ */
+int32_t acl_match_first_scalar(const uint64_t *const rows[ACL_FIELD_NUM], uint32_t word_count)
+{
+	for (uint32_t w = 0; w < word_count; ++w)
+	{
+		uint64_t bits = rows[0][w] & rows[1][w] & rows[2][w] & rows[3][w] & rows[4][w];
+		if (bits != 0)
+		{
+			return w * 64 + __builtin_ctzll(bits);
+		}
+	}
+	return -1;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * AVX2 版
+ * 4 ワード (256 ルール) ずつ AND をとり、0 でなければその中から探す
+ */
+__attribute__((target("avx2"))) int32_t acl_match_first_avx2(const uint64_t *const rows[ACL_FIELD_NUM], uint32_t word_count)
+{
+	for (uint32_t w = 0; w < word_count; w += ACL_WORD_ALIGN)
+	{
+		__m256i bits = _mm256_load_si256(reinterpret_cast<const __m256i *>(rows[0] + w));
+		bits = _mm256_and_si256(bits, _mm256_load_si256(reinterpret_cast<const __m256i *>(rows[1] + w)));
+		bits = _mm256_and_si256(bits, _mm256_load_si256(reinterpret_cast<const __m256i *>(rows[2] + w)));
+		bits = _mm256_and_si256(bits, _mm256_load_si256(reinterpret_cast<const __m256i *>(rows[3] + w)));
+		bits = _mm256_and_si256(bits, _mm256_load_si256(reinterpret_cast<const __m256i *>(rows[4] + w)));
+		if (!_mm256_testz_si256(bits, bits))
+		{
+			uint64_t words[ACL_WORD_ALIGN];
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(words), bits);
+			for (int i = 0; i < ACL_WORD_ALIGN; ++i)
+			{
+				if (words[i] != 0)
+				{
+					return (w + i) * 64 + __builtin_ctzll(words[i]);
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+#endif
+
+int32_t (*acl_match_first)(const uint64_t *const rows[ACL_FIELD_NUM], uint32_t word_count) = acl_match_first_scalar;
+
+/**
+ * ルールのリストをコンパイルする
+ * @param rules 優先する順に並べたルール
+ * @param rule_count
+ * @param default_action どのルールにも一致しなかったときの動作
+ * @return 確保できなければ nullptr
+ */
+acl_table *acl_compile(const acl_rule *rules, uint32_t rule_count, acl_action default_action)
+{
+	uint64_t start = current_time_ns();
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		acl_match_first = acl_match_first_avx2;
+	}
+#endif
+
+	void *memory = aligned_alloc(alignof(acl_table), sizeof(acl_table));
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+	memset(memory, 0, sizeof(acl_table));
+	auto *acl = new (memory) acl_table();
+	acl->rule_count = rule_count;
+	acl->word_count = ((rule_count + 63) / 64 + ACL_WORD_ALIGN - 1) / ACL_WORD_ALIGN * ACL_WORD_ALIGN;
+	if (acl->word_count == 0)
+	{
+		acl->word_count = ACL_WORD_ALIGN;
+	}
+	acl->default_action = default_action;
+	acl->rules = (acl_rule *)calloc(rule_count == 0 ? 1 : rule_count, sizeof(acl_rule));
+	if (acl->rules == nullptr)
+	{
+		acl_free(acl);
+		return nullptr;
+	}
+	memcpy(acl->rules, rules, rule_count * sizeof(acl_rule));
+	acl->memory_size = sizeof(acl_table) + rule_count * sizeof(acl_rule);
+
+	for (int field = 0; field < ACL_FIELD_NUM; ++field)
+	{
+		if (!compile_acl_field(acl, field))
+		{
+			acl_free(acl);
+			return nullptr;
+		}
+	}
+
+	acl->compile_ns = current_time_ns() - start;
+	return acl;
+}
+
+/**
+ * コンパイルした ACL を解放する
+ * @param acl
+ */
+void acl_free(acl_table *acl)
+{
+	if (acl == nullptr)
+	{
+		return;
+	}
+	for (int field = 0; field < ACL_FIELD_NUM; ++field)
+	{
+		free(acl->fields[field].bounds);
+		free(acl->fields[field].bitmaps);
+	}
+	free(acl->rules);
+	free(acl);
+}
+
+/**
+ * フィールドの値から、一致する最も優先度の高いルールを探す
+ * @param acl
+ * @param values acl_field_type の順に並べた、ホストバイトオーダーの値
+ * @return ルールの番号。どのルールにも一致しなければ -1
+ */
+int32_t acl_classify(const acl_table *acl, const uint32_t values[ACL_FIELD_NUM])
+{
+	const uint64_t *rows[ACL_FIELD_NUM];
+	for (int field = 0; field < ACL_FIELD_NUM; ++field)
+	{
+		const acl_field *f = &acl->fields[field];
+		rows[field] = f->bitmaps + (size_t)find_acl_interval(f, values[field]) * acl->word_count;
+	}
+	return acl_match_first(rows, acl->word_count);
+}
+
+/**
+ * 受信した IP パケットを ACL で検査する
+ * ヘッダが壊れているパケットは判定せずに通し、ip_input で捨てる
+ * @param acl
+ * @param buffer IP パケットの先頭
+ * @param len
+ * @return 通してよければ true
+ */
+bool acl_permit(acl_table *acl, const uint8_t *buffer, size_t len)
+{
+	if (len < sizeof(ip_header))
+	{
+		return true;
+	}
+
+	auto *ip_packet = reinterpret_cast<const ip_header *>(buffer);
+	uint32_t values[ACL_FIELD_NUM];
+	values[acl_field_src_addr] = ntohl(ip_packet->src_addr);
+	values[acl_field_dest_addr] = ntohl(ip_packet->dest_addr);
+	values[acl_field_protocol] = ip_packet->protocol;
+	values[acl_field_src_port] = 0;
+	values[acl_field_dest_port] = 0;
+
+	// ポートは TCP と UDP の、最初のフラグメントだけから取り出せる
+	size_t header_len = ip_packet->header_len * 4;
+	if ((ip_packet->protocol == IP_PROTOCOL_NUM_TCP or ip_packet->protocol == IP_PROTOCOL_NUM_UDP) and
+			(ntohs(ip_packet->frag_offset) & 0x1fff) == 0 and len >= header_len + 4)
+	{
+		values[acl_field_src_port] = buffer[header_len] << 8 | buffer[header_len + 1];
+		values[acl_field_dest_port] = buffer[header_len + 2] << 8 | buffer[header_len + 3];
+	}
+
+	int32_t rule = acl_classify(acl, values);
+	acl_action action = rule < 0 ? acl->default_action : acl->rules[rule].action;
+	if (action == acl_action::deny)
+	{
+		acl_counters *counters = &acl->workers[worker_id];
+		counters->deny.store(counters->deny.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		LOG_IP("ACL denied %s => %s protocol %d (rule %d)\n", log_htoa(values[acl_field_src_addr]), log_htoa(values[acl_field_dest_addr]), values[acl_field_protocol], rule);
+		return false;
+	}
+	acl_counters *counters = &acl->workers[worker_id];
+	counters->permit.store(counters->permit.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * デバイスごとの ACL の大きさと統計を出力
+ */
+void dump_acl_stats()
+{
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev == nullptr or dev->ip_dev->acl == nullptr)
+		{
+			continue;
+		}
+
+		acl_table *acl = dev->ip_dev->acl;
+		uint64_t permit = 0, deny = 0;
+		for (uint32_t i = 0; i < WORKER_MAX; ++i)
+		{
+			permit += acl->workers[i].permit.load(std::memory_order_relaxed);
+			deny += acl->workers[i].deny.load(std::memory_order_relaxed);
+		}
+		printf("ACL on %s: %u rules, %zu bytes, compiled in %.3f ms, %lu permitted, %lu denied\n",
+					 dev->name, acl->rule_count, acl->memory_size, acl->compile_ns / 1e6, permit, deny);
+	}
+}
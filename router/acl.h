@@ -0,0 +1,88 @@
+#ifndef CURO_ACL_H
+#define CURO_ACL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "worker.h"
+
+/**
+ * 受信したパケットを IP の処理の前にフィルタする ACL
+ * ルールのリストは、フィールドごとの区間とビットベクタ (bit-vector 方式) にコンパイルして検索する
+ *  - フィールドごとに、ルールの範囲の境界で値の範囲を区間に分ける
+ *  - 区間ごとに、その区間を含むルールのビットを立てたビットベクタを持つ
+ *  - パケットの各フィールドの区間を二分探索し、ビットベクタの AND で最初に立っているビットが一致したルール
+ */
+
+#define ACL_FIELD_NUM 5
+#define ACL_WORD_ALIGN 4 // ビットベクタの長さ (64bit 単位)。AVX2 で 4 ワードずつ処理するので揃える
+
+enum class acl_action : uint8_t
+{
+	permit,
+	deny
+};
+
+enum acl_field_type
+{
+	acl_field_src_addr,
+	acl_field_dest_addr,
+	acl_field_protocol,
+	acl_field_src_port,
+	acl_field_dest_port
+};
+
+// ルール。値はホストバイトオーダーで、上にあるルールほど優先する
+// プロトコル番号 0 は全てのプロトコルに一致する。TCP と UDP 以外のパケットのポートは 0 として扱う
+struct acl_rule
+{
+	uint32_t src_prefix;
+	uint32_t src_prefix_len;
+	uint32_t dest_prefix;
+	uint32_t dest_prefix_len;
+	uint8_t protocol;
+	uint16_t src_port_min;
+	uint16_t src_port_max;
+	uint16_t dest_port_min;
+	uint16_t dest_port_max;
+	acl_action action;
+};
+
+// フィールドごとの区間とビットベクタ
+struct acl_field
+{
+	uint32_t interval_count;
+	uint32_t *bounds; // 区間の開始値 (昇順、先頭は 0)
+	uint64_t *bitmaps; // interval_count × word_count のビットベクタ
+};
+
+// ワーカーごとの統計。書き込むワーカーが違うカウンタは別のキャッシュラインに置く
+struct alignas(64) acl_counters
+{
+	std::atomic<uint64_t> permit;
+	std::atomic<uint64_t> deny;
+};
+
+struct acl_table
+{
+	uint32_t rule_count;
+	uint32_t word_count;
+	acl_rule *rules;
+	acl_action default_action; // どのルールにも一致しなかったときの動作
+	acl_field fields[ACL_FIELD_NUM];
+
+	size_t memory_size; // コンパイルした表のバイト数
+	uint64_t compile_ns; // コンパイルにかかった時間
+
+	acl_counters workers[WORKER_MAX];
+};
+
+acl_table *acl_compile(const acl_rule *rules, uint32_t rule_count, acl_action default_action);
+void acl_free(acl_table *acl);
+
+int32_t acl_classify(const acl_table *acl, const uint32_t values[ACL_FIELD_NUM]);
+bool acl_permit(acl_table *acl, const uint8_t *buffer, size_t len);
+
+void dump_acl_stats();
+
+#endif // CURO_ACL_H
@@ -1,63 +1,123 @@
 #include "arp.h"
 
 #include "ethernet.h"
+#include "flow_cache.h"
 #include "ip.h"
 #include "log.h"
 #include "my_buf.h"
+#include "napt.h"
+#include "net.h"
+#include "persist.h"
+#include "stats.h"
 #include "utils.h"
+#include <atomic>
 #include <cstring>
+#include <mutex>
 
 /**
  * ARP Table
- * グローバル変数にテーブルを保持
+ * 再起動しても引き継げるよう、共有メモリに確保する
  */
-arp_table_entry arp_table[ARP_TABLE_SIZE];
+arp_table_entry *arp_table;
 
 /**
- * ARP テーブルにエントリの追加と更新
- * @param dev
- * @param mac_addr
- * @param ip_addr
+ * アドレス解決待ちのエントリのリスト
+ * タイマーで ARP リクエストを再送するために保持する
  */
-void add_arp_table_entry(net_device *dev, uint8_t *mac_addr, uint32_t ip_addr)
+arp_table_entry *arp_incomplete_list = nullptr;
+
+/**
+ * ARP テーブルと解決待ちのリストのロック
+ * 全てのワーカーが同じテーブルを読み書きするので、このロックを取ってから触る
+ */
+std::mutex arp_table_mutex;
+
+/**
+ * 解決済みのエントリのコピーを、ワーカーごとに持つキャッシュ
+ * 転送のたびにロックを取らないよう、search_arp_table_entry はまずここを見る
+ * エントリの MAC アドレスかデバイスが変わったら arp_generation を進め、古い世代のコピーは使わない
+ */
+struct arp_cache_entry
 {
-	// 候補となるインデックスは、Hash テーブルの IP アドレスのハッシュ
-	const uint32_t index = ip_addr % ARP_TABLE_SIZE;
-	arp_table_entry *candidate = &arp_table[index];
+	uint64_t generation; // コピーしたときの arp_generation (0 なら空)
+	arp_table_entry *table; // コピー元のテーブル (シミュレーションではルータごとにテーブルを入れ替える)
+	uint32_t ip_addr;
+	uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+	net_device *dev;
+};
 
-	if (candidate->ip_addr == 0 or candidate->ip_addr == ip_addr)
+std::atomic<uint64_t> arp_generation{1};
+thread_local arp_cache_entry arp_cache[ARP_CACHE_SIZE];
+
+/**
+ * 前のプロセスから引き継いだエントリを、このプロセスで使えるようにする
+ * デバイスは名前で付け直し、解決待ちのパケットはプロセスと一緒に失われているので捨てる
+ * @param entry
+ */
+void restore_arp_table_entry(arp_table_entry *entry)
+{
+	entry->dev = nullptr;
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
 	{
-		memcpy(candidate->mac_addr, mac_addr, 6);
-		candidate->ip_addr = ip_addr;
-		candidate->dev = dev;
-		return;
+		if (strcmp(dev->name, entry->dev_name) == 0)
+		{
+			entry->dev = dev;
+			break;
+		}
 	}
 
-	while (candidate->next != nullptr)
+	// 解決待ちのエントリとデバイスがなくなったエントリは、次に送信するときに解決し直す
+	if (entry->state == arp_entry_state::incomplete or entry->dev == nullptr)
 	{
-		candidate = candidate->next;
-		if (candidate->ip_addr == ip_addr)
+		entry->state = arp_entry_state::incomplete;
+		entry->retry_count = 0;
+	}
+	entry->pending_count = 0;
+	memset(entry->pending, 0, sizeof(entry->pending));
+	entry->incomplete_next = nullptr;
+}
+
+/**
+ * ARP テーブルを確保する
+ * 前のプロセスが共有メモリに残したテーブルがあれば引き継ぐ
+ */
+void init_arp_table()
+{
+	arp_table = (arp_table_entry *)persist_get_root("arp");
+	if (arp_table == nullptr)
+	{
+		arp_table = (arp_table_entry *)persist_calloc(ARP_TABLE_SIZE, sizeof(arp_table_entry));
+		if (arp_table == nullptr)
 		{
-			memcpy(candidate->mac_addr, mac_addr, 6);
-			candidate->ip_addr = ip_addr;
-			candidate->dev = dev;
-			return;
+			LOG_ERROR("Failed to allocate ARP table\n");
+			exit(EXIT_FAILURE);
 		}
+		persist_set_root("arp", arp_table);
+		return;
 	}
 
-	// 連結リストの末尾に新しくエントリを作成
-	candidate->next = (arp_table_entry *)calloc(1, sizeof(arp_table_entry));
-	memcpy(candidate->next->mac_addr, mac_addr, 6);
-	candidate->next->ip_addr = ip_addr;
-	candidate->next->dev = dev;
+	uint32_t restored = 0;
+	for (int i = 0; i < ARP_TABLE_SIZE; ++i)
+	{
+		for (arp_table_entry *entry = &arp_table[i]; entry != nullptr and entry->ip_addr != 0; entry = entry->next)
+		{
+			restore_arp_table_entry(entry);
+			if (entry->state == arp_entry_state::reachable)
+			{
+				restored++;
+			}
+		}
+	}
+	printf("Restored %u arp table entries\n", restored);
 }
 
 /**
- * ARP テーブルの検索
+ * ARP テーブルからエントリを探す (解決待ちのエントリも含む)
+ * arp_table_mutex を取ってから呼ぶ
  * @param ip_addr
  * @return
  */
-arp_table_entry *search_arp_table_entry(uint32_t ip_addr)
+arp_table_entry *find_arp_table_entry(uint32_t ip_addr)
 {
 	arp_table_entry *candidate = &arp_table[ip_addr % ARP_TABLE_SIZE];
 
@@ -65,7 +125,7 @@ arp_table_entry *search_arp_table_entry(uint32_t ip_addr)
 	{
 		return candidate;
 	}
-	else if (candidate->ip_addr = 0)
+	else if (candidate->ip_addr == 0)
 	{
 		return nullptr;
 	}
@@ -82,6 +142,255 @@ arp_table_entry *search_arp_table_entry(uint32_t ip_addr)
 	return nullptr;
 }
 
+/**
+ * IP アドレスに対応するエントリの領域を返す。なければ作成する
+ * arp_table_mutex を取ってから呼ぶ
+ * @param ip_addr
+ * @return 作成できなければ nullptr
+ */
+arp_table_entry *allocate_arp_table_entry(uint32_t ip_addr)
+{
+	// 候補となるインデックスは、Hash テーブルの IP アドレスのハッシュ
+	const uint32_t index = ip_addr % ARP_TABLE_SIZE;
+	arp_table_entry *candidate = &arp_table[index];
+
+	if (candidate->ip_addr == 0 or candidate->ip_addr == ip_addr)
+	{
+		return candidate;
+	}
+
+	while (candidate->next != nullptr)
+	{
+		candidate = candidate->next;
+		if (candidate->ip_addr == ip_addr)
+		{
+			return candidate;
+		}
+	}
+
+	// 連結リストの末尾に新しくエントリを作成
+	candidate->next = (arp_table_entry *)persist_calloc(1, sizeof(arp_table_entry));
+	return candidate->next;
+}
+
+/**
+ * アドレス解決待ちのパケットを全て送信する
+ * @param entry
+ */
+void flush_arp_pending_queue(arp_table_entry *entry)
+{
+	for (int i = 0; i < entry->pending_count; ++i)
+	{
+		ethernet_encapsulate_output(entry->dev, entry->mac_addr, entry->pending[i], ETHER_TYPE_IP);
+		entry->pending[i] = nullptr;
+	}
+	entry->pending_count = 0;
+}
+
+/**
+ * アドレス解決待ちのパケットを全て破棄する
+ * @param entry
+ */
+void drop_arp_pending_queue(arp_table_entry *entry)
+{
+	for (int i = 0; i < entry->pending_count; ++i)
+	{
+		count_drop(entry->dev, drop_reason::arp_miss);
+		my_buf::my_buf_free(entry->pending[i], true);
+		entry->pending[i] = nullptr;
+	}
+	entry->pending_count = 0;
+}
+
+/**
+ * ARP テーブルにエントリの追加と更新
+ * @param dev
+ * @param mac_addr
+ * @param ip_addr
+ */
+void add_arp_table_entry(net_device *dev, uint8_t *mac_addr, uint32_t ip_addr)
+{
+	std::lock_guard<std::mutex> lock(arp_table_mutex);
+	arp_table_entry *entry = allocate_arp_table_entry(ip_addr);
+	if (entry == nullptr)
+	{
+		LOG_WARN(ARP, "Failed to allocate ARP entry for %s\n", log_htoa(ip_addr));
+		return;
+	}
+
+	// 転送先が変わったら、キャッシュした Ethernet ヘッダを使わせない
+	if (entry->state == arp_entry_state::reachable and (entry->dev != dev or memcmp(entry->mac_addr, mac_addr, 6) != 0))
+	{
+		flow_cache_invalidate();
+		arp_generation.fetch_add(1, std::memory_order_release);
+	}
+
+	memcpy(entry->mac_addr, mac_addr, 6);
+	entry->ip_addr = ip_addr;
+	entry->dev = dev;
+	strcpy(entry->dev_name, dev->name);
+
+	// 解決待ちだったら、溜まっていたパケットをすぐに送信する
+	// 解決待ちリストからは arp_timer で取り除かれる
+	if (entry->state == arp_entry_state::incomplete)
+	{
+		entry->state = arp_entry_state::reachable;
+		entry->retry_count = 0;
+		flush_arp_pending_queue(entry);
+	}
+}
+
+/**
+ * ARP テーブルの検索
+ * MAC アドレスが解決済みなら、MAC アドレスと送信するデバイスをコピーする
+ * エントリは他のワーカーが書き換えるので、ロックの外で読めるポインタは返さない
+ * ワーカーごとのキャッシュにあればロックを取らない
+ * @param ip_addr
+ * @param mac_addr MAC アドレスを書き込む領域 (ETHERNET_ADDRESS_LEN バイト)
+ * @param dev 送信するデバイス
+ * @return 解決済みのエントリがなければ false
+ */
+bool search_arp_table_entry(uint32_t ip_addr, uint8_t *mac_addr, net_device **dev)
+{
+	arp_cache_entry *cached = &arp_cache[(ip_addr * 0x9e3779b1) >> 24 & (ARP_CACHE_SIZE - 1)];
+	if (cached->generation == arp_generation.load(std::memory_order_acquire) and cached->ip_addr == ip_addr and cached->table == arp_table)
+	{
+		memcpy(mac_addr, cached->mac_addr, ETHERNET_ADDRESS_LEN);
+		*dev = cached->dev;
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(arp_table_mutex);
+	arp_table_entry *entry = find_arp_table_entry(ip_addr);
+
+	if (entry == nullptr or entry->state != arp_entry_state::reachable)
+	{
+		return false;
+	}
+	memcpy(mac_addr, entry->mac_addr, ETHERNET_ADDRESS_LEN);
+	*dev = entry->dev;
+
+	// 世代はロックを持ったまま進めるので、ここで読んだ世代のあいだはコピーが正しい
+	cached->generation = arp_generation.load(std::memory_order_relaxed);
+	cached->table = arp_table;
+	cached->ip_addr = ip_addr;
+	memcpy(cached->mac_addr, entry->mac_addr, ETHERNET_ADDRESS_LEN);
+	cached->dev = entry->dev;
+	return true;
+}
+
+/**
+ * ARP で MAC アドレスを解決してイーサネットで送信する
+ * 未解決の場合はパケットをキューに入れ、ARP リクエストはエントリごとに 1 回だけ送信する
+ * @param dev 解決に使うデバイス
+ * @param ip_addr 解決する IP アドレス
+ * @param buffer 送信する IP パケット
+ */
+void arp_resolve_output(net_device *dev, uint32_t ip_addr, my_buf *buffer)
+{
+	uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+	net_device *output_dev;
+	if (search_arp_table_entry(ip_addr, mac_addr, &output_dev))
+	{
+		ethernet_encapsulate_output(output_dev, mac_addr, buffer, ETHER_TYPE_IP);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(arp_table_mutex);
+	arp_table_entry *entry = find_arp_table_entry(ip_addr);
+
+	// 検索してからロックを取るまでに解決されていたら、送信はロックを離してから行う
+	if (entry != nullptr and entry->state == arp_entry_state::reachable)
+	{
+		memcpy(mac_addr, entry->mac_addr, ETHERNET_ADDRESS_LEN);
+		output_dev = entry->dev;
+		lock.unlock();
+		ethernet_encapsulate_output(output_dev, mac_addr, buffer, ETHER_TYPE_IP);
+		return;
+	}
+
+	if (entry == nullptr)
+	{
+		entry = allocate_arp_table_entry(ip_addr);
+		if (entry == nullptr)
+		{
+			LOG_WARN(ARP, "Failed to allocate ARP entry for %s\n", log_htoa(ip_addr));
+			count_drop(dev, drop_reason::arp_miss);
+			my_buf::my_buf_free(buffer, true);
+			return;
+		}
+		entry->ip_addr = ip_addr;
+		entry->state = arp_entry_state::incomplete;
+		entry->retry_count = 0;
+	}
+
+	// キューが溢れたら一番古いパケットを捨てる
+	if (entry->pending_count == ARP_PENDING_QUEUE_SIZE)
+	{
+		LOG_ARP("Pending queue for %s is full, dropped oldest packet\n", log_htoa(ip_addr));
+		count_drop(dev, drop_reason::arp_miss);
+		my_buf::my_buf_free(entry->pending[0], true);
+		memmove(&entry->pending[0], &entry->pending[1], sizeof(my_buf *) * (ARP_PENDING_QUEUE_SIZE - 1));
+		entry->pending_count--;
+	}
+	entry->pending[entry->pending_count++] = buffer;
+
+	// 解決中でなければ ARP リクエストを送信して解決待ちリストに入れる
+	if (entry->retry_count == 0)
+	{
+		entry->dev = dev;
+		strcpy(entry->dev_name, dev->name);
+		entry->retry_count = 1;
+		entry->last_request_time = current_time_ms();
+		entry->incomplete_next = arp_incomplete_list;
+		arp_incomplete_list = entry;
+		send_arp_request(dev, ip_addr);
+	}
+}
+
+/**
+ * 解決待ちのエントリの ARP リクエストを再送する
+ * 最大回数再送しても応答がなければ、キューのパケットを破棄する
+ */
+void arp_timer()
+{
+	std::lock_guard<std::mutex> lock(arp_table_mutex);
+	uint64_t now = current_time_ms();
+
+	arp_table_entry **link = &arp_incomplete_list;
+	while (*link != nullptr)
+	{
+		arp_table_entry *entry = *link;
+
+		// 解決済みのエントリはリストから外す
+		if (entry->state != arp_entry_state::incomplete)
+		{
+			*link = entry->incomplete_next;
+			entry->incomplete_next = nullptr;
+			continue;
+		}
+
+		if (now - entry->last_request_time >= ARP_REQUEST_RETRANSMIT_MS)
+		{
+			if (entry->retry_count >= ARP_REQUEST_MAX_RETRY)
+			{
+				LOG_WARN(ARP, "No arp reply from %s, dropped %d pending packets\n", log_htoa(entry->ip_addr), entry->pending_count);
+				drop_arp_pending_queue(entry);
+				entry->retry_count = 0;
+				*link = entry->incomplete_next;
+				entry->incomplete_next = nullptr;
+				continue;
+			}
+
+			entry->retry_count++;
+			entry->last_request_time = now;
+			send_arp_request(entry->dev, entry->ip_addr);
+		}
+
+		link = &entry->incomplete_next;
+	}
+}
+
 /**
  * ARP Request の送信
  * @param dev
@@ -89,7 +398,7 @@ arp_table_entry *search_arp_table_entry(uint32_t ip_addr)
  */
 void send_arp_request(net_device *dev, uint32_t ip_addr)
 {
-	LOG_ARP("Sending arp request via %s for %s\n", dev->name, ip_htoa(ip_addr));
+	LOG_ARP("Sending arp request via %s for %s\n", dev->name, log_htoa(ip_addr));
 
 	auto *arp_mybuf = my_buf::create(ARP_ETHERNET_PACKET_LEN);
 	auto *arp_msg = reinterpret_cast<arp_ip_to_ethernet *>(arp_mybuf->buffer);
@@ -160,6 +469,34 @@ void arp_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
 	}
 }
 
+/**
+ * デバイスが ARP に応答すべきアドレスか
+ * 自分のアドレスと、デバイスのネットワークに含まれる NAPT の外側アドレスのプールが対象
+ * @param dev
+ * @param addr
+ * @return
+ */
+bool is_arp_target_address(net_device *dev, uint32_t addr)
+{
+	if (dev->ip_dev->address == addr)
+	{
+		return true;
+	}
+
+	if (!in_subnet(dev->ip_dev->address, dev->ip_dev->netmask, addr))
+	{
+		return false;
+	}
+	for (net_device *nat_dev_owner = net_dev_list; nat_dev_owner; nat_dev_owner = nat_dev_owner->next)
+	{
+		if (nat_dev_owner->ip_dev != nullptr and nat_dev_owner->ip_dev->nat_dev != nullptr and is_nat_global_address(nat_dev_owner->ip_dev->nat_dev, addr))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 /**
  * ARP Request Packet の受信処理
  * @param dev
@@ -171,9 +508,9 @@ void arp_request_arrives(net_device *dev, arp_ip_to_ethernet *request)
 	if (dev->ip_dev != nullptr and dev->ip_dev->address != IP_ADDRESS(0, 0, 0, 0))
 	{
 		// 要求されているアドレスが自分のものだったら
-		if (dev->ip_dev->address == ntohl(request->tpa))
+		if (is_arp_target_address(dev, ntohl(request->tpa)))
 		{
-			LOG_ARP("Sending arp reply via %s\n", ip_ntoa(request->tpa));
+			LOG_ARP("Sending arp reply via %s\n", log_ntoa(request->tpa));
 
 			auto *reply_mybuf = my_buf::create(ARP_ETHERNET_PACKET_LEN);
 
@@ -186,7 +523,7 @@ void arp_request_arrives(net_device *dev, arp_ip_to_ethernet *request)
 
 			// 返答の情報を書き込む
 			memcpy(reply_msg->sha, dev->mac_addr, ETHERNET_ADDRESS_LEN);
-			reply_msg->spa = htonl(dev->ip_dev->address);
+			reply_msg->spa = request->tpa;
 			memcpy(reply_msg->tha, request->sha, ETHERNET_ADDRESS_LEN);
 			reply_msg->tpa = request->spa;
 
@@ -209,7 +546,7 @@ void arp_reply_arrives(net_device *dev, arp_ip_to_ethernet *reply)
 	// IP Address が設定されているデバイスからの受信だったら
 	if (dev->ip_dev != nullptr and dev->ip_dev->address != IP_ADDRESS(0, 0, 0, 0))
 	{
-		LOG_ARP("Adred arp table entry by arp reply (%s => %s)\n", ip_ntoa(reply->spa), mac_addr_toa(reply->sha));
+		LOG_ARP("Adred arp table entry by arp reply (%s => %s)\n", log_ntoa(reply->spa), log_mac(reply->sha));
 	}
 	// ARP Table エントリの追加
 	add_arp_table_entry(dev, reply->sha, ntohl(reply->spa));
@@ -11,25 +11,53 @@
 #define ARP_ETHERNET_PACKET_LEN 46
 
 #define ARP_TABLE_SIZE 1111
+#define ARP_CACHE_SIZE 256 // ワーカーごとの解決済みエントリのキャッシュの大きさ (2 のべき乗)
+
+#define ARP_PENDING_QUEUE_SIZE 8 // アドレス解決待ちでキューに入れておけるパケット数
+#define ARP_REQUEST_RETRANSMIT_MS 1000 // ARP リクエストの再送間隔
+#define ARP_REQUEST_MAX_RETRY 3 // ARP リクエストの最大再送回数
 
 struct net_device;
+struct my_buf;
+
+enum class arp_entry_state
+{
+	reachable, // MAC アドレス解決済み
+	incomplete // ARP リクエストを送信して応答待ち
+};
 
 struct arp_table_entry
 {
 	uint8_t mac_addr[6];
 	uint32_t ip_addr;
 	net_device *dev;
+	char dev_name[32]; // 再起動後に dev を付け直すためのデバイス名
+	arp_entry_state state;
+	uint8_t retry_count; // 送信した ARP リクエストの回数
+	uint8_t pending_count; // キューに入っているパケット数
+	uint64_t last_request_time; // 最後に ARP リクエストを送信した時刻 (ms)
+	my_buf *pending[ARP_PENDING_QUEUE_SIZE]; // アドレス解決待ちのパケット
+	arp_table_entry *incomplete_next; // 解決待ちエントリのリスト
 	arp_table_entry *next;
 };
 
+extern arp_table_entry *arp_table;
+extern arp_table_entry *arp_incomplete_list;
+
+void init_arp_table();
+
 void add_arp_table_entry(net_device *dev, uint8_t *mac_addr, uint32_t ip_addr);
 
-arp_table_entry *search_arp_table_entry(uint32_t ip_addr);
+bool search_arp_table_entry(uint32_t ip_addr, uint8_t *mac_addr, net_device **dev);
 
 void dump_arp_table_entry();
 
 void send_arp_request(net_device *dev, uint32_t ip_addr);
 
+void arp_resolve_output(net_device *dev, uint32_t ip_addr, my_buf *buffer);
+
+void arp_timer();
+
 struct arp_ip_to_ethernet
 {
 	uint16_t htype; // ハードウェアタイプ
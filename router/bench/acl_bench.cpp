@@ -0,0 +1,146 @@
+#include "acl.h"
+#include "bench.h"
+#include "utils.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * ルール数を変えて、ACL のコンパイル時間・メモリ・1 パケットあたりの分類時間を測る
+ * 結果がルールを順に調べた場合と一致するかも確かめる
+ */
+
+#define ACL_BENCH_PACKETS 4096 // 分類するパケットの種類
+#define ACL_BENCH_ITERATIONS 2000000 // 分類を繰り返す回数
+
+volatile int64_t acl_bench_sink; // 分類の結果を使い、計測するループが消されないようにする
+
+/**
+ * ランダムなルールを作る
+ * 実際の ACL に近づけるため、プレフィックスやポートはいくつかの候補から選ぶ
+ * @param rule
+ */
+void make_random_rule(acl_rule *rule)
+{
+	const uint32_t prefix_lens[] = {0, 16, 24, 24, 32, 32, 32, 32};
+	const uint8_t protocols[] = {0, 1, 6, 17};
+
+	rule->src_prefix = random_u32();
+	rule->src_prefix_len = prefix_lens[random_u32() % 8];
+	rule->dest_prefix = random_u32();
+	rule->dest_prefix_len = prefix_lens[random_u32() % 8];
+	rule->protocol = protocols[random_u32() % 4];
+	rule->src_port_min = 0;
+	rule->src_port_max = 0xffff;
+	if (random_u32() % 2 == 0)
+	{
+		rule->dest_port_min = random_u32() % 1024;
+		rule->dest_port_max = rule->dest_port_min + random_u32() % 16;
+	}
+	else
+	{
+		rule->dest_port_min = 0;
+		rule->dest_port_max = 0xffff;
+	}
+	rule->action = random_u32() % 2 == 0 ? acl_action::permit : acl_action::deny;
+}
+
+/**
+ * ルールを上から順に調べる
+ * @param rules
+ * @param rule_count
+ * @param values
+ * @return
+ */
+int32_t classify_linear(const acl_rule *rules, uint32_t rule_count, const uint32_t values[ACL_FIELD_NUM])
+{
+	for (uint32_t i = 0; i < rule_count; ++i)
+	{
+		const acl_rule *rule = &rules[i];
+		uint32_t src_mask = rule->src_prefix_len == 0 ? 0 : 0xffffffff << (32 - rule->src_prefix_len);
+		uint32_t dest_mask = rule->dest_prefix_len == 0 ? 0 : 0xffffffff << (32 - rule->dest_prefix_len);
+		if ((values[acl_field_src_addr] & src_mask) == (rule->src_prefix & src_mask) and
+				(values[acl_field_dest_addr] & dest_mask) == (rule->dest_prefix & dest_mask) and
+				(rule->protocol == 0 or values[acl_field_protocol] == rule->protocol) and
+				rule->src_port_min <= values[acl_field_src_port] and values[acl_field_src_port] <= rule->src_port_max and
+				rule->dest_port_min <= values[acl_field_dest_port] and values[acl_field_dest_port] <= rule->dest_port_max)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int main()
+{
+	const uint32_t rule_counts[] = {16, 256, 1024, 4096};
+
+	printf("%6s %12s %12s %10s %10s\n", "rules", "compile ms", "bytes", "ns/pkt", "linear ns");
+	for (uint32_t rule_count : rule_counts)
+	{
+		auto *rules = (acl_rule *)calloc(rule_count, sizeof(acl_rule));
+		for (uint32_t i = 0; i < rule_count; ++i)
+		{
+			make_random_rule(&rules[i]);
+		}
+		acl_table *acl = acl_compile(rules, rule_count, acl_action::permit);
+		if (acl == nullptr)
+		{
+			printf("failed to compile %u rules\n", rule_count);
+			return EXIT_FAILURE;
+		}
+
+		// 半分はルールから作ったパケットにして、一致するルールがあるようにする
+		auto *packets = (uint32_t *)calloc(ACL_BENCH_PACKETS * ACL_FIELD_NUM, sizeof(uint32_t));
+		for (uint32_t i = 0; i < ACL_BENCH_PACKETS; ++i)
+		{
+			uint32_t *values = &packets[i * ACL_FIELD_NUM];
+			const acl_rule *rule = &rules[random_u32() % rule_count];
+			bool from_rule = random_u32() % 2 == 0;
+			values[acl_field_src_addr] = from_rule ? rule->src_prefix : random_u32();
+			values[acl_field_dest_addr] = from_rule ? rule->dest_prefix : random_u32();
+			values[acl_field_protocol] = from_rule and rule->protocol != 0 ? rule->protocol : 6;
+			values[acl_field_src_port] = random_u32() & 0xffff;
+			values[acl_field_dest_port] = from_rule ? rule->dest_port_min : random_u32() % 2048;
+
+			int32_t expected = classify_linear(rules, rule_count, values);
+			int32_t actual = acl_classify(acl, values);
+			if (actual != expected)
+			{
+				printf("%u rules: classify mismatch %d != %d\n", rule_count, actual, expected);
+				return EXIT_FAILURE;
+			}
+		}
+
+		int64_t sum = 0;
+		bench_measure measure;
+		bench_start(&measure);
+		for (uint32_t n = 0; n < ACL_BENCH_ITERATIONS; ++n)
+		{
+			sum += acl_classify(acl, &packets[(n % ACL_BENCH_PACKETS) * ACL_FIELD_NUM]);
+		}
+		bench_stop(&measure);
+		double ns = measure.ns / ACL_BENCH_ITERATIONS;
+
+		// 順に調べる場合は遅いので回数を減らす
+		uint32_t linear_iterations = ACL_BENCH_ITERATIONS / 16;
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t n = 0; n < linear_iterations; ++n)
+		{
+			sum += classify_linear(rules, rule_count, &packets[(n % ACL_BENCH_PACKETS) * ACL_FIELD_NUM]);
+		}
+		auto end = std::chrono::steady_clock::now();
+		double linear_ns = std::chrono::duration<double, std::nano>(end - start).count() / linear_iterations;
+
+		acl_bench_sink = sum;
+		printf("%6u %12.3f %12zu %10.1f %10.1f\n", rule_count, acl->compile_ns / 1e6, acl->memory_size, ns, linear_ns);
+		char params[64];
+		snprintf(params, sizeof(params), "rules=%u", rule_count);
+		bench_write_json("acl", "classify", params, ACL_BENCH_ITERATIONS, &measure, static_cast<double>(acl->memory_size) / rule_count);
+
+		acl_free(acl);
+		free(packets);
+		free(rules);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#include "arp.h"
+#include "bench.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "net.h"
+#include "stats.h"
+#include "utils.h"
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * ホスト数を変えて、ARP テーブルの登録と検索の時間とメモリを測る
+ * テーブルのバケット数 (ARP_TABLE_SIZE) は固定なので、ホストが多いとチェインが伸びる
+ * エントリあたりのメモリには、バケットの配列も含む
+ */
+
+#define ARP_BENCH_ITERATIONS 4000000
+
+volatile uintptr_t arp_bench_sink;
+
+int main()
+{
+	const uint32_t host_counts[] = {100, 1000, 10000, 100000};
+
+	auto *dev = (net_device *)calloc(1, sizeof(net_device));
+	strcpy(dev->name, "bench0");
+	init_net_device_stats(dev);
+
+	bench_print_header();
+	for (uint32_t host_count : host_counts)
+	{
+		// 加入者のネットワークのように、連続したアドレスのホストを登録する
+		auto *addrs = (uint32_t *)malloc(host_count * sizeof(uint32_t));
+		auto *macs = (uint8_t *)malloc(host_count * ETHERNET_ADDRESS_LEN);
+		for (uint32_t i = 0; i < host_count; ++i)
+		{
+			addrs[i] = IP_ADDRESS(10, 0, 0, 1) + i;
+			uint32_t r = random_u32();
+			uint8_t mac[ETHERNET_ADDRESS_LEN] = {0x02, 0x00, (uint8_t)(r >> 24), (uint8_t)(r >> 16), (uint8_t)(r >> 8), (uint8_t)r};
+			memcpy(&macs[i * ETHERNET_ADDRESS_LEN], mac, ETHERNET_ADDRESS_LEN);
+		}
+		auto *order = (uint32_t *)malloc(host_count * sizeof(uint32_t));
+		for (uint32_t i = 0; i < host_count; ++i)
+		{
+			order[i] = i;
+		}
+		for (uint32_t i = host_count - 1; i > 0; --i)
+		{
+			std::swap(order[i], order[random_u32() % (i + 1)]);
+		}
+
+		char params[64];
+		snprintf(params, sizeof(params), "hosts=%u", host_count);
+
+		// テーブルは作り直す (前のテーブルは解放しない)
+		size_t heap_before = bench_heap_used();
+		init_arp_table();
+		bench_measure measure;
+		bench_start(&measure);
+		for (uint32_t i = 0; i < host_count; ++i)
+		{
+			add_arp_table_entry(dev, &macs[order[i] * ETHERNET_ADDRESS_LEN], addrs[order[i]]);
+		}
+		bench_stop(&measure);
+		double bytes_per_host = static_cast<double>(bench_heap_used() - heap_before) / host_count;
+		bench_report("arp", "add", params, host_count, &measure, bytes_per_host);
+
+		uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+		net_device *output_dev;
+		for (uint32_t i = 0; i < host_count; ++i)
+		{
+			if (!search_arp_table_entry(addrs[i], mac_addr, &output_dev) or memcmp(mac_addr, &macs[i * ETHERNET_ADDRESS_LEN], ETHERNET_ADDRESS_LEN) != 0)
+			{
+				printf("arp: entry for host %u was not found\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+
+		uintptr_t sum = 0;
+		bench_start(&measure);
+		for (uint32_t n = 0; n < ARP_BENCH_ITERATIONS; ++n)
+		{
+			sum += search_arp_table_entry(addrs[order[n % host_count]], mac_addr, &output_dev) ? mac_addr[5] : 0;
+		}
+		bench_stop(&measure);
+		arp_bench_sink = sum;
+		bench_report("arp", "search", params, ARP_BENCH_ITERATIONS, &measure, -1);
+
+		free(order);
+		free(macs);
+		free(addrs);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+#ifndef CURO_BENCH_H
+#define CURO_BENCH_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * ベンチマークの共通処理
+ * 1 回あたりの時間に加えて、perf_event_open が使えればキャッシュミスと命令数も測る
+ * 環境変数 CURO_BENCH_JSON にファイル名を指定すると、結果を 1 行 1 件の JSON で追記するので、
+ * バージョン間で比べるときは make bench-json の出力を diff する
+ */
+
+struct bench_measure
+{
+	std::chrono::steady_clock::time_point start;
+	double ns;
+	int64_t cache_misses; // 測れなければ -1
+	int64_t instructions; // 測れなければ -1
+};
+
+inline int bench_cache_miss_fd = -2; // -2 は未初期化、-1 は使えない
+inline int bench_instruction_fd = -2;
+inline FILE *bench_json = nullptr;
+
+/**
+ * このプロセスのユーザー空間だけを数えるハードウェアカウンタを開く
+ * コンテナや VM では許可されていないことが多いので、開けなければ -1 を返し、その値は測らない
+ */
+inline int bench_open_counter(uint64_t config)
+{
+	perf_event_attr attr{};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd == -1)
+	{
+		fprintf(stderr, "perf_event_open failed: %s (counters are not reported)\n", strerror(errno));
+	}
+	return fd;
+}
+
+inline void bench_init()
+{
+	if (bench_cache_miss_fd != -2)
+	{
+		return;
+	}
+	bench_cache_miss_fd = bench_open_counter(PERF_COUNT_HW_CACHE_MISSES);
+	bench_instruction_fd = bench_cache_miss_fd != -1 ? bench_open_counter(PERF_COUNT_HW_INSTRUCTIONS) : -1;
+
+	const char *path = getenv("CURO_BENCH_JSON");
+	if (path != nullptr and path[0] != '\0')
+	{
+		bench_json = fopen(path, "a");
+		if (bench_json == nullptr)
+		{
+			fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		}
+	}
+}
+
+inline void bench_counter_start(int fd)
+{
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+inline int64_t bench_counter_stop(int fd)
+{
+	uint64_t value;
+	if (fd < 0)
+	{
+		return -1;
+	}
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+	{
+		return -1;
+	}
+	return value;
+}
+
+inline void bench_start(bench_measure *measure)
+{
+	bench_init();
+	bench_counter_start(bench_cache_miss_fd);
+	bench_counter_start(bench_instruction_fd);
+	measure->start = std::chrono::steady_clock::now();
+}
+
+inline void bench_stop(bench_measure *measure)
+{
+	auto end = std::chrono::steady_clock::now();
+	measure->cache_misses = bench_counter_stop(bench_cache_miss_fd);
+	measure->instructions = bench_counter_stop(bench_instruction_fd);
+	measure->ns = std::chrono::duration<double, std::nano>(end - measure->start).count();
+}
+
+/**
+ * malloc で確保中のバイト数 (テーブルのメモリ使用量を、確保の前後の差で求める)
+ * 大きな領域は mmap で確保されるので、その分も足す
+ */
+inline size_t bench_heap_used()
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+/**
+ * key=value,key=value を JSON のメンバーとして書く。値は数値ならそのまま、それ以外は文字列にする
+ */
+inline void bench_write_json_params(const char *params)
+{
+	const char *p = params;
+	bool first = true;
+	while (*p != '\0')
+	{
+		size_t len = strcspn(p, ",");
+		const char *equal = static_cast<const char *>(memchr(p, '=', len));
+		if (equal != nullptr)
+		{
+			size_t key_len = equal - p;
+			size_t value_len = len - key_len - 1;
+			char *end;
+			strtod(equal + 1, &end);
+			bool numeric = value_len != 0 and end == equal + 1 + value_len;
+			fprintf(bench_json, numeric ? "%s\"%.*s\":%.*s" : "%s\"%.*s\":\"%.*s\"", first ? "" : ",", (int)key_len, p, (int)value_len, equal + 1);
+			first = false;
+		}
+		p += len;
+		if (*p == ',')
+		{
+			p++;
+		}
+	}
+}
+
+inline void bench_print_header()
+{
+	printf("%-8s %-14s %-24s %10s %12s %12s %12s\n", "bench", "case", "params", "ns/op", "misses/op", "insns/op", "bytes/entry");
+}
+
+/**
+ * 結果を CURO_BENCH_JSON のファイルに 1 行の JSON で書き出す (指定されていなければ何もしない)
+ * @param bench ベンチマークの名前
+ * @param name 測った処理
+ * @param params 条件 (key=value をカンマで並べる)
+ * @param ops 計測した処理の回数
+ * @param measure
+ * @param bytes_per_entry エントリあたりのメモリ (なければ負の値)
+ */
+inline void bench_write_json(const char *bench, const char *name, const char *params, uint64_t ops, const bench_measure *measure, double bytes_per_entry)
+{
+	bench_init();
+	if (bench_json == nullptr)
+	{
+		return;
+	}
+	fprintf(bench_json, "{\"bench\":\"%s\",\"case\":\"%s\",\"params\":{", bench, name);
+	bench_write_json_params(params);
+	fprintf(bench_json, "},\"ops\":%lu,\"ns_per_op\":%.3f", ops, measure->ns / ops);
+	if (measure->cache_misses >= 0 and measure->instructions >= 0)
+	{
+		fprintf(bench_json, ",\"cache_misses_per_op\":%.4f,\"instructions_per_op\":%.2f",
+						static_cast<double>(measure->cache_misses) / ops, static_cast<double>(measure->instructions) / ops);
+	}
+	else
+	{
+		fprintf(bench_json, ",\"cache_misses_per_op\":null,\"instructions_per_op\":null");
+	}
+	if (bytes_per_entry >= 0)
+	{
+		fprintf(bench_json, ",\"bytes_per_entry\":%.1f}\n", bytes_per_entry);
+	}
+	else
+	{
+		fprintf(bench_json, ",\"bytes_per_entry\":null}\n");
+	}
+	fflush(bench_json);
+}
+
+/**
+ * 結果を bench_print_header の表の 1 行として表示し、JSON にも書き出す
+ */
+inline void bench_report(const char *bench, const char *name, const char *params, uint64_t ops, const bench_measure *measure, double bytes_per_entry)
+{
+	char misses[32] = "-", instructions[32] = "-", bytes[32] = "-";
+	if (measure->cache_misses >= 0 and measure->instructions >= 0)
+	{
+		snprintf(misses, sizeof(misses), "%.3f", static_cast<double>(measure->cache_misses) / ops);
+		snprintf(instructions, sizeof(instructions), "%.1f", static_cast<double>(measure->instructions) / ops);
+	}
+	if (bytes_per_entry >= 0)
+	{
+		snprintf(bytes, sizeof(bytes), "%.1f", bytes_per_entry);
+	}
+	printf("%-8s %-14s %-24s %10.1f %12s %12s %12s\n", bench, name, params, measure->ns / ops, misses, instructions, bytes);
+	bench_write_json(bench, name, params, ops, measure, bytes_per_entry);
+}
+
+#endif // CURO_BENCH_H
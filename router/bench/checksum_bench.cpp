@@ -0,0 +1,227 @@
+#include "bench.h"
+#include "checksum.h"
+#include "ip.h"
+#include "utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * checksum_16 の実装ごとの速度を、パケットサイズを変えて測る
+ * 結果がスカラー版と一致するかも確かめる
+ * 差分更新 (checksum_adjust など) の結果も、書き換えた後に全体を計算し直した値と比べる
+ */
+
+#define CHECKSUM_BENCH_BYTES (256ull * 1024 * 1024) // サイズごとに計算する総バイト数
+#define CHECKSUM_INCREMENTAL_CHECKS 1000000 // 差分更新を確かめる回数
+#define CHECKSUM_UDP_PAYLOAD_MAX 64
+
+// UDP のチェックサムの計算範囲 (疑似ヘッダ、UDP ヘッダ、ペイロード)
+struct checksum_udp_packet
+{
+	uint32_t src_addr;
+	uint32_t dest_addr;
+	uint16_t protocol;
+	uint16_t pseudo_len;
+	uint16_t src_port;
+	uint16_t dest_port;
+	uint16_t len;
+	uint16_t checksum;
+	uint8_t payload[CHECKSUM_UDP_PAYLOAD_MAX];
+};
+
+#define CHECKSUM_PSEUDO_HEADER_SIZE 12
+
+/**
+ * 全体を計算し直した UDP のチェックサム (0 になったら 0xffff)
+ */
+uint16_t udp_checksum_full(checksum_udp_packet *packet, size_t len)
+{
+	uint16_t saved = packet->checksum;
+	packet->checksum = 0;
+	uint16_t checksum = checksum_16(reinterpret_cast<uint16_t *>(packet), len, 0);
+	packet->checksum = saved;
+	return checksum == 0 ? 0xffff : checksum;
+}
+
+/**
+ * IP ヘッダ、UDP、送信時に計算する L4 チェックサムの差分更新が、全体の計算と一致するか確かめる
+ * NAPT と同じく、アドレス、ポート、TTL をランダムに書き換える
+ * @return 一致しなければ false
+ */
+bool check_incremental()
+{
+	uint8_t ip_packet[sizeof(ip_header)];
+	checksum_udp_packet udp;
+	uint32_t zero_checked = 0, ffff_checked = 0;
+
+	for (uint32_t n = 0; n < CHECKSUM_INCREMENTAL_CHECKS; ++n)
+	{
+		// IP ヘッダ: 送信元か宛先のアドレスと TTL を書き換える
+		for (auto &b : ip_packet)
+		{
+			b = random_u32();
+		}
+		auto *header = reinterpret_cast<ip_header *>(ip_packet);
+		header->header_checksum = 0;
+		uint16_t checksum = checksum_16(reinterpret_cast<uint16_t *>(ip_packet), sizeof(ip_packet), 0);
+
+		uint32_t new_addr = random_u32();
+		uint32_t addr_diff;
+		if (n & 1)
+		{
+			addr_diff = checksum_diff_32(header->src_addr, new_addr);
+			header->src_addr = new_addr;
+		}
+		else
+		{
+			addr_diff = checksum_diff_32(header->dest_addr, new_addr);
+			header->dest_addr = new_addr;
+		}
+		uint16_t old_ttl_word = htons(header->ttl << 8 | header->protocol);
+		header->ttl--;
+		uint16_t new_ttl_word = htons(header->ttl << 8 | header->protocol);
+		checksum = checksum_adjust(checksum, addr_diff + checksum_diff_16(old_ttl_word, new_ttl_word));
+		uint16_t expected = checksum_16(reinterpret_cast<uint16_t *>(ip_packet), sizeof(ip_packet), 0);
+		if (checksum != expected)
+		{
+			printf("checksum_adjust: mismatch %04x != %04x\n", checksum, expected);
+			return false;
+		}
+
+		// UDP: 送信元のアドレスとポートを書き換える
+		size_t len = sizeof(checksum_udp_packet) - CHECKSUM_UDP_PAYLOAD_MAX + random_u32() % (CHECKSUM_UDP_PAYLOAD_MAX + 1);
+		for (size_t i = 0; i < sizeof(udp); ++i)
+		{
+			reinterpret_cast<uint8_t *>(&udp)[i] = random_u32();
+		}
+		udp.protocol = htons(IP_PROTOCOL_NUM_UDP);
+		udp.pseudo_len = htons(len - CHECKSUM_PSEUDO_HEADER_SIZE);
+		udp.len = udp.pseudo_len;
+		udp.checksum = udp_checksum_full(&udp, len);
+
+		new_addr = random_u32();
+		uint16_t new_port = random_u32();
+		switch (n % 4)
+		{
+		case 0:
+			// チェックサムなし (0) は更新しない
+			udp.checksum = 0;
+			break;
+		case 1:
+		{
+			// 書き換えた後の計算結果がちょうど 0 になり、0xffff で送る場合
+			// アドレスはそのままにして、和が 0xffff になるポートを選ぶ
+			new_addr = udp.src_addr;
+			uint16_t saved = udp.checksum;
+			udp.checksum = 0;
+			uint16_t sum = ~checksum_16(reinterpret_cast<uint16_t *>(&udp), len, 0);
+			udp.checksum = saved;
+			new_port = checksum_fold(static_cast<uint16_t>(~sum) + static_cast<uint32_t>(udp.src_port));
+			break;
+		}
+		}
+
+		uint32_t diff = checksum_diff_32(udp.src_addr, new_addr) + checksum_diff_16(udp.src_port, new_port);
+		uint16_t adjusted = checksum_adjust_udp(udp.checksum, diff);
+		bool no_checksum = udp.checksum == 0;
+		udp.src_addr = new_addr;
+		udp.src_port = new_port;
+		expected = no_checksum ? 0 : udp_checksum_full(&udp, len);
+		if (adjusted != expected)
+		{
+			printf("checksum_adjust_udp: mismatch %04x != %04x\n", adjusted, expected);
+			return false;
+		}
+		zero_checked += no_checksum;
+		ffff_checked += !no_checksum and expected == 0xffff;
+
+		// 送信時に計算する L4 チェックサム: 疑似ヘッダのアドレスだけを書き換える
+		uint16_t partial = ~checksum_16(reinterpret_cast<uint16_t *>(&udp), CHECKSUM_PSEUDO_HEADER_SIZE, 0);
+		new_addr = random_u32();
+		partial = checksum_adjust_partial(partial, checksum_diff_32(udp.dest_addr, new_addr));
+		udp.dest_addr = new_addr;
+		expected = ~checksum_16(reinterpret_cast<uint16_t *>(&udp), CHECKSUM_PSEUDO_HEADER_SIZE, 0);
+		if (partial != expected)
+		{
+			printf("checksum_adjust_partial: mismatch %04x != %04x\n", partial, expected);
+			return false;
+		}
+	}
+
+	if (zero_checked == 0 or ffff_checked == 0)
+	{
+		printf("checksum_adjust_udp: 0 and 0xffff cases were not covered\n");
+		return false;
+	}
+	printf("incremental: %u updates match full checksums (udp no checksum %u, 0xffff %u)\n", CHECKSUM_INCREMENTAL_CHECKS, zero_checked, ffff_checked);
+	return true;
+}
+
+int main()
+{
+	const size_t sizes[] = {20, 64, 128, 256, 512, 1500, 4096, 9000};
+	const size_t max_size = 9000 + 1;
+
+	// 奇数アドレスからも読めるよう、1byte 余分に確保する
+	auto *buffer = (uint8_t *)malloc(max_size + 1);
+	for (size_t i = 0; i < max_size + 1; ++i)
+	{
+		buffer[i] = random_u32();
+	}
+
+	// 差分更新はスカラー版と比べる
+	set_checksum_impl(checksum_impl::scalar);
+	if (!check_incremental())
+	{
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %6s %10s %10s\n", "impl", "bytes", "ns/op", "GB/s");
+	for (int i = 0; i < CHECKSUM_IMPL_NUM; ++i)
+	{
+		auto impl = static_cast<checksum_impl>(i);
+		if (!is_checksum_impl_supported(impl))
+		{
+			printf("%-8s not supported\n", checksum_impl_name(impl));
+			continue;
+		}
+
+		for (size_t size : sizes)
+		{
+			// 長さや開始位置がずれていても、スカラー版と同じ結果になるか
+			for (size_t offset = 0; offset < 2; ++offset)
+			{
+				for (size_t len = size - 1; len <= size + 1; ++len)
+				{
+					set_checksum_impl(checksum_impl::scalar);
+					uint16_t expected = checksum_16(reinterpret_cast<uint16_t *>(buffer + offset), len, 0);
+					set_checksum_impl(impl);
+					uint16_t actual = checksum_16(reinterpret_cast<uint16_t *>(buffer + offset), len, 0);
+					if (actual != expected)
+					{
+						printf("%s: checksum mismatch len=%zu offset=%zu %04x != %04x\n", checksum_impl_name(impl), len, offset, actual, expected);
+						return EXIT_FAILURE;
+					}
+				}
+			}
+
+			set_checksum_impl(impl);
+			uint64_t iterations = CHECKSUM_BENCH_BYTES / size;
+			bench_measure measure;
+			bench_start(&measure);
+			for (uint64_t n = 0; n < iterations; ++n)
+			{
+				checksum_16(reinterpret_cast<uint16_t *>(buffer), size, n);
+			}
+			bench_stop(&measure);
+
+			printf("%-8s %6zu %10.1f %10.2f\n", checksum_impl_name(impl), size, measure.ns / iterations, (double)iterations * size / measure.ns);
+			char params[64];
+			snprintf(params, sizeof(params), "impl=%s,bytes=%zu", checksum_impl_name(impl), size);
+			bench_write_json("checksum", "checksum_16", params, iterations, &measure, -1);
+		}
+	}
+	free(buffer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+#include "bench.h"
+#include "binary_trie.h"
+#include "ip.h"
+#include "utils.h"
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * 経路数を変えて、FIB (binary_trie) の登録と検索の時間とメモリを測る
+ * プレフィックス長はインターネットの経路表に近い分布にし、検索結果が最長一致になっているかも確かめる
+ */
+
+#define FIB_BENCH_KEYS (1 << 20) // 検索するアドレスの種類 (キャッシュに収まらない数)
+#define FIB_BENCH_ITERATIONS 4000000 // 検索を繰り返す回数
+
+volatile uintptr_t fib_bench_sink; // 検索の結果を使い、計測するループが消されないようにする
+
+/**
+ * 経路表に近い分布でプレフィックス長を選ぶ (/24 が半分以上、/8 より短いものはない)
+ * @return
+ */
+uint32_t random_prefix_len()
+{
+	const struct
+	{
+		uint32_t len;
+		uint32_t weight;
+	} distribution[] = {
+			{8, 1}, {12, 2}, {16, 15}, {17, 8}, {18, 14}, {19, 27}, {20, 45}, {21, 50}, {22, 110}, {23, 100}, {24, 580}, {28, 3}, {32, 5}};
+	uint32_t pick = random_u32() % 960;
+	for (auto &d : distribution)
+	{
+		if (pick < d.weight)
+		{
+			return d.len;
+		}
+		pick -= d.weight;
+	}
+	return 24;
+}
+
+uint32_t prefix_mask(uint32_t len)
+{
+	return len == 0 ? 0 : 0xffffffff << (32 - len);
+}
+
+template <typename DATA_TYPE>
+void binary_trie_free(binary_trie_node<DATA_TYPE> *node)
+{
+	if (node == nullptr)
+	{
+		return;
+	}
+	binary_trie_free(node->node_0);
+	binary_trie_free(node->node_1);
+	free(node);
+}
+
+int main()
+{
+	const uint32_t route_counts[] = {1000, 10000, 100000, 500000};
+
+	auto *keys = (uint32_t *)malloc(FIB_BENCH_KEYS * sizeof(uint32_t));
+	bench_print_header();
+	for (uint32_t route_count : route_counts)
+	{
+		auto *prefixes = (uint32_t *)malloc(route_count * sizeof(uint32_t));
+		auto *prefix_lens = (uint32_t *)malloc(route_count * sizeof(uint32_t));
+		auto *routes = (ip_route_entry *)calloc(route_count, sizeof(ip_route_entry));
+		for (uint32_t i = 0; i < route_count; ++i)
+		{
+			prefix_lens[i] = random_prefix_len();
+			prefixes[i] = random_u32() & prefix_mask(prefix_lens[i]);
+			routes[i].type = network;
+			routes[i].next_hop = random_u32();
+		}
+
+		char params[64];
+		snprintf(params, sizeof(params), "routes=%u", route_count);
+
+		size_t heap_before = bench_heap_used();
+		auto *fib = (binary_trie_node<ip_route_entry> *)calloc(1, sizeof(binary_trie_node<ip_route_entry>));
+		bench_measure measure;
+		bench_start(&measure);
+		for (uint32_t i = 0; i < route_count; ++i)
+		{
+			binary_trie_add(fib, prefixes[i], prefix_lens[i], &routes[i]);
+		}
+		bench_stop(&measure);
+		double bytes_per_route = static_cast<double>(bench_heap_used() - heap_before) / route_count;
+		bench_report("fib", "add", params, route_count, &measure, bytes_per_route);
+
+		// 登録した経路の中のアドレスを検索する。同じ経路が複数回登録されていれば、後のものが残る
+		for (uint32_t i = 0; i < FIB_BENCH_KEYS; ++i)
+		{
+			uint32_t r = random_u32() % route_count;
+			keys[i] = prefixes[r] | (random_u32() & ~prefix_mask(prefix_lens[r]));
+		}
+		for (uint32_t i = 0; i < 4096; ++i)
+		{
+			ip_route_entry *route = binary_trie_search(fib, keys[i]);
+			if (route == nullptr)
+			{
+				printf("fib: no route for %08x\n", keys[i]);
+				return EXIT_FAILURE;
+			}
+			// 一致した経路が宛先を含み、それより長い一致がないか
+			uint32_t len = prefix_lens[route - routes];
+			if ((keys[i] & prefix_mask(len)) != prefixes[route - routes])
+			{
+				printf("fib: route for %08x does not match\n", keys[i]);
+				return EXIT_FAILURE;
+			}
+			for (uint32_t r = 0; r < route_count and route_count <= 10000; ++r)
+			{
+				if (prefix_lens[r] > len and (keys[i] & prefix_mask(prefix_lens[r])) == prefixes[r])
+				{
+					printf("fib: route for %08x is not the longest match\n", keys[i]);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		uintptr_t sum = 0;
+		bench_start(&measure);
+		for (uint32_t n = 0; n < FIB_BENCH_ITERATIONS; ++n)
+		{
+			sum += reinterpret_cast<uintptr_t>(binary_trie_search(fib, keys[n % FIB_BENCH_KEYS]));
+		}
+		bench_stop(&measure);
+		fib_bench_sink = sum;
+		bench_report("fib", "search", params, FIB_BENCH_ITERATIONS, &measure, -1);
+
+		binary_trie_free(fib);
+		free(routes);
+		free(prefix_lens);
+		free(prefixes);
+	}
+	free(keys);
+	return EXIT_SUCCESS;
+}
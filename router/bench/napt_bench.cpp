@@ -0,0 +1,144 @@
+#include "bench.h"
+#include "checksum.h"
+#include "ip.h"
+#include "napt.h"
+#include "utils.h"
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * セッション数を変えて、nat_exec の時間とメモリを測る
+ * 新しいセッションの作成、内側から外側 (既存のセッション)、外側から内側の 3 つを測り、
+ * 外側から戻したパケットが元のアドレスとポートになるかも確かめる
+ * セッションあたりのメモリには、テーブルの固定の領域 (ハッシュのバケットなど) も含む
+ */
+
+#define NAPT_BENCH_OUTSIDE_ADDRESSES 16
+#define NAPT_BENCH_SESSIONS_PER_SUBSCRIBER 1000 // 加入者 1 人あたりのセッション数 (2 ブロック分)
+#define NAPT_BENCH_ITERATIONS 4000000
+#define NAPT_BENCH_PACKET_SIZE 28 // IP ヘッダと UDP ヘッダ
+
+// nat_exec はパケットを書き換えるので、毎回元のパケットをコピーしてから渡す
+struct napt_bench_packet
+{
+	uint8_t data[32];
+};
+
+volatile uint32_t napt_bench_sink;
+
+void make_udp_packet(napt_bench_packet *packet, uint32_t src_addr, uint16_t src_port, uint32_t dest_addr, uint16_t dest_port)
+{
+	memset(packet, 0, sizeof(napt_bench_packet));
+	auto *ip_packet = reinterpret_cast<ip_header *>(packet->data);
+	ip_set_header(ip_packet, dest_addr, src_addr, NAPT_BENCH_PACKET_SIZE - sizeof(ip_header), IP_PROTOCOL_NUM_UDP);
+	auto *ports = reinterpret_cast<uint16_t *>(packet->data + sizeof(ip_header));
+	ports[0] = htons(src_port);
+	ports[1] = htons(dest_port);
+	ports[2] = htons(NAPT_BENCH_PACKET_SIZE - sizeof(ip_header));
+	ports[3] = htons(0x1234);
+}
+
+/**
+ * パケットを順に nat_exec に通す
+ * @return 変換できたパケット数
+ */
+uint32_t run_nat_exec(nat_device *nat_dev, const napt_bench_packet *packets, const uint32_t *order, uint32_t order_count, uint64_t iterations, nat_direction direction)
+{
+	napt_bench_packet scratch;
+	uint32_t translated = 0;
+	for (uint64_t n = 0; n < iterations; ++n)
+	{
+		scratch = packets[order[n % order_count]];
+		translated += nat_exec(reinterpret_cast<ip_header *>(scratch.data), nat_dev, nat_protocol::udp, direction);
+	}
+	return translated;
+}
+
+int main()
+{
+	const uint32_t session_counts[] = {1000, 10000, 100000, 500000};
+	const uint32_t server = IP_ADDRESS(203, 0, 113, 10);
+
+	bench_print_header();
+	for (uint32_t session_count : session_counts)
+	{
+		auto *outgoing = (napt_bench_packet *)malloc(session_count * sizeof(napt_bench_packet));
+		auto *incoming = (napt_bench_packet *)malloc(session_count * sizeof(napt_bench_packet));
+		auto *order = (uint32_t *)malloc(session_count * sizeof(uint32_t));
+		for (uint32_t i = 0; i < session_count; ++i)
+		{
+			uint32_t subscriber = i / NAPT_BENCH_SESSIONS_PER_SUBSCRIBER;
+			make_udp_packet(&outgoing[i], IP_ADDRESS(10, 0, 0, 0) + subscriber, 20000 + i % NAPT_BENCH_SESSIONS_PER_SUBSCRIBER, server, 443);
+			order[i] = i;
+		}
+		// 同じ加入者のパケットが続かないよう、順序を混ぜる
+		for (uint32_t i = session_count - 1; i > 0; --i)
+		{
+			std::swap(order[i], order[random_u32() % (i + 1)]);
+		}
+
+		char params[64];
+		snprintf(params, sizeof(params), "sessions=%u", session_count);
+
+		size_t heap_before = bench_heap_used();
+		auto *nat_dev = (nat_device *)calloc(1, sizeof(nat_device));
+		init_nat_device(nat_dev, IP_ADDRESS(192, 0, 2, 0), NAPT_BENCH_OUTSIDE_ADDRESSES, 1);
+
+		// 新しいセッションの作成。外側に出たパケットは、戻りのパケットの元にする
+		bench_measure measure;
+		bench_start(&measure);
+		uint32_t created = 0;
+		for (uint32_t i = 0; i < session_count; ++i)
+		{
+			incoming[order[i]] = outgoing[order[i]];
+			created += nat_exec(reinterpret_cast<ip_header *>(incoming[order[i]].data), nat_dev, nat_protocol::udp, nat_direction::outgoing);
+		}
+		bench_stop(&measure);
+		if (created != session_count)
+		{
+			printf("napt: created %u of %u sessions\n", created, session_count);
+			return EXIT_FAILURE;
+		}
+		double bytes_per_session = static_cast<double>(bench_heap_used() - heap_before) / session_count;
+		bench_report("napt", "create", params, session_count, &measure, bytes_per_session);
+
+		for (uint32_t i = 0; i < session_count; ++i)
+		{
+			auto *ip_packet = reinterpret_cast<ip_header *>(incoming[i].data);
+			auto *ports = reinterpret_cast<uint16_t *>(incoming[i].data + sizeof(ip_header));
+			uint32_t global_addr = ntohl(ip_packet->src_addr);
+			uint16_t global_port = ntohs(ports[0]);
+			make_udp_packet(&incoming[i], server, 443, global_addr, global_port);
+
+			// 戻りのパケットが元の送信元に戻るか
+			napt_bench_packet scratch = incoming[i];
+			auto *result = reinterpret_cast<ip_header *>(scratch.data);
+			auto *original = reinterpret_cast<ip_header *>(outgoing[i].data);
+			if (!nat_exec(result, nat_dev, nat_protocol::udp, nat_direction::incoming) or
+					result->dest_addr != original->src_addr or
+					reinterpret_cast<uint16_t *>(scratch.data + sizeof(ip_header))[1] != reinterpret_cast<uint16_t *>(outgoing[i].data + sizeof(ip_header))[0] or
+					checksum_16(reinterpret_cast<uint16_t *>(scratch.data), sizeof(ip_header), 0) != 0)
+			{
+				printf("napt: session %u was not translated back\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+
+		bench_start(&measure);
+		uint32_t translated = run_nat_exec(nat_dev, outgoing, order, session_count, NAPT_BENCH_ITERATIONS, nat_direction::outgoing);
+		bench_stop(&measure);
+		bench_report("napt", "outgoing", params, NAPT_BENCH_ITERATIONS, &measure, -1);
+
+		bench_start(&measure);
+		translated += run_nat_exec(nat_dev, incoming, order, session_count, NAPT_BENCH_ITERATIONS, nat_direction::incoming);
+		bench_stop(&measure);
+		bench_report("napt", "incoming", params, NAPT_BENCH_ITERATIONS, &measure, -1);
+		napt_bench_sink = translated;
+
+		// テーブルは解放しない (セッションを消す処理は測らない)
+		free(order);
+		free(incoming);
+		free(outgoing);
+	}
+	return EXIT_SUCCESS;
+}
@@ -96,6 +96,11 @@ DATA_TYPE *binary_trie_search(binary_trie_node<DATA_TYPE> *root, uint32_t prefix
 		}
 	}
 
+	// 32 bit 全てを辿った先のノード (/32 の経路)
+	if (current->data != nullptr)
+	{
+		result = current->data;
+	}
 	return result;
 }
 
@@ -0,0 +1,408 @@
+#include "capture.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <thread>
+#include <unistd.h>
+#include "acl.h"
+#include "ethernet.h"
+#include "log.h"
+#include "utils.h"
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPTION_END 0
+#define PCAPNG_OPTION_IF_NAME 2
+#define PCAPNG_OPTION_IF_TSRESOL 9
+#define PCAPNG_OPTION_EPB_FLAGS 2
+#define PCAPNG_EPB_FLAG_INBOUND 0x1
+#define PCAPNG_EPB_FLAG_OUTBOUND 0x2
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_LINKTYPE_IPV4 228
+
+#define CAPTURE_DEVICE_MAX 32
+
+std::atomic<bool> capture_active{false};
+capture_session *capture_current = nullptr;
+
+std::thread capture_thread;
+std::atomic<bool> capture_running{false};
+FILE *capture_file = nullptr;
+uint64_t capture_file_bytes = 0;
+uint64_t capture_realtime_offset_ns = 0; // current_time_ns から UNIX 時刻への差
+net_device *capture_devices[CAPTURE_DEVICE_MAX]; // インターフェース番号 / CAPTURE_POINT_NUM がこの添字
+uint32_t capture_device_count = 0;
+
+const char *capture_point_name(capture_point point)
+{
+	switch (point)
+	{
+	case capture_point::rx:
+		return "rx";
+	case capture_point::pre_nat:
+		return "pre_nat";
+	case capture_point::post_nat:
+		return "post_nat";
+	case capture_point::egress:
+		return "egress";
+	}
+	return "unknown";
+}
+
+/**
+ * キャプチャの設定を作る。capture_start で開始する
+ * @param dev キャプチャするデバイス (nullptr なら全て)
+ * @param point_mask キャプチャする位置 (CAPTURE_POINT_BIT の組み合わせ)
+ * @param filter キャプチャする IP パケットを permit とする ACL (nullptr なら全て)
+ * @param path ファイル名の前半
+ * @param file_size ファイルを切り替えるサイズ
+ * @param file_count 使い回すファイルの数
+ * @return
+ */
+capture_session *create_capture_session(net_device *dev, uint8_t point_mask, acl_table *filter, const char *path, uint64_t file_size, uint32_t file_count)
+{
+	void *memory = calloc(1, sizeof(capture_session));
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+	auto *session = new (memory) capture_session();
+	session->dev = dev;
+	session->point_mask = point_mask;
+	session->filter = filter;
+	strncpy(session->path, path, CAPTURE_PATH_LEN - 1);
+	session->file_size = file_size;
+	session->file_count = file_count == 0 ? 1 : file_count;
+
+	// 転送中に確保しないよう、リングは先に確保しておく
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		void *ring = aligned_alloc(alignof(spsc_ring<capture_slot, CAPTURE_RING_SIZE>), sizeof(spsc_ring<capture_slot, CAPTURE_RING_SIZE>));
+		if (ring == nullptr)
+		{
+			return nullptr;
+		}
+		session->rings[i] = new (ring) spsc_ring<capture_slot, CAPTURE_RING_SIZE>();
+	}
+
+	capture_current = session;
+	return session;
+}
+
+/**
+ * パケットがキャプチャの条件に一致したら、このワーカーのリングにコピーする
+ */
+void capture_packet_slow(capture_point point, net_device *dev, const uint8_t *data, size_t len)
+{
+	capture_session *session = capture_current;
+	if (!(session->point_mask & CAPTURE_POINT_BIT(point)) or (session->dev != nullptr and session->dev != dev))
+	{
+		return;
+	}
+
+	if (session->filter != nullptr)
+	{
+		const uint8_t *ip_packet = data;
+		size_t ip_len = len;
+		if (point == capture_point::rx or point == capture_point::egress)
+		{
+			// フィルタは IP パケットにだけ一致する
+			if (len < ETHERNET_HEADER_SIZE or ntohs(reinterpret_cast<const ethernet_header *>(data)->type) != ETHER_TYPE_IP)
+			{
+				return;
+			}
+			ip_packet += ETHERNET_HEADER_SIZE;
+			ip_len -= ETHERNET_HEADER_SIZE;
+		}
+		if (!acl_permit(session->filter, ip_packet, ip_len))
+		{
+			return;
+		}
+	}
+
+	spsc_ring<capture_slot, CAPTURE_RING_SIZE> *ring = session->rings[worker_id];
+	capture_slot *slot = spsc_ring_reserve(ring);
+	if (slot == nullptr)
+	{
+		session->dropped[worker_id].store(session->dropped[worker_id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	slot->time_ns = current_time_ns();
+	slot->dev = dev;
+	slot->orig_len = len;
+	slot->cap_len = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+	slot->point = point;
+	memcpy(slot->data, data, slot->cap_len);
+	spsc_ring_commit(ring);
+	session->captured[worker_id].store(session->captured[worker_id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/**
+ * pcapng のブロックを書き込む
+ * 本体は 4 byte 境界まで 0 で埋める
+ * @param type
+ * @param parts 本体を分けて渡す
+ * @param lens
+ * @param count
+ */
+void write_pcapng_block(uint32_t type, const void *const *parts, const size_t *lens, int count)
+{
+	static const uint8_t padding[4] = {};
+	size_t body_len = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		body_len += lens[i];
+	}
+	uint32_t pad = (4 - body_len % 4) % 4;
+	uint32_t total_len = 12 + body_len + pad;
+
+	fwrite(&type, 4, 1, capture_file);
+	fwrite(&total_len, 4, 1, capture_file);
+	for (int i = 0; i < count; ++i)
+	{
+		fwrite(parts[i], 1, lens[i], capture_file);
+	}
+	fwrite(padding, 1, pad, capture_file);
+	fwrite(&total_len, 4, 1, capture_file);
+	capture_file_bytes += total_len;
+	capture_current->written_bytes.fetch_add(total_len, std::memory_order_relaxed);
+}
+
+/**
+ * pcapng のオプションをバッファに追加する
+ * @return 追加した後の長さ
+ */
+size_t put_pcapng_option(uint8_t *buffer, size_t pos, uint16_t code, const void *value, uint16_t len)
+{
+	memcpy(buffer + pos, &code, 2);
+	memcpy(buffer + pos + 2, &len, 2);
+	memcpy(buffer + pos + 4, value, len);
+	pos += 4 + len;
+	while (pos % 4 != 0)
+	{
+		buffer[pos++] = 0;
+	}
+	return pos;
+}
+
+/**
+ * 次のファイルを開き、Section Header Block と、デバイスと位置の組ごとの Interface Description Block を書き込む
+ * @return
+ */
+bool open_capture_file()
+{
+	capture_session *session = capture_current;
+	if (capture_file != nullptr)
+	{
+		fclose(capture_file);
+		capture_file = nullptr;
+	}
+
+	char path[CAPTURE_PATH_LEN + 32];
+	uint32_t index = session->file_index.fetch_add(1, std::memory_order_relaxed) % session->file_count;
+	snprintf(path, sizeof(path), "%s-%u.pcapng", session->path, index);
+	capture_file = fopen(path, "wb");
+	if (capture_file == nullptr)
+	{
+		LOG_ERROR("Failed to open capture file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	capture_file_bytes = 0;
+
+	uint8_t shb[16];
+	uint32_t magic = PCAPNG_BYTE_ORDER_MAGIC;
+	uint16_t major = 1, minor = 0;
+	int64_t section_len = -1;
+	memcpy(shb, &magic, 4);
+	memcpy(shb + 4, &major, 2);
+	memcpy(shb + 6, &minor, 2);
+	memcpy(shb + 8, &section_len, 8);
+	const void *shb_parts[] = {shb};
+	size_t shb_lens[] = {sizeof(shb)};
+	write_pcapng_block(PCAPNG_BLOCK_SHB, shb_parts, shb_lens, 1);
+
+	for (uint32_t i = 0; i < capture_device_count; ++i)
+	{
+		for (uint8_t point = 0; point < CAPTURE_POINT_NUM; ++point)
+		{
+			bool is_frame = point == static_cast<uint8_t>(capture_point::rx) or point == static_cast<uint8_t>(capture_point::egress);
+			uint8_t idb[128];
+			uint16_t linktype = is_frame ? PCAPNG_LINKTYPE_ETHERNET : PCAPNG_LINKTYPE_IPV4;
+			uint16_t reserved = 0;
+			uint32_t snaplen = CAPTURE_SNAPLEN;
+			memcpy(idb, &linktype, 2);
+			memcpy(idb + 2, &reserved, 2);
+			memcpy(idb + 4, &snaplen, 4);
+
+			char name[64];
+			snprintf(name, sizeof(name), "%s/%s", capture_devices[i]->name, capture_point_name(static_cast<capture_point>(point)));
+			uint8_t tsresol = 9; // ns
+			size_t len = put_pcapng_option(idb, 8, PCAPNG_OPTION_IF_NAME, name, strlen(name));
+			len = put_pcapng_option(idb, len, PCAPNG_OPTION_IF_TSRESOL, &tsresol, 1);
+			len = put_pcapng_option(idb, len, PCAPNG_OPTION_END, nullptr, 0);
+
+			const void *idb_parts[] = {idb};
+			size_t idb_lens[] = {len};
+			write_pcapng_block(PCAPNG_BLOCK_IDB, idb_parts, idb_lens, 1);
+		}
+	}
+	return true;
+}
+
+/**
+ * キャプチャしたパケットを Enhanced Packet Block として書き込む
+ * @param slot
+ */
+void write_capture_slot(const capture_slot *slot)
+{
+	uint32_t device_index = 0;
+	while (device_index < capture_device_count and capture_devices[device_index] != slot->dev)
+	{
+		device_index++;
+	}
+	if (device_index == capture_device_count)
+	{
+		return;
+	}
+
+	uint32_t header[5];
+	uint64_t timestamp = slot->time_ns + capture_realtime_offset_ns;
+	header[0] = device_index * CAPTURE_POINT_NUM + static_cast<uint8_t>(slot->point);
+	header[1] = timestamp >> 32;
+	header[2] = timestamp & 0xffffffff;
+	header[3] = slot->cap_len;
+	header[4] = slot->orig_len;
+
+	static const uint8_t padding[4] = {};
+	uint8_t options[16];
+	size_t options_len = 0;
+	if (slot->point == capture_point::rx or slot->point == capture_point::egress)
+	{
+		uint32_t flags = slot->point == capture_point::rx ? PCAPNG_EPB_FLAG_INBOUND : PCAPNG_EPB_FLAG_OUTBOUND;
+		options_len = put_pcapng_option(options, 0, PCAPNG_OPTION_EPB_FLAGS, &flags, 4);
+		options_len = put_pcapng_option(options, options_len, PCAPNG_OPTION_END, nullptr, 0);
+	}
+
+	const void *parts[] = {header, slot->data, padding, options};
+	size_t lens[] = {sizeof(header), slot->cap_len, (4 - slot->cap_len % 4) % 4, options_len};
+	write_pcapng_block(PCAPNG_BLOCK_EPB, parts, lens, 4);
+}
+
+/**
+ * 全てのワーカーのリングからファイルに書き出す
+ * @return 書き出したパケット数
+ */
+uint32_t drain_capture_rings()
+{
+	capture_session *session = capture_current;
+	uint32_t drained = 0;
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		capture_slot *slot;
+		while ((slot = spsc_ring_peek(session->rings[i])) != nullptr)
+		{
+			if (capture_file != nullptr)
+			{
+				if (capture_file_bytes >= session->file_size)
+				{
+					open_capture_file();
+				}
+				if (capture_file != nullptr)
+				{
+					write_capture_slot(slot);
+				}
+			}
+			spsc_ring_release(session->rings[i]);
+			drained++;
+		}
+	}
+	return drained;
+}
+
+/**
+ * キャプチャを開始し、書き込み用のスレッドを起動する
+ * @return
+ */
+bool capture_start()
+{
+	if (capture_current == nullptr or capture_running.load())
+	{
+		return false;
+	}
+
+	capture_device_count = 0;
+	for (net_device *dev = net_dev_list; dev and capture_device_count < CAPTURE_DEVICE_MAX; dev = dev->next)
+	{
+		capture_devices[capture_device_count++] = dev;
+	}
+
+	timespec realtime{};
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	capture_realtime_offset_ns = (uint64_t)realtime.tv_sec * 1000000000 + realtime.tv_nsec - current_time_ns();
+
+	if (!open_capture_file())
+	{
+		return false;
+	}
+
+	capture_running.store(true);
+	capture_thread = std::thread([] {
+		while (capture_running.load(std::memory_order_relaxed))
+		{
+			if (drain_capture_rings() == 0)
+			{
+				usleep(1000);
+			}
+		}
+	});
+	capture_active.store(true);
+	return true;
+}
+
+/**
+ * キャプチャを止め、リングに残っているパケットを書き出してファイルを閉じる
+ */
+void capture_stop()
+{
+	capture_active.store(false);
+	if (!capture_running.exchange(false))
+	{
+		return;
+	}
+	capture_thread.join();
+	drain_capture_rings();
+	if (capture_file != nullptr)
+	{
+		fclose(capture_file);
+		capture_file = nullptr;
+	}
+}
+
+/**
+ * キャプチャの統計を出力
+ */
+void dump_capture_stats()
+{
+	capture_session *session = capture_current;
+	if (session == nullptr)
+	{
+		printf("Capture is not configured\n");
+		return;
+	}
+
+	uint64_t captured = 0, dropped = 0;
+	for (uint32_t i = 0; i < WORKER_MAX; ++i)
+	{
+		captured += session->captured[i].load(std::memory_order_relaxed);
+		dropped += session->dropped[i].load(std::memory_order_relaxed);
+	}
+	printf("Capture %s to %s-*.pcapng (%s, points %02x): %lu captured, %lu dropped, %lu bytes written, %u files\n",
+				 capture_active.load() ? "running" : "stopped", session->path, session->dev != nullptr ? session->dev->name : "all devices",
+				 session->point_mask, captured, dropped, session->written_bytes.load(), session->file_index.load());
+}
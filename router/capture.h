@@ -0,0 +1,90 @@
+#ifndef CURO_CAPTURE_H
+#define CURO_CAPTURE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "net.h"
+#include "spsc_ring.h"
+
+/**
+ * ルータの中で見えているパケットのキャプチャ
+ * デバイスと処理の位置 (受信、NAPT の前後、送信) を選んで、フィルタに一致したパケットを
+ * ワーカーごとに確保済みのリングにコピーし、書き込み用のスレッドが pcapng のファイルに書き出す
+ * リングが溢れたらそのパケットはキャプチャせずに数えるだけで、転送はファイルの書き込みを待たない
+ */
+
+#define CAPTURE_SNAPLEN 2048 // パケットごとにコピーする最大長
+#define CAPTURE_RING_SIZE 1024 // ワーカーごとのリングのスロット数 (2 のべき乗)
+#define CAPTURE_PATH_LEN 128
+
+enum class capture_point : uint8_t
+{
+	rx, // 受信したフレーム
+	pre_nat, // NAPT で書き換える前の IP パケット
+	post_nat, // NAPT で書き換えた後の IP パケット
+	egress, // 送信するフレーム
+};
+
+#define CAPTURE_POINT_NUM 4
+#define CAPTURE_POINT_ALL 0x0f
+#define CAPTURE_POINT_BIT(point) (1 << static_cast<uint8_t>(point))
+
+struct capture_slot
+{
+	uint64_t time_ns; // current_time_ns の時刻
+	net_device *dev;
+	uint32_t orig_len;
+	uint32_t cap_len;
+	capture_point point;
+	uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct acl_table;
+
+struct capture_session
+{
+	net_device *dev; // キャプチャするデバイス (nullptr なら全て)
+	uint8_t point_mask; // キャプチャする位置のビット
+	acl_table *filter; // permit に一致した IP パケットだけをキャプチャする (nullptr なら全て)
+	char path[CAPTURE_PATH_LEN]; // ファイル名の前半。<path>-<番号>.pcapng に書き出す
+	uint64_t file_size; // これを超えたら次のファイルに切り替える
+	uint32_t file_count; // 何個のファイルを順に使い回すか
+
+	spsc_ring<capture_slot, CAPTURE_RING_SIZE> *rings[WORKER_MAX];
+
+	// 統計
+	std::atomic<uint64_t> captured[WORKER_MAX];
+	std::atomic<uint64_t> dropped[WORKER_MAX]; // リングが溢れてキャプチャできなかった数
+	std::atomic<uint64_t> written_bytes;
+	std::atomic<uint32_t> file_index;
+};
+
+extern std::atomic<bool> capture_active;
+
+void capture_packet_slow(capture_point point, net_device *dev, const uint8_t *data, size_t len);
+
+/**
+ * キャプチャが有効なら、パケットをリングにコピーする
+ * 無効なときは 1 回の読み出しと分岐だけで済むよう、呼び出し側に展開する
+ * @param point
+ * @param dev パケットを受信したか、送信するデバイス
+ * @param data フレームか、NAPT の前後なら IP パケットの先頭
+ * @param len
+ */
+inline void capture_packet(capture_point point, net_device *dev, const uint8_t *data, size_t len)
+{
+	if (capture_active.load(std::memory_order_relaxed))
+	{
+		capture_packet_slow(point, dev, data, len);
+	}
+}
+
+capture_session *create_capture_session(net_device *dev, uint8_t point_mask, acl_table *filter, const char *path, uint64_t file_size, uint32_t file_count);
+
+bool capture_start();
+void capture_stop();
+
+void dump_capture_stats();
+
+#endif // CURO_CAPTURE_H
@@ -0,0 +1,252 @@
+#include "checksum.h"
+
+#include "utils.h"
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * 16bit ごとの 1 の補数和を求める (スカラー版)
+ * 8 byte ずつ 32bit の半分に分けて 64bit で足し、桁上がりは最後にまとめて折り返す
+ * 2^16 ≡ 1 (mod 0xffff) なので、32bit 単位で足しても 16bit 単位の和と同じになる
+ * @param buffer
+ * @param count
+ * @param sum
+ * @return 折り返す前の和
+ */
+uint64_t checksum_sum_scalar(const uint8_t *buffer, size_t count, uint64_t sum)
+{
+	while (count >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, buffer, 8);
+		sum += v & 0xffffffff;
+		sum += v >> 32;
+		buffer += 8;
+		count -= 8;
+	}
+
+	while (count > 1)
+	{
+		uint16_t v;
+		memcpy(&v, buffer, 2);
+		sum += v;
+		buffer += 2;
+		count -= 2;
+	}
+
+	// 1byte だけ残ったら、それを加算
+	if (count > 0)
+	{
+		sum += *buffer;
+	}
+	return sum;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * SSE2 版
+ * 32bit ずつ 64bit のレーンに広げて足すので、パケットの長さでは溢れない
+ */
+__attribute__((target("sse2"))) uint64_t checksum_sum_sse2(const uint8_t *buffer, size_t count, uint64_t sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero;
+	__m128i acc1 = zero;
+	while (count >= 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+		buffer += 16;
+		count -= 16;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_add_epi64(acc0, acc1));
+	return checksum_sum_scalar(buffer, count, sum + lanes[0] + lanes[1]);
+}
+
+/**
+ * AVX2 版
+ */
+__attribute__((target("avx2"))) uint64_t checksum_sum_avx2(const uint8_t *buffer, size_t count, uint64_t sum)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero;
+	__m256i acc1 = zero;
+	while (count >= 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buffer));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+		buffer += 32;
+		count -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), _mm256_add_epi64(acc0, acc1));
+	return checksum_sum_sse2(buffer, count, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+/**
+ * AVX-512 版
+ */
+__attribute__((target("avx512f"))) uint64_t checksum_sum_avx512(const uint8_t *buffer, size_t count, uint64_t sum)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc0 = zero;
+	__m512i acc1 = zero;
+	while (count >= 64)
+	{
+		__m512i v = _mm512_loadu_si512(buffer);
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+		buffer += 64;
+		count -= 64;
+	}
+
+	return checksum_sum_avx2(buffer, count, sum + _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1)));
+}
+
+#endif
+
+uint64_t checksum_sum_resolve(const uint8_t *buffer, size_t count, uint64_t sum);
+
+/**
+ * 使用中の実装
+ * 最初の呼び出しで checksum_sum_resolve が CPU に合わせて差し替える
+ */
+uint64_t (*checksum_sum)(const uint8_t *buffer, size_t count, uint64_t sum) = checksum_sum_resolve;
+checksum_impl current_checksum_impl = checksum_impl::scalar;
+
+/**
+ * 実装の表示名
+ * @param impl
+ * @return
+ */
+const char *checksum_impl_name(checksum_impl impl)
+{
+	switch (impl)
+	{
+	case checksum_impl::scalar:
+		return "scalar";
+	case checksum_impl::sse2:
+		return "sse2";
+	case checksum_impl::avx2:
+		return "avx2";
+	case checksum_impl::avx512:
+		return "avx512";
+	}
+	return "?";
+}
+
+/**
+ * CPU が実装に対応しているか (cpuid で調べる)
+ * @param impl
+ * @return
+ */
+bool is_checksum_impl_supported(checksum_impl impl)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	switch (impl)
+	{
+	case checksum_impl::scalar:
+		return true;
+	case checksum_impl::sse2:
+		return __builtin_cpu_supports("sse2");
+	case checksum_impl::avx2:
+		return __builtin_cpu_supports("avx2");
+	case checksum_impl::avx512:
+		return __builtin_cpu_supports("avx512f");
+	}
+	return false;
+#else
+	return impl == checksum_impl::scalar;
+#endif
+}
+
+/**
+ * 使う実装を切り替える
+ * @param impl
+ * @return CPU が対応していなければ false
+ */
+bool set_checksum_impl(checksum_impl impl)
+{
+	if (!is_checksum_impl_supported(impl))
+	{
+		return false;
+	}
+
+	switch (impl)
+	{
+#if defined(__x86_64__)
+	case checksum_impl::sse2:
+		checksum_sum = checksum_sum_sse2;
+		break;
+	case checksum_impl::avx2:
+		checksum_sum = checksum_sum_avx2;
+		break;
+	case checksum_impl::avx512:
+		checksum_sum = checksum_sum_avx512;
+		break;
+#endif
+	default:
+		checksum_sum = checksum_sum_scalar;
+		break;
+	}
+	current_checksum_impl = impl;
+	return true;
+}
+
+/**
+ * 使用中の実装を返す
+ * @return
+ */
+checksum_impl get_checksum_impl()
+{
+	if (checksum_sum == checksum_sum_resolve)
+	{
+		checksum_sum_resolve(nullptr, 0, 0);
+	}
+	return current_checksum_impl;
+}
+
+/**
+ * CPU が対応している一番速い実装を選び、以降はそれを直接呼ぶ
+ */
+uint64_t checksum_sum_resolve(const uint8_t *buffer, size_t count, uint64_t sum)
+{
+	for (int impl = CHECKSUM_IMPL_NUM - 1; impl >= 0; --impl)
+	{
+		if (set_checksum_impl(static_cast<checksum_impl>(impl)))
+		{
+			break;
+		}
+	}
+	return checksum_sum(buffer, count, sum);
+}
+
+/**
+ * Checksum の計算
+ * @param buffer
+ * @param count
+ * @param start
+ * @return
+ */
+uint16_t checksum_16(uint16_t *buffer, size_t count, uint16_t start)
+{
+	uint64_t sum = checksum_sum(reinterpret_cast<const uint8_t *>(buffer), count, start);
+
+	// 溢れた桁を折り返して足す
+	while (sum >> 16)
+	{
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	// 論理否定をとって返す
+	return ~sum;
+}
@@ -0,0 +1,110 @@
+#ifndef CURO_CHECKSUM_H
+#define CURO_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// checksum_16 の実装。起動時に CPU が対応している一番速いものを選ぶ
+enum class checksum_impl
+{
+	scalar,
+	sse2,
+	avx2,
+	avx512
+};
+
+#define CHECKSUM_IMPL_NUM 4
+
+const char *checksum_impl_name(checksum_impl impl);
+bool is_checksum_impl_supported(checksum_impl impl);
+bool set_checksum_impl(checksum_impl impl);
+checksum_impl get_checksum_impl();
+
+/**
+ * インターネットチェックサムの差分更新 (RFC 1624)
+ * ヘッダのフィールドを書き換えたとき、全体を計算し直さずにチェックサムを更新する
+ * 値は全てパケットに書かれている通りのバイトオーダー (ネットワークバイトオーダー) で渡す
+ *
+ * 使い方:
+ *   uint32_t diff = checksum_diff_32(old_addr, new_addr) + checksum_diff_16(old_port, new_port);
+ *   checksum = checksum_adjust(checksum, diff);
+ */
+
+/**
+ * 32bit の和を 16bit に折り返す
+ * 2 回折り返せば、どんな 32bit の和も 16bit に収まる
+ * @param sum
+ * @return
+ */
+inline uint16_t checksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/**
+ * 16bit のフィールドを old_value から new_value に変えたときの差分 (~m + m')
+ * 複数のフィールドの差分は足し合わせてから checksum_adjust に渡せる
+ * @param old_value
+ * @param new_value
+ * @return
+ */
+inline uint32_t checksum_diff_16(uint16_t old_value, uint16_t new_value)
+{
+	return static_cast<uint16_t>(~old_value) + static_cast<uint32_t>(new_value);
+}
+
+/**
+ * 32bit のフィールド (IP アドレスなど) を変えたときの差分
+ * @param old_value
+ * @param new_value
+ * @return
+ */
+inline uint32_t checksum_diff_32(uint32_t old_value, uint32_t new_value)
+{
+	return checksum_diff_16(old_value & 0xffff, new_value & 0xffff) + checksum_diff_16(old_value >> 16, new_value >> 16);
+}
+
+/**
+ * チェックサムに差分を反映する (RFC 1624 の式 3: HC' = ~(~HC + ~m + m'))
+ * @param checksum 更新前のチェックサム
+ * @param diff checksum_diff_16, checksum_diff_32 の和
+ * @return 更新後のチェックサム
+ */
+inline uint16_t checksum_adjust(uint16_t checksum, uint32_t diff)
+{
+	return ~checksum_fold(static_cast<uint16_t>(~checksum) + static_cast<uint32_t>(checksum_fold(diff)));
+}
+
+/**
+ * 送信時に計算する (チェックサムオフロード中の) L4 チェックサムに差分を反映する
+ * フィールドには疑似ヘッダの和が否定をとらずに入っているので、そのまま足す
+ * 疑似ヘッダに含まれないフィールド (ポートなど) は送信時に計算されるので、差分に含めない
+ * @param partial
+ * @param diff
+ * @return
+ */
+inline uint16_t checksum_adjust_partial(uint16_t partial, uint32_t diff)
+{
+	return checksum_fold(static_cast<uint32_t>(partial) + checksum_fold(diff));
+}
+
+/**
+ * UDP のチェックサムに差分を反映する
+ * 0 は「チェックサムなし」を表すので更新せず、計算結果が 0 になったら 0xffff にする (RFC 768)
+ * @param checksum
+ * @param diff
+ * @return
+ */
+inline uint16_t checksum_adjust_udp(uint16_t checksum, uint32_t diff)
+{
+	if (checksum == 0)
+	{
+		return 0;
+	}
+	checksum = checksum_adjust(checksum, diff);
+	return checksum == 0 ? 0xffff : checksum;
+}
+
+#endif // CURO_CHECKSUM_H
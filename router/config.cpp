@@ -1,10 +1,18 @@
 #include "config.h"
 
+#include "acl.h"
 #include "binary_trie.h"
+#include "capture.h"
+#include "egress_queue.h"
+#include "flow_cache.h"
+#include "flow_export.h"
 #include "log.h"
 #include "ip.h"
 #include "napt.h"
+#include "nat_event.h"
 #include "net.h"
+#include "persist.h"
+#include "policer.h"
 #include "utils.h"
 #include <cstdlib>
 #include <cstdint>
@@ -47,6 +55,7 @@ void configure_ip_address(net_device *dev, uint32_t address, uint32_t netmask)
 	// 直接接続ネットワークの経路を設定
 	// address & netmask のネットワークには、entry にセットされた net_device が接続されている、という内容
 	binary_trie_add(ip_fib, address & netmask, len, entry);
+	flow_cache_invalidate();
 
 	printf("Set directly connected route %s/%d via %s\n", ip_htoa(address & netmask), len, dev->name);
 }
@@ -71,22 +80,253 @@ void configure_ip_net_route(uint32_t prefix, uint32_t prefix_len, uint32_t next_
 
 	// 経路の登録
 	binary_trie_add(ip_fib, prefix & mask, prefix_len, entry);
+	flow_cache_invalidate();
 }
 
 /**
  * デバイスに NAPT を設定
+ * 外側のデバイスの IP アドレスに変換する
  * @param inside NAPT の内側のデバイス
  * @param outside NAPT の外側のデバイス
  */
 void configure_ip_napt(net_device *inside, net_device *outside)
+{
+	if (outside == nullptr or outside->ip_dev == nullptr)
+	{
+		LOG_ERROR("Failed to configure NAT: outside device not found\n");
+		exit(EXIT_FAILURE);
+	}
+
+	configure_ip_napt_pool(inside, outside, outside->ip_dev->address, 1);
+}
+
+/**
+ * デバイスに外側アドレスのプールを使う NAPT を設定
+ * プールのアドレスは外側のデバイスのネットワークで代理 ARP 応答する
+ * @param inside NAPT の内側のデバイス
+ * @param outside NAPT の外側のデバイス
+ * @param first_addr プールの先頭のアドレス
+ * @param addr_count プールのアドレス数 (first_addr から連続)
+ */
+void configure_ip_napt_pool(net_device *inside, net_device *outside, uint32_t first_addr, uint32_t addr_count)
 {
 	if (inside == nullptr or outside == nullptr or inside->ip_dev == nullptr or outside->ip_dev == nullptr)
 	{
-		LOG_ERROR("Failed to configure NAT %s => %s\n", inside->name, outside->name);
+		LOG_ERROR("Failed to configure NAT %s => %s\n", inside ? inside->name : "?", outside ? outside->name : "?");
+		exit(EXIT_FAILURE);
+	}
+
+	if (addr_count == 0 or addr_count > NAT_ADDRESS_POOL_MAX)
+	{
+		LOG_ERROR("Invalid NAT address pool size %u\n", addr_count);
+		exit(EXIT_FAILURE);
+	}
+
+	// 前のプロセスが同じ設定で使っていた NAT テーブルがあれば、セッションごと引き継ぐ
+	// 設定が変わっていたら、古いテーブルは使わずに作り直す
+	char root_name[PERSIST_ROOT_NAME_LEN];
+	snprintf(root_name, sizeof(root_name), "nat:%s", inside->name);
+	auto *nat_dev = (nat_device *)persist_get_root(root_name);
+	if (nat_dev != nullptr and nat_dev->outside_addr == first_addr and nat_dev->outside_addr_count == addr_count and nat_dev->shard_count == worker_count)
+	{
+		restore_nat_device(nat_dev);
+	}
+	else
+	{
+		nat_dev = (nat_device *)persist_calloc(1, sizeof(nat_device));
+		if (nat_dev == nullptr)
+		{
+			LOG_ERROR("Failed to allocate NAT device for %s\n", inside->name);
+			exit(EXIT_FAILURE);
+		}
+		init_nat_device(nat_dev, first_addr, addr_count, worker_count);
+		persist_set_root(root_name, nat_dev);
+	}
+	inside->ip_dev->nat_dev = nat_dev;
+
+	printf("Set NAPT %s => %s with %u outside addresses from %s\n", inside->name, outside->name, addr_count, ip_htoa(first_addr));
+}
+
+/**
+ * デバイスが受信したパケットに ACL を設定
+ * @param dev
+ * @param rules 優先する順に並べたルール
+ * @param rule_count
+ * @param default_action どのルールにも一致しなかったときの動作
+ */
+void configure_ip_acl(net_device *dev, const acl_rule *rules, uint32_t rule_count, acl_action default_action)
+{
+	if (dev == nullptr or dev->ip_dev == nullptr)
+	{
+		LOG_ERROR("Failed to configure ACL on %s\n", dev ? dev->name : "?");
+		exit(EXIT_FAILURE);
+	}
+
+	acl_table *acl = acl_compile(rules, rule_count, default_action);
+	if (acl == nullptr)
+	{
+		LOG_ERROR("Failed to compile ACL for %s\n", dev->name);
+		exit(EXIT_FAILURE);
+	}
+	acl_free(dev->ip_dev->acl);
+	dev->ip_dev->acl = acl;
+
+	printf("Set ACL to %s with %u rules (%zu bytes, compiled in %.3f ms)\n", dev->name, rule_count, acl->memory_size, acl->compile_ns / 1e6);
+}
+
+/**
+ * デバイスに送信キューを設定
+ * ワーカーごとにキューを持ち、レートはワーカーで等分する
+ * @param dev
+ * @param rate_bps 送信レートの上限 (bit/s)。0 なら制限せず、スケジューリングと AQM だけを行う
+ */
+void configure_egress_queue(net_device *dev, uint64_t rate_bps)
+{
+	if (dev == nullptr)
+	{
+		LOG_ERROR("Configure net dev not found\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		dev->egress[i] = create_egress_queue(dev, rate_bps / worker_count);
+		if (dev->egress[i] == nullptr)
+		{
+			LOG_ERROR("Failed to create egress queue for %s\n", dev->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("Set egress queue to %s (rate %lu bit/s)\n", dev->name, rate_bps);
+}
+
+/**
+ * デバイスが受信したパケットに、送信元ごとのレート制限を設定
+ * NAPT の内側のデバイスなら、新しいセッションを作るレートも制限する
+ * @param dev
+ * @param packet_limit 送信元ごとのパケット数の上限 (/s)。0 なら制限しない
+ * @param session_limit 送信元ごとの新しい NAPT セッション数の上限 (/s)。0 なら制限しない
+ */
+void configure_ip_policer(net_device *dev, uint32_t packet_limit, uint32_t session_limit)
+{
+	if (dev == nullptr or dev->ip_dev == nullptr)
+	{
+		LOG_ERROR("Failed to configure policer on %s\n", dev ? dev->name : "?");
+		exit(EXIT_FAILURE);
+	}
+
+	src_policer *policer = create_policer(packet_limit, session_limit);
+	if (policer == nullptr)
+	{
+		LOG_ERROR("Failed to create policer for %s\n", dev->name);
 		exit(EXIT_FAILURE);
 	}
+	dev->ip_dev->policer = policer;
+	if (dev->ip_dev->nat_dev != nullptr)
+	{
+		dev->ip_dev->nat_dev->policer = policer;
+	}
+
+	printf("Set policer to %s (%u packets/s, %u sessions/s per source)\n", dev->name, packet_limit, session_limit);
+}
+
+/**
+ * NAPT のセッションの作成と削除の記録を設定
+ * @param path 書き出すファイル名の前半
+ * @param file_size ファイルを切り替える圧縮前のサイズ (byte)
+ * @param file_count 使い回すファイルの数
+ */
+void configure_nat_event_log(const char *path, uint64_t file_size, uint32_t file_count)
+{
+	if (!nat_event_log_init(path, file_size, file_count))
+	{
+		LOG_ERROR("Failed to start NAT event log\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Set NAT event log to %s-*\n", path);
+}
+
+/**
+ * サンプリングしたフローの IPFIX での送出を設定
+ * @param collector_addr コレクタの IP アドレス
+ * @param collector_port
+ * @param sample_rate 平均で何パケットに 1 つサンプリングするか
+ */
+void configure_flow_export(uint32_t collector_addr, uint16_t collector_port, uint32_t sample_rate)
+{
+	if (create_flow_exporter(collector_addr, collector_port, sample_rate) == nullptr)
+	{
+		LOG_ERROR("Failed to create flow exporter\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Set flow export to %s:%u (1 in %u packets)\n", ip_htoa(collector_addr), collector_port, sample_rate);
+}
 
-	inside->ip_dev->nat_dev = (nat_device *)calloc(1, sizeof(nat_device));
-	inside->ip_dev->nat_dev->entries = (nat_entries *)calloc(1, sizeof(nat_entries));
-	inside->ip_dev->nat_dev->outside_addr = outside->ip_dev->address;
+/**
+ * パケットのキャプチャを設定。キャプチャはキー入力で開始と停止をする
+ * @param dev キャプチャするデバイス (nullptr なら全て)
+ * @param point_mask キャプチャする位置 (CAPTURE_POINT_BIT の組み合わせ)
+ * @param rules permit に一致した IP パケットだけをキャプチャするルール (nullptr なら全てのパケット)
+ * @param rule_count
+ * @param path 書き出すファイル名の前半
+ * @param file_size ファイルを切り替えるサイズ (byte)
+ * @param file_count 使い回すファイルの数
+ */
+void configure_capture(net_device *dev, uint8_t point_mask, const acl_rule *rules, uint32_t rule_count, const char *path, uint64_t file_size, uint32_t file_count)
+{
+	acl_table *filter = nullptr;
+	if (rules != nullptr)
+	{
+		filter = acl_compile(rules, rule_count, acl_action::deny);
+		if (filter == nullptr)
+		{
+			LOG_ERROR("Failed to compile capture filter\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (create_capture_session(dev, point_mask, filter, path, file_size, file_count) == nullptr)
+	{
+		LOG_ERROR("Failed to create capture session\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Set capture on %s (points %02x, %s) to %s-*.pcapng\n", dev != nullptr ? dev->name : "all devices", point_mask, filter != nullptr ? "filtered" : "unfiltered", path);
+}
+
+/**
+ * フローキャッシュを使うか設定
+ * 無効にすると、全てのパケットを NAT・経路・ARP の検索をして転送する (キャッシュの効果を測るとき用)
+ * @param enabled
+ */
+void configure_flow_cache(bool enabled)
+{
+	flow_cache_enabled = enabled;
+	flow_cache_invalidate();
+	printf("Set flow cache %s\n", enabled ? "enabled" : "disabled");
+}
+
+/**
+ * パケットを処理するワーカーの数を設定し、デバイスの受信を順に割り当てる
+ * NAPT のシャードや送信キューはワーカーの数だけ作るので、他の設定より先に呼ぶ
+ * @param count
+ */
+void configure_workers(uint32_t count)
+{
+	if (count == 0 or count > WORKER_MAX)
+	{
+		LOG_ERROR("Invalid worker count %u (1 to %u)\n", count, WORKER_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	worker_count = count;
+	uint32_t index = 0;
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		dev->worker = index++ % count;
+		printf("Set %s to worker %u\n", dev->name, dev->worker);
+	}
 }
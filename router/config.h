@@ -5,6 +5,8 @@
 #include <cstdio>
 
 struct net_device;
+struct acl_rule;
+enum class acl_action : uint8_t;
 
 void configure_ip_net_route(uint32_t prefix, uint32_t prefix_len, uint32_t next_hop);
 
@@ -12,4 +14,22 @@ void configure_ip_address(net_device *dev, uint32_t address, uint32_t netmask);
 
 void configure_ip_napt(net_device *inside, net_device *outside);
 
+void configure_ip_napt_pool(net_device *inside, net_device *outside, uint32_t first_addr, uint32_t addr_count);
+
+void configure_ip_acl(net_device *dev, const acl_rule *rules, uint32_t rule_count, acl_action default_action);
+
+void configure_egress_queue(net_device *dev, uint64_t rate_bps);
+
+void configure_ip_policer(net_device *dev, uint32_t packet_limit, uint32_t session_limit);
+
+void configure_nat_event_log(const char *path, uint64_t file_size, uint32_t file_count);
+
+void configure_flow_export(uint32_t collector_addr, uint16_t collector_port, uint32_t sample_rate);
+
+void configure_capture(net_device *dev, uint8_t point_mask, const acl_rule *rules, uint32_t rule_count, const char *path, uint64_t file_size, uint32_t file_count);
+
+void configure_flow_cache(bool enabled);
+
+void configure_workers(uint32_t count);
+
 #endif // CURO_CONFIG_H
@@ -0,0 +1,487 @@
+#include "egress_queue.h"
+#include "capture.h"
+
+#include "ethernet.h"
+#include "ip.h"
+#include "log.h"
+#include "stats.h"
+#include "utils.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * 送信キューを作る
+ * @param dev
+ * @param rate_bps 送信レートの上限 (bit/s)。0 なら制限しない
+ * @return
+ */
+egress_queue *create_egress_queue(net_device *dev, uint64_t rate_bps)
+{
+	auto *queue = (egress_queue *)calloc(1, sizeof(egress_queue));
+	if (queue == nullptr)
+	{
+		return nullptr;
+	}
+	queue->dev = dev;
+	queue->rate = rate_bps / 8;
+	// GSO のフレームも 1 つは送れるようにする
+	queue->burst = queue->rate / 100 > NET_FRAME_MAX_SIZE ? queue->rate / 100 : NET_FRAME_MAX_SIZE;
+	queue->tokens = queue->burst;
+	queue->last_refill_ns = current_time_ns();
+	return queue;
+}
+
+/**
+ * フレームの 5-tuple から、入れるバケットを決める
+ * @param frame
+ * @param len
+ * @return
+ */
+uint32_t get_egress_bucket_index(const uint8_t *frame, size_t len)
+{
+	auto *ethernet = reinterpret_cast<const ethernet_header *>(frame);
+	uint64_t hash = ntohs(ethernet->type);
+	if (ntohs(ethernet->type) == ETHER_TYPE_IP and len >= ETHERNET_HEADER_SIZE + sizeof(ip_header))
+	{
+		auto *ip_packet = reinterpret_cast<const ip_header *>(frame + ETHERNET_HEADER_SIZE);
+		hash = (static_cast<uint64_t>(ip_packet->src_addr) << 32 | ip_packet->dest_addr) ^ ip_packet->protocol;
+
+		size_t header_len = ip_packet->header_len * 4;
+		if ((ip_packet->protocol == IP_PROTOCOL_NUM_TCP or ip_packet->protocol == IP_PROTOCOL_NUM_UDP) and
+				(ntohs(ip_packet->frag_offset) & 0x1fff) == 0 and len >= ETHERNET_HEADER_SIZE + header_len + 4)
+		{
+			uint32_t ports;
+			memcpy(&ports, frame + ETHERNET_HEADER_SIZE + header_len, sizeof(ports));
+			hash ^= static_cast<uint64_t>(ports) << 16;
+		}
+	}
+	hash *= 0x9e3779b97f4a7c15ull;
+	return (hash >> 32) % EGRESS_BUCKET_NUM;
+}
+
+void push_egress_bucket(egress_bucket_list *list, egress_bucket *bucket)
+{
+	bucket->next = nullptr;
+	if (list->tail == nullptr)
+	{
+		list->head = bucket;
+	}
+	else
+	{
+		list->tail->next = bucket;
+	}
+	list->tail = bucket;
+}
+
+egress_bucket *pop_egress_bucket(egress_bucket_list *list)
+{
+	egress_bucket *bucket = list->head;
+	list->head = bucket->next;
+	if (list->head == nullptr)
+	{
+		list->tail = nullptr;
+	}
+	bucket->next = nullptr;
+	return bucket;
+}
+
+/**
+ * バケットの先頭のパケットを取り出す
+ * @param queue
+ * @param bucket
+ * @return
+ */
+egress_packet *pop_egress_packet(egress_queue *queue, egress_bucket *bucket)
+{
+	egress_packet *packet = bucket->head;
+	if (packet == nullptr)
+	{
+		return nullptr;
+	}
+	bucket->head = packet->next;
+	if (bucket->head == nullptr)
+	{
+		bucket->tail = nullptr;
+	}
+	bucket->packets--;
+	bucket->bytes -= packet->len;
+	queue->packets--;
+	queue->bytes -= packet->len;
+	return packet;
+}
+
+/**
+ * キューが溢れたら、一番溜まっているバケットの先頭を捨てる
+ * @param queue
+ */
+void drop_egress_overflow(egress_queue *queue)
+{
+	egress_bucket *fattest = &queue->buckets[0];
+	for (int i = 1; i < EGRESS_BUCKET_NUM; ++i)
+	{
+		if (queue->buckets[i].bytes > fattest->bytes)
+		{
+			fattest = &queue->buckets[i];
+		}
+	}
+	free(pop_egress_packet(queue, fattest));
+	fattest->overflow_drops++;
+	queue->overflow_drops++;
+	count_drop(queue->dev, drop_reason::queue_drop);
+}
+
+/**
+ * 取り出したパケットの滞留時間を見て、CoDel で捨ててよいか判定する (RFC 8289 の dodequeue)
+ * @param queue
+ * @param bucket
+ * @param now
+ * @param ok_to_drop
+ * @return
+ */
+egress_packet *codel_do_dequeue(egress_queue *queue, egress_bucket *bucket, uint64_t now, bool *ok_to_drop)
+{
+	*ok_to_drop = false;
+	egress_packet *packet = pop_egress_packet(queue, bucket);
+	if (packet == nullptr)
+	{
+		bucket->first_above_ns = 0;
+		return nullptr;
+	}
+
+	uint64_t sojourn = now - packet->enqueue_ns;
+	if (sojourn < EGRESS_CODEL_TARGET_NS or bucket->bytes <= EGRESS_QUANTUM)
+	{
+		// 目標を下回ったか、残りが 1 パケット分しかなければリセット
+		bucket->first_above_ns = 0;
+	}
+	else if (bucket->first_above_ns == 0)
+	{
+		bucket->first_above_ns = now + EGRESS_CODEL_INTERVAL_NS;
+	}
+	else if (now >= bucket->first_above_ns)
+	{
+		*ok_to_drop = true;
+	}
+	return packet;
+}
+
+/**
+ * 次に捨てる時刻。捨てた回数の平方根に反比例して間隔を縮める
+ * @param t
+ * @param count
+ * @return
+ */
+uint64_t codel_control_law(uint64_t t, uint32_t count)
+{
+	return t + static_cast<uint64_t>(EGRESS_CODEL_INTERVAL_NS / std::sqrt(static_cast<double>(count)));
+}
+
+void drop_egress_codel(egress_queue *queue, egress_bucket *bucket, egress_packet *packet)
+{
+	free(packet);
+	bucket->codel_drops++;
+	queue->codel_drops++;
+	count_drop(queue->dev, drop_reason::queue_drop);
+}
+
+/**
+ * CoDel を通してバケットからパケットを取り出す
+ * @param queue
+ * @param bucket
+ * @param now
+ * @return 送信するパケット。バケットが空になれば nullptr
+ */
+egress_packet *codel_dequeue(egress_queue *queue, egress_bucket *bucket, uint64_t now)
+{
+	bool ok_to_drop;
+	egress_packet *packet = codel_do_dequeue(queue, bucket, now, &ok_to_drop);
+
+	if (bucket->dropping)
+	{
+		if (!ok_to_drop)
+		{
+			// 滞留が解消した
+			bucket->dropping = false;
+		}
+		while (bucket->dropping and now >= bucket->drop_next_ns)
+		{
+			drop_egress_codel(queue, bucket, packet);
+			bucket->drop_count++;
+			packet = codel_do_dequeue(queue, bucket, now, &ok_to_drop);
+			if (!ok_to_drop)
+			{
+				bucket->dropping = false;
+			}
+			else
+			{
+				bucket->drop_next_ns = codel_control_law(bucket->drop_next_ns, bucket->drop_count);
+			}
+		}
+	}
+	else if (ok_to_drop)
+	{
+		drop_egress_codel(queue, bucket, packet);
+		packet = codel_do_dequeue(queue, bucket, now, &ok_to_drop);
+		bucket->dropping = true;
+
+		// 少し前まで捨てていたなら、その時の間隔から再開する
+		uint32_t delta = bucket->drop_count - bucket->last_drop_count;
+		bucket->drop_count = delta > 1 and now - bucket->drop_next_ns < 16 * EGRESS_CODEL_INTERVAL_NS ? delta : 1;
+		bucket->drop_next_ns = codel_control_law(now, bucket->drop_count);
+		bucket->last_drop_count = bucket->drop_count;
+	}
+
+	if (packet != nullptr)
+	{
+		bucket->sent++;
+		bucket->sojourn_ns = now - packet->enqueue_ns;
+		if (bucket->sojourn_ns > bucket->max_sojourn_ns)
+		{
+			bucket->max_sojourn_ns = bucket->sojourn_ns;
+		}
+	}
+	return packet;
+}
+
+/**
+ * 次に送信するパケットを Deficit Round Robin で選ぶ (RFC 8290)
+ * @param queue
+ * @param now
+ * @return
+ */
+egress_packet *egress_dequeue(egress_queue *queue, uint64_t now)
+{
+	while (true)
+	{
+		egress_bucket_list *list = queue->new_buckets.head != nullptr ? &queue->new_buckets : &queue->old_buckets;
+		if (list->head == nullptr)
+		{
+			return nullptr;
+		}
+
+		egress_bucket *bucket = list->head;
+		if (bucket->deficit <= 0)
+		{
+			// 送信できる量を使い切ったら、次の巡に回す
+			bucket->deficit += EGRESS_QUANTUM;
+			push_egress_bucket(&queue->old_buckets, pop_egress_bucket(list));
+			continue;
+		}
+
+		egress_packet *packet = codel_dequeue(queue, bucket, now);
+		if (packet == nullptr)
+		{
+			pop_egress_bucket(list);
+			// 新しいバケットが空になっても、すぐには新しい扱いに戻さない
+			if (list == &queue->new_buckets and queue->old_buckets.head != nullptr)
+			{
+				push_egress_bucket(&queue->old_buckets, bucket);
+			}
+			else
+			{
+				bucket->active = false;
+			}
+			continue;
+		}
+
+		bucket->deficit -= packet->len;
+		return packet;
+	}
+}
+
+/**
+ * 経過時間の分だけトークンを足す
+ * @param queue
+ * @param now
+ */
+void refill_egress_tokens(egress_queue *queue, uint64_t now)
+{
+	if (queue->rate == 0)
+	{
+		return;
+	}
+	uint64_t elapsed = now - queue->last_refill_ns;
+	if (elapsed >= 1000000000)
+	{
+		// 長く空いていたら満タンにする (掛け算が溢れないように)
+		queue->tokens = queue->burst;
+		queue->last_refill_ns = now;
+		return;
+	}
+	uint64_t added = elapsed * queue->rate / 1000000000;
+	if (added == 0)
+	{
+		return;
+	}
+	// 端数の時間は次回に持ち越す
+	queue->last_refill_ns += added * 1000000000 / queue->rate;
+	queue->tokens += added;
+	if (queue->tokens > (int64_t)queue->burst)
+	{
+		queue->tokens = queue->burst;
+	}
+}
+
+/**
+ * デバイスからフレームを送信して、送信数を数える
+ * @param dev
+ * @param frame
+ * @param len
+ * @param offload
+ * @return
+ */
+int transmit_frame(net_device *dev, uint8_t *frame, size_t len, const net_offload *offload)
+{
+	capture_packet(capture_point::egress, dev, frame, len);
+	int result = dev->ops.transmit(dev, frame, len, offload);
+	if (result == -1)
+	{
+		count_tx_error(dev);
+	}
+	else
+	{
+		count_tx(dev, len);
+	}
+	return result;
+}
+
+/**
+ * 送信キューを通してフレームを送信する
+ * キューがないか、空で送信できるときはそのまま送信し、そうでなければコピーしてキューに入れる
+ * @param dev
+ * @param frame
+ * @param len
+ * @param offload
+ * @return
+ */
+int egress_output(net_device *dev, uint8_t *frame, size_t len, const net_offload *offload)
+{
+	egress_queue *queue = dev->egress[worker_id];
+	if (queue == nullptr)
+	{
+		return transmit_frame(dev, frame, len, offload);
+	}
+
+	uint64_t now = current_time_ns();
+	refill_egress_tokens(queue, now);
+	if (queue->packets == 0 and (queue->rate == 0 or queue->tokens > 0))
+	{
+		queue->tokens -= len;
+		queue->direct++;
+		return transmit_frame(dev, frame, len, offload);
+	}
+
+	auto *packet = (egress_packet *)malloc(sizeof(egress_packet) + len);
+	if (packet == nullptr)
+	{
+		queue->overflow_drops++;
+		count_drop(dev, drop_reason::queue_drop);
+		return -1;
+	}
+	packet->next = nullptr;
+	packet->enqueue_ns = now;
+	packet->len = len;
+	packet->has_offload = offload != nullptr;
+	if (offload != nullptr)
+	{
+		packet->offload = *offload;
+	}
+	memcpy(packet->frame, frame, len);
+
+	egress_bucket *bucket = &queue->buckets[get_egress_bucket_index(frame, len)];
+	if (bucket->tail == nullptr)
+	{
+		bucket->head = packet;
+	}
+	else
+	{
+		bucket->tail->next = packet;
+	}
+	bucket->tail = packet;
+	bucket->packets++;
+	bucket->bytes += len;
+	queue->packets++;
+	queue->bytes += len;
+	queue->enqueued++;
+
+	if (!bucket->active)
+	{
+		bucket->active = true;
+		bucket->deficit = EGRESS_QUANTUM;
+		push_egress_bucket(&queue->new_buckets, bucket);
+	}
+
+	while (queue->packets > EGRESS_QUEUE_PACKET_LIMIT or queue->bytes > EGRESS_QUEUE_BYTE_LIMIT)
+	{
+		drop_egress_overflow(queue);
+	}
+	return 0;
+}
+
+/**
+ * トークンがある分だけキューから送信する
+ * @param dev
+ */
+void egress_queue_poll(net_device *dev)
+{
+	egress_queue *queue = dev->egress[worker_id];
+	if (queue == nullptr or queue->packets == 0)
+	{
+		return;
+	}
+
+	uint64_t now = current_time_ns();
+	refill_egress_tokens(queue, now);
+	while (queue->rate == 0 or queue->tokens > 0)
+	{
+		egress_packet *packet = egress_dequeue(queue, now);
+		if (packet == nullptr)
+		{
+			return;
+		}
+		queue->tokens -= packet->len;
+		if (transmit_frame(dev, packet->frame, packet->len, packet->has_offload ? &packet->offload : nullptr) == -1)
+		{
+			queue->tx_errors++;
+		}
+		else
+		{
+			queue->sent++;
+		}
+		free(packet);
+	}
+}
+
+/**
+ * 送信キューの深さ・滞留時間・廃棄数を出力
+ */
+void dump_egress_queue_stats()
+{
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		for (uint32_t w = 0; w < worker_count; ++w)
+		{
+			egress_queue *queue = dev->egress[w];
+			if (queue == nullptr)
+			{
+				continue;
+			}
+
+			printf("Egress queue on %s (worker %u, rate %lu bit/s): %u packets / %lu bytes queued, %lu direct, %lu enqueued, %lu sent, %lu codel drops, %lu overflow drops, %lu tx errors\n",
+						 dev->name, w, queue->rate * 8, queue->packets, queue->bytes,
+						 queue->direct, queue->enqueued, queue->sent, queue->codel_drops, queue->overflow_drops, queue->tx_errors);
+			for (int i = 0; i < EGRESS_BUCKET_NUM; ++i)
+			{
+				egress_bucket *bucket = &queue->buckets[i];
+				if (bucket->sent == 0 and bucket->packets == 0 and bucket->codel_drops == 0 and bucket->overflow_drops == 0)
+				{
+					continue;
+				}
+				printf("  bucket %2d: %u packets / %u bytes, sojourn %.2f ms (max %.2f ms), %lu sent, %lu codel drops, %lu overflow drops\n",
+							 i, bucket->packets, bucket->bytes, bucket->sojourn_ns / 1e6, bucket->max_sojourn_ns / 1e6,
+							 bucket->sent, bucket->codel_drops, bucket->overflow_drops);
+			}
+		}
+	}
+}
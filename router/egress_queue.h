@@ -0,0 +1,97 @@
+#ifndef CURO_EGRESS_QUEUE_H
+#define CURO_EGRESS_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "net.h"
+
+/**
+ * デバイスごとの送信キュー
+ *  - フレームを 5-tuple のハッシュでバケットに分け、Deficit Round Robin で順に送信する
+ *    新しく送信を始めたバケットを優先するので、対話的な通信は大量の通信の後ろで待たされない
+ *  - バケットごとに CoDel で滞留時間を見て、溜まり続けているバケットのパケットを捨てる
+ *  - トークンバケットで送信レートを制限する
+ * キューが空で送信できるときは、コピーせずにそのまま送信する
+ */
+
+#define EGRESS_BUCKET_NUM 64
+#define EGRESS_QUEUE_PACKET_LIMIT 2048 // キュー全体のパケット数の上限
+#define EGRESS_QUEUE_BYTE_LIMIT (4 * 1024 * 1024) // キュー全体のバイト数の上限
+#define EGRESS_QUANTUM 1514 // 1 巡ごとにバケットが送信できるバイト数
+#define EGRESS_CODEL_TARGET_NS (5 * 1000 * 1000ull) // 許容する滞留時間
+#define EGRESS_CODEL_INTERVAL_NS (100 * 1000 * 1000ull) // 滞留が続いたら捨て始めるまでの時間
+
+struct egress_packet
+{
+	egress_packet *next;
+	uint64_t enqueue_ns;
+	uint32_t len;
+	bool has_offload;
+	net_offload offload;
+	uint8_t frame[];
+};
+
+struct egress_bucket
+{
+	egress_packet *head;
+	egress_packet *tail;
+	uint32_t packets;
+	uint32_t bytes;
+	int32_t deficit;
+	bool active; // new_buckets か old_buckets のどちらかに入っているか
+	egress_bucket *next;
+
+	// CoDel の状態
+	uint64_t first_above_ns; // 滞留時間が目標を超え続けていたら、捨て始める時刻
+	uint64_t drop_next_ns;
+	uint32_t drop_count;
+	uint32_t last_drop_count;
+	bool dropping;
+
+	// 統計
+	uint64_t sojourn_ns; // 最後に送信したパケットの滞留時間
+	uint64_t max_sojourn_ns;
+	uint64_t sent;
+	uint64_t codel_drops;
+	uint64_t overflow_drops;
+};
+
+struct egress_bucket_list
+{
+	egress_bucket *head;
+	egress_bucket *tail;
+};
+
+struct egress_queue
+{
+	net_device *dev;
+	egress_bucket buckets[EGRESS_BUCKET_NUM];
+	egress_bucket_list new_buckets; // 送信を始めたばかりのバケット
+	egress_bucket_list old_buckets;
+	uint32_t packets;
+	uint64_t bytes;
+
+	// トークンバケット (rate が 0 なら制限しない)
+	uint64_t rate; // bytes/s
+	uint64_t burst; // トークンの上限 (bytes)
+	int64_t tokens;
+	uint64_t last_refill_ns;
+
+	// 統計
+	uint64_t direct; // キューを通さずに送信したパケット数
+	uint64_t enqueued;
+	uint64_t sent;
+	uint64_t codel_drops;
+	uint64_t overflow_drops;
+	uint64_t tx_errors;
+};
+
+egress_queue *create_egress_queue(net_device *dev, uint64_t rate_bps);
+
+int egress_output(net_device *dev, uint8_t *frame, size_t len, const net_offload *offload);
+
+void egress_queue_poll(net_device *dev);
+
+void dump_egress_queue_stats();
+
+#endif // CURO_EGRESS_QUEUE_H
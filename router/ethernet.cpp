@@ -1,9 +1,15 @@
 #include "ethernet.h"
+#include "acl.h"
 #include "arp.h"
+#include "capture.h"
+#include "egress_queue.h"
+#include "flow_export.h"
 #include "ip.h"
+#include "latency.h"
 #include "log.h"
 #include "my_buf.h"
 #include "net.h"
+#include "stats.h"
 #include "utils.h"
 #include <cstring>
 
@@ -12,9 +18,19 @@
  * @param dev device that received
  * @param buffer byte sequence of the data received
  * @param len length of the data received
+ * @param offload checksum offload & GSO info of the frame (nullable)
  */
-void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len)
+void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len, const net_offload *offload)
 {
+	LATENCY_STAGE(ethernet_input);
+	count_rx(dev, len);
+	if (len < ETHERNET_HEADER_SIZE)
+	{
+		count_drop(dev, drop_reason::short_packet);
+		return;
+	}
+	capture_packet(capture_point::rx, dev, buffer, len);
+
 	// 送られてきた通信をイーサネットのフレームとして解釈する
 	auto *header = reinterpret_cast<ethernet_header *>(buffer);
 	// イーサタイプを抜き出し、ホストバイトオーダーに変換
@@ -26,7 +42,7 @@ void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len)
 		return;
 	}
 
-	LOG_ETHERNET("Received ethernet frame type %04x from %s to %s\n", ether_type, mac_addr_toa(header->src_addr), mac_addr_toa(header->dest_addr));
+	LOG_ETHERNET("Received ethernet frame type %04x from %s to %s\n", ether_type, log_mac(header->src_addr), log_mac(header->dest_addr));
 
 	// イーサタイプの値から上位プロトコルを特定する
 	switch (ether_type)
@@ -38,11 +54,33 @@ void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len)
 				buffer + ETHERNET_HEADER_SIZE,
 				len - ETHERNET_HEADER_SIZE);
 	case ETHER_TYPE_IP:
+	{
+		// 受信したデバイスに ACL があれば、NAPT や転送の前にフィルタする
+		if (dev->ip_dev != nullptr and dev->ip_dev->acl != nullptr and
+				!acl_permit(dev->ip_dev->acl, buffer + ETHERNET_HEADER_SIZE, len - ETHERNET_HEADER_SIZE))
+		{
+			count_drop(dev, drop_reason::acl_deny);
+			return;
+		}
+		// NAPT のワーカー間の受け渡しで ip_input を 2 回通ることがあるので、受信したときにサンプリングする
+		flow_sample(dev, buffer + ETHERNET_HEADER_SIZE, len - ETHERNET_HEADER_SIZE);
+
+		// オフロードの情報の位置も、Ethernet ヘッダを外した後の位置にする
+		net_offload ip_offload;
+		if (offload != nullptr)
+		{
+			ip_offload = *offload;
+			ip_offload.csum_start -= ETHERNET_HEADER_SIZE;
+			ip_offload.hdr_len = ip_offload.hdr_len > ETHERNET_HEADER_SIZE ? ip_offload.hdr_len - ETHERNET_HEADER_SIZE : 0;
+		}
+
 		// Ethernet ヘッダを外して IP 処理へ
 		return ip_input(
 				dev,
 				buffer + ETHERNET_HEADER_SIZE,
-				len - ETHERNET_HEADER_SIZE);
+				len - ETHERNET_HEADER_SIZE,
+				offload != nullptr ? &ip_offload : nullptr);
+	}
 	default:
 		LOG_ETHERNET("Received unhandled ether type %04x\n", ether_type);
 		return;
@@ -59,7 +97,7 @@ void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len)
 void ethernet_encapsulate_output(
 		net_device *dev, const uint8_t *dest_addr, my_buf *payload_mybuf, uint16_t ether_type)
 {
-	LOG_ETHERNET("Sending ethernet frame type %04x from %s to %s\n", ether_type, mac_addr_toa(dev->mac_addr), mac_addr_toa(dest_addr));
+	LOG_ETHERNET("Sending ethernet frame type %04x from %s to %s\n", ether_type, log_mac(dev->mac_addr), log_mac(dest_addr));
 
 	// Ethernet ヘッダ長分のバッファを確保
 	my_buf *header_mybuf = my_buf::create(ETHERNET_HEADER_SIZE);
@@ -73,7 +111,8 @@ void ethernet_encapsulate_output(
 	// 上位プロトコルから受け取ったバッファにヘッダをつける
 	payload_mybuf->add_header(header_mybuf);
 
-	uint8_t send_buffer[1550];
+	// GSO のフレームも入るよう、大きめのバッファをスレッドごとに持つ
+	static thread_local uint8_t send_buffer[NET_FRAME_MAX_SIZE];
 	// 全長を計算しながらメモリにバッファを展開する
 	size_t total_len = 0;
 	my_buf *current = header_mybuf;
@@ -92,8 +131,19 @@ void ethernet_encapsulate_output(
 		current = current->next;
 	}
 
-	// ネットワーク・デバイスに送信する
-	dev->ops.transmit(dev, send_buffer, total_len);
+	// オフロードの情報があれば、Ethernet ヘッダの分だけ位置をずらして渡す
+	const net_offload *offload = nullptr;
+	net_offload frame_offload;
+	if (payload_mybuf->offload.flags != 0 or payload_mybuf->offload.gso_type != NET_OFFLOAD_GSO_NONE)
+	{
+		frame_offload = payload_mybuf->offload;
+		frame_offload.csum_start += ETHERNET_HEADER_SIZE;
+		frame_offload.hdr_len += ETHERNET_HEADER_SIZE;
+		offload = &frame_offload;
+	}
+
+	// 送信キューを通してネットワーク・デバイスに送信する
+	egress_output(dev, send_buffer, total_len, offload);
 
 	// メモリ解放
 	my_buf::my_buf_free(header_mybuf, true);
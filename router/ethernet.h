@@ -31,7 +31,7 @@ struct ethernet_header
 	uint16_t type;
 } __attribute__((packed));
 
-void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len);
+void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len, const net_offload *offload = nullptr);
 
 struct my_buf;
 
@@ -0,0 +1,294 @@
+#include "flow_cache.h"
+
+#include "arp.h"
+#include "capture.h"
+#include "checksum.h"
+#include "egress_queue.h"
+#include "ip.h"
+#include "napt.h"
+#include "net.h"
+#include "utils.h"
+#include "worker.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * キャッシュの世代番号
+ * 経路・ARP が変わるたびに進め、古い世代のエントリは使わない
+ * エントリの 0 は空きを表すので 1 から始める
+ */
+std::atomic<uint64_t> flow_cache_generation{1};
+
+// false なら全てのパケットを通常の処理で転送する (キャッシュの効果を測るため)
+bool flow_cache_enabled = true;
+
+// ワーカーごとのキャッシュ (最初に登録するときに確保する)
+thread_local flow_cache_entry *flow_cache = nullptr;
+thread_local flow_cache_stats flow_cache_stat = {};
+
+/**
+ * キーからキャッシュの位置を求める
+ * @param key
+ * @return
+ */
+uint32_t get_flow_cache_index(const flow_key *key)
+{
+	uint64_t hash = reinterpret_cast<uintptr_t>(key->input_dev);
+	hash ^= (static_cast<uint64_t>(key->src_addr) << 32 | key->dest_addr) * 0x9e3779b97f4a7c15ull;
+	hash ^= (static_cast<uint64_t>(key->src_port) << 24 | static_cast<uint64_t>(key->dest_port) << 8 | key->protocol) * 0xc2b2ae3d27d4eb4full;
+	return (hash ^ hash >> 29) & (FLOW_CACHE_SIZE - 1);
+}
+
+bool is_flow_key_equal(const flow_key *a, const flow_key *b)
+{
+	return a->input_dev == b->input_dev and
+				 a->src_addr == b->src_addr and
+				 a->dest_addr == b->dest_addr and
+				 a->src_port == b->src_port and
+				 a->dest_port == b->dest_port and
+				 a->protocol == b->protocol;
+}
+
+/**
+ * 受信した IP パケットからキャッシュのキーを作る
+ * キャッシュするのは TCP と UDP だけで、フラグメントや、NAT が TCP の状態を追う SYN/FIN/RST は対象外
+ * @param input_dev
+ * @param ip_packet 検証済みのヘッダ
+ * @param len IP パケットの長さ
+ * @param key
+ * @return キャッシュできるパケットなら true
+ */
+bool make_flow_key(net_device *input_dev, ip_header *ip_packet, size_t len, flow_key *key)
+{
+	// フラグメントの 2 つめ以降にはポートがない
+	if ((ntohs(ip_packet->frag_offset) & 0x3fff) != 0)
+	{
+		return false;
+	}
+
+	auto *l4 = reinterpret_cast<nat_packet_head *>(reinterpret_cast<uint8_t *>(ip_packet) + sizeof(ip_header));
+	switch (ip_packet->protocol)
+	{
+	case IP_PROTOCOL_NUM_TCP:
+		if (len < sizeof(ip_header) + 20 or (l4->tcp.flag & (TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST)) != 0)
+		{
+			return false;
+		}
+		break;
+	case IP_PROTOCOL_NUM_UDP:
+		if (len < sizeof(ip_header) + 8)
+		{
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+
+	key->input_dev = input_dev;
+	key->src_addr = ip_packet->src_addr;
+	key->dest_addr = ip_packet->dest_addr;
+	key->src_port = l4->src_port;
+	key->dest_port = l4->dest_port;
+	key->protocol = ip_packet->protocol;
+	return true;
+}
+
+/**
+ * キャッシュにあるフローなら、覚えている書き換えをしてそのまま送信する
+ * Ethernet ヘッダは IP パケットの直前に書き込むので、ip_packet の前に ETHERNET_HEADER_SIZE の余白が必要
+ * @param key
+ * @param ip_packet
+ * @param len
+ * @param offload
+ * @return 送信したら true。false ならパケットは変更されていない
+ */
+bool flow_cache_forward(const flow_key *key, ip_header *ip_packet, size_t len, const net_offload *offload)
+{
+	if (flow_cache == nullptr)
+	{
+		flow_cache_stat.misses++;
+		return false;
+	}
+
+	flow_cache_entry *entry = &flow_cache[get_flow_cache_index(key)];
+	if (entry->generation != flow_cache_generation.load(std::memory_order_relaxed) or !is_flow_key_equal(&entry->key, key))
+	{
+		flow_cache_stat.misses++;
+		return false;
+	}
+
+	// TTL が尽きるパケットは ICMP を返すために通常の処理に回す
+	if (entry->decrement_ttl and ip_packet->ttl <= 1)
+	{
+		flow_cache_stat.misses++;
+		return false;
+	}
+
+	// NAT するフローは、セッションが削除されていないか確かめる
+	nat_entry *nat = nullptr;
+	if (entry->nat_dev != nullptr)
+	{
+		nat = get_nat_entry_by_sequence(entry->nat_dev, entry->nat_proto, entry->nat_global_addr, entry->nat_global_port, entry->nat_sequence);
+		if (nat == nullptr)
+		{
+			entry->generation = 0;
+			flow_cache_stat.stale_sessions++;
+			flow_cache_stat.misses++;
+			return false;
+		}
+	}
+	flow_cache_stat.hits++;
+
+	if (nat != nullptr)
+	{
+		capture_packet(capture_point::pre_nat, key->input_dev, reinterpret_cast<uint8_t *>(ip_packet), len);
+	}
+	if (entry->decrement_ttl)
+	{
+		ip_packet->ttl--;
+	}
+	ip_packet->src_addr = entry->new_src_addr;
+	ip_packet->dest_addr = entry->new_dest_addr;
+	ip_packet->header_checksum = checksum_adjust(ip_packet->header_checksum, entry->ip_checksum_diff);
+
+	auto *l4 = reinterpret_cast<nat_packet_head *>(reinterpret_cast<uint8_t *>(ip_packet) + sizeof(ip_header));
+	l4->src_port = entry->new_src_port;
+	l4->dest_port = entry->new_dest_port;
+	if (offload != nullptr and (offload->flags & NET_OFFLOAD_NEEDS_CSUM))
+	{
+		// チェックサムは送信時に計算されるので、疑似ヘッダの部分だけ更新する
+		uint16_t *checksum = ip_packet->protocol == IP_PROTOCOL_NUM_TCP ? &l4->tcp.checksum : &l4->udp.checksum;
+		*checksum = checksum_adjust_partial(*checksum, entry->l4_partial_checksum_diff);
+	}
+	else if (ip_packet->protocol == IP_PROTOCOL_NUM_TCP)
+	{
+		l4->tcp.checksum = checksum_adjust(l4->tcp.checksum, entry->l4_checksum_diff);
+	}
+	else
+	{
+		l4->udp.checksum = checksum_adjust_udp(l4->udp.checksum, entry->l4_checksum_diff);
+	}
+
+	if (nat != nullptr)
+	{
+		capture_packet(capture_point::post_nat, key->input_dev, reinterpret_cast<uint8_t *>(ip_packet), len);
+		touch_nat_entry(nat);
+	}
+
+	// 直前の余白に Ethernet ヘッダを書いて送信する
+	uint8_t *frame = reinterpret_cast<uint8_t *>(ip_packet) - ETHERNET_HEADER_SIZE;
+	memcpy(frame, entry->ethernet_header, ETHERNET_HEADER_SIZE);
+
+	net_offload frame_offload;
+	const net_offload *transmit_offload = nullptr;
+	if (offload != nullptr and (offload->flags != 0 or offload->gso_type != NET_OFFLOAD_GSO_NONE))
+	{
+		frame_offload = *offload;
+		frame_offload.csum_start += ETHERNET_HEADER_SIZE;
+		frame_offload.hdr_len += ETHERNET_HEADER_SIZE;
+		transmit_offload = &frame_offload;
+	}
+	egress_output(entry->output_dev, frame, len + ETHERNET_HEADER_SIZE, transmit_offload);
+	return true;
+}
+
+/**
+ * 通常の処理で転送したフローをキャッシュに登録する
+ * 次の転送先の MAC アドレスが解決済みのときだけ登録する
+ * @param key 書き換える前のパケットから作ったキー
+ * @param ip_packet 書き換えた後のパケット
+ * @param decrement_ttl TTL を減らして転送したか
+ * @param nat_dev nat のテーブル (nullable)
+ * @param nat フローの NAT セッション (nullable)
+ */
+void flow_cache_fill(const flow_key *key, ip_header *ip_packet, bool decrement_ttl, nat_device *nat_dev, nat_entry *nat)
+{
+	uint32_t dest_addr = ntohl(ip_packet->dest_addr);
+	ip_route_entry *route = binary_trie_search(ip_fib, dest_addr);
+	if (route == nullptr)
+	{
+		return;
+	}
+	uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+	net_device *output_dev;
+	if (!search_arp_table_entry(route->type == connected ? dest_addr : route->next_hop, mac_addr, &output_dev) or output_dev == nullptr)
+	{
+		return;
+	}
+
+	if (flow_cache == nullptr)
+	{
+		flow_cache = (flow_cache_entry *)calloc(FLOW_CACHE_SIZE, sizeof(flow_cache_entry));
+		if (flow_cache == nullptr)
+		{
+			return;
+		}
+	}
+
+	flow_cache_entry *entry = &flow_cache[get_flow_cache_index(key)];
+	entry->key = *key;
+	entry->generation = flow_cache_generation.load(std::memory_order_relaxed);
+	entry->output_dev = output_dev;
+
+	auto *ethernet = reinterpret_cast<ethernet_header *>(entry->ethernet_header);
+	memcpy(ethernet->dest_addr, mac_addr, MAC_ADDRESS_SIZE);
+	memcpy(ethernet->src_addr, output_dev->mac_addr, MAC_ADDRESS_SIZE);
+	ethernet->type = htons(ETHER_TYPE_IP);
+
+	auto *l4 = reinterpret_cast<nat_packet_head *>(reinterpret_cast<uint8_t *>(ip_packet) + sizeof(ip_header));
+	entry->new_src_addr = ip_packet->src_addr;
+	entry->new_dest_addr = ip_packet->dest_addr;
+	entry->new_src_port = l4->src_port;
+	entry->new_dest_port = l4->dest_port;
+
+	uint32_t addr_diff = checksum_diff_32(key->src_addr, entry->new_src_addr) + checksum_diff_32(key->dest_addr, entry->new_dest_addr);
+	uint32_t port_diff = checksum_diff_16(key->src_port, entry->new_src_port) + checksum_diff_16(key->dest_port, entry->new_dest_port);
+	uint32_t ttl_diff = 0;
+	if (decrement_ttl)
+	{
+		// TTL を 1 減らしたときの差分は TTL の値によらない
+		ttl_diff = checksum_diff_16(htons((ip_packet->ttl + 1) << 8 | ip_packet->protocol), htons(ip_packet->ttl << 8 | ip_packet->protocol));
+	}
+	entry->ip_checksum_diff = checksum_fold(addr_diff + ttl_diff);
+	entry->l4_checksum_diff = checksum_fold(addr_diff + port_diff);
+	entry->l4_partial_checksum_diff = checksum_fold(addr_diff);
+	entry->decrement_ttl = decrement_ttl;
+	entry->nat_dev = nat != nullptr ? nat_dev : nullptr;
+	if (nat != nullptr)
+	{
+		entry->nat_proto = nat->proto;
+		entry->nat_global_addr = nat->global_addr;
+		entry->nat_global_port = nat->global_port;
+		entry->nat_sequence = nat->sequence;
+	}
+
+	flow_cache_stat.fills++;
+}
+
+/**
+ * 全てのワーカーのキャッシュを無効にする
+ * 経路・ARP エントリ・デバイスを変更、削除したときに呼ぶ
+ */
+void flow_cache_invalidate()
+{
+	flow_cache_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * キャッシュのヒット率を出力
+ */
+void dump_flow_cache_stats()
+{
+	uint64_t total = flow_cache_stat.hits + flow_cache_stat.misses;
+	printf("Flow cache (worker %u, %s): %lu hits, %lu misses (%.1f%% hit), %lu fills, %lu stale sessions, generation %lu\n",
+				 worker_id,
+				 flow_cache_enabled ? "enabled" : "disabled",
+				 flow_cache_stat.hits,
+				 flow_cache_stat.misses,
+				 total == 0 ? 0.0 : 100.0 * flow_cache_stat.hits / total,
+				 flow_cache_stat.fills,
+				 flow_cache_stat.stale_sessions,
+				 flow_cache_generation.load(std::memory_order_relaxed));
+}
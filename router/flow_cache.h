@@ -0,0 +1,81 @@
+#ifndef CURO_FLOW_CACHE_H
+#define CURO_FLOW_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "ethernet.h"
+
+/**
+ * 転送済みのフローの処理結果を覚えておくキャッシュ
+ * (入力デバイス, 5-tuple) が一致するパケットは、NAT・経路・ARP の検索をせずに、覚えている書き換えをして送信する
+ * キャッシュはワーカーごとに持ち、経路・ARP が変わったら世代番号を進めて全て無効にする
+ * NAT セッションの削除は、そのセッションのエントリだけを無効にする (エントリごとにセッションの番号を比べる)
+ */
+
+#define FLOW_CACHE_BITS 12
+#define FLOW_CACHE_SIZE (1 << FLOW_CACHE_BITS)
+
+struct ip_header;
+struct nat_device;
+struct nat_entry;
+struct net_device;
+struct net_offload;
+enum class nat_protocol;
+
+// 値はパケットに書かれている通りのバイトオーダー
+struct flow_key
+{
+	net_device *input_dev;
+	uint32_t src_addr;
+	uint32_t dest_addr;
+	uint16_t src_port;
+	uint16_t dest_port;
+	uint8_t protocol;
+};
+
+struct flow_cache_entry
+{
+	flow_key key;
+	uint64_t generation; // 登録したときの世代番号。現在の世代と違えば無効
+	net_device *output_dev;
+	uint8_t ethernet_header[ETHERNET_HEADER_SIZE]; // 送信するフレームの Ethernet ヘッダ
+	uint32_t new_src_addr; // 書き換え後の値
+	uint32_t new_dest_addr;
+	uint16_t new_src_port;
+	uint16_t new_dest_port;
+	uint16_t ip_checksum_diff; // IP ヘッダチェックサムの差分 (アドレスと TTL)
+	uint16_t l4_checksum_diff; // L4 チェックサムの差分 (疑似ヘッダのアドレスとポート)
+	uint16_t l4_partial_checksum_diff; // チェックサムオフロード中の L4 チェックサムの差分 (アドレスだけ)
+	bool decrement_ttl;
+	// 通過を記録する NAT セッション (NAT しないフローは nat_dev が nullptr)
+	// 削除されたセッションの領域は再利用されるので、ポインタではなく外側のアドレスとポートで引き直し、番号を比べる
+	nat_device *nat_dev;
+	nat_protocol nat_proto;
+	uint32_t nat_global_addr; // ホストバイトオーダー
+	uint16_t nat_global_port;
+	uint64_t nat_sequence;
+};
+
+struct flow_cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;
+	uint64_t stale_sessions; // セッションが削除されていて使えなかったエントリ
+};
+
+extern bool flow_cache_enabled;
+
+bool is_flow_key_equal(const flow_key *a, const flow_key *b);
+
+bool make_flow_key(net_device *input_dev, ip_header *ip_packet, size_t len, flow_key *key);
+
+bool flow_cache_forward(const flow_key *key, ip_header *ip_packet, size_t len, const net_offload *offload);
+
+void flow_cache_fill(const flow_key *key, ip_header *ip_packet, bool decrement_ttl, nat_device *nat_dev, nat_entry *nat);
+
+void flow_cache_invalidate();
+
+void dump_flow_cache_stats();
+
+#endif // CURO_FLOW_CACHE_H
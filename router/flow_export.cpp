@@ -0,0 +1,553 @@
+#include "flow_export.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <endian.h>
+#include <netinet/in.h>
+#include <new>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ip.h"
+#include "log.h"
+#include "napt.h"
+#include "net.h"
+#include "utils.h"
+
+// IPFIX の情報要素の番号 (IANA)
+#define IPFIX_VERSION 10
+#define IPFIX_SET_ID_TEMPLATE 2
+#define IPFIX_IE_OCTET_DELTA_COUNT 1
+#define IPFIX_IE_PACKET_DELTA_COUNT 2
+#define IPFIX_IE_PROTOCOL_IDENTIFIER 4
+#define IPFIX_IE_SOURCE_TRANSPORT_PORT 7
+#define IPFIX_IE_SOURCE_IPV4_ADDRESS 8
+#define IPFIX_IE_INGRESS_INTERFACE 10
+#define IPFIX_IE_DESTINATION_TRANSPORT_PORT 11
+#define IPFIX_IE_DESTINATION_IPV4_ADDRESS 12
+#define IPFIX_IE_FLOW_START_MILLISECONDS 152
+#define IPFIX_IE_FLOW_END_MILLISECONDS 153
+#define IPFIX_IE_POST_NAT_SOURCE_IPV4_ADDRESS 225
+#define IPFIX_IE_POST_NAT_DESTINATION_IPV4_ADDRESS 226
+#define IPFIX_IE_POST_NAPT_SOURCE_TRANSPORT_PORT 227
+#define IPFIX_IE_POST_NAPT_DESTINATION_TRANSPORT_PORT 228
+#define IPFIX_IE_SAMPLING_PACKET_INTERVAL 305
+
+#define IPFIX_MESSAGE_HEADER_SIZE 16
+#define IPFIX_SET_HEADER_SIZE 4
+
+// テンプレートのフィールド (情報要素, 長さ)。データレコードはこの順に書く
+const uint16_t flow_export_template[][2] = {
+		{IPFIX_IE_SOURCE_IPV4_ADDRESS, 4},
+		{IPFIX_IE_DESTINATION_IPV4_ADDRESS, 4},
+		{IPFIX_IE_SOURCE_TRANSPORT_PORT, 2},
+		{IPFIX_IE_DESTINATION_TRANSPORT_PORT, 2},
+		{IPFIX_IE_PROTOCOL_IDENTIFIER, 1},
+		{IPFIX_IE_INGRESS_INTERFACE, 4},
+		{IPFIX_IE_POST_NAT_SOURCE_IPV4_ADDRESS, 4},
+		{IPFIX_IE_POST_NAT_DESTINATION_IPV4_ADDRESS, 4},
+		{IPFIX_IE_POST_NAPT_SOURCE_TRANSPORT_PORT, 2},
+		{IPFIX_IE_POST_NAPT_DESTINATION_TRANSPORT_PORT, 2},
+		{IPFIX_IE_PACKET_DELTA_COUNT, 8},
+		{IPFIX_IE_OCTET_DELTA_COUNT, 8},
+		{IPFIX_IE_FLOW_START_MILLISECONDS, 8},
+		{IPFIX_IE_FLOW_END_MILLISECONDS, 8},
+		{IPFIX_IE_SAMPLING_PACKET_INTERVAL, 4},
+};
+#define FLOW_EXPORT_FIELD_NUM (sizeof(flow_export_template) / sizeof(flow_export_template[0]))
+#define FLOW_EXPORT_POST_NAT_FIELD_NUM 4 // FLOW_EXPORT_TEMPLATE_ID_NO_NAT で省くフィールドの数
+#define FLOW_EXPORT_RECORD_SIZE 65 // フィールドの長さの合計
+#define FLOW_EXPORT_RECORD_SIZE_NO_NAT 53 // 変換後のアドレスとポートを省いた長さ
+
+flow_exporter *flow_export = nullptr;
+
+// 0 から減らすと一周するまでサンプリングしないので、最初のパケットで設定を見るように 1 から始める
+thread_local uint32_t flow_sample_countdown = 1;
+
+/**
+ * 次にサンプリングするまでのパケット数
+ * 一定の間隔だと周期的なトラフィックと同期して偏るので、平均が sample_rate になるよう一様に散らす
+ * @param sample_rate
+ * @return
+ */
+uint32_t get_flow_sample_interval(uint32_t sample_rate)
+{
+	if (sample_rate <= 1)
+	{
+		return 1;
+	}
+	return 1 + random_u32() % (2 * sample_rate - 1);
+}
+
+/**
+ * キーから集計表の位置を求める
+ * @param key
+ * @return
+ */
+uint32_t get_flow_export_index(const flow_key *key)
+{
+	uint64_t hash = reinterpret_cast<uintptr_t>(key->input_dev);
+	hash ^= (static_cast<uint64_t>(key->src_addr) << 32 | key->dest_addr) * 0x9e3779b97f4a7c15ull;
+	hash ^= (static_cast<uint64_t>(key->src_port) << 24 | static_cast<uint64_t>(key->dest_port) << 8 | key->protocol) * 0xc2b2ae3d27d4eb4full;
+	return (hash ^ hash >> 31) & (FLOW_EXPORT_TABLE_SIZE - 1);
+}
+
+/**
+ * NAPT のセッションから、変換後のアドレスとポートを記録する
+ * セッションを作る前の最初のパケットでは見つからないので、サンプリングのたびに調べ直す
+ * 他のワーカーが担当するシャードは書き換え中のことがあるので読まず、変換後の値は分からないものとして送る
+ * @param record
+ */
+void update_flow_nat(flow_export_record *record)
+{
+	nat_protocol proto;
+	if ((record->key.protocol != IP_PROTOCOL_NUM_TCP and record->key.protocol != IP_PROTOCOL_NUM_UDP) or
+			!get_nat_protocol(record->key.protocol, &proto))
+	{
+		return;
+	}
+
+	// NAT の内側から外側への通信は、送信元が変わる
+	net_device *input_dev = record->key.input_dev;
+	if (input_dev->ip_dev != nullptr and input_dev->ip_dev->nat_dev != nullptr)
+	{
+		nat_device *nat_dev = input_dev->ip_dev->nat_dev;
+		uint32_t local_addr = ntohl(record->key.src_addr);
+		if (get_nat_shard_by_local(nat_dev, local_addr) % worker_count != worker_id)
+		{
+			record->post_nat_known = false;
+			return;
+		}
+		nat_entry *entry = get_nat_entry_by_local(nat_dev, proto, local_addr, ntohs(record->key.src_port));
+		record->post_nat_known = entry != nullptr;
+		if (entry != nullptr)
+		{
+			record->post_nat_src_addr = htonl(entry->global_addr);
+			record->post_nat_src_port = htons(entry->global_port);
+		}
+		return;
+	}
+
+	// 外側アドレス宛の通信は、宛先が変わる
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev == nullptr or dev->ip_dev->nat_dev == nullptr or !is_nat_global_address(dev->ip_dev->nat_dev, ntohl(record->key.dest_addr)))
+		{
+			continue;
+		}
+		nat_device *nat_dev = dev->ip_dev->nat_dev;
+		uint16_t global_port = ntohs(record->key.dest_port);
+		if (get_nat_shard_by_global(nat_dev, global_port) % worker_count != worker_id)
+		{
+			record->post_nat_known = false;
+			return;
+		}
+		nat_entry *entry = get_nat_entry_by_global(nat_dev, proto, ntohl(record->key.dest_addr), global_port);
+		record->post_nat_known = entry != nullptr;
+		if (entry != nullptr)
+		{
+			record->post_nat_dest_addr = htonl(entry->local_addr);
+			record->post_nat_dest_port = htons(entry->local_port);
+		}
+		return;
+	}
+}
+
+void put_u8(uint8_t **pos, uint8_t value)
+{
+	*(*pos)++ = value;
+}
+
+void put_u16(uint8_t **pos, uint16_t value)
+{
+	value = htons(value);
+	memcpy(*pos, &value, 2);
+	*pos += 2;
+}
+
+void put_u32(uint8_t **pos, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(*pos, &value, 4);
+	*pos += 4;
+}
+
+void put_u64(uint8_t **pos, uint64_t value)
+{
+	value = htobe64(value);
+	memcpy(*pos, &value, 8);
+	*pos += 8;
+}
+
+/**
+ * 今のデータセットの長さを書いて閉じる
+ * @param worker
+ */
+void close_flow_export_data_set(flow_export_worker *worker)
+{
+	if (worker->data_set_template == 0)
+	{
+		return;
+	}
+	uint8_t *pos = worker->message + worker->data_set_offset + 2;
+	put_u16(&pos, worker->message_len - worker->data_set_offset);
+	worker->data_set_template = 0;
+}
+
+/**
+ * 送信途中のメッセージを完成させてコレクタに送る
+ * @param worker
+ */
+void flush_flow_export_message(flow_export_worker *worker)
+{
+	if (worker->message_len == 0)
+	{
+		return;
+	}
+
+	close_flow_export_data_set(worker);
+
+	timespec realtime{};
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	uint8_t *pos = worker->message;
+	put_u16(&pos, IPFIX_VERSION);
+	put_u16(&pos, worker->message_len);
+	put_u32(&pos, realtime.tv_sec);
+	put_u32(&pos, worker->sequence); // このメッセージより前に送ったデータレコードの数
+	put_u32(&pos, worker_id); // ワーカーごとに別の観測ドメインにする
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(flow_export->collector_addr);
+	addr.sin_port = htons(flow_export->collector_port);
+	if (sendto(flow_export->fd, worker->message, worker->message_len, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+	{
+		worker->send_errors++;
+	}
+	else
+	{
+		worker->sent_messages++;
+	}
+
+	// 届かなかったレコードも、シーケンス番号は進めてコレクタが欠落を数えられるようにする
+	worker->sequence += worker->record_count;
+	worker->message_len = 0;
+	worker->record_count = 0;
+}
+
+/**
+ * 変換後のアドレスとポートのフィールドか
+ * @param element 情報要素の番号
+ * @return
+ */
+bool is_flow_export_post_nat_field(uint16_t element)
+{
+	return element == IPFIX_IE_POST_NAT_SOURCE_IPV4_ADDRESS or element == IPFIX_IE_POST_NAT_DESTINATION_IPV4_ADDRESS or
+				 element == IPFIX_IE_POST_NAPT_SOURCE_TRANSPORT_PORT or element == IPFIX_IE_POST_NAPT_DESTINATION_TRANSPORT_PORT;
+}
+
+/**
+ * 新しいメッセージを始める。テンプレートを送り直す時刻なら、データセットの前にテンプレートセットを入れる
+ * @param worker
+ */
+void begin_flow_export_message(flow_export_worker *worker)
+{
+	uint8_t *pos = worker->message + IPFIX_MESSAGE_HEADER_SIZE;
+
+	uint64_t now = current_time_ms();
+	if (worker->last_template_ms == 0 or now - worker->last_template_ms >= FLOW_EXPORT_TEMPLATE_INTERVAL_MS)
+	{
+		put_u16(&pos, IPFIX_SET_ID_TEMPLATE);
+		put_u16(&pos, IPFIX_SET_HEADER_SIZE + 4 + FLOW_EXPORT_FIELD_NUM * 4 + 4 + (FLOW_EXPORT_FIELD_NUM - FLOW_EXPORT_POST_NAT_FIELD_NUM) * 4);
+		put_u16(&pos, FLOW_EXPORT_TEMPLATE_ID);
+		put_u16(&pos, FLOW_EXPORT_FIELD_NUM);
+		for (const auto &field : flow_export_template)
+		{
+			put_u16(&pos, field[0]);
+			put_u16(&pos, field[1]);
+		}
+		put_u16(&pos, FLOW_EXPORT_TEMPLATE_ID_NO_NAT);
+		put_u16(&pos, FLOW_EXPORT_FIELD_NUM - FLOW_EXPORT_POST_NAT_FIELD_NUM);
+		for (const auto &field : flow_export_template)
+		{
+			if (!is_flow_export_post_nat_field(field[0]))
+			{
+				put_u16(&pos, field[0]);
+				put_u16(&pos, field[1]);
+			}
+		}
+		worker->last_template_ms = now;
+	}
+
+	worker->data_set_template = 0;
+	worker->message_len = pos - worker->message;
+}
+
+/**
+ * 今のデータセットが違うテンプレートなら閉じて、新しいデータセットを始める
+ * データセットの長さは閉じるときに書く
+ * @param worker
+ * @param template_id
+ */
+void begin_flow_export_data_set(flow_export_worker *worker, uint16_t template_id)
+{
+	if (worker->data_set_template == template_id)
+	{
+		return;
+	}
+	close_flow_export_data_set(worker);
+
+	uint8_t *pos = worker->message + worker->message_len;
+	worker->data_set_offset = worker->message_len;
+	worker->data_set_template = template_id;
+	put_u16(&pos, template_id);
+	put_u16(&pos, 0);
+	worker->message_len = pos - worker->message;
+}
+
+/**
+ * フローの集計をデータレコードとしてメッセージに追加する
+ * @param worker
+ * @param record
+ */
+void export_flow_record(flow_export_worker *worker, const flow_export_record *record)
+{
+	if (record->packets == 0)
+	{
+		return;
+	}
+	uint16_t template_id = record->post_nat_known ? FLOW_EXPORT_TEMPLATE_ID : FLOW_EXPORT_TEMPLATE_ID_NO_NAT;
+	size_t record_size = record->post_nat_known ? FLOW_EXPORT_RECORD_SIZE : FLOW_EXPORT_RECORD_SIZE_NO_NAT;
+	if (worker->data_set_template != template_id)
+	{
+		record_size += IPFIX_SET_HEADER_SIZE;
+	}
+	if (worker->message_len != 0 and worker->message_len + record_size > FLOW_EXPORT_MESSAGE_SIZE)
+	{
+		flush_flow_export_message(worker);
+	}
+	if (worker->message_len == 0)
+	{
+		begin_flow_export_message(worker);
+	}
+	begin_flow_export_data_set(worker, template_id);
+
+	// アドレスとポートはネットワークバイトオーダーのまま書く
+	uint8_t *pos = worker->message + worker->message_len;
+	memcpy(pos, &record->key.src_addr, 4);
+	memcpy(pos + 4, &record->key.dest_addr, 4);
+	memcpy(pos + 8, &record->key.src_port, 2);
+	memcpy(pos + 10, &record->key.dest_port, 2);
+	pos += 12;
+	put_u8(&pos, record->key.protocol);
+	put_u32(&pos, record->key.input_dev->ifindex);
+	if (record->post_nat_known)
+	{
+		memcpy(pos, &record->post_nat_src_addr, 4);
+		memcpy(pos + 4, &record->post_nat_dest_addr, 4);
+		memcpy(pos + 8, &record->post_nat_src_port, 2);
+		memcpy(pos + 10, &record->post_nat_dest_port, 2);
+		pos += 12;
+	}
+	put_u64(&pos, record->packets);
+	put_u64(&pos, record->bytes);
+	put_u64(&pos, record->first_ms + flow_export->realtime_offset_ms);
+	put_u64(&pos, record->last_ms + flow_export->realtime_offset_ms);
+	put_u32(&pos, flow_export->sample_rate);
+
+	worker->message_len = pos - worker->message;
+	worker->record_count++;
+	worker->exported_records++;
+}
+
+/**
+ * サンプリングしたパケットを集計表に加える
+ * 集計表の同じ位置に別のフローがあれば、そのフローを送って置き換える
+ * @param dev
+ * @param buffer
+ * @param len
+ */
+void flow_sample_slow(net_device *dev, const uint8_t *buffer, size_t len)
+{
+	if (flow_export == nullptr)
+	{
+		flow_sample_countdown = UINT32_MAX;
+		return;
+	}
+	flow_sample_countdown = get_flow_sample_interval(flow_export->sample_rate);
+
+	auto *ip_packet = reinterpret_cast<const ip_header *>(buffer);
+	if (len < sizeof(ip_header) or ip_packet->version != 4 or ip_packet->header_len < (sizeof(ip_header) >> 2))
+	{
+		return;
+	}
+
+	flow_export_worker *worker = &flow_export->workers[worker_id];
+	if (worker->table == nullptr)
+	{
+		worker->table = (flow_export_record *)calloc(FLOW_EXPORT_TABLE_SIZE, sizeof(flow_export_record));
+		if (worker->table == nullptr)
+		{
+			return;
+		}
+	}
+
+	flow_key key{};
+	key.input_dev = dev;
+	key.src_addr = ip_packet->src_addr;
+	key.dest_addr = ip_packet->dest_addr;
+	key.protocol = ip_packet->protocol;
+	size_t header_len = ip_packet->header_len << 2;
+	if ((ip_packet->protocol == IP_PROTOCOL_NUM_TCP or ip_packet->protocol == IP_PROTOCOL_NUM_UDP) and
+			(ntohs(ip_packet->frag_offset) & 0x1fff) == 0 and len >= header_len + 4)
+	{
+		memcpy(&key.src_port, buffer + header_len, 2);
+		memcpy(&key.dest_port, buffer + header_len + 2, 2);
+	}
+
+	uint64_t now = current_time_ms();
+	flow_export_record *record = &worker->table[get_flow_export_index(&key)];
+	if (record->used and !is_flow_key_equal(&record->key, &key))
+	{
+		export_flow_record(worker, record);
+		worker->evicted++;
+		record->used = false;
+	}
+	if (!record->used)
+	{
+		memset(record, 0, sizeof(flow_export_record));
+		record->key = key;
+		record->post_nat_src_addr = key.src_addr;
+		record->post_nat_dest_addr = key.dest_addr;
+		record->post_nat_src_port = key.src_port;
+		record->post_nat_dest_port = key.dest_port;
+		record->post_nat_known = true;
+		record->first_ms = now;
+		record->exported_ms = now;
+		record->used = true;
+	}
+
+	uint16_t total_len = ntohs(ip_packet->total_len);
+	record->packets++;
+	record->bytes += total_len >= sizeof(ip_header) and total_len <= len ? total_len : len;
+	record->last_ms = now;
+	update_flow_nat(record);
+	worker->sampled++;
+}
+
+/**
+ * フローの送出を設定する
+ * @param collector_addr コレクタの IP アドレス (ホストバイトオーダー)
+ * @param collector_port
+ * @param sample_rate 平均で何パケットに 1 つサンプリングするか
+ * @return
+ */
+flow_exporter *create_flow_exporter(uint32_t collector_addr, uint16_t collector_port, uint32_t sample_rate)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		LOG_ERROR("socket for flow export failed: %s\n", strerror(errno));
+		return nullptr;
+	}
+
+	void *memory = aligned_alloc(alignof(flow_exporter), sizeof(flow_exporter));
+	if (memory == nullptr)
+	{
+		close(fd);
+		return nullptr;
+	}
+	memset(memory, 0, sizeof(flow_exporter));
+	auto *exporter = new (memory) flow_exporter();
+	exporter->fd = fd;
+	exporter->collector_addr = collector_addr;
+	exporter->collector_port = collector_port;
+	exporter->sample_rate = sample_rate == 0 ? 1 : sample_rate;
+
+	timespec realtime{};
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	exporter->realtime_offset_ms = (uint64_t)realtime.tv_sec * 1000 + realtime.tv_nsec / 1000000 - current_time_ms();
+
+	flow_export = exporter;
+	return exporter;
+}
+
+/**
+ * 一定の間隔で、このワーカーの集計表からタイムアウトしたフローを送る
+ */
+void flow_export_timer()
+{
+	if (flow_export == nullptr)
+	{
+		return;
+	}
+	flow_export_worker *worker = &flow_export->workers[worker_id];
+	uint64_t now = current_time_ms();
+	if (now - worker->last_scan_ms < FLOW_EXPORT_INTERVAL_MS)
+	{
+		return;
+	}
+	worker->last_scan_ms = now;
+
+	if (worker->table != nullptr)
+	{
+		for (uint32_t i = 0; i < FLOW_EXPORT_TABLE_SIZE; ++i)
+		{
+			flow_export_record *record = &worker->table[i];
+			if (!record->used)
+			{
+				continue;
+			}
+			if (now - record->last_ms >= FLOW_EXPORT_IDLE_TIMEOUT_MS)
+			{
+				export_flow_record(worker, record);
+				record->used = false;
+			}
+			else if (now - record->exported_ms >= FLOW_EXPORT_ACTIVE_TIMEOUT_MS)
+			{
+				// 送った分は差分として数え直す
+				export_flow_record(worker, record);
+				record->packets = 0;
+				record->bytes = 0;
+				record->first_ms = now;
+				record->exported_ms = now;
+			}
+		}
+	}
+	flush_flow_export_message(worker);
+}
+
+/**
+ * フローの送出の統計を出力
+ */
+void dump_flow_export_stats()
+{
+	if (flow_export == nullptr)
+	{
+		printf("Flow export is not configured\n");
+		return;
+	}
+
+	uint64_t sampled = 0, evicted = 0, records = 0, messages = 0, errors = 0;
+	uint32_t active = 0;
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		flow_export_worker *worker = &flow_export->workers[i];
+		sampled += worker->sampled;
+		evicted += worker->evicted;
+		records += worker->exported_records;
+		messages += worker->sent_messages;
+		errors += worker->send_errors;
+		if (worker->table != nullptr)
+		{
+			for (uint32_t j = 0; j < FLOW_EXPORT_TABLE_SIZE; ++j)
+			{
+				active += worker->table[j].used;
+			}
+		}
+	}
+	printf("Flow export to %s:%u (1 in %u packets): %lu sampled, %u active flows, %lu evicted, %lu records in %lu messages, %lu send errors\n",
+				 ip_htoa(flow_export->collector_addr), flow_export->collector_port, flow_export->sample_rate,
+				 sampled, active, evicted, records, messages, errors);
+}
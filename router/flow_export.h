@@ -0,0 +1,101 @@
+#ifndef CURO_FLOW_EXPORT_H
+#define CURO_FLOW_EXPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include "flow_cache.h"
+#include "worker.h"
+
+/**
+ * サンプリングしたフローの IPFIX (RFC 7011) での送出
+ * 受信した IP パケットを平均 1/N でサンプリングし、(入力デバイス, 5-tuple) ごとにワーカーの固定長の表で集計して、
+ * 一定の間隔で UDP のコレクタに送る
+ * NAPT で変換するフローは、nat_entry から変換後のアドレスとポートも送る
+ * 変換後の値が分からないフロー (他のワーカーが担当するセッション、セッションを作る前) は、変換後のフィールドのないテンプレートで送る
+ * サンプリングしないパケットは、スレッドごとのカウンタを 1 減らすだけで済む
+ */
+
+#define FLOW_EXPORT_TABLE_SIZE 4096 // ワーカーごとの集計表のエントリ数 (2 のべき乗)
+#define FLOW_EXPORT_INTERVAL_MS 1000 // 集計表を調べる間隔
+#define FLOW_EXPORT_IDLE_TIMEOUT_MS 15000 // この間サンプリングされなかったフローを送って消す
+#define FLOW_EXPORT_ACTIVE_TIMEOUT_MS 60000 // 続いているフローも、この間隔で途中までの集計を送る
+#define FLOW_EXPORT_TEMPLATE_INTERVAL_MS 30000 // UDP では届かないことがあるので、テンプレートを送り直す間隔
+#define FLOW_EXPORT_MESSAGE_SIZE 1400 // 1 つの UDP データグラムに入れる最大長
+#define FLOW_EXPORT_TEMPLATE_ID 256 // 変換後のアドレスとポートを含むテンプレート
+#define FLOW_EXPORT_TEMPLATE_ID_NO_NAT 257 // 変換後のアドレスとポートを含まないテンプレート
+#define FLOW_EXPORT_DEFAULT_PORT 4739
+
+struct ip_header;
+struct net_device;
+
+struct flow_export_record
+{
+	flow_key key; // 受信したときのアドレスとポート (ネットワークバイトオーダー)
+	uint32_t post_nat_src_addr; // NAPT で変換した後の値 (変換しなければ key と同じ)
+	uint32_t post_nat_dest_addr;
+	uint16_t post_nat_src_port;
+	uint16_t post_nat_dest_port;
+	bool post_nat_known; // false なら変換後の値が分からないので、変換後のフィールドを送らない
+	uint64_t packets; // サンプリングしたパケット数
+	uint64_t bytes;
+	uint64_t first_ms; // current_time_ms の時刻
+	uint64_t last_ms;
+	uint64_t exported_ms; // 最後に途中までの集計を送った時刻
+	bool used;
+};
+
+struct alignas(64) flow_export_worker
+{
+	flow_export_record *table; // 最初にサンプリングしたときに確保する
+	uint8_t message[FLOW_EXPORT_MESSAGE_SIZE]; // 送信途中の IPFIX メッセージ
+	size_t message_len; // 0 なら送信途中のメッセージはない
+	size_t data_set_offset; // message の中の今のデータセットの位置
+	uint16_t data_set_template; // 今のデータセットのテンプレート ID (0 ならデータセットはない)
+	uint16_t record_count; // message のデータセットに入っているレコード数
+	uint32_t sequence; // 送ったデータレコードの累計 (IPFIX のシーケンス番号)
+	uint64_t last_scan_ms;
+	uint64_t last_template_ms;
+
+	// 統計
+	uint64_t sampled;
+	uint64_t evicted; // 集計表の衝突で、途中で送った数
+	uint64_t exported_records;
+	uint64_t sent_messages;
+	uint64_t send_errors;
+};
+
+struct flow_exporter
+{
+	int fd;
+	uint32_t collector_addr; // ホストバイトオーダー
+	uint16_t collector_port;
+	uint32_t sample_rate; // 平均で何パケットに 1 つサンプリングするか
+	uint64_t realtime_offset_ms; // current_time_ms から UNIX 時刻への差
+	flow_export_worker workers[WORKER_MAX];
+};
+
+extern thread_local uint32_t flow_sample_countdown;
+
+void flow_sample_slow(net_device *dev, const uint8_t *buffer, size_t len);
+
+/**
+ * 受信した IP パケットをサンプリングする
+ * @param dev
+ * @param buffer IP パケットの先頭 (ヘッダは未検証)
+ * @param len
+ */
+inline void flow_sample(net_device *dev, const uint8_t *buffer, size_t len)
+{
+	if (--flow_sample_countdown == 0)
+	{
+		flow_sample_slow(dev, buffer, len);
+	}
+}
+
+flow_exporter *create_flow_exporter(uint32_t collector_addr, uint16_t collector_port, uint32_t sample_rate);
+
+void flow_export_timer();
+
+void dump_flow_export_stats();
+
+#endif // CURO_FLOW_EXPORT_H
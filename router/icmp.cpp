@@ -1,24 +1,158 @@
 #include "icmp.h"
 
 #include <cstring>
+#include "checksum.h"
 #include "ip.h"
 #include "log.h"
 #include "my_buf.h"
+#include "net.h"
+#include "stats.h"
 #include "utils.h"
+#include "worker.h"
+
+icmp_stat icmp_stats[WORKER_MAX];
+
+// エラーを送るのは受信したワーカーなので、バケットもワーカーごとに持つ
+thread_local icmp_token_bucket icmp_error_bucket;
+thread_local icmp_token_bucket icmp_error_dest_buckets[ICMP_ERROR_DEST_TABLE_SIZE];
 
 /**
- * ICMP パケットの受信処理
- * @param source
- * @param destination
- * @param buffer
+ * トークンバケットからトークンを 1 つ取る
+ * @param bucket
+ * @param now_ns
+ * @param cost_ns トークン 1 つが溜まるのにかかる時間
+ * @param burst トークンの上限
+ * @return 取れたら true
+ */
+bool take_icmp_token(icmp_token_bucket *bucket, uint64_t now_ns, uint64_t cost_ns, uint32_t burst)
+{
+	uint64_t limit_ns = cost_ns * burst;
+	bucket->credit_ns += now_ns - bucket->last_ns;
+	if (bucket->credit_ns > limit_ns)
+	{
+		bucket->credit_ns = limit_ns;
+	}
+	bucket->last_ns = now_ns;
+
+	if (bucket->credit_ns < cost_ns)
+	{
+		return false;
+	}
+	bucket->credit_ns -= cost_ns;
+	return true;
+}
+
+/**
+ * dest_addr に ICMP エラーを送信してよいか確認する
+ * @param dest_addr
+ * @return
+ */
+bool icmp_error_allowed(uint32_t dest_addr)
+{
+	uint64_t now_ns = current_time_ns();
+
+	// ルータ全体のレートをワーカーで分ける
+	if (!take_icmp_token(&icmp_error_bucket, now_ns, 1000000000ull * worker_count / ICMP_ERROR_RATE, ICMP_ERROR_BURST))
+	{
+		return false;
+	}
+
+	// 宛先ごとのバケットは、別の宛先と衝突したら満タンの状態から使い直す
+	uint32_t index = (dest_addr * 0x9e3779b1u) >> 24 & (ICMP_ERROR_DEST_TABLE_SIZE - 1);
+	icmp_token_bucket *bucket = &icmp_error_dest_buckets[index];
+	uint64_t dest_cost_ns = 1000000000ull / ICMP_ERROR_DEST_RATE;
+	if (bucket->last_ns == 0 or bucket->addr != dest_addr)
+	{
+		bucket->addr = dest_addr;
+		bucket->credit_ns = dest_cost_ns * ICMP_ERROR_DEST_BURST;
+		bucket->last_ns = now_ns;
+	}
+	return take_icmp_token(bucket, now_ns, dest_cost_ns, ICMP_ERROR_DEST_BURST);
+}
+
+/**
+ * 宛先アドレスがブロードキャストか調べる
+ * @param dest_addr
+ * @return
+ */
+bool is_broadcast_address(uint32_t dest_addr)
+{
+	if (dest_addr == IP_ADDRESS_LIMITED_BROADCAST)
+	{
+		return true;
+	}
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev != nullptr and dev->ip_dev->broadcast == dest_addr)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * ICMP Echo Request を書き換えて Echo Reply にし、受信したバッファのまま返信する
+ * IP ヘッダのアドレスを入れ替えてもチェックサムは変わらないので、TTL と ICMP のタイプの分だけ差分で更新する
+ * @param ip_packet
  * @param len
  */
-void icmp_input(uint32_t source, uint32_t destination, void *buffer, size_t len)
+void icmp_echo_reply_in_place(ip_header *ip_packet, size_t len)
+{
+	auto *icmp_msg = reinterpret_cast<icmp_message *>(reinterpret_cast<uint8_t *>(ip_packet) + IP_HEADER_SIZE);
+
+	uint16_t old_type_word = htons(icmp_msg->header.type << 8 | icmp_msg->header.code);
+	icmp_msg->header.type = ICMP_TYPE_ECHO_REPLY;
+	icmp_msg->header.code = 0;
+	uint16_t new_type_word = htons(icmp_msg->header.type << 8 | icmp_msg->header.code);
+	icmp_msg->header.checksum = checksum_adjust(icmp_msg->header.checksum, checksum_diff_16(old_type_word, new_type_word));
+
+	uint32_t src_addr = ip_packet->src_addr;
+	ip_packet->src_addr = ip_packet->dest_addr;
+	ip_packet->dest_addr = src_addr;
+
+	uint16_t old_ttl_word = htons(ip_packet->ttl << 8 | ip_packet->protocol);
+	ip_packet->ttl = 0xff;
+	uint16_t new_ttl_word = htons(ip_packet->ttl << 8 | ip_packet->protocol);
+	ip_packet->header_checksum = checksum_adjust(ip_packet->header_checksum, checksum_diff_16(old_ttl_word, new_ttl_word));
+
+	if (ip_output_in_place(ip_packet, len))
+	{
+		icmp_stats[worker_id].echo_replies_in_place++;
+		return;
+	}
+
+	// 宛先の MAC アドレスが解決できていなければ、コピーして ARP の解決を待つ
+	size_t icmp_len = len - IP_HEADER_SIZE;
+	my_buf *reply_mybuf = my_buf::create(icmp_len);
+	memcpy(reply_mybuf->buffer, icmp_msg, icmp_len);
+	ip_encapsulate_output(ntohl(ip_packet->dest_addr), ntohl(ip_packet->src_addr), reply_mybuf, IP_PROTOCOL_NUM_ICMP);
+	icmp_stats[worker_id].echo_replies_copied++;
+}
+
+/**
+ * ICMP パケットの受信処理
+ * Echo Request には受信したバッファを書き換えて返信するので、ip_packet の前に ETHERNET_HEADER_SIZE の余白が必要
+ * @param ip_packet
+ * @param len IP パケットの長さ
+ */
+void icmp_input(ip_header *ip_packet, size_t len)
 {
+	void *buffer = reinterpret_cast<uint8_t *>(ip_packet) + IP_HEADER_SIZE;
+	len -= IP_HEADER_SIZE;
 
 	if (len < sizeof(icmp_header))
 	{
 		LOG_ICMP("Received ICMP packet too short\n");
+		count_drop(nullptr, drop_reason::short_packet);
+		return;
+	}
+
+	// チェックサムが正しいか確認する
+	if (checksum_16(reinterpret_cast<uint16_t *>(buffer), len, 0) != 0)
+	{
+		LOG_ICMP("Received ICMP packet with invalid checksum\n");
+		count_drop(nullptr, drop_reason::bad_checksum);
 		return;
 	}
 
@@ -45,6 +179,13 @@ void icmp_input(uint32_t source, uint32_t destination, void *buffer, size_t len)
 		}
 		LOG_ICMP("Received icmp echo request id %04x seq %d\n", ntohs(icmp_msg->echo.identify), ntohs(icmp_msg->echo.sequence));
 
+		// ユニキャストの Echo Request は、受信したバッファのまま返信する
+		if (!is_broadcast_address(ntohl(ip_packet->dest_addr)))
+		{
+			icmp_echo_reply_in_place(ip_packet, len + IP_HEADER_SIZE);
+			return;
+		}
+
 		my_buf *reply_mybuf = my_buf::create(len);
 
 		auto *reply_msg = reinterpret_cast<icmp_message *>(reply_mybuf->buffer);
@@ -57,7 +198,8 @@ void icmp_input(uint32_t source, uint32_t destination, void *buffer, size_t len)
 
 		reply_msg->header.checksum = checksum_16(reinterpret_cast<uint16_t *>(reply_mybuf->buffer), reply_mybuf->len, 0); // checksum の計算
 
-		ip_encapsulate_output(source, destination, reply_mybuf, IP_PROTOCOL_NUM_ICMP);
+		ip_encapsulate_output(ntohl(ip_packet->src_addr), ntohl(ip_packet->dest_addr), reply_mybuf, IP_PROTOCOL_NUM_ICMP);
+		icmp_stats[worker_id].echo_replies_copied++;
 	}
 	break;
 	default:
@@ -73,6 +215,14 @@ void send_icmp_time_exceeded(uint32_t dest_addr, uint32_t src_addr, uint8_t code
 		return;
 	}
 
+	if (!icmp_error_allowed(dest_addr))
+	{
+		LOG_ICMP("ICMP error to %s suppressed by rate limit\n", log_htoa(dest_addr));
+		icmp_stats[worker_id].errors_suppressed++;
+		return;
+	}
+	icmp_stats[worker_id].errors_sent++;
+
 	// ICMP Header + メッセージの領域 + エラーパケット分（IP Header + 1byte）を確保
 	my_buf *time_exceeded_mybuf = my_buf::create(sizeof(icmp_header) + sizeof(icmp_time_exceeded) + sizeof(ip_header) + 8);
 	auto *time_exceeded_msg = reinterpret_cast<icmp_message *>(time_exceeded_mybuf->buffer);
@@ -94,6 +244,14 @@ void send_icmp_destination_unreachable(uint32_t dest_addr, uint32_t src_addr, ui
 		return;
 	}
 
+	if (!icmp_error_allowed(dest_addr))
+	{
+		LOG_ICMP("ICMP error to %s suppressed by rate limit\n", log_htoa(dest_addr));
+		icmp_stats[worker_id].errors_suppressed++;
+		return;
+	}
+	icmp_stats[worker_id].errors_sent++;
+
 	my_buf *unreachable_mybuf = my_buf::create(sizeof(icmp_header) + sizeof(icmp_destination_unreachable) + sizeof(ip_header) + 8);
 	auto *unreachable_msg = reinterpret_cast<icmp_message *>(unreachable_mybuf->buffer);
 	unreachable_msg->header.type = ICMP_TYPE_DESTINATION_UNREACHABLE;
@@ -105,3 +263,21 @@ void send_icmp_destination_unreachable(uint32_t dest_addr, uint32_t src_addr, ui
 
 	ip_encapsulate_output(dest_addr, src_addr, unreachable_mybuf, IP_PROTOCOL_NUM_ICMP);
 }
+
+/**
+ * ICMP の統計を出力
+ */
+void dump_icmp_stats()
+{
+	icmp_stat total{};
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		total.echo_replies_in_place += icmp_stats[i].echo_replies_in_place;
+		total.echo_replies_copied += icmp_stats[i].echo_replies_copied;
+		total.errors_sent += icmp_stats[i].errors_sent;
+		total.errors_suppressed += icmp_stats[i].errors_suppressed;
+	}
+	printf("ICMP: %lu echo replies in place, %lu copied, %lu errors sent, %lu suppressed (limit %d/s, %d/s per destination)\n",
+				 total.echo_replies_in_place, total.echo_replies_copied, total.errors_sent, total.errors_suppressed,
+				 ICMP_ERROR_RATE, ICMP_ERROR_DEST_RATE);
+}
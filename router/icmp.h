@@ -55,9 +55,39 @@ struct icmp_message
 #define ICMP_TIME_EXCEEDED_CODE_TIME_TO_LIVE_EXCEEDED 0
 #define ICMP_TIME_EXCEEDED_CODE_FRAGMENT_REASSEMBLY_TIME_EXCEEDED 1
 
-void icmp_input(uint32_t source, uint32_t destination, void *buffer, size_t len);
+/**
+ * 送信する ICMP エラーのレート制限
+ * TTL 切れやポート到達不能が大量に起きても、エラーの送信で CPU と送信帯域を使い切らないよう、
+ * ルータ全体と宛先ごとのトークンバケットの両方にトークンがあるときだけ送信する
+ */
+#define ICMP_ERROR_RATE 1000 // ルータ全体で 1 秒あたりに送信できるエラーの数
+#define ICMP_ERROR_BURST 50
+#define ICMP_ERROR_DEST_RATE 10 // 宛先ごとに 1 秒あたりに送信できるエラーの数
+#define ICMP_ERROR_DEST_BURST 6
+#define ICMP_ERROR_DEST_TABLE_SIZE 256 // 宛先ごとのバケットの数 (2 のべき乗)
+
+struct icmp_token_bucket
+{
+	uint32_t addr; // 宛先ごとのバケットのときの宛先
+	uint64_t credit_ns; // トークンを、溜まるのにかかった時間で持つ
+	uint64_t last_ns;
+};
+
+struct icmp_stat
+{
+	uint64_t echo_replies_in_place; // 受信したパケットを書き換えて返信した数
+	uint64_t echo_replies_copied;
+	uint64_t errors_sent;
+	uint64_t errors_suppressed;
+};
+
+struct ip_header;
+
+void icmp_input(ip_header *ip_packet, size_t len);
 
 void send_icmp_time_exceeded(uint32_t dest_addr, uint32_t src_addr, uint8_t code, void *error_ip_buffer, size_t len);
 void send_icmp_destination_unreachable(uint32_t dest_addr, uint32_t src_addr, uint8_t code, void *error_ip_buffer, size_t len);
 
+void dump_icmp_stats();
+
 #endif // CURO_ICMP_H
@@ -1,12 +1,20 @@
 #include "arp.h"
+#include "capture.h"
+#include "checksum.h"
+#include "egress_queue.h"
 #include "ethernet.h"
+#include "flow_cache.h"
 #include "icmp.h"
 #include "ip.h"
+#include "latency.h"
 #include "log.h"
 #include "my_buf.h"
 #include "napt.h"
 #include "net.h"
+#include "policer.h"
+#include "stats.h"
 #include "utils.h"
+#include <atomic>
 
 binary_trie_node<ip_route_entry> *ip_fib;
 
@@ -24,12 +32,16 @@ bool in_subnet(uint32_t subnet_prefix, uint32_t subnet_mask, uint32_t target_add
 
 /**
  * receive process for IP packet
+ * フローキャッシュから送信するときに Ethernet ヘッダを buffer の直前に書き込むので、ETHERNET_HEADER_SIZE の余白が必要
  * @param input_dev
  * @param buffer
  * @param len
+ * @param offload 受信したパケットのチェックサムオフロードと GSO の情報 (nullable)
  */
-void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
+void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len, const net_offload *offload)
 {
+	LATENCY_STAGE(ip_input);
+
 	// IP Address のついていないインターフェースからの受信は無視
 	if (input_dev->ip_dev == nullptr or input_dev->ip_dev->address == 0)
 	{
@@ -40,17 +52,19 @@ void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
 	if (len < sizeof(ip_header))
 	{
 		LOG_IP("Received IP Packet too short from %s\n", input_dev->name);
+		count_drop(input_dev, drop_reason::short_packet);
 		return;
 	}
 
 	// 送られてきたバッファをキャストして扱う
 	auto *ip_packet = reinterpret_cast<ip_header *>(buffer);
 
-	LOG_IP("Received IP packet type %d from %s to %s\n", ip_packet->protocol, ip_ntoa(ip_packet->src_addr), ip_ntoa(ip_packet->dest_addr));
+	LOG_IP("Received IP packet type %d from %s to %s\n", ip_packet->protocol, log_ntoa(ip_packet->src_addr), log_ntoa(ip_packet->dest_addr));
 
 	if (ip_packet->version != 4)
 	{
 		LOG_IP("Incorrect IP version\n");
+		count_drop(input_dev, drop_reason::unsupported);
 		return;
 	}
 
@@ -58,13 +72,48 @@ void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
 	if (ip_packet->header_len != (sizeof(ip_header) >> 2))
 	{
 		LOG_IP("IP header option is not supported\n");
+		count_drop(input_dev, drop_reason::unsupported);
+		return;
+	}
+
+	// ヘッダチェックサムが正しいか確認する。正しければ、チェックサムを含めた和は 0 になる
+	if (checksum_16(reinterpret_cast<uint16_t *>(buffer), sizeof(ip_header), 0) != 0)
+	{
+		LOG_IP("IP header checksum mismatch from %s\n", input_dev->name);
+		count_drop(input_dev, drop_reason::bad_checksum);
+		return;
+	}
+
+	// イーサネットのパディングを除いて、IP パケットの長さにする
+	uint16_t total_len = ntohs(ip_packet->total_len);
+	if (total_len < sizeof(ip_header) or total_len > len)
+	{
+		LOG_IP("Invalid IP total length %d from %s\n", total_len, input_dev->name);
+		count_drop(input_dev, drop_reason::short_packet);
+		return;
+	}
+	len = total_len;
+
+	// 送信元ごとのレートを超えたパケットは捨てる
+	if (input_dev->ip_dev->policer != nullptr and !policer_admit_packet(input_dev->ip_dev->policer, ntohl(ip_packet->src_addr)))
+	{
+		LOG_IP("Rate limited packet from %s\n", log_ntoa(ip_packet->src_addr));
+		count_drop(input_dev, drop_reason::rate_limited);
+		return;
+	}
+
+	// 転送したことのあるフローなら、キャッシュした処理結果で送信する
+	flow_key key;
+	bool cacheable = flow_cache_enabled and make_flow_key(input_dev, ip_packet, len, &key);
+	if (cacheable and flow_cache_forward(&key, ip_packet, len, offload))
+	{
 		return;
 	}
 
 	if (ip_packet->dest_addr == IP_ADDRESS_LIMITED_BROADCAST)
 	{
 		// ブロードキャストの場合も自分宛の通信として処理
-		return ip_input_to_ours(input_dev, ip_packet, len);
+		return ip_input_to_ours(input_dev, ip_packet, len, offload);
 	}
 
 	// 宛先 IP アドレスをルータが持っているか調べる
@@ -75,81 +124,121 @@ void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
 			if (dev->ip_dev->address == ntohl(ip_packet->dest_addr) or dev->ip_dev->broadcast == ntohl(ip_packet->dest_addr))
 			{
 				// 自分宛の通信として処理
-				return ip_input_to_ours(dev, ip_packet, len);
+				return ip_input_to_ours(dev, ip_packet, len, offload, cacheable ? &key : nullptr);
 			}
+
+		// NAPT の外側アドレスのプール宛も自分宛として処理
+		if (dev->ip_dev != nullptr and dev->ip_dev->nat_dev != nullptr and is_nat_global_address(dev->ip_dev->nat_dev, ntohl(ip_packet->dest_addr)))
+		{
+			return ip_input_to_ours(input_dev, ip_packet, len, offload, cacheable ? &key : nullptr);
+		}
 	}
 
 	// NAT の内側から外側への通信
 	if (input_dev->ip_dev->nat_dev != nullptr)
 	{
 		// インターネットにプライベートアドレス宛の通信が漏れないよう、NAPT による変換ができないならドロップする
-		if (ip_packet->protocol == IP_PROTOCOL_NUM_UDP)
-		{
-			if (!nat_exec(
-							ip_packet,
-							len,
-							input_dev->ip_dev->nat_dev,
-							nat_protocol::udp,
-							nat_direction::outgoing))
-			{
-				return;
-			}
-		}
-		else if (ip_packet->protocol == IP_PROTOCOL_NUM_TCP)
-		{
-			if (!nat_exec(ip_packet,
-										len,
-										input_dev->ip_dev->nat_dev,
-										nat_protocol::tcp,
-										nat_direction::outgoing))
-			{
-				return;
-			}
-		}
-		else if (ip_packet->protocol == IP_PROTOCOL_NUM_ICMP)
+		nat_protocol proto;
+		if (get_nat_protocol(ip_packet->protocol, &proto))
 		{
-			if (!nat_exec(
-							ip_packet,
-							len,
-							input_dev->ip_dev->nat_dev,
-							nat_protocol::icmp,
-							nat_direction::outgoing))
+			// セッションを担当するワーカーが別なら、そちらに処理を任せる
+			if (nat_handoff(input_dev->ip_dev->nat_dev, input_dev, ip_packet, len, offload, proto, nat_direction::outgoing))
 			{
 				return;
 			}
+			return ip_input_nat_outgoing(input_dev, input_dev->ip_dev->nat_dev, ip_packet, len, offload, proto, cacheable ? &key : nullptr);
 		}
 		else
 		{
 			LOG_IP("NAT unimplemented packet dropped type=%d\n", ip_packet->protocol);
+			count_drop(input_dev, drop_reason::unsupported);
+			return;
 		}
 	}
 
+	ip_forward(input_dev, ip_packet, len, offload, cacheable ? &key : nullptr, nullptr, nullptr);
+}
+
+/**
+ * 内側から外側へのパケットを NAPT で変換して転送する
+ * nat_handoff で他のワーカーから渡されたパケットは、受信したワーカーが検査とレート制限を済ませているので、ここから処理する
+ * @param input_dev
+ * @param nat_dev
+ * @param ip_packet
+ * @param len
+ * @param offload
+ * @param proto
+ * @param key 受信したパケットのフローキャッシュのキー (nullable)
+ */
+void ip_input_nat_outgoing(net_device *input_dev, nat_device *nat_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, const flow_key *key)
+{
+	auto *buffer = reinterpret_cast<uint8_t *>(ip_packet);
+	capture_packet(capture_point::pre_nat, input_dev, buffer, len);
+	if (!nat_exec(ip_packet, nat_dev, proto, nat_direction::outgoing, offload))
+	{
+		return;
+	}
+	capture_packet(capture_point::post_nat, input_dev, buffer, len);
+
+	nat_entry *nat = nullptr;
+	if (key != nullptr)
+	{
+		auto *nat_packet = reinterpret_cast<nat_packet_head *>(buffer + sizeof(ip_header));
+		nat = get_nat_entry_by_global(nat_dev, proto, ntohl(ip_packet->src_addr), ntohs(nat_packet->src_port));
+	}
+	ip_forward(input_dev, ip_packet, len, offload, key, nat_dev, nat);
+}
+
+/**
+ * 経路を引いて、TTL を減らして転送する
+ * @param input_dev
+ * @param ip_packet
+ * @param len
+ * @param offload
+ * @param key 受信したパケットのフローキャッシュのキー。転送したフローをキャッシュに登録する (nullable)
+ * @param nat_dev パケットを変換した NAT のテーブル (nullable)
+ * @param nat パケットを変換した NAT のセッション (nullable)
+ */
+void ip_forward(net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload, const flow_key *key, nat_device *nat_dev, nat_entry *nat)
+{
 	// 宛先 IP アドレスがルータの持っている IP アドレスでない場合はフォワーディングを行う
+	LATENCY_STAGE(fib_lookup);
 	ip_route_entry *route = binary_trie_search(ip_fib, ntohl(ip_packet->dest_addr));
 	if (route == nullptr)
 	{
-		LOG_IP("[input] No route to %s\n", ip_htoa(ntohl(ip_packet->dest_addr)));
+		LOG_IP("[input] No route to %s\n", log_htoa(ntohl(ip_packet->dest_addr)));
 		// Drop packet
+		count_drop(input_dev, drop_reason::no_route);
 		return;
 	}
 
 	if (ip_packet->ttl <= 1)
 	{
-		send_icmp_time_exceeded(ntohl(ip_packet->src_addr), input_dev->ip_dev->address, ICMP_TIME_EXCEEDED_CODE_TIME_TO_LIVE_EXCEEDED, buffer, len);
+		send_icmp_time_exceeded(ntohl(ip_packet->src_addr), input_dev->ip_dev->address, ICMP_TIME_EXCEEDED_CODE_TIME_TO_LIVE_EXCEEDED, ip_packet, len);
+		count_drop(input_dev, drop_reason::ttl_exceeded);
 		return;
 	}
 
-	// TLL を1減らす
+	// TLL を1減らし、IP Header checksum を差分で更新する
+	// TTL はプロトコル番号と 1 つの 16bit ワードになっている
+	uint16_t old_ttl_word = htons(ip_packet->ttl << 8 | ip_packet->protocol);
 	ip_packet->ttl--;
+	uint16_t new_ttl_word = htons(ip_packet->ttl << 8 | ip_packet->protocol);
+	ip_packet->header_checksum = checksum_adjust(ip_packet->header_checksum, checksum_diff_16(old_ttl_word, new_ttl_word));
 
-	// IP Header checksum の再計算
-	ip_packet->header_checksum = 0;
-	ip_packet->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(buffer), sizeof(ip_header), 0);
+	if (key != nullptr)
+	{
+		flow_cache_fill(key, ip_packet, true, nat_dev, nat);
+	}
 
 	// my_buf 構造にコピー
 	my_buf *ip_fwd_mybuf = my_buf::create(len);
-	memcpy(ip_fwd_mybuf->buffer, buffer, len);
+	memcpy(ip_fwd_mybuf->buffer, ip_packet, len);
 	ip_fwd_mybuf->len = len;
+	if (offload != nullptr)
+	{
+		ip_fwd_mybuf->offload = *offload;
+	}
 
 	if (route->type == connected)
 	{
@@ -169,57 +258,90 @@ void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len)
  * @param input_dev
  * @param ip_packet
  * @param len
+ * @param offload
+ * @param key 受信したパケットのフローキャッシュのキー。NAT で転送するフローをキャッシュに登録する (nullable)
  */
-void ip_input_to_ours(net_device *input_dev, ip_header *ip_packet, size_t len)
+void ip_input_to_ours(net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload, const flow_key *key)
 {
 	// NAT の通信の向きを確認
+	// 外側アドレスのプールは NAT デバイスごとに重ならないので、一致するのは 1 つだけ
 	for (net_device *dev = net_dev_list; dev; dev = dev->next)
 	{
-		if (dev->ip_dev != nullptr and dev->ip_dev->nat_dev != nullptr and dev->ip_dev->nat_dev->outside_addr == ntohl(ip_packet->dest_addr))
+		if (dev->ip_dev != nullptr and dev->ip_dev->nat_dev != nullptr and is_nat_global_address(dev->ip_dev->nat_dev, ntohl(ip_packet->dest_addr)))
 		{
-			bool nat_executed = false;
-			switch (ip_packet->protocol)
+			nat_protocol proto;
+			if (!get_nat_protocol(ip_packet->protocol, &proto))
 			{
-			case IP_PROTOCOL_NUM_UDP:
-				if (nat_exec(ip_packet, len, dev->ip_dev->nat_dev, nat_protocol::udp, nat_direction::incoming))
-				{
-					nat_executed = true;
-				}
-				break;
-			case IP_PROTOCOL_NUM_TCP:
-				if (nat_exec(ip_packet, len, dev->ip_dev->nat_dev, nat_protocol::tcp, nat_direction::incoming))
-				{
-					printf("#####################################\n");
-					nat_executed = true;
-				}
-				break;
-			case IP_PROTOCOL_NUM_ICMP:
-				if (nat_exec(ip_packet, len, dev->ip_dev->nat_dev, nat_protocol::icmp, nat_direction::incoming))
-				{
-					nat_executed = true;
-				}
 				break;
 			}
 
-			if (nat_executed)
+			// セッションを担当するワーカーが別なら、そちらに処理を任せる
+			if (nat_handoff(dev->ip_dev->nat_dev, input_dev, ip_packet, len, offload, proto, nat_direction::incoming))
 			{
-				my_buf *nat_fwd_mybuf = my_buf::create(len);
-				memcpy(nat_fwd_mybuf->buffer, ip_packet, len);
-				nat_fwd_mybuf->len = len;
-				ip_output(ntohl(ip_packet->dest_addr), ntohl(ip_packet->src_addr), nat_fwd_mybuf);
 				return;
 			}
+
+			if (ip_input_nat_incoming(input_dev, dev->ip_dev->nat_dev, ip_packet, len, offload, proto, key))
+			{
+				return;
+			}
+			break;
 		}
 	}
 
+	ip_input_to_protocol(input_dev, ip_packet, len);
+}
+
+/**
+ * NAPT の外側アドレス宛のパケットを変換して、内側に転送する
+ * nat_handoff で他のワーカーから渡されたパケットは、ここから処理する
+ * @param input_dev
+ * @param nat_dev
+ * @param ip_packet
+ * @param len
+ * @param offload
+ * @param proto
+ * @param key 受信したパケットのフローキャッシュのキー (nullable)
+ * @return セッションがなく変換できなかったら false。自分宛のパケットとして処理する
+ */
+bool ip_input_nat_incoming(net_device *input_dev, nat_device *nat_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, const flow_key *key)
+{
+	capture_packet(capture_point::pre_nat, input_dev, reinterpret_cast<uint8_t *>(ip_packet), len);
+	if (!nat_exec(ip_packet, nat_dev, proto, nat_direction::incoming, offload))
+	{
+		return false;
+	}
+	capture_packet(capture_point::post_nat, input_dev, reinterpret_cast<uint8_t *>(ip_packet), len);
+	if (key != nullptr)
+	{
+		auto *nat_packet = reinterpret_cast<nat_packet_head *>(reinterpret_cast<uint8_t *>(ip_packet) + sizeof(ip_header));
+		nat_entry *nat = get_nat_entry_by_local(nat_dev, proto, ntohl(ip_packet->dest_addr), ntohs(nat_packet->dest_port));
+		flow_cache_fill(key, ip_packet, false, nat_dev, nat);
+	}
+	my_buf *nat_fwd_mybuf = my_buf::create(len);
+	memcpy(nat_fwd_mybuf->buffer, ip_packet, len);
+	nat_fwd_mybuf->len = len;
+	if (offload != nullptr)
+	{
+		nat_fwd_mybuf->offload = *offload;
+	}
+	ip_output(ntohl(ip_packet->dest_addr), ntohl(ip_packet->src_addr), nat_fwd_mybuf);
+	return true;
+}
+
+/**
+ * 自分宛の IP パケットを上位プロトコルで処理する
+ * @param input_dev
+ * @param ip_packet
+ * @param len
+ */
+void ip_input_to_protocol(net_device *input_dev, ip_header *ip_packet, size_t len)
+{
 	// 上位プロトコルの処理に移行
 	switch (ip_packet->protocol)
 	{
 	case IP_PROTOCOL_NUM_ICMP:
-		return icmp_input(
-				ntohl(ip_packet->src_addr),
-				ntohl(ip_packet->dest_addr),
-				((uint8_t *)ip_packet) + IP_HEADER_SIZE, len - IP_HEADER_SIZE);
+		return icmp_input(ip_packet, len);
 	case IP_PROTOCOL_NUM_UDP:
 		send_icmp_destination_unreachable(
 				ntohl(ip_packet->src_addr),
@@ -235,6 +357,34 @@ void ip_input_to_ours(net_device *input_dev, ip_header *ip_packet, size_t len)
 	}
 }
 
+/**
+ * IP ヘッダの各項目を設定し、チェックサムを計算する
+ * @param ip_buf
+ * @param dest_addr 送信先の IP アドレス
+ * @param src_addr 送信元の IP アドレス
+ * @param payload_len IP ヘッダに続くデータの長さ
+ * @param protocol_num IP プロトコル番号
+ */
+void ip_set_header(ip_header *ip_buf, uint32_t dest_addr, uint32_t src_addr, uint16_t payload_len, uint8_t protocol_num)
+{
+	ip_buf->version = 4;
+	ip_buf->header_len = sizeof(ip_header) >> 2;
+	ip_buf->tos = 0;
+	ip_buf->total_len = htons(sizeof(ip_header) + payload_len);
+	ip_buf->protocol = protocol_num;
+
+	// 全てのワーカーが使うので、同じ ID を続けて使わないよう atomic にする
+	static std::atomic<uint16_t> id{0};
+	ip_buf->identify = id.fetch_add(1, std::memory_order_relaxed);
+	ip_buf->frag_offset = 0;
+	ip_buf->ttl = 0xff;
+	ip_buf->header_checksum = 0;
+	ip_buf->dest_addr = htonl(dest_addr);
+	ip_buf->src_addr = htonl(src_addr);
+	void *header = ip_buf;
+	ip_buf->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(header), sizeof(ip_header), 0);
+}
+
 /**
  * IP パケットにカプセル化して送信
  * @param dest_addr 送信先の IP アドレス
@@ -259,21 +409,7 @@ void ip_encapsulate_output(uint32_t dest_addr, uint32_t src_addr, my_buf *payloa
 	payload_mybuf->add_header(ip_mybuf);
 
 	// IP ヘッダの各項目を設定
-	auto *ip_buf = reinterpret_cast<ip_header *>(ip_mybuf->buffer);
-	ip_buf->version = 4;
-	ip_buf->header_len = sizeof(ip_header) >> 2;
-	ip_buf->tos = 0;
-	ip_buf->total_len = htons(sizeof(ip_header) + total_len);
-	ip_buf->protocol = protocol_num;
-
-	static uint16_t id = 0;
-	ip_buf->identify = id++;
-	ip_buf->frag_offset = 0;
-	ip_buf->ttl = 0xff;
-	ip_buf->header_checksum = 0;
-	ip_buf->dest_addr = htonl(dest_addr);
-	ip_buf->src_addr = htonl(src_addr);
-	ip_buf->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(ip_mybuf->buffer), ip_mybuf->len, 0);
+	ip_set_header(reinterpret_cast<ip_header *>(ip_mybuf->buffer), dest_addr, src_addr, total_len, protocol_num);
 
 	for (net_device *dev = net_dev_list; dev; dev = dev->next)
 	{
@@ -284,18 +420,15 @@ void ip_encapsulate_output(uint32_t dest_addr, uint32_t src_addr, my_buf *payloa
 
 		if (in_subnet(dev->ip_dev->address, dev->ip_dev->netmask, dest_addr))
 		{
-			arp_table_entry *entry;
-			entry = search_arp_table_entry(dest_addr);
-			if (entry == nullptr)
-			{
-				LOG_IP("Trying ip output, but no arp record to %s\n", ip_htoa(dest_addr));
-				send_arp_request(dev, dest_addr);
-				my_buf::my_buf_free(payload_mybuf, true);
-				return;
-			}
-			ethernet_encapsulate_output(dev, entry->mac_addr, ip_mybuf, ETHER_TYPE_IP);
+			// ARP で解決できるまではキューで待たせる
+			arp_resolve_output(dev, dest_addr, ip_mybuf);
+			return;
 		}
 	}
+
+	LOG_IP("Trying ip output, but no connected network to %s\n", log_htoa(dest_addr));
+	count_drop(nullptr, drop_reason::no_route);
+	my_buf::my_buf_free(ip_mybuf, true); // Drop packet
 }
 
 /**
@@ -310,7 +443,8 @@ void ip_output(uint32_t dest_addr, uint32_t src_addr, my_buf *buffer)
 	ip_route_entry *route = binary_trie_search(ip_fib, dest_addr);
 	if (route == nullptr)
 	{
-		LOG_IP("[output] No route to %s\n", ip_htoa(dest_addr));
+		LOG_IP("[output] No route to %s\n", log_htoa(dest_addr));
+		count_drop(nullptr, drop_reason::no_route);
 		my_buf::my_buf_free(buffer, true); // Drop packet
 		return;
 	}
@@ -327,6 +461,39 @@ void ip_output(uint32_t dest_addr, uint32_t src_addr, my_buf *buffer)
 	}
 }
 
+/**
+ * 受信したバッファの上で組み立てた IP パケットを、コピーせずに送信する
+ * Ethernet ヘッダを ip_packet の直前に書き込むので、ETHERNET_HEADER_SIZE の余白が必要
+ * @param ip_packet
+ * @param len
+ * @return 経路がないか、次のホップの MAC アドレスが解決できておらず送信できなかったら false
+ */
+bool ip_output_in_place(ip_header *ip_packet, size_t len)
+{
+	uint32_t dest_addr = ntohl(ip_packet->dest_addr);
+	ip_route_entry *route = binary_trie_search(ip_fib, dest_addr);
+	if (route == nullptr)
+	{
+		return false;
+	}
+
+	uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+	net_device *output_dev;
+	if (!search_arp_table_entry(route->type == connected ? dest_addr : route->next_hop, mac_addr, &output_dev))
+	{
+		return false;
+	}
+
+	uint8_t *frame = reinterpret_cast<uint8_t *>(ip_packet) - ETHERNET_HEADER_SIZE;
+	auto *ethernet = reinterpret_cast<ethernet_header *>(frame);
+	memcpy(ethernet->dest_addr, mac_addr, MAC_ADDRESS_SIZE);
+	memcpy(ethernet->src_addr, output_dev->mac_addr, MAC_ADDRESS_SIZE);
+	ethernet->type = htons(ETHER_TYPE_IP);
+
+	egress_output(output_dev, frame, len + ETHERNET_HEADER_SIZE, nullptr);
+	return true;
+}
+
 /**
  * IP パケットをイーサネットで直接ホストに送信
  * @param dev
@@ -336,44 +503,32 @@ void ip_output(uint32_t dest_addr, uint32_t src_addr, my_buf *buffer)
  */
 void ip_output_to_host(net_device *dev, uint32_t dest_addr, uint32_t src_addr, my_buf *payload_mybuf)
 {
-	arp_table_entry *entry = search_arp_table_entry(dest_addr); // ARP テーブルの検索
-
-	if (!entry) // ARP エントリがなかったら
-	{
-		LOG_IP("Trying ip output to host, but no arp record to %s\n", ip_htoa(dest_addr));
-		send_arp_request(dev, dest_addr);					// ARP リクエストの送信
-		my_buf::my_buf_free(payload_mybuf, true); // Drop packet
-		return;
-	}
-	else
-	{
-		ethernet_encapsulate_output(entry->dev, entry->mac_addr, payload_mybuf, ETHER_TYPE_IP); // イーサネットでカプセル化して送信
-	}
+	// ARP エントリがなければ、解決されるまでキューで待たせる
+	arp_resolve_output(dev, dest_addr, payload_mybuf);
 }
 
 void ip_output_to_next_hop(uint32_t next_hop, my_buf *buffer)
 {
-	arp_table_entry *entry = search_arp_table_entry(next_hop); // ARP Table の検索
-
-	if (!entry)
+	uint8_t mac_addr[ETHERNET_ADDRESS_LEN];
+	net_device *output_dev;
+	if (!search_arp_table_entry(next_hop, mac_addr, &output_dev)) // ARP Table の検索
 	{
-		LOG_IP("Trying ip output to next hop, but no arp record to %s\n", ip_htoa(next_hop));
-
 		ip_route_entry *route_to_next_hop = binary_trie_search(ip_fib, next_hop); // ルーティングテーブルのルックアップ
 
 		if (route_to_next_hop == nullptr or route_to_next_hop->type != connected) // next hop への経路がなかったら
 		{
-			LOG_IP("Next hop %s is not reachable\n", ip_htoa(next_hop));
+			LOG_IP("Next hop %s is not reachable\n", log_htoa(next_hop));
+			count_drop(nullptr, drop_reason::no_route);
+			my_buf::my_buf_free(buffer, true); // Drop packet
 		}
 		else
 		{
-			send_arp_request(route_to_next_hop->dev, next_hop); // ARP リクエストを送信
+			arp_resolve_output(route_to_next_hop->dev, next_hop, buffer); // 解決されるまでキューで待たせる
 		}
-		my_buf::my_buf_free(buffer, true); // Drop packet
 		return;
 	}
 	else
 	{
-		ethernet_encapsulate_output(entry->dev, entry->mac_addr, buffer, ETHER_TYPE_IP); // イーサネットでカプセル化して送信
+		ethernet_encapsulate_output(output_dev, mac_addr, buffer, ETHER_TYPE_IP); // イーサネットでカプセル化して送信
 	}
 }
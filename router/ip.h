@@ -30,6 +30,8 @@ struct ip_header
 } __attribute__((packed));
 
 struct nat_device;
+struct acl_table;
+struct src_policer;
 
 struct ip_device
 {
@@ -37,17 +39,32 @@ struct ip_device
 	uint32_t netmask = 0;
 	uint32_t broadcast = 0;
 	nat_device *nat_dev = nullptr;
+	acl_table *acl = nullptr; // 受信したパケットに適用する ACL
+	src_policer *policer = nullptr; // 受信したパケットの送信元ごとのレート制限
 };
 
 struct net_device;
+struct net_offload;
 struct my_buf;
+struct flow_key;
+struct nat_entry;
+enum class nat_protocol;
 
 bool in_subnet(uint32_t subnet_prefix, uint32_t subnet_mask, uint32_t target_address);
-void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len);
-void ip_input_to_ours(net_device *input_dev, ip_header *ip_packet, size_t len);
+void ip_input(net_device *input_dev, uint8_t *buffer, ssize_t len, const net_offload *offload = nullptr);
+void ip_input_to_ours(net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload = nullptr, const flow_key *key = nullptr);
+void ip_input_nat_outgoing(net_device *input_dev, nat_device *nat_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, const flow_key *key);
+bool ip_input_nat_incoming(net_device *input_dev, nat_device *nat_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, const flow_key *key);
+void ip_input_to_protocol(net_device *input_dev, ip_header *ip_packet, size_t len);
+void ip_forward(net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload, const flow_key *key, nat_device *nat_dev, nat_entry *nat);
+
+void ip_set_header(ip_header *ip_buf, uint32_t dest_addr, uint32_t src_addr, uint16_t payload_len, uint8_t protocol_num);
+
 void ip_encapsulate_output(uint32_t dest_addr, uint32_t src_addr, my_buf *payload_mybuf, uint8_t protocol_num);
 
 void ip_output(uint32_t dest_addr, uint32_t src_addr, my_buf *buffer);
+
+bool ip_output_in_place(ip_header *ip_packet, size_t len);
 void ip_output_to_host(net_device *dev, uint32_t dest_addr, uint32_t src_addr, my_buf *payload_mybuf);
 void ip_output_to_next_hop(uint32_t next_hop, my_buf *buffer);
 
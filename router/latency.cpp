@@ -0,0 +1,143 @@
+#include "latency.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/socket.h>
+#include <x86intrin.h>
+#include "utils.h"
+
+#ifdef CURO_LATENCY
+
+latency_worker latency_workers[WORKER_MAX];
+thread_local latency_packet latency_current;
+
+double latency_tsc_per_ns = 1;
+
+/**
+ * 受信したパケットの計測を始める
+ * パケットソケットに SO_TIMESTAMPNS を設定していれば、カーネルが受信した時刻からの時間も記録する
+ * @param msg recvmsg で受け取ったメッセージ (nullable)
+ */
+void latency_begin(const msghdr *msg)
+{
+	uint64_t now = __rdtsc();
+	latency_current.start_tsc = now;
+	latency_current.last_tsc = now;
+	latency_current.stage = latency_stage::poll;
+	latency_current.active = true;
+
+	if (msg == nullptr)
+	{
+		return;
+	}
+	auto *mutable_msg = const_cast<msghdr *>(msg);
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(mutable_msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(mutable_msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			// カーネルの受信時刻は CLOCK_REALTIME なので、同じ時計の今の時刻と比べる
+			timespec received, current;
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+			clock_gettime(CLOCK_REALTIME, &current);
+			int64_t ns = (current.tv_sec - received.tv_sec) * 1000000000ll + (current.tv_nsec - received.tv_nsec);
+			if (ns >= 0)
+			{
+				latency_record(latency_stage::kernel, ns);
+			}
+		}
+	}
+}
+
+const char *latency_stage_name(uint8_t stage)
+{
+	static const char *names[LATENCY_STAGE_NUM] = {
+			"kernel", "poll", "ethernet_input", "ip_input", "nat_exec", "fib_lookup", "transmit", "total"};
+	return names[stage];
+}
+
+/**
+ * バケットに入る値の下限
+ * @param bucket
+ * @return
+ */
+uint64_t get_latency_bucket_value(uint32_t bucket)
+{
+	if (bucket < LATENCY_SUB_BUCKET_NUM)
+	{
+		return bucket;
+	}
+	uint32_t shift = bucket / LATENCY_SUB_BUCKET_NUM - 1;
+	return static_cast<uint64_t>(LATENCY_SUB_BUCKET_NUM + bucket % LATENCY_SUB_BUCKET_NUM) << shift;
+}
+
+#endif
+
+/**
+ * TSC の周波数を測っておく
+ */
+void latency_init()
+{
+#ifdef CURO_LATENCY
+	uint64_t start_ns = current_time_ns();
+	uint64_t start_tsc = __rdtsc();
+	while (current_time_ns() - start_ns < 20 * 1000 * 1000)
+	{
+	}
+	latency_tsc_per_ns = static_cast<double>(__rdtsc() - start_tsc) / (current_time_ns() - start_ns);
+	printf("Latency instrumentation enabled (TSC %.2f GHz)\n", latency_tsc_per_ns);
+#endif
+}
+
+/**
+ * 段階ごとの滞留時間の分布を出力
+ */
+void dump_latency_stats()
+{
+#ifdef CURO_LATENCY
+	static uint64_t counts[LATENCY_BUCKET_NUM];
+	const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+
+	for (uint8_t stage = 0; stage < LATENCY_STAGE_NUM; ++stage)
+	{
+		uint64_t total = 0, max = 0;
+		memset(counts, 0, sizeof(counts));
+		for (uint32_t worker = 0; worker < WORKER_MAX; ++worker)
+		{
+			latency_histogram *histogram = &latency_workers[worker].stages[stage];
+			for (uint32_t i = 0; i < LATENCY_BUCKET_NUM; ++i)
+			{
+				counts[i] += histogram->counts[i].load(std::memory_order_relaxed);
+			}
+			uint64_t worker_max = histogram->max.load(std::memory_order_relaxed);
+			max = worker_max > max ? worker_max : max;
+		}
+		for (uint32_t i = 0; i < LATENCY_BUCKET_NUM; ++i)
+		{
+			total += counts[i];
+		}
+		if (total == 0)
+		{
+			continue;
+		}
+
+		// kernel は ns で、それ以外は TSC のサイクル数で記録している
+		double scale = stage == static_cast<uint8_t>(latency_stage::kernel) ? 1 : 1 / latency_tsc_per_ns;
+		printf("%-16s %10lu packets", latency_stage_name(stage), total);
+		uint32_t bucket = 0;
+		uint64_t seen = 0;
+		for (double percentile : percentiles)
+		{
+			uint64_t target = static_cast<uint64_t>(total * percentile);
+			while (bucket < LATENCY_BUCKET_NUM - 1 and seen + counts[bucket] <= target)
+			{
+				seen += counts[bucket++];
+			}
+			printf("  p%g %8.0fns", percentile * 100, get_latency_bucket_value(bucket) * scale);
+		}
+		printf("  max %8.0fns\n", max * scale);
+	}
+#else
+	printf("Latency instrumentation is disabled (build with make LATENCY=1)\n");
+#endif
+}
@@ -0,0 +1,144 @@
+#ifndef CURO_LATENCY_H
+#define CURO_LATENCY_H
+
+#include <atomic>
+#include <cstdint>
+#include "worker.h"
+
+/**
+ * 処理段階ごとの滞留時間の計測
+ * make LATENCY=1 でビルドしたときだけ有効になり、そうでなければマクロは何も残さない
+ * 受信したパケットの処理はワーカーの中で完結するので、処理中のパケットの状態はスレッドローカルに持ち、
+ * 段階の境界で TSC を読んで、直前の段階にいた時間をワーカーごとのヒストグラムに記録する
+ */
+
+// 記録する段階。各段階の時間は、その境界から次の境界までの時間
+enum class latency_stage : uint8_t
+{
+	kernel, // カーネルが受信してから recv が返るまで (ns。カーネルの受信時刻が取れたときだけ)
+	poll, // recv が返ってから ethernet_input まで
+	ethernet_input,
+	ip_input,
+	nat_exec,
+	fib_lookup,
+	transmit, // net_device_transmit の送信
+	total, // recv が返ってから送信が終わるまで
+};
+
+#define LATENCY_STAGE_NUM 8
+
+/**
+ * 対数線形のヒストグラム (HDR Histogram と同じ考え方)
+ * 2 のべき乗ごとの区間をさらに LATENCY_SUB_BUCKET_NUM 個に等分するので、相対誤差は 1/8 以下
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKET_NUM (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKET_NUM ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKET_NUM)
+
+struct alignas(64) latency_histogram
+{
+	std::atomic<uint64_t> counts[LATENCY_BUCKET_NUM];
+	std::atomic<uint64_t> max;
+};
+
+struct latency_worker
+{
+	latency_histogram stages[LATENCY_STAGE_NUM];
+};
+
+/**
+ * ワーカーが処理中のパケットの計測状態
+ */
+struct latency_packet
+{
+	uint64_t start_tsc;
+	uint64_t last_tsc; // 直前の境界の時刻
+	latency_stage stage; // 今いる段階
+	bool active; // 受信したパケットを処理中か
+};
+
+void latency_init();
+
+void dump_latency_stats();
+
+#ifdef CURO_LATENCY
+
+#include <x86intrin.h>
+
+struct msghdr;
+
+extern latency_worker latency_workers[WORKER_MAX];
+extern thread_local latency_packet latency_current;
+
+inline uint32_t get_latency_bucket(uint64_t value)
+{
+	if (value < LATENCY_SUB_BUCKET_NUM)
+	{
+		return value;
+	}
+	uint32_t shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKET_NUM + ((value >> shift) & (LATENCY_SUB_BUCKET_NUM - 1));
+}
+
+/**
+ * ヒストグラムに記録する
+ * 書き込むのはそのワーカーだけなので、不可分な加算は使わない
+ */
+inline void latency_record(latency_stage stage, uint64_t value)
+{
+	latency_histogram *histogram = &latency_workers[worker_id].stages[static_cast<uint8_t>(stage)];
+	std::atomic<uint64_t> *count = &histogram->counts[get_latency_bucket(value)];
+	count->store(count->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (value > histogram->max.load(std::memory_order_relaxed))
+	{
+		histogram->max.store(value, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * 次の段階に入る。直前の段階にいた時間を記録する
+ */
+inline void latency_enter(latency_stage stage)
+{
+	if (!latency_current.active)
+	{
+		return;
+	}
+	uint64_t now = __rdtsc();
+	latency_record(latency_current.stage, now - latency_current.last_tsc);
+	latency_current.stage = stage;
+	latency_current.last_tsc = now;
+}
+
+/**
+ * 送信が終わったら、最後の段階と全体の時間を記録して計測を終える
+ */
+inline void latency_end()
+{
+	if (!latency_current.active)
+	{
+		return;
+	}
+	uint64_t now = __rdtsc();
+	latency_record(latency_current.stage, now - latency_current.last_tsc);
+	latency_record(latency_stage::total, now - latency_current.start_tsc);
+	latency_current.active = false;
+}
+
+void latency_begin(const msghdr *msg);
+
+#define LATENCY_BEGIN(msg) latency_begin(msg)
+#define LATENCY_STAGE(stage) latency_enter(latency_stage::stage)
+#define LATENCY_END() latency_end()
+#define LATENCY_CLEAR() (latency_current.active = false)
+
+#else
+
+#define LATENCY_BEGIN(msg)
+#define LATENCY_STAGE(stage)
+#define LATENCY_END()
+#define LATENCY_CLEAR()
+
+#endif
+
+#endif // CURO_LATENCY_H
@@ -0,0 +1,331 @@
+#include "log.h"
+
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <unistd.h>
+#include "spsc_ring.h"
+
+#define LOG_THREAD_MAX 32 // ログを書き込めるスレッド数
+
+struct log_ring
+{
+	spsc_ring<log_record, LOG_RING_SIZE> ring;
+	std::atomic<uint64_t> dropped; // リングが溢れて捨てたログの数
+};
+
+std::atomic<int> log_level{LOG_LEVEL_INFO};
+std::atomic<uint32_t> log_categories{LOG_CATEGORY_ALL};
+
+log_ring *log_rings[LOG_THREAD_MAX];
+std::atomic<uint32_t> log_ring_count{0};
+thread_local log_ring *log_thread_ring = nullptr;
+thread_local bool log_thread_failed = false; // リングを確保できなかったスレッドは書き込まない
+
+std::thread log_thread;
+std::atomic<bool> log_running{false};
+
+/**
+ * このスレッドのリングを確保して、ログ用のスレッドから見えるようにする
+ * @return
+ */
+log_ring *register_log_ring()
+{
+	uint32_t index = log_ring_count.load(std::memory_order_relaxed);
+	void *memory = aligned_alloc(alignof(log_ring), sizeof(log_ring));
+	if (memory == nullptr)
+	{
+		log_thread_failed = true;
+		return nullptr;
+	}
+	auto *ring = new (memory) log_ring();
+
+	// 複数のスレッドが同時に登録することがあるので、空いている場所を取り合う
+	do
+	{
+		if (index >= LOG_THREAD_MAX)
+		{
+			free(memory);
+			log_thread_failed = true;
+			return nullptr;
+		}
+	} while (!log_ring_count.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+	// 読み出し側は log_ring_count を見てから log_rings を読むので、nullptr のまま見えることがある
+	__atomic_store_n(&log_rings[index], ring, __ATOMIC_RELEASE);
+	log_thread_ring = ring;
+	return ring;
+}
+
+/**
+ * このスレッドのリングに書き込むレコードを取得する
+ * @return レコード。リングが溢れていれば nullptr
+ */
+log_record *log_reserve()
+{
+	log_ring *ring = log_thread_ring;
+	if (ring == nullptr)
+	{
+		if (log_thread_failed or (ring = register_log_ring()) == nullptr)
+		{
+			return nullptr;
+		}
+	}
+
+	log_record *record = spsc_ring_reserve(&ring->ring);
+	if (record == nullptr)
+	{
+		ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	return record;
+}
+
+void log_commit()
+{
+	spsc_ring_commit(&log_thread_ring->ring);
+}
+
+/**
+ * レコードから次の引数を読む
+ */
+const uint8_t *log_next_arg(const uint8_t *pos, const uint8_t *end, log_arg_type *type, const uint8_t **value)
+{
+	if (pos >= end)
+	{
+		return nullptr;
+	}
+	*type = static_cast<log_arg_type>(*pos++);
+	*value = pos;
+	switch (*type)
+	{
+	case LOG_ARG_INT:
+	case LOG_ARG_UINT:
+	case LOG_ARG_DOUBLE:
+		return pos + 8;
+	case LOG_ARG_STRING:
+		return pos + 1 + pos[0];
+	case LOG_ARG_IP:
+		return pos + 4;
+	case LOG_ARG_MAC:
+		return pos + 6;
+	}
+	return nullptr;
+}
+
+/**
+ * レコードを printf と同じように文字列にする
+ * 書式の変換指定ごとに、長さ修飾子を引数の型に合わせて付け直して snprintf に渡す
+ * @param record
+ * @param buffer
+ * @param size
+ * @return 書き込んだ長さ
+ */
+size_t log_format(const log_record *record, char *buffer, size_t size)
+{
+	size_t len = 0;
+	auto append = [&](int n) {
+		if (n > 0)
+		{
+			len = len + n < size ? len + n : size - 1;
+		}
+	};
+
+	append(snprintf(buffer, size, "[%s] ", record->site->category_name));
+
+	const uint8_t *arg = record->data;
+	const uint8_t *end = record->data + record->len;
+	for (const char *p = record->site->format; *p != '\0' and len < size - 1; ++p)
+	{
+		if (*p != '%')
+		{
+			buffer[len++] = *p;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			buffer[len++] = '%';
+			++p;
+			continue;
+		}
+
+		// フラグ、幅、精度だけを残し、長さ修飾子は取り除く
+		char spec[32] = "%";
+		size_t spec_len = 1;
+		++p;
+		while (*p != '\0' and strchr("-+ #0123456789.", *p) != nullptr and spec_len < sizeof(spec) - 4)
+		{
+			spec[spec_len++] = *p++;
+		}
+		while (*p != '\0' and strchr("hlLqjzt", *p) != nullptr)
+		{
+			++p;
+		}
+		if (*p == '\0')
+		{
+			break;
+		}
+		char conversion = *p;
+
+		log_arg_type type;
+		const uint8_t *value;
+		const uint8_t *next = log_next_arg(arg, end, &type, &value);
+		if (next == nullptr or next > end)
+		{
+			append(snprintf(buffer + len, size - len, "<?>"));
+			continue;
+		}
+		arg = next;
+
+		int64_t i;
+		uint64_t u;
+		double d;
+		char text[LOG_STRING_MAX + 1];
+		switch (type)
+		{
+		case LOG_ARG_INT:
+		case LOG_ARG_UINT:
+			if (conversion == 'c')
+			{
+				memcpy(&i, value, sizeof(i));
+				spec[spec_len++] = 'c';
+				spec[spec_len] = '\0';
+				append(snprintf(buffer + len, size - len, spec, static_cast<int>(i)));
+				break;
+			}
+			if (strchr("eEfFgGaA", conversion) != nullptr)
+			{
+				memcpy(&i, value, sizeof(i));
+				spec[spec_len++] = conversion;
+				spec[spec_len] = '\0';
+				append(snprintf(buffer + len, size - len, spec, static_cast<double>(i)));
+				break;
+			}
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = strchr("sp", conversion) != nullptr ? 'd' : conversion;
+			spec[spec_len] = '\0';
+			if (type == LOG_ARG_INT)
+			{
+				memcpy(&i, value, sizeof(i));
+				append(snprintf(buffer + len, size - len, spec, static_cast<long long>(i)));
+			}
+			else
+			{
+				memcpy(&u, value, sizeof(u));
+				append(snprintf(buffer + len, size - len, spec, static_cast<unsigned long long>(u)));
+			}
+			break;
+		case LOG_ARG_DOUBLE:
+			memcpy(&d, value, sizeof(d));
+			spec[spec_len++] = strchr("eEfFgGaA", conversion) != nullptr ? conversion : 'g';
+			spec[spec_len] = '\0';
+			append(snprintf(buffer + len, size - len, spec, d));
+			break;
+		case LOG_ARG_STRING:
+			memcpy(text, value + 1, value[0]);
+			text[value[0]] = '\0';
+			spec[spec_len++] = 's';
+			spec[spec_len] = '\0';
+			append(snprintf(buffer + len, size - len, spec, text));
+			break;
+		case LOG_ARG_IP:
+			memcpy(&u, value, 4);
+			u &= 0xffffffff;
+			snprintf(text, sizeof(text), "%lu.%lu.%lu.%lu", u >> 24 & 0xff, u >> 16 & 0xff, u >> 8 & 0xff, u & 0xff);
+			spec[spec_len++] = 's';
+			spec[spec_len] = '\0';
+			append(snprintf(buffer + len, size - len, spec, text));
+			break;
+		case LOG_ARG_MAC:
+			snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x", value[0], value[1], value[2], value[3], value[4], value[5]);
+			spec[spec_len++] = 's';
+			spec[spec_len] = '\0';
+			append(snprintf(buffer + len, size - len, spec, text));
+			break;
+		}
+	}
+	buffer[len] = '\0';
+	return len;
+}
+
+/**
+ * 全てのリングに溜まっているログを出力する
+ * @return 出力したログの数
+ */
+uint32_t log_drain()
+{
+	static char line[1024];
+	uint32_t drained = 0;
+	uint32_t count = log_ring_count.load(std::memory_order_acquire);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		log_ring *ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+		if (ring == nullptr)
+		{
+			continue;
+		}
+
+		log_record *record;
+		while ((record = spsc_ring_peek(&ring->ring)) != nullptr)
+		{
+			size_t len = log_format(record, line, sizeof(line));
+			fwrite(line, 1, len, stdout);
+			spsc_ring_release(&ring->ring);
+			drained++;
+		}
+	}
+	return drained;
+}
+
+/**
+ * ログを文字列にして出力するスレッドを起動する
+ */
+void log_init()
+{
+	log_running.store(true);
+	log_thread = std::thread([] {
+		while (log_running.load(std::memory_order_relaxed))
+		{
+			if (log_drain() == 0)
+			{
+				usleep(1000);
+			}
+			else
+			{
+				fflush(stdout);
+			}
+		}
+	});
+}
+
+/**
+ * ログ用のスレッドを止めて、残っているログを出力する
+ */
+void log_shutdown()
+{
+	if (log_running.exchange(false))
+	{
+		log_thread.join();
+	}
+	log_drain();
+	fflush(stdout);
+}
+
+/**
+ * ログの設定と、溢れて捨てたログの数を出力
+ */
+void dump_log_stats()
+{
+	uint64_t dropped = 0;
+	uint32_t count = log_ring_count.load(std::memory_order_acquire);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		log_ring *ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+		if (ring != nullptr)
+		{
+			dropped += ring->dropped.load(std::memory_order_relaxed);
+		}
+	}
+	printf("Log: level %d (compiled up to %d), categories %08x, %u threads, %lu records dropped\n",
+				 log_level.load(), CURO_LOG_LEVEL, log_categories.load(), count, dropped);
+}
@@ -1,23 +1,221 @@
 #ifndef CURO_LOG_H
 #define CURO_LOG_H
 
-#define LOG_ETHERNET(...) \
-	printf("[ETHER] ");     \
-	printf(__VA_ARGS__)
-#define LOG_IP(...) \
-	printf("[IP] ");  \
-	printf(__VA_ARGS__);
-#define LOG_ARP(...) \
-	printf("[ARP] ");  \
-	printf(__VA_ARGS__);
-#define LOG_ICMP(...) \
-	printf("[ICMP] ");  \
-	printf(__VA_ARGS__);
-#define LOG_NAT(...) \
-	printf("[NAT] ");  \
-	printf(__VA_ARGS__);
-#define LOG_ERROR(...)                          \
-	printf("[ERROR %s:%d] ", __FILE__, __LINE__); \
-	fprintf(stderr, __VA_ARGS__);
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * 非同期のログ
+ * データパスでは文字列にせず、書式の場所と引数の値をそのままスレッドごとのリングバッファに書き込み、
+ * 文字列にして出力するのはログ用のスレッドで行う
+ * リングが溢れたら、待たずにそのログを捨てて数える
+ *
+ * CURO_LOG_LEVEL より詳細なログは呼び出しごとコンパイル時に消え、
+ * それ以外は実行時のレベルとカテゴリで出力するかを決める
+ * エラーはすぐに終了することがあるので、その場で出力する
+ */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3 // パケットごとのログ
+
+#ifndef CURO_LOG_LEVEL
+#define CURO_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_CATEGORY_ETHERNET 0x01
+#define LOG_CATEGORY_ARP 0x02
+#define LOG_CATEGORY_IP 0x04
+#define LOG_CATEGORY_ICMP 0x08
+#define LOG_CATEGORY_NAT 0x10
+#define LOG_CATEGORY_ALL 0xffffffff
+
+#define LOG_RING_SIZE 4096 // スレッドごとのリングのレコード数 (2 のべき乗)
+#define LOG_RECORD_DATA_SIZE 112
+#define LOG_STRING_MAX 32 // 引数の文字列をコピーする最大長
+
+extern std::atomic<int> log_level;
+extern std::atomic<uint32_t> log_categories;
+
+/**
+ * ログの呼び出し箇所ごとに 1 つだけ作る静的な情報
+ * レコードにはこのポインタを書式の ID として書き込む
+ */
+struct log_site
+{
+	int level;
+	const char *category_name;
+	const char *format;
+};
+
+struct log_record
+{
+	const log_site *site;
+	uint32_t len; // data に書き込んだ長さ
+	uint8_t data[LOG_RECORD_DATA_SIZE]; // 型のタグと値を並べた引数
+};
+
+enum log_arg_type : uint8_t
+{
+	LOG_ARG_INT,
+	LOG_ARG_UINT,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STRING, // 長さ (1 byte) と文字列
+	LOG_ARG_IP, // ホストバイトオーダーの IPv4 アドレス
+	LOG_ARG_MAC,
+};
+
+/**
+ * ログ用のスレッドで文字列にする IP アドレスと MAC アドレス
+ * ip_htoa などの代わりに、ログの引数に渡す
+ */
+struct log_ip_addr
+{
+	uint32_t addr; // ホストバイトオーダー
+};
+
+struct log_mac_addr
+{
+	const uint8_t *addr;
+};
+
+inline log_ip_addr log_htoa(uint32_t addr)
+{
+	return {addr};
+}
+
+inline log_ip_addr log_ntoa(uint32_t addr)
+{
+	return {__builtin_bswap32(addr)};
+}
+
+inline log_mac_addr log_mac(const uint8_t *addr)
+{
+	return {addr};
+}
+
+struct log_writer
+{
+	uint8_t *pos;
+	uint8_t *end;
+};
+
+/**
+ * 型のタグと値を書き込む。入りきらなければ、以降の引数は書き込まない
+ */
+inline void log_put(log_writer *writer, log_arg_type type, const void *value, size_t len)
+{
+	if (static_cast<size_t>(writer->end - writer->pos) < 1 + len)
+	{
+		writer->pos = writer->end;
+		return;
+	}
+	*writer->pos++ = type;
+	memcpy(writer->pos, value, len);
+	writer->pos += len;
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value>::type log_put_arg(log_writer *writer, T value)
+{
+	if (std::is_signed<T>::value)
+	{
+		int64_t v = static_cast<int64_t>(value);
+		log_put(writer, LOG_ARG_INT, &v, sizeof(v));
+	}
+	else
+	{
+		uint64_t v = static_cast<uint64_t>(value);
+		log_put(writer, LOG_ARG_UINT, &v, sizeof(v));
+	}
+}
+
+inline void log_put_arg(log_writer *writer, double value)
+{
+	log_put(writer, LOG_ARG_DOUBLE, &value, sizeof(value));
+}
+
+inline void log_put_arg(log_writer *writer, const char *value)
+{
+	uint8_t buffer[1 + LOG_STRING_MAX];
+	buffer[0] = strnlen(value, LOG_STRING_MAX);
+	memcpy(buffer + 1, value, buffer[0]);
+	log_put(writer, LOG_ARG_STRING, buffer, 1 + buffer[0]);
+}
+
+inline void log_put_arg(log_writer *writer, log_ip_addr value)
+{
+	log_put(writer, LOG_ARG_IP, &value.addr, sizeof(value.addr));
+}
+
+inline void log_put_arg(log_writer *writer, log_mac_addr value)
+{
+	log_put(writer, LOG_ARG_MAC, value.addr, 6);
+}
+
+log_record *log_reserve();
+void log_commit();
+
+/**
+ * レコードを書き込む
+ * @param site
+ * @param args
+ */
+template <typename... Args>
+void log_write(const log_site *site, Args... args)
+{
+	log_record *record = log_reserve();
+	if (record == nullptr)
+	{
+		return;
+	}
+	record->site = site;
+	log_writer writer{record->data, record->data + LOG_RECORD_DATA_SIZE};
+	(log_put_arg(&writer, args), ...);
+	record->len = writer.pos - record->data;
+	log_commit();
+}
+
+inline bool log_enabled(int level, uint32_t category)
+{
+	return level <= log_level.load(std::memory_order_relaxed) and (log_categories.load(std::memory_order_relaxed) & category);
+}
+
+#define LOG_WRITE(level, category, format, ...)                                    \
+	do                                                                               \
+	{                                                                                \
+		if ((level) <= CURO_LOG_LEVEL and log_enabled(level, LOG_CATEGORY_##category)) \
+		{                                                                              \
+			static const log_site site = {level, #category, format};                     \
+			log_write(&site, ##__VA_ARGS__);                                             \
+		}                                                                              \
+	} while (0)
+
+#define LOG_WARN(category, ...) LOG_WRITE(LOG_LEVEL_WARN, category, __VA_ARGS__)
+#define LOG_INFO(category, ...) LOG_WRITE(LOG_LEVEL_INFO, category, __VA_ARGS__)
+
+#define LOG_ETHERNET(...) LOG_WRITE(LOG_LEVEL_DEBUG, ETHERNET, __VA_ARGS__)
+#define LOG_IP(...) LOG_WRITE(LOG_LEVEL_DEBUG, IP, __VA_ARGS__)
+#define LOG_ARP(...) LOG_WRITE(LOG_LEVEL_DEBUG, ARP, __VA_ARGS__)
+#define LOG_ICMP(...) LOG_WRITE(LOG_LEVEL_DEBUG, ICMP, __VA_ARGS__)
+#define LOG_NAT(...) LOG_WRITE(LOG_LEVEL_DEBUG, NAT, __VA_ARGS__)
+#define LOG_ERROR(...)                              \
+	do                                                \
+	{                                                 \
+		printf("[ERROR %s:%d] ", __FILE__, __LINE__);   \
+		fprintf(stderr, __VA_ARGS__);                   \
+	} while (0)
+
+void log_init();
+void log_shutdown();
+
+size_t log_format(const log_record *record, char *buffer, size_t size);
+
+void dump_log_stats();
 
 #endif // CURO_LOG_H
@@ -2,21 +2,33 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <iostream>
-#include <linux/if_ether.h>
 #include <net/if.h>
-#include <netpacket/packet.h>
 #include <string.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
+#include "acl.h"
+#include "arp.h"
+#include "capture.h"
 #include "config.h"
+#include "egress_queue.h"
 #include "ethernet.h"
+#include "flow_cache.h"
+#include "flow_export.h"
+#include "icmp.h"
 #include "ip.h"
+#include "latency.h"
 #include "log.h"
 #include "napt.h"
+#include "nat_event.h"
 #include "net.h"
+#include "packet_socket.h"
+#include "persist.h"
+#include "policer.h"
+#include "replay.h"
+#include "sim.h"
+#include "stats.h"
 #include "utils.h"
+#include "worker.h"
 
 bool is_ignore_interface(const char *ifname)
 {
@@ -70,32 +82,96 @@ void configure_ip()
 
 	configure_ip_napt(
 			get_net_device_by_name("router1-br0"), get_net_device_by_name("router1-router2"));
-}
 
-int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len);
-int net_device_poll(net_device *dev);
+	// 内側から、内側のネットワーク以外を送信元とするパケットが来たら捨てる
+	acl_rule inside_rules[] = {
+			{IP_ADDRESS(192, 168, 1, 0), 24, 0, 0, 0, 0, 0xffff, 0, 0xffff, acl_action::permit},
+	};
+	configure_ip_acl(
+			get_net_device_by_name("router1-br0"), inside_rules, 1, acl_action::deny);
 
-struct net_device_data
-{
-	int fd;
-};
+	// 内側の 1 台のホストが、NAPT のポートや転送の処理を使い切らないようにする
+	configure_ip_policer(
+			get_net_device_by_name("router1-br0"), 200000, 1000);
+
+	// 内側への送信をリンクより少し遅いレートに絞り、詰まったときのキューをルータ側で管理する
+	configure_egress_queue(
+			get_net_device_by_name("router1-br0"), 900ull * 1000 * 1000);
+
+	// NAPT のセッションの作成と削除を全て記録する
+	configure_nat_event_log(
+			"/tmp/curo-nat-events", 64ull * 1024 * 1024, 8);
+
+	// 受信したパケットを 1/100 でサンプリングし、フローの統計を同じホストのコレクタに送る
+	configure_flow_export(
+			IP_ADDRESS(127, 0, 0, 1), FLOW_EXPORT_DEFAULT_PORT, 100);
 
-int main()
+	// 全てのデバイスの全ての位置をキャプチャできるようにしておき、c キーで開始と停止をする
+	configure_capture(
+			nullptr, CAPTURE_POINT_ALL, nullptr, 0, "/tmp/curo-capture", 64ull * 1024 * 1024, 4);
+}
+
+int main(int argc, char **argv)
 {
-	struct ifreq ifr
-	{
-	};
 	struct ifaddrs *addrs;
 
+	// ログを出力するスレッドを起動する
+	log_init();
+
+	// --no-flow-cache を付けると、フローキャッシュを使わずに転送する (--bench や --sim でキャッシュの効果を比べる)
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--no-flow-cache") == 0)
+		{
+			configure_flow_cache(false);
+			memmove(&argv[i], &argv[i + 1], sizeof(char *) * (argc - i));
+			argc--;
+			break;
+		}
+	}
+
+	// --workers N を付けると、N 個のワーカーのスレッドでデバイスを分担して処理する
+	uint32_t workers = 1;
+	for (int i = 1; i + 1 < argc; ++i)
+	{
+		if (strcmp(argv[i], "--workers") == 0)
+		{
+			workers = atoi(argv[i + 1]);
+			memmove(&argv[i], &argv[i + 2], sizeof(char *) * (argc - i - 1));
+			argc -= 2;
+			break;
+		}
+	}
+
+	// router --bench <trace.pcap> [seconds] [output.pcap] で、pcap ファイルを流して性能を測る
+	if (argc >= 3 and strcmp(argv[1], "--bench") == 0)
+	{
+		int result = run_replay_bench(argv[2], argc >= 4 ? atoi(argv[3]) : 5, argc >= 5 ? argv[4] : nullptr, workers);
+		log_shutdown();
+		return result;
+	}
+
+	// router --sim [seconds] で、複数のルータとホストをプロセスの中でつないで性能を測る
+	// ルータごとに状態を入れ替えて 1 つのスレッドで動かすので、ワーカーは 1 つだけ
+	if (argc >= 2 and strcmp(argv[1], "--sim") == 0)
+	{
+		if (workers != 1)
+		{
+			LOG_ERROR("--sim runs with a single worker\n");
+			log_shutdown();
+			return EXIT_FAILURE;
+		}
+		int result = run_sim_bench(argc >= 3 ? atoi(argv[2]) : 5);
+		log_shutdown();
+		return result;
+	}
+
 	// get Network Interface info
 	getifaddrs(&addrs);
 	for (ifaddrs *tmp = addrs; tmp; tmp = tmp->ifa_next)
 	{
 		if (tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_PACKET)
 		{
-			// ioctl でコントロールするインターフェースを設定
-			memset(&ifr, 0, sizeof(ifr));
-			strcpy(ifr.ifr_name, tmp->ifa_name);
 			// 無視するインターフェースか確認
 			if (is_ignore_interface(tmp->ifa_name))
 			{
@@ -103,69 +179,16 @@ int main()
 				continue;
 			}
 
-			// open socket
-			int sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-			if (sock == -1)
-			{
-				LOG_ERROR("socket open failed: %s\n", strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			// get interface index
-			if (ioctl(sock, SIOCGIFINDEX, &ifr) == -1)
-			{
-				LOG_ERROR("ioctl SIOCGIFINDEX failed: %s\n", strerror(errno));
-				close(sock);
-				exit(EXIT_FAILURE);
-			}
-
-			// bind interface to socket
-			sockaddr_ll addr{};
-			memset(&addr, 0x00, sizeof(addr));
-			addr.sll_family = AF_PACKET;
-			addr.sll_protocol = htons(ETH_P_ALL);
-			addr.sll_ifindex = ifr.ifr_ifindex;
-			if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+			net_device *dev = create_packet_socket_device(tmp->ifa_name);
+			if (dev == nullptr)
 			{
-				LOG_ERROR("bind failed: %s\n", strerror(errno));
-				close(sock);
 				exit(EXIT_FAILURE);
 			}
-
-			// get interface MAC address
-			if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0)
-			{
-				LOG_ERROR("ioctl SIOCGIFHWADDR failed: %s\n", strerror(errno));
-				close(sock);
-				continue;
-			}
-
-			// create net_device struct
-			// allocate memory for net_device & net_device_data
-			net_device *dev;
-			dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(net_device_data));
-
-			// set transmit function
-			dev->ops.transmit = net_device_transmit;
-			// set poll function
-			dev->ops.poll = net_device_poll;
-
-			// set interface name to net_device
-			strcpy(dev->name, tmp->ifa_name);
-			// set MAC address to net_device
-			memcpy(dev->mac_addr, &ifr.ifr_hwaddr.sa_data[0], 6);
-			((net_device_data *)dev->data)->fd = sock;
-
-			printf("Created device %s socket %d\n", dev->name, sock);
+			printf("Created device %s socket %d\n", dev->name, ((net_device_data *)dev->data)->fd);
 
 			// add net_device to net_dev_list
 			dev->next = net_dev_list;
 			net_dev_list = dev;
-
-			// set non blocking
-			// get File descriptor flag
-			int val = fcntl(sock, F_GETFL, 0);
-			// set non blocking bit
-			fcntl(sock, F_SETFL, val | O_NONBLOCK);
 		}
 	}
 
@@ -176,10 +199,20 @@ int main()
 		exit(EXIT_FAILURE);
 	}
 
+	// NAPT のシャードなどはワーカーの数だけ作るので、設定より先に決める
+	configure_workers(workers);
+
+	// 前のプロセスの NAT セッションと ARP テーブルを引き継ぐ
+	persist_init();
+	init_arp_table();
+
 	ip_fib = (binary_trie_node<ip_route_entry> *)calloc(1, sizeof(binary_trie_node<ip_route_entry>));
 
 	configure_ip();
 
+	stats_init();
+	latency_init();
+
 	// 入力時にバッファリングせず、すぐに入力を受け取るための設定
 	termios attr{};
 	tcgetattr(0, &attr);
@@ -189,6 +222,9 @@ int main()
 	tcsetattr(0, TCSANOW, &attr);
 	fcntl(0, F_SETFL, O_NONBLOCK); // 標準入力にノンブロッキングの設定
 
+	// ワーカー 1 以降のスレッドを起動する。このスレッドはワーカー 0 として処理する
+	worker_start();
+
 	while (true)
 	{
 		int input = getchar(); // 入力を受け取る
@@ -202,7 +238,59 @@ int main()
 			}
 			else if (input == 'n')
 			{
-				// dump_nat_tables();
+				dump_nat_tables();
+				dump_nat_event_stats();
+			}
+			else if (input == 'f')
+			{
+				dump_flow_cache_stats();
+			}
+			else if (input == 'l')
+			{
+				dump_acl_stats();
+			}
+			else if (input == 'e')
+			{
+				dump_egress_queue_stats();
+			}
+			else if (input == 'p')
+			{
+				dump_policer_stats();
+			}
+			else if (input == 'i')
+			{
+				dump_icmp_stats();
+			}
+			else if (input == 's')
+			{
+				dump_stats();
+			}
+			else if (input == 't')
+			{
+				dump_latency_stats();
+			}
+			else if (input == 'x')
+			{
+				dump_flow_export_stats();
+			}
+			else if (input == 'c')
+			{
+				// キャプチャの開始と停止を切り替える
+				if (capture_active.load())
+				{
+					capture_stop();
+				}
+				else
+				{
+					capture_start();
+				}
+				dump_capture_stats();
+			}
+			else if (input == 'v')
+			{
+				// パケットごとのログの出力を切り替える
+				log_level.store(log_level.load() == LOG_LEVEL_DEBUG ? LOG_LEVEL_INFO : LOG_LEVEL_DEBUG);
+				dump_log_stats();
 			}
 			else if (input == 'q')
 			{
@@ -210,66 +298,15 @@ int main()
 			}
 		}
 
-		// poll communication from device
-		for (net_device *dev = net_dev_list; dev; dev = dev->next)
-		{
-			dev->ops.poll(dev);
-		}
+		// ワーカー 0 の受信と送信、タイマー
+		worker_iteration();
 	}
 
+	worker_shutdown();
+	stats_shutdown();
+	capture_stop();
+	nat_event_log_shutdown();
+	log_shutdown();
 	printf("Goodbye!\n");
 	return 0;
 }
-
-/**
- * Transmission process for net devices
- * @param dev device used for transmission
- * @param buffer buffer to be transmitted
- * @param len length of buffer
- */
-int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len)
-{
-	// transmit data via socket
-	send(((net_device_data *)dev->data)->fd, buffer, len, 0);
-	return 0;
-}
-
-/**
- * Receiving process for net devices
- * @param dev device attempting to receive
- */
-int net_device_poll(net_device *dev)
-{
-	uint8_t recv_buffer[1550];
-	// receive from socket
-	ssize_t n = recv(
-			((net_device_data *)
-					 dev->data)
-					->fd,
-			recv_buffer, sizeof(recv_buffer), 0);
-
-	if (n == -1)
-	{
-		if (errno == EAGAIN)
-		{
-			// no data
-			return 0;
-		}
-		else
-		{
-			return -1;
-		}
-	}
-
-	printf("Received %lu bytes from %s: ", n, dev->name);
-	for (int i = 0; i < n; ++i)
-	{
-		printf("%02x", recv_buffer[i]);
-	}
-	printf("\n");
-
-	// send received data to ethernet layer
-	ethernet_input(dev, recv_buffer, n);
-
-	return 0;
-}
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <cstdio>
 #include <string>
+#include "net.h"
 
 struct my_buf
 {
@@ -14,6 +15,8 @@ struct my_buf
 	my_buf *next = nullptr;
 	// my_buf に含む buffer の長さ
 	uint32_t len = 0;
+	// 受信時のチェックサムオフロードと GSO の情報 (位置は buffer の先頭から)
+	net_offload offload = {};
 	uint8_t buffer[];
 
 	/**
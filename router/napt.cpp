@@ -1,70 +1,534 @@
 #include "napt.h"
 
+#include "checksum.h"
 #include "config.h"
 #include "ip.h"
+#include "latency.h"
 #include "log.h"
 #include "net.h"
 #include "my_buf.h"
+#include "nat_event.h"
+#include "persist.h"
+#include "policer.h"
+#include "stats.h"
 #include "utils.h"
+#include <cstddef>
+#include <cstring>
+
+// 受信したワーカー × 担当のワーカーごとの、パケットを受け渡すリング
+// ワーカーが 1 つのときは使わない
+spsc_ring<nat_handoff_packet, NAT_HANDOFF_RING_SIZE> *nat_handoff_rings[WORKER_MAX][WORKER_MAX];
+uint64_t nat_handoff_count[WORKER_MAX]; // 他のワーカーに渡したパケット数 (受信したワーカーごと)
+uint64_t nat_handoff_drop_count[WORKER_MAX]; // リングが満杯で捨てたパケット数 (受信したワーカーごと)
+
+/**
+ * プロトコルの表示名
+ * @param proto
+ * @return
+ */
+const char *nat_protocol_name(nat_protocol proto)
+{
+	switch (proto)
+	{
+	case nat_protocol::udp:
+		return "UDP";
+	case nat_protocol::tcp:
+		return "TCP";
+	case nat_protocol::icmp:
+		return "ICMP";
+	}
+	return "?";
+}
 
 /**
  * Output NAT Table
+ * 加入者ごとに、割り当てたブロックとその中のエントリを出力する
  */
-void dump_nat_table()
+void dump_nat_tables()
 {
 	printf("|-PROTO-|--------LOCAL--------|--------GLOBAL--------|\n");
 	for (net_device *dev = net_dev_list; dev; dev = dev->next)
 	{
-		if (dev->ip_dev != nullptr and dev->ip_dev->nat_dev != nullptr)
+		if (dev->ip_dev == nullptr or dev->ip_dev->nat_dev == nullptr)
 		{
-			for (int i = 0; i < NAT_GLOBAL_PORT_SIZE; ++i)
+			continue;
+		}
+
+		nat_device *nat_dev = dev->ip_dev->nat_dev;
+		for (uint32_t s = 0; s < nat_dev->shard_count; ++s)
+		{
+			for (int i = 0; i < NAT_SUBSCRIBER_HASH_SIZE; ++i)
 			{
-				if (dev->ip_dev->nat_dev->entries->tcp[i].global_port != 0)
+				for (nat_subscriber *subscriber = nat_dev->shards[s]->subscribers[i]; subscriber; subscriber = subscriber->next)
 				{
-					printf("|  TCP  | %15s:%05d | %15s:%05d |\n",
-								 ip_htoa(dev->ip_dev->nat_dev->entries->tcp[i].local_addr),
-								 dev->ip_dev->nat_dev->entries->tcp[i].local_port,
-								 ip_htoa(dev->ip_dev->nat_dev->entries->tcp[i].global_addr),
-								 dev->ip_dev->nat_dev->entries->tcp[i].global_port);
+					for (int proto = 0; proto < NAT_PROTOCOL_NUM; ++proto)
+					{
+						for (nat_port_block *block = subscriber->blocks[proto]; block; block = block->next)
+						{
+							printf("| %5s | %15s       | %15s:%05d-%05d (%u used)\n",
+										 nat_protocol_name(block->proto),
+										 ip_htoa(subscriber->local_addr),
+										 ip_htoa(block->global_addr),
+										 block->first_port,
+										 block->first_port + NAT_PORT_BLOCK_SIZE - 1,
+										 block->ports.used);
+
+							for (int port = 0; port < NAT_PORT_BLOCK_SIZE; ++port)
+							{
+								nat_entry *entry = block->entries[port];
+								if (entry != nullptr)
+								{
+									printf("| %5s | %15s:%05d | %15s:%05d |\n",
+												 nat_protocol_name(entry->proto),
+												 ip_htoa(entry->local_addr),
+												 entry->local_port,
+												 ip_htoa(entry->global_addr),
+												 entry->global_port);
+								}
+							}
+						}
+					}
 				}
+			}
+		}
+	}
+	printf("|-------|-----------------------|-----------------------|\n");
+	dump_nat_pool_usage();
+}
 
-				if (dev->ip_dev->nat_dev->entries->udp[i].global_port != 0)
+/**
+ * プロトコルごとのポートとブロックの使用率を出力
+ */
+void dump_nat_pool_usage()
+{
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev == nullptr or dev->ip_dev->nat_dev == nullptr)
+		{
+			continue;
+		}
+
+		nat_device *nat_dev = dev->ip_dev->nat_dev;
+		uint32_t block_capacity = nat_dev->outside_addr_count * NAT_BLOCKS_PER_ADDRESS;
+		uint32_t port_capacity = block_capacity * NAT_PORT_BLOCK_SIZE;
+		printf("NAT usage on %s (%u outside addresses from %s, %u shards)\n", dev->name, nat_dev->outside_addr_count, ip_htoa(nat_dev->outside_addr), nat_dev->shard_count);
+		for (int proto = 0; proto < NAT_PROTOCOL_NUM; ++proto)
+		{
+			uint32_t session_count = 0;
+			uint32_t block_count = 0;
+			for (uint32_t s = 0; s < nat_dev->shard_count; ++s)
+			{
+				session_count += nat_dev->shards[s]->session_count[proto];
+				block_count += nat_dev->shards[s]->block_count[proto];
+			}
+			printf("  %-4s ports %u/%u (%.1f%%), blocks %u/%u (%.1f%%)\n",
+						 nat_protocol_name(static_cast<nat_protocol>(proto)),
+						 session_count, port_capacity, 100.0 * session_count / port_capacity,
+						 block_count, block_capacity, 100.0 * block_count / block_capacity);
+		}
+		if (worker_count > 1)
+		{
+			for (uint32_t i = 0; i < worker_count; ++i)
+			{
+				printf("  worker %u handoffs %lu, handoff drops %lu\n", i, nat_handoff_count[i], nat_handoff_drop_count[i]);
+			}
+		}
+	}
+}
+
+/**
+ * セッションのアイドルタイムアウト (tick) を返す
+ * @param entry
+ * @return
+ */
+uint64_t get_nat_entry_timeout(nat_entry *entry)
+{
+	uint64_t timeout;
+	switch (entry->proto)
+	{
+	case nat_protocol::icmp:
+		timeout = NAT_ICMP_TIMEOUT;
+		break;
+	case nat_protocol::udp:
+		timeout = NAT_UDP_TIMEOUT;
+		break;
+	case nat_protocol::tcp:
+	default:
+		if (entry->tcp_state == nat_tcp_state::established or entry->tcp_state == nat_tcp_state::fin_wait)
+		{
+			timeout = NAT_TCP_ESTABLISHED_TIMEOUT;
+		}
+		else if (entry->tcp_state == nat_tcp_state::closed)
+		{
+			timeout = NAT_TCP_CLOSED_TIMEOUT;
+		}
+		else
+		{
+			timeout = NAT_TCP_TRANSITORY_TIMEOUT;
+		}
+		break;
+	}
+	return timeout * 1000 / NAT_TIMER_TICK_MS;
+}
+
+/**
+ * パケットの通過をセッションに記録し、TCP の状態を更新する
+ * タイマーは満了したときに last_seen を見て延長するので、通常は時刻を書き込むだけ
+ * @param entries
+ * @param entry
+ * @param nat_packet
+ * @param direction
+ */
+void update_nat_session(nat_entries *entries, nat_entry *entry, nat_packet_head *nat_packet, nat_direction direction)
+{
+	entry->last_seen = entries->timer.current_tick;
+
+	if (entry->proto != nat_protocol::tcp)
+	{
+		return;
+	}
+
+	uint64_t old_timeout = get_nat_entry_timeout(entry);
+	uint8_t flag = nat_packet->tcp.flag;
+	if (flag & TCP_FLAG_RST)
+	{
+		entry->tcp_state = nat_tcp_state::closed;
+	}
+	else if (flag & TCP_FLAG_FIN)
+	{
+		entry->tcp_fin_seen |= 1 << static_cast<int>(direction);
+		entry->tcp_state = entry->tcp_fin_seen == 0b11 ? nat_tcp_state::time_wait : nat_tcp_state::fin_wait;
+	}
+	else if (flag & TCP_FLAG_SYN)
+	{
+		if (direction == nat_direction::incoming and entry->tcp_state == nat_tcp_state::syn_sent)
+		{
+			entry->tcp_state = nat_tcp_state::established;
+		}
+		else if (direction == nat_direction::outgoing and (entry->tcp_state == nat_tcp_state::time_wait or entry->tcp_state == nat_tcp_state::closed))
+		{
+			// 同じポートで新しいコネクションが始まった
+			entry->tcp_state = nat_tcp_state::syn_sent;
+			entry->tcp_fin_seen = 0;
+		}
+	}
+
+	// タイムアウトが短くなった場合だけ、タイマーを付け替える
+	uint64_t timeout = get_nat_entry_timeout(entry);
+	if (timeout < old_timeout)
+	{
+		timer_wheel_add(&entries->timer, &entry->timer, entry->last_seen + timeout);
+	}
+}
+
+/**
+ * セッションのタイマーが満了したときの処理
+ * 最後の通過からタイムアウトが経っていなければタイマーを延長する
+ * @param node
+ */
+void nat_entry_timer_expired(timer_node *node, void *)
+{
+	auto *entry = reinterpret_cast<nat_entry *>(reinterpret_cast<uint8_t *>(node) - offsetof(nat_entry, timer));
+	nat_entries *shard = entry->block->subscriber->shard;
+
+	uint64_t deadline = entry->last_seen + get_nat_entry_timeout(entry);
+	if (deadline > shard->timer.current_tick)
+	{
+		timer_wheel_add(&shard->timer, node, deadline);
+		return;
+	}
+
+	LOG_NAT("Expired nat table entry %s:%d => %s:%d\n", log_htoa(entry->local_addr), entry->local_port, log_htoa(entry->global_addr), entry->global_port);
+	delete_nat_entry(entry);
+}
+
+/**
+ * NAT セッションのタイマーを進め、アイドルタイムアウトしたエントリを削除する
+ * このワーカーが担当するシャードだけを進める
+ */
+void nat_timer()
+{
+	uint64_t tick = current_time_ms() / NAT_TIMER_TICK_MS;
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev != nullptr and dev->ip_dev->nat_dev != nullptr)
+		{
+			nat_device *nat_dev = dev->ip_dev->nat_dev;
+			for (uint32_t s = worker_id; s < nat_dev->shard_count; s += worker_count)
+			{
+				timer_wheel_advance(&nat_dev->shards[s]->timer, tick, nat_entry_timer_expired, nullptr);
+			}
+		}
+	}
+}
+
+/**
+ * local 側アドレスを担当するシャードの番号
+ * 同じ加入者のセッションは同じシャードに入る
+ * @param nat_dev
+ * @param local_addr
+ * @return
+ */
+uint32_t get_nat_shard_by_local(nat_device *nat_dev, uint32_t local_addr)
+{
+	return ((local_addr * 0x9e3779b1) >> 16) % nat_dev->shard_count;
+}
+
+/**
+ * 外側のポートを担当するシャードの番号
+ * ポートブロックの番号をシャード数で割った余りで決まる
+ * @param nat_dev
+ * @param port
+ * @return
+ */
+uint32_t get_nat_shard_by_global(nat_device *nat_dev, uint16_t port)
+{
+	if (port < NAT_GLOBAL_PORT_MIN)
+	{
+		return 0; // どのエントリにも当たらないので、どのシャードで調べてもよい
+	}
+	return ((port - NAT_GLOBAL_PORT_MIN) / NAT_PORT_BLOCK_SIZE) % nat_dev->shard_count;
+}
+
+void init_nat_handoff_rings();
+
+/**
+ * NAT デバイスの初期化
+ * 外側アドレスのプールの大きさに合わせて、シャードごとにブロックの索引を確保する
+ * @param nat_dev
+ * @param outside_addr プールの先頭の外側アドレス
+ * @param outside_addr_count プールのアドレス数
+ * @param shard_count テーブルのシャード数 (通常はワーカー数)
+ */
+void init_nat_device(nat_device *nat_dev, uint32_t outside_addr, uint32_t outside_addr_count, uint32_t shard_count)
+{
+	nat_dev->outside_addr = outside_addr;
+	nat_dev->outside_addr_count = outside_addr_count;
+	nat_dev->shard_count = shard_count;
+	for (uint32_t s = 0; s < shard_count; ++s)
+	{
+		auto *shard = (nat_entries *)persist_calloc(1, sizeof(nat_entries));
+		if (shard == nullptr)
+		{
+			LOG_ERROR("Failed to allocate NAT table\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int proto = 0; proto < NAT_PROTOCOL_NUM; ++proto)
+		{
+			shard->blocks[proto] = (nat_port_block **)persist_calloc(outside_addr_count * NAT_BLOCKS_PER_ADDRESS, sizeof(nat_port_block *));
+			shard->block_pools[proto] = (port_pool<NAT_BLOCKS_PER_ADDRESS> *)persist_calloc(outside_addr_count, sizeof(port_pool<NAT_BLOCKS_PER_ADDRESS>));
+			if (shard->blocks[proto] == nullptr or shard->block_pools[proto] == nullptr)
+			{
+				LOG_ERROR("Failed to allocate NAT table\n");
+				exit(EXIT_FAILURE);
+			}
+
+			// 他のシャードが担当するブロックは、このシャードでは割り当てない
+			for (uint32_t address_index = 0; address_index < outside_addr_count; ++address_index)
+			{
+				for (uint32_t index = 0; index < NAT_BLOCKS_PER_ADDRESS; ++index)
 				{
-					printf("|  UDP  | %15s:%05d | %15s:%05d |\n",
-								 ip_htoa(dev->ip_dev->nat_dev->entries->udp[i].local_addr),
-								 dev->ip_dev->nat_dev->entries->udp[i].local_port,
-								 ip_htoa(dev->ip_dev->nat_dev->entries->udp[i].global_addr),
-								 dev->ip_dev->nat_dev->entries->udp[i].global_port);
+					if (index % shard_count != s)
+					{
+						port_pool_mark_used(&shard->block_pools[proto][address_index], index);
+					}
 				}
 			}
+		}
+		timer_wheel_init(&shard->timer, current_time_ms() / NAT_TIMER_TICK_MS);
+		nat_dev->shards[s] = shard;
+	}
+
+	init_nat_handoff_rings();
+}
+
+/**
+ * 前のプロセスから引き継いだ NAT デバイスを使えるようにする
+ * テーブルは共有メモリの中にそのまま残っているので、プロセスごとの状態だけを作り直す
+ * @param nat_dev
+ */
+void restore_nat_device(nat_device *nat_dev)
+{
+	uint32_t session_count = 0;
+	for (uint32_t s = 0; s < nat_dev->shard_count; ++s)
+	{
+		for (int proto = 0; proto < NAT_PROTOCOL_NUM; ++proto)
+		{
+			session_count += nat_dev->shards[s]->session_count[proto];
+		}
+	}
+	printf("Restored %u NAT sessions for %s\n", session_count, ip_htoa(nat_dev->outside_addr));
 
-			for (int i = 0; i < NAT_ICMP_ID_SIZE; ++i)
+	// 前のプロセスのレート制限は使えない
+	nat_dev->policer = nullptr;
+
+	init_nat_handoff_rings();
+}
+
+/**
+ * ワーカー間でパケットを受け渡すリングを確保する
+ * リングはプロセスごとの状態なので、共有メモリには置かない
+ */
+void init_nat_handoff_rings()
+{
+	if (worker_count > 1 and nat_handoff_rings[0][1] == nullptr)
+	{
+		for (uint32_t from = 0; from < worker_count; ++from)
+		{
+			for (uint32_t to = 0; to < worker_count; ++to)
 			{
-				if (dev->ip_dev->nat_dev->entries->icmp[i].local_addr != 0)
+				if (from != to)
 				{
-					printf("|  ICMP  | %15s:%05d | %15s:%05d |\n",
-								 ip_htoa(dev->ip_dev->nat_dev->entries->icmp[i].local_addr),
-								 dev->ip_dev->nat_dev->entries->icmp[i].local_port,
-								 ip_htoa(dev->ip_dev->nat_dev->entries->icmp[i].global_addr),
-								 dev->ip_dev->nat_dev->entries->icmp[i].global_port);
+					nat_handoff_rings[from][to] = (spsc_ring<nat_handoff_packet, NAT_HANDOFF_RING_SIZE> *)calloc(1, sizeof(spsc_ring<nat_handoff_packet, NAT_HANDOFF_RING_SIZE>));
 				}
 			}
 		}
 	}
-	printf("|-------|-----------------------|-----------------------|\n");
 }
 
 /**
- * NAT のアドレス変換を実行する
+ * IP のプロトコル番号から NAT のプロトコルを求める
+ * @param protocol_num
+ * @param proto
+ * @return NAT に対応していないプロトコルなら false
+ */
+bool get_nat_protocol(uint8_t protocol_num, nat_protocol *proto)
+{
+	switch (protocol_num)
+	{
+	case IP_PROTOCOL_NUM_UDP:
+		*proto = nat_protocol::udp;
+		return true;
+	case IP_PROTOCOL_NUM_TCP:
+		*proto = nat_protocol::tcp;
+		return true;
+	case IP_PROTOCOL_NUM_ICMP:
+		*proto = nat_protocol::icmp;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * パケットのセッションを担当するワーカーが別なら、そのワーカーのリングにパケットを渡す
+ * シャードを読み書きするのは担当のワーカーだけなので、テーブルにロックは要らない
+ * @param nat_dev
+ * @param input_dev
  * @param ip_packet
  * @param len
+ * @param offload
+ * @param proto
+ * @param direction
+ * @return 渡した (またはリングが満杯で捨てた) なら true。このワーカーで処理するなら false
+ */
+bool nat_handoff(nat_device *nat_dev, net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, nat_direction direction)
+{
+	if (worker_count <= 1)
+	{
+		return false;
+	}
+
+	auto *nat_packet = (nat_packet_head *)((uint8_t *)ip_packet + sizeof(ip_header));
+	uint32_t shard;
+	if (direction == nat_direction::incoming)
+	{
+		uint16_t port = proto == nat_protocol::icmp ? nat_packet->icmp.identify : nat_packet->dest_port;
+		shard = get_nat_shard_by_global(nat_dev, ntohs(port));
+	}
+	else
+	{
+		shard = get_nat_shard_by_local(nat_dev, ntohl(ip_packet->src_addr));
+	}
+
+	uint32_t owner = shard % worker_count;
+	if (owner == worker_id)
+	{
+		return false;
+	}
+
+	auto *ring = nat_handoff_rings[worker_id][owner];
+	nat_handoff_packet *slot = spsc_ring_reserve(ring);
+	uint8_t *large = nullptr;
+	if (slot != nullptr and len > NAT_HANDOFF_BUFFER_SIZE)
+	{
+		large = (uint8_t *)malloc(ETHERNET_HEADER_SIZE + len);
+	}
+	if (slot == nullptr or (len > NAT_HANDOFF_BUFFER_SIZE and large == nullptr))
+	{
+		LOG_NAT("Failed to hand off packet to worker %u\n", owner);
+		nat_handoff_drop_count[worker_id]++;
+		count_drop(input_dev, drop_reason::handoff_full);
+		return true;
+	}
+	slot->large = large;
+	slot->input_dev = input_dev;
+	slot->nat_dev = nat_dev;
+	slot->proto = proto;
+	slot->direction = direction;
+	slot->len = len;
+	slot->has_offload = offload != nullptr;
+	if (offload != nullptr)
+	{
+		slot->offload = *offload;
+	}
+	memcpy(large != nullptr ? large + ETHERNET_HEADER_SIZE : slot->buffer, ip_packet, len);
+	spsc_ring_commit(ring);
+	nat_handoff_count[worker_id]++;
+	return true;
+}
+
+/**
+ * 他のワーカーから渡されたパケットを処理する
+ * 受信したワーカーがヘッダの検査とレート制限を済ませているので、NAPT の変換から処理を続ける
+ * フローキャッシュはワーカーごとで、このフローのパケットはこのワーカーでは受信しないので登録しない
+ */
+void nat_handoff_poll()
+{
+	if (worker_count <= 1)
+	{
+		return;
+	}
+
+	for (uint32_t from = 0; from < worker_count; ++from)
+	{
+		auto *ring = nat_handoff_rings[from][worker_id];
+		if (ring == nullptr)
+		{
+			continue;
+		}
+
+		nat_handoff_packet *slot;
+		while ((slot = spsc_ring_peek(ring)) != nullptr)
+		{
+			auto *ip_packet = reinterpret_cast<ip_header *>(slot->large != nullptr ? slot->large + ETHERNET_HEADER_SIZE : slot->buffer);
+			const net_offload *offload = slot->has_offload ? &slot->offload : nullptr;
+			if (slot->direction == nat_direction::outgoing)
+			{
+				ip_input_nat_outgoing(slot->input_dev, slot->nat_dev, ip_packet, slot->len, offload, slot->proto, nullptr);
+			}
+			else if (!ip_input_nat_incoming(slot->input_dev, slot->nat_dev, ip_packet, slot->len, offload, slot->proto, nullptr))
+			{
+				ip_input_to_protocol(slot->input_dev, ip_packet, slot->len);
+			}
+			free(slot->large);
+			spsc_ring_release(ring);
+		}
+	}
+}
+
+/**
+ * NAT のアドレス変換を実行する
+ * @param ip_packet
  * @pram nat_dev
  * @param proto
  * @param direction
+ * @param offload 受信したパケットのチェックサムオフロードの情報 (nullable)
  * @return
  */
-bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protocol proto, nat_direction direction)
+bool nat_exec(ip_header *ip_packet, nat_device *nat_dev, nat_protocol proto, nat_direction direction, const net_offload *offload)
 {
+	LATENCY_STAGE(nat_exec);
+
 	// TODO: ip_packet のペイロードは、そのまま nat_packet_head にマッピングできる構造になっているのか？
 	auto *nat_packet = (nat_packet_head *)((uint8_t *)ip_packet + sizeof(ip_header));
 
@@ -81,7 +545,7 @@ bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protoco
 		if (proto == nat_protocol::icmp)
 		{
 			entry = get_nat_entry_by_global(
-					nat_dev->entries,
+					nat_dev,
 					proto,
 					ntohl(ip_packet->dest_addr),
 					ntohs(nat_packet->icmp.identify));
@@ -89,7 +553,7 @@ bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protoco
 		else
 		{
 			entry = get_nat_entry_by_global(
-					nat_dev->entries,
+					nat_dev,
 					proto,
 					ntohl(ip_packet->dest_addr),
 					ntohs(nat_packet->dest_port));
@@ -104,7 +568,7 @@ bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protoco
 		if (proto == nat_protocol::icmp)
 		{
 			entry = get_nat_entry_by_local(
-					nat_dev->entries,
+					nat_dev,
 					proto,
 					ntohl(ip_packet->src_addr),
 					ntohs(nat_packet->icmp.identify));
@@ -112,7 +576,7 @@ bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protoco
 		else
 		{
 			entry = get_nat_entry_by_local(
-					nat_dev->entries,
+					nat_dev,
 					proto,
 					ntohl(ip_packet->src_addr),
 					ntohs(nat_packet->src_port));
@@ -120,248 +584,490 @@ bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protoco
 
 		if (entry == nullptr)
 		{
-			entry = create_nat_entry(nat_dev->entries, proto);
-			if (entry == nullptr)
+			uint16_t local_port;
+			if (proto == nat_protocol::icmp)
+			{
+				local_port = ntohs(nat_packet->icmp.identify);
+			}
+			else
+			{
+				local_port = ntohs(nat_packet->src_port);
+			}
+
+			// 送信元が新しいセッションを作りすぎていたら、ポートを割り当てない
+			if (nat_dev->policer != nullptr and !policer_admit_session(nat_dev->policer, ntohl(ip_packet->src_addr)))
 			{
-				LOG_NAT("NAT table is full!\n");
+				LOG_NAT("Too many new sessions from %s\n", log_htoa(ntohl(ip_packet->src_addr)));
+				count_drop(nullptr, drop_reason::rate_limited);
 				return false;
 			}
-			LOG_NAT("Created new nat table entry global port %d\n", entry->global_port);
-			entry->global_addr = nat_dev->outside_addr;
-			entry->local_addr = ntohl(ip_packet->src_addr);
-			if (proto == nat_protocol::icmp)
+
+			entry = create_nat_entry(nat_dev, proto, ntohl(ip_packet->src_addr), local_port);
+			if (entry == nullptr)
 			{
-				entry->local_port = ntohs(nat_packet->icmp.identify);
+				LOG_WARN(NAT, "NAT table is full!\n");
+				count_drop(nullptr, drop_reason::nat_full);
+				return false;
 			}
-			else
+			LOG_NAT("Created new nat table entry %s:%d\n", log_htoa(entry->global_addr), entry->global_port);
+
+			// SYN 以外で始まったセッションは、途中から引き継いだものとして確立済みとみなす
+			if (proto == nat_protocol::tcp and !(nat_packet->tcp.flag & TCP_FLAG_SYN))
 			{
-				entry->local_port = ntohs(nat_packet->src_port);
+				entry->tcp_state = nat_tcp_state::established;
 			}
 		}
 	}
 
-	uint32_t checksum;
-	if (proto == nat_protocol::icmp)
+	update_nat_session(entry->block->subscriber->shard, entry, nat_packet, direction);
+
+	// 書き換えるフィールドの、書き換え前と書き換え後の値 (ネットワークバイトオーダー)
+	uint32_t old_addr, new_addr;
+	uint16_t old_port, new_port;
+	if (direction == nat_direction::incoming)
 	{
-		checksum = nat_packet->icmp.header.checksum;
-		checksum = ~checksum;
-		checksum -= nat_packet->icmp.identify;
-		if (direction == nat_direction::incoming)
-		{
-			checksum += htons(entry->local_port);
-		}
-		else
-		{
-			checksum += htons(entry->global_port);
-		}
+		old_addr = ip_packet->dest_addr;
+		new_addr = htonl(entry->local_addr);
+		old_port = proto == nat_protocol::icmp ? nat_packet->icmp.identify : nat_packet->dest_port;
+		new_port = htons(entry->local_port);
 	}
 	else
 	{
-		if (proto == nat_protocol::udp)
-		{
-			checksum = nat_packet->udp.checksum;
-		}
-		else
-		{
-			checksum = nat_packet->tcp.checksum;
-		}
-		checksum = ~checksum;
-
-		// checksum の差分計算
-		if (direction == nat_direction::incoming)
-		{
-			checksum -= ip_packet->dest_addr & 0xffff;
-			checksum -= ip_packet->dest_addr >> 16;
-			checksum -= nat_packet->dest_port;
-			checksum += htonl(entry->local_addr) & 0xffff;
-			checksum += htonl(entry->local_addr) >> 16;
-			checksum += htons(entry->local_port);
-		}
-		else
-		{
-			checksum -= ip_packet->src_addr & 0xffff;
-			checksum -= ip_packet->src_addr >> 16;
-			checksum -= nat_packet->src_port;
-			checksum += htonl(entry->global_addr) & 0xffff;
-			checksum += htonl(entry->global_addr) >> 16;
-			checksum += htons(entry->global_port);
-		}
+		old_addr = ip_packet->src_addr;
+		new_addr = htonl(entry->global_addr);
+		old_port = proto == nat_protocol::icmp ? nat_packet->icmp.identify : nat_packet->src_port;
+		new_port = htons(entry->global_port);
 	}
-	checksum = ~checksum;
 
-	if (checksum > 0xffff)
+	// チェックサムの差分更新
+	// TCP と UDP は疑似ヘッダのアドレスもチェックサムに含む。ICMP は ID だけ
+	uint32_t addr_diff = checksum_diff_32(old_addr, new_addr);
+	uint32_t port_diff = checksum_diff_16(old_port, new_port);
+	if (offload != nullptr and (offload->flags & NET_OFFLOAD_NEEDS_CSUM) and proto != nat_protocol::icmp)
 	{
-		checksum = (checksum & 0xffff) + (checksum >> 16);
+		// チェックサムは送信時に計算されるので、疑似ヘッダのアドレスの差分だけを反映する
+		uint16_t *checksum = proto == nat_protocol::udp ? &nat_packet->udp.checksum : &nat_packet->tcp.checksum;
+		*checksum = checksum_adjust_partial(*checksum, addr_diff);
 	}
-
-	if (proto == nat_protocol::icmp)
+	else if (proto == nat_protocol::icmp)
 	{
-		nat_packet->icmp.header.checksum = checksum;
+		nat_packet->icmp.header.checksum = checksum_adjust(nat_packet->icmp.header.checksum, port_diff);
 	}
 	else if (proto == nat_protocol::udp)
 	{
-		nat_packet->udp.checksum = checksum;
-	}
-	else if (proto == nat_protocol::tcp)
-	{
-		nat_packet->tcp.checksum = checksum;
+		nat_packet->udp.checksum = checksum_adjust_udp(nat_packet->udp.checksum, addr_diff + port_diff);
 	}
 	else
 	{
-		return false;
+		nat_packet->tcp.checksum = checksum_adjust(nat_packet->tcp.checksum, addr_diff + port_diff);
 	}
+	ip_packet->header_checksum = checksum_adjust(ip_packet->header_checksum, addr_diff);
 
 	if (direction == nat_direction::incoming)
 	{
-		ip_packet->dest_addr = htonl(entry->local_addr);
+		ip_packet->dest_addr = new_addr;
 		if (proto == nat_protocol::icmp)
 		{
-			nat_packet->icmp.identify = htons(entry->local_port);
+			nat_packet->icmp.identify = new_port;
 		}
 		else
 		{
-			nat_packet->dest_port = htons(entry->local_port);
+			nat_packet->dest_port = new_port;
 		}
 	}
 	else
 	{
-		ip_packet->src_addr = htonl(nat_dev->outside_addr);
+		ip_packet->src_addr = new_addr;
 		if (proto == nat_protocol::icmp)
 		{
-			nat_packet->icmp.identify = htons(entry->global_port);
+			nat_packet->icmp.identify = new_port;
 		}
 		else
 		{
-			nat_packet->src_port = htons(entry->global_port);
+			nat_packet->src_port = new_port;
 		}
 	}
 
-	// IP Header のヘッダチェックサムの再計算
-	ip_packet->header_checksum = 0;
-	ip_packet->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(ip_packet), sizeof(ip_header), 0);
-
 	return true;
 }
 
+/**
+ * 外側アドレスのプールに含まれるアドレスか
+ * @param nat_dev
+ * @param addr
+ * @return
+ */
+bool is_nat_global_address(nat_device *nat_dev, uint32_t addr)
+{
+	return addr - nat_dev->outside_addr < nat_dev->outside_addr_count;
+}
+
 /**
  * get NAT entry by global address & port
+ * (外側アドレスの番号, ポート) からブロックとエントリを直接引く
+ * @param nat_dev
+ * @param proto
+ * @param addr
+ * @param port
+ * @return
+ */
+nat_entry *get_nat_entry_by_global(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port)
+{
+	// 変換に使っている範囲外のアドレスやポート宛なら NAT の対象ではない
+	if (!is_nat_global_address(nat_dev, addr) or port < NAT_GLOBAL_PORT_MIN)
+	{
+		return nullptr;
+	}
+
+	// ポートの範囲はブロックでちょうど埋まるので、ブロックの番号は範囲外にならない
+	uint32_t offset = port - NAT_GLOBAL_PORT_MIN;
+	uint32_t address_index = addr - nat_dev->outside_addr;
+	nat_entries *shard = nat_dev->shards[get_nat_shard_by_global(nat_dev, port)];
+	nat_port_block *block = shard->blocks[static_cast<int>(proto)][address_index * NAT_BLOCKS_PER_ADDRESS + offset / NAT_PORT_BLOCK_SIZE];
+	if (block == nullptr)
+	{
+		return nullptr;
+	}
+	return block->entries[offset % NAT_PORT_BLOCK_SIZE];
+}
+
+/**
+ * local 側のハッシュテーブルでバケットの位置を求める
+ * @param addr
+ * @param port
+ * @return
+ */
+uint32_t nat_local_hash(uint32_t addr, uint16_t port)
+{
+	uint32_t hash = addr ^ ((uint32_t)port << 16 | port);
+	hash *= 0x9e3779b1; // 黄金比由来の定数で上位ビットに撹拌する
+	return hash >> (32 - NAT_LOCAL_HASH_BITS);
+}
+
+/**
+ * プロトコルに対応する local 側ハッシュテーブルのバケットを返す
  * @param entries
  * @param proto
  * @param addr
  * @param port
  * @return
  */
-nat_entry *get_nat_entry_by_global(nat_entries *entries, nat_protocol proto, uint32_t addr, uint16_t port)
+nat_entry **get_nat_local_bucket(nat_entries *entries, nat_protocol proto, uint32_t addr, uint16_t port)
+{
+	return &entries->local_hash[static_cast<int>(proto)][nat_local_hash(addr, port)];
+}
+
+/**
+ * get NAT entry by local address & port
+ * @param nat_dev
+ * @param proto
+ * @param addr
+ * @param port
+ * @return
+ */
+nat_entry *get_nat_entry_by_local(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port)
 {
-	if (proto == nat_protocol::udp)
+	nat_entries *shard = nat_dev->shards[get_nat_shard_by_local(nat_dev, addr)];
+	for (nat_entry *entry = *get_nat_local_bucket(shard, proto, addr, port); entry; entry = entry->local_next)
 	{
-		if (entries->udp[port - NAT_GLOBAL_PORT_MIN].global_addr == addr and entries->udp[port - NAT_GLOBAL_PORT_MIN].global_port == port)
+		if (entry->local_addr == addr and entry->local_port == port)
 		{
-			return &entries->udp[port - NAT_GLOBAL_PORT_MIN];
+			return entry;
 		}
 	}
-	else if (proto == nat_protocol::tcp)
+	return nullptr;
+}
+
+/**
+ * 外側のアドレスとポートで引いたエントリが、指定した番号のセッションのままか確かめる
+ * フローキャッシュが、覚えているセッションが削除 (と再利用) されていないか調べるのに使う
+ * @param nat_dev
+ * @param proto
+ * @param addr
+ * @param port
+ * @param sequence
+ * @return 同じセッションが残っていなければ nullptr
+ */
+nat_entry *get_nat_entry_by_sequence(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port, uint64_t sequence)
+{
+	nat_entry *entry = get_nat_entry_by_global(nat_dev, proto, addr, port);
+	if (entry == nullptr or entry->sequence != sequence)
+	{
+		return nullptr;
+	}
+	return entry;
+}
+
+/**
+ * 加入者を探す。なければ作成する
+ * @param entries
+ * @param local_addr
+ * @return 作成できなければ nullptr
+ */
+nat_subscriber *get_nat_subscriber(nat_entries *entries, uint32_t local_addr)
+{
+	nat_subscriber **bucket = &entries->subscribers[(local_addr * 0x9e3779b1) >> (32 - NAT_SUBSCRIBER_HASH_BITS)];
+	for (nat_subscriber *subscriber = *bucket; subscriber; subscriber = subscriber->next)
 	{
-		if (entries->tcp[port - NAT_GLOBAL_PORT_MIN].global_addr == addr and entries->tcp[port - NAT_GLOBAL_PORT_MIN].global_port == port)
+		if (subscriber->local_addr == local_addr)
 		{
-			return &entries->tcp[port - NAT_GLOBAL_PORT_MIN];
+			return subscriber;
 		}
 	}
-	else if (proto == nat_protocol::icmp)
+
+	auto *subscriber = (nat_subscriber *)persist_calloc(1, sizeof(nat_subscriber));
+	if (subscriber == nullptr)
+	{
+		return nullptr;
+	}
+	subscriber->local_addr = local_addr;
+	subscriber->shard = entries;
+	subscriber->next = *bucket;
+	*bucket = subscriber;
+	return subscriber;
+}
+
+/**
+ * ブロックを持っていない加入者を削除する
+ * @param entries
+ * @param subscriber
+ */
+void release_nat_subscriber_if_unused(nat_entries *entries, nat_subscriber *subscriber)
+{
+	for (int proto = 0; proto < NAT_PROTOCOL_NUM; ++proto)
 	{
-		if (entries->icmp[port].global_addr == addr and entries->icmp[port].global_port == port)
+		if (subscriber->blocks[proto] != nullptr)
 		{
-			return &entries->icmp[port];
+			return;
 		}
 	}
-	return nullptr;
+
+	nat_subscriber **link = &entries->subscribers[(subscriber->local_addr * 0x9e3779b1) >> (32 - NAT_SUBSCRIBER_HASH_BITS)];
+	while (*link != nullptr)
+	{
+		if (*link == subscriber)
+		{
+			*link = subscriber->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	persist_free(subscriber);
 }
 
 /**
- * get NAT entry by local address & port
- * @param entries
+ * 加入者にポートブロックを割り当てる
+ * 加入者が既に使っている外側アドレスを優先し、なければ他のアドレスから探す
+ * @param nat_dev
+ * @param subscriber
  * @param proto
- * @param addr
- * @param port
- * @return
+ * @return 割り当てたブロック。割り当てられなければ nullptr
  */
-nat_entry *get_nat_entry_by_local(nat_entries *entries, nat_protocol proto, uint32_t addr, uint16_t port)
+nat_port_block *allocate_nat_port_block(nat_device *nat_dev, nat_subscriber *subscriber, nat_protocol proto)
 {
-	if (proto == nat_protocol::udp)
+	nat_entries *entries = subscriber->shard;
+	int p = static_cast<int>(proto);
+	if (subscriber->block_count[p] >= NAT_MAX_BLOCKS_PER_SUBSCRIBER)
+	{
+		return nullptr;
+	}
+
+	// 同じ加入者の通信はなるべく同じ外側アドレスから出す (RFC 4787 の paired pooling)
+	uint32_t preferred = (subscriber->local_addr * 0x9e3779b1) % nat_dev->outside_addr_count;
+	for (int i = 0; i < NAT_PROTOCOL_NUM; ++i)
 	{
-		for (int i = 0; i < NAT_GLOBAL_PORT_SIZE; ++i)
+		if (subscriber->blocks[i] != nullptr)
 		{
-			if (entries->tcp[i].local_addr == addr and entries->tcp[i].local_port == port)
-			{
-				return &entries->udp[i];
-			}
+			preferred = subscriber->blocks[i]->address_index;
+			break;
 		}
 	}
-	else if (proto == nat_protocol::tcp)
+
+	for (uint32_t i = 0; i < nat_dev->outside_addr_count; ++i)
 	{
-		for (int i = 0; i < NAT_GLOBAL_PORT_SIZE; ++i)
+		uint32_t address_index = (preferred + i) % nat_dev->outside_addr_count;
+		int32_t index = port_pool_alloc(&entries->block_pools[p][address_index], random_u32());
+		if (index == -1)
 		{
-			if (entries->tcp[i].local_addr == addr and entries->tcp[i].local_port == port)
-			{
-				return &entries->tcp[i];
-			}
+			continue;
 		}
+
+		auto *block = (nat_port_block *)persist_calloc(1, sizeof(nat_port_block));
+		if (block == nullptr)
+		{
+			port_pool_release(&entries->block_pools[p][address_index], index);
+			return nullptr;
+		}
+		block->subscriber = subscriber;
+		block->proto = proto;
+		block->address_index = address_index;
+		block->index = index;
+		block->global_addr = nat_dev->outside_addr + address_index;
+		block->first_port = NAT_GLOBAL_PORT_MIN + index * NAT_PORT_BLOCK_SIZE;
+		block->next = subscriber->blocks[p];
+		subscriber->blocks[p] = block;
+		subscriber->block_count[p]++;
+		entries->blocks[p][address_index * NAT_BLOCKS_PER_ADDRESS + index] = block;
+		entries->block_count[p]++;
+
+		LOG_INFO(NAT, "Allocated %s port block %s:%d-%d to %s\n", nat_protocol_name(proto), log_htoa(block->global_addr), block->first_port, block->first_port + NAT_PORT_BLOCK_SIZE - 1, log_htoa(subscriber->local_addr));
+		return block;
 	}
-	else if (proto == nat_protocol::icmp)
+	return nullptr;
+}
+
+/**
+ * 使われなくなったポートブロックを解放する
+ * @param block
+ */
+void release_nat_port_block(nat_port_block *block)
+{
+	nat_subscriber *subscriber = block->subscriber;
+	nat_entries *entries = subscriber->shard;
+	int p = static_cast<int>(block->proto);
+
+	LOG_INFO(NAT, "Released %s port block %s:%d-%d from %s\n", nat_protocol_name(block->proto), log_htoa(block->global_addr), block->first_port, block->first_port + NAT_PORT_BLOCK_SIZE - 1, log_htoa(subscriber->local_addr));
+
+	nat_port_block **link = &subscriber->blocks[p];
+	while (*link != nullptr)
 	{
-		for (int i = 0; i < NAT_ICMP_ID_SIZE; ++i)
+		if (*link == block)
 		{
-			if (entries->icmp[i].local_addr == addr and entries->icmp[i].local_port == port)
-			{
-				return &entries->icmp[i];
-			}
+			*link = block->next;
+			break;
 		}
+		link = &(*link)->next;
 	}
-	return nullptr;
+	subscriber->block_count[p]--;
+
+	entries->blocks[p][block->address_index * NAT_BLOCKS_PER_ADDRESS + block->index] = nullptr;
+	port_pool_release(&entries->block_pools[p][block->address_index], block->index);
+	entries->block_count[p]--;
+	persist_free(block);
+
+	release_nat_subscriber_if_unused(entries, subscriber);
 }
 
 /**
- * 空いてるポートを探し、NAT エントリを作成する
- * @param entries
+ * 加入者のブロックから空いてるポートを確保し、NAT エントリを作成する
+ * ブロックに空きがなければ、新しいブロックを割り当てる
+ * 作成したエントリは local 側のハッシュテーブルにも登録する
+ * @param nat_dev
  * @param proto
+ * @param local_addr
+ * @param local_port
  * @return
  */
-nat_entry *create_nat_entry(nat_entries *entries, nat_protocol proto)
+nat_entry *create_nat_entry(nat_device *nat_dev, nat_protocol proto, uint32_t local_addr, uint16_t local_port)
 {
-	if (proto == nat_protocol::udp)
+	nat_entries *entries = nat_dev->shards[get_nat_shard_by_local(nat_dev, local_addr)];
+	int p = static_cast<int>(proto);
+	nat_subscriber *subscriber = get_nat_subscriber(entries, local_addr);
+	if (subscriber == nullptr)
+	{
+		return nullptr;
+	}
+
+	// 空いているポートをランダムに選ぶ
+	int32_t index = -1;
+	nat_port_block *block;
+	for (block = subscriber->blocks[p]; block; block = block->next)
 	{
-		for (int i = 0; i < NAT_GLOBAL_PORT_SIZE; ++i)
+		index = port_pool_alloc(&block->ports, random_u32());
+		if (index != -1)
 		{
-			if (entries->udp[i].global_addr == 0)
-			{
-				entries->udp[i].global_port = NAT_GLOBAL_PORT_MIN + i;
-				return &entries->udp[i];
-			}
+			break;
 		}
 	}
-	else if (proto == nat_protocol::tcp)
+
+	if (block == nullptr)
 	{
-		for (int i = 0; i < NAT_GLOBAL_PORT_SIZE; ++i)
+		block = allocate_nat_port_block(nat_dev, subscriber, proto);
+		if (block == nullptr)
 		{
-			if (entries->tcp[i].global_addr == 0)
-			{
-				entries->tcp[i].global_port = NAT_GLOBAL_PORT_MIN + i;
-				return &entries->tcp[i];
-			}
+			// 空いているブロックなし
+			release_nat_subscriber_if_unused(entries, subscriber);
+			return nullptr;
 		}
+		index = port_pool_alloc(&block->ports, random_u32());
 	}
-	else if (proto == nat_protocol::icmp)
+
+	auto *entry = (nat_entry *)persist_calloc(1, sizeof(nat_entry));
+	if (entry == nullptr)
 	{
-		for (int i = 0; i < NAT_ICMP_ID_SIZE; ++i)
+		// 確保したポートを戻し、このために割り当てたブロックなら解放する
+		port_pool_release(&block->ports, index);
+		if (block->ports.used == 0)
 		{
-			if (entries->icmp[i].global_addr == 0)
-			{
-				// TODO: ICMP の場合だけ、TCP, UDP のように SIZE を足さないのはなぜ？PORT を使わないプロトコルだから？TCP, UDP は well known port と被らないように足している？
-				entries->icmp[i].global_port = i;
-				return &entries->icmp[i];
-			}
+			release_nat_port_block(block);
 		}
+		return nullptr;
+	}
+	entry->global_addr = block->global_addr;
+	entry->global_port = block->first_port + index;
+	entry->local_addr = local_addr;
+	entry->local_port = local_port;
+	entry->proto = proto;
+	entry->tcp_state = nat_tcp_state::syn_sent;
+	entry->tcp_fin_seen = 0;
+	entry->last_seen = entries->timer.current_tick;
+	entry->block = block;
+	entry->sequence = ++entries->next_sequence;
+	block->entries[index] = entry;
+	entries->session_count[p]++;
+
+	// local 側ハッシュテーブルのバケットの先頭に登録
+	nat_entry **bucket = get_nat_local_bucket(entries, proto, local_addr, local_port);
+	entry->local_next = *bucket;
+	*bucket = entry;
+
+	timer_wheel_add(&entries->timer, &entry->timer, entry->last_seen + get_nat_entry_timeout(entry));
+	emit_nat_event(nat_event_type::create, entry);
+
+	return entry;
+}
+
+/**
+ * パケットの通過をセッションに記録する (フローキャッシュから転送したとき用)
+ * @param entry
+ */
+void touch_nat_entry(nat_entry *entry)
+{
+	entry->last_seen = entry->block->subscriber->shard->timer.current_tick;
+}
+
+/**
+ * NAT エントリを削除し、ポートを解放する
+ * ブロックのポートが全て空いたら、ブロックも解放する
+ * @param entry
+ */
+void delete_nat_entry(nat_entry *entry)
+{
+	nat_entries *entries = entry->block->subscriber->shard;
+	emit_nat_event(nat_event_type::remove, entry);
+	timer_wheel_remove(&entry->timer);
+
+	// local 側ハッシュテーブルから外す
+	nat_entry **link = get_nat_local_bucket(entries, entry->proto, entry->local_addr, entry->local_port);
+	while (*link != nullptr)
+	{
+		if (*link == entry)
+		{
+			*link = entry->local_next;
+			break;
+		}
+		link = &(*link)->local_next;
+	}
+
+	nat_port_block *block = entry->block;
+	uint32_t index = entry->global_port - block->first_port;
+	block->entries[index] = nullptr;
+	port_pool_release(&block->ports, index);
+	entries->session_count[static_cast<int>(entry->proto)]--;
+	persist_free(entry);
+
+	if (block->ports.used == 0)
+	{
+		release_nat_port_block(block);
 	}
-	// 空いているエントリなし
-	return nullptr;
 }
@@ -2,15 +2,52 @@
 #define CURO_NAT_H
 
 #include <iostream>
+#include "ethernet.h"
 #include "icmp.h"
 #include "ip.h"
+#include "net.h"
+#include "port_pool.h"
+#include "spsc_ring.h"
+#include "timer_wheel.h"
+#include "worker.h"
 
-#define NAT_GLOBAL_PORT_MIN 20000
-#define NAT_GLOBAL_PORT_MAX 59999
+// ICMP の ID も同じ範囲から割り当てる
+#define NAT_GLOBAL_PORT_MIN 1024
+#define NAT_GLOBAL_PORT_MAX 65535
 
 #define NAT_GLOBAL_PORT_SIZE (NAT_GLOBAL_PORT_MAX - NAT_GLOBAL_PORT_MIN + 1)
 
-#define NAT_ICMP_ID_SIZE 0xffff
+#define NAT_PORT_BLOCK_SIZE 512 // 加入者に割り当てるポートブロックの大きさ
+#define NAT_BLOCKS_PER_ADDRESS (NAT_GLOBAL_PORT_SIZE / NAT_PORT_BLOCK_SIZE) // 外側アドレス 1 つあたりのブロック数
+// 変換に使うポートの範囲がブロックでちょうど埋まり、範囲内のポートは必ずどれかのブロックに入る
+static_assert(NAT_GLOBAL_PORT_SIZE % NAT_PORT_BLOCK_SIZE == 0, "NAT port range must be a multiple of the port block size");
+#define NAT_MAX_BLOCKS_PER_SUBSCRIBER 4 // 加入者 1 人がプロトコルごとに持てるブロック数
+#define NAT_ADDRESS_POOL_MAX 256 // 外側アドレスのプールの最大数
+
+#define NAT_SHARD_MAX WORKER_MAX // NAT テーブルの最大分割数
+#define NAT_HANDOFF_RING_SIZE 256 // ワーカー間で受け渡すパケットのリングの大きさ
+#define NAT_HANDOFF_BUFFER_SIZE 1600
+
+#define NAT_SUBSCRIBER_HASH_BITS 12
+#define NAT_SUBSCRIBER_HASH_SIZE (1 << NAT_SUBSCRIBER_HASH_BITS)
+
+// セッションのアイドルタイムアウト (秒)
+// TCP の値は RFC 5382、UDP の値は RFC 4787 の推奨値
+#define NAT_ICMP_TIMEOUT 60
+#define NAT_UDP_TIMEOUT 300
+#define NAT_TCP_ESTABLISHED_TIMEOUT 7440
+#define NAT_TCP_TRANSITORY_TIMEOUT 240
+#define NAT_TCP_CLOSED_TIMEOUT 10
+
+#define NAT_TIMER_TICK_MS 1000 // セッションのタイマーの 1 tick
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_ACK 0x10
+
+#define NAT_LOCAL_HASH_BITS 16
+#define NAT_LOCAL_HASH_SIZE (1 << NAT_LOCAL_HASH_BITS) // local 側ハッシュテーブルのバケット数
 
 enum class nat_direction
 {
@@ -25,6 +62,8 @@ enum class nat_protocol
 	icmp
 };
 
+#define NAT_PROTOCOL_NUM 3
+
 struct nat_packet_head
 {
 	union
@@ -61,35 +100,136 @@ struct nat_packet_head
 	};
 };
 
+// フラグから追跡する TCP の状態
+enum class nat_tcp_state : uint8_t
+{
+	syn_sent, // 内側からの SYN のみ
+	established, // 外側からも SYN が返ってきた
+	fin_wait, // 片方向の FIN
+	time_wait, // 両方向の FIN
+	closed // RST
+};
+
+struct nat_port_block;
+struct nat_subscriber;
+struct nat_entries;
+struct src_policer;
+
 struct nat_entry
 {
 	uint32_t global_addr;
 	uint32_t local_addr;
 	uint16_t global_port;
 	uint16_t local_port;
+	nat_protocol proto;
+	nat_tcp_state tcp_state;
+	uint8_t tcp_fin_seen; // FIN を見た方向 (1 << nat_direction)
+	uint64_t last_seen; // 最後にパケットが通過した tick
+	timer_node timer; // アイドルタイムアウトのタイマー
+	nat_entry *local_next; // local 側ハッシュで同じバケットに入る次のエントリ
+	nat_port_block *block; // エントリのポートを含むブロック
+	uint64_t sequence; // シャードの中で作成した順の番号 (フローキャッシュが削除を検出するのに使う)
+};
+
+/**
+ * 加入者 (NAT の内側のアドレス) に割り当てた外側アドレスのポートの範囲
+ * ブロック単位で割り当てるので、ログもブロック単位で残せばマッピングを追える
+ */
+struct nat_port_block
+{
+	nat_subscriber *subscriber;
+	nat_protocol proto;
+	uint16_t address_index; // プール内の外側アドレスの番号
+	uint16_t index; // 外側アドレス内のブロックの番号
+	uint32_t global_addr; // 外側アドレス
+	uint16_t first_port; // ブロックの先頭のポート
+	port_pool<NAT_PORT_BLOCK_SIZE> ports; // 使用中のポート
+	nat_entry *entries[NAT_PORT_BLOCK_SIZE]; // ポートごとのエントリ
+	nat_port_block *next; // 同じ加入者の次のブロック
 };
 
-// ICMP, UDP, TCP の NAT テーブルセット
+// NAT の内側のアドレスごとの、割り当て済みブロックのリスト
+struct nat_subscriber
+{
+	uint32_t local_addr;
+	uint32_t block_count[NAT_PROTOCOL_NUM];
+	nat_port_block *blocks[NAT_PROTOCOL_NUM];
+	nat_entries *shard; // 加入者を管理するシャード
+	nat_subscriber *next; // 同じバケットの次の加入者
+};
+
+// ICMP, UDP, TCP の NAT テーブルセット (シャード)
+// シャードはワーカーごとに分かれていて、担当のワーカーだけが読み書きする
+// global 側は (外側アドレスの番号, ポート) からブロックを直接引き、local 側は (local_addr, local_port) のハッシュで引く
+// エントリとブロックは使用中の分だけ確保する
 struct nat_entries
 {
-	nat_entry icmp[NAT_ICMP_ID_SIZE];
-	nat_entry udp[NAT_GLOBAL_PORT_SIZE];
-	nat_entry tcp[NAT_GLOBAL_PORT_SIZE];
+	nat_port_block **blocks[NAT_PROTOCOL_NUM]; // [外側アドレスの番号 * NAT_BLOCKS_PER_ADDRESS + ブロックの番号]
+	port_pool<NAT_BLOCKS_PER_ADDRESS> *block_pools[NAT_PROTOCOL_NUM]; // 外側アドレスごとの使用中のブロック
+	nat_entry *local_hash[NAT_PROTOCOL_NUM][NAT_LOCAL_HASH_SIZE];
+	nat_subscriber *subscribers[NAT_SUBSCRIBER_HASH_SIZE];
+	uint32_t session_count[NAT_PROTOCOL_NUM];
+	uint32_t block_count[NAT_PROTOCOL_NUM];
+	timer_wheel timer; // セッションのアイドルタイムアウト
+	uint64_t next_sequence; // 次に作成するエントリの番号
 };
 
 // NAT の内側の ip_device がもつ NAT デバイス
+// テーブルは加入者 (local 側のアドレス) のハッシュでシャードに分け、各シャードは外側のブロック番号が
+// シャード数で割った余りと一致するブロックだけを使う。どちらの向きのパケットも担当のシャードが 1 つに決まる
 struct nat_device
 {
-	uint32_t outside_addr; // NAT の外側の IP アドレス
-	nat_entries *entries;	 // NAT テーブル
+	uint32_t outside_addr; // NAT の外側の IP アドレス (プールの先頭)
+	uint32_t outside_addr_count; // プールの外側アドレスの数 (outside_addr から連続)
+	uint32_t shard_count; // NAT テーブルのシャード数
+	nat_entries *shards[NAT_SHARD_MAX]; // NAT テーブル
+	src_policer *policer; // 新しいセッションを作るレートの制限 (プロセスごとの状態なので、設定のたびに設定し直す)
+};
+
+// 担当でないワーカーが受信したパケットを、担当のワーカーに渡すためのスロット
+// スロットより大きい GSO のパケットは、ヒープに確保した領域で渡す
+struct nat_handoff_packet
+{
+	net_device *input_dev;
+	nat_device *nat_dev;
+	nat_protocol proto;
+	nat_direction direction;
+	uint32_t len;
+	bool has_offload;
+	net_offload offload;
+	uint8_t *large; // buffer に入らないパケット (先頭に ETHERNET_HEADER_SIZE の余白を取って malloc し、受け取った側が解放する。nullable)
+	uint8_t headroom[ETHERNET_HEADER_SIZE]; // ICMP のエコー応答をその場で送信するときに Ethernet ヘッダを書き込む余白
+	uint8_t buffer[NAT_HANDOFF_BUFFER_SIZE];
 };
 
 void dump_nat_tables();
 
-bool nat_exec(ip_header *ip_packet, size_t len, nat_device *nat_dev, nat_protocol proto, nat_direction direction);
+void dump_nat_pool_usage();
+
+bool get_nat_protocol(uint8_t protocol_num, nat_protocol *proto);
+
+bool nat_exec(ip_header *ip_packet, nat_device *nat_dev, nat_protocol proto, nat_direction direction, const net_offload *offload = nullptr);
+
+extern uint64_t nat_handoff_count[WORKER_MAX];
+extern uint64_t nat_handoff_drop_count[WORKER_MAX];
+
+bool nat_handoff(nat_device *nat_dev, net_device *input_dev, ip_header *ip_packet, size_t len, const net_offload *offload, nat_protocol proto, nat_direction direction);
+void nat_handoff_poll();
+
+bool is_nat_global_address(nat_device *nat_dev, uint32_t addr);
+
+uint32_t get_nat_shard_by_local(nat_device *nat_dev, uint32_t local_addr);
+uint32_t get_nat_shard_by_global(nat_device *nat_dev, uint16_t port);
+
+nat_entry *get_nat_entry_by_global(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port);
+nat_entry *get_nat_entry_by_local(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port);
+nat_entry *get_nat_entry_by_sequence(nat_device *nat_dev, nat_protocol proto, uint32_t addr, uint16_t port, uint64_t sequence);
+nat_entry *create_nat_entry(nat_device *nat_dev, nat_protocol proto, uint32_t local_addr, uint16_t local_port);
+void delete_nat_entry(nat_entry *entry);
+void touch_nat_entry(nat_entry *entry);
 
-nat_entry *get_nat_entry_by_global(nat_entries *entries, nat_protocol proto, uint32_t addr, uint16_t port);
-nat_entry *get_nat_entry_by_local(nat_entries *entries, nat_protocol proto, uint32_t addr, uint16_t port);
-nat_entry *create_nat_entry(nat_entries *entries, nat_protocol proto);
+void init_nat_device(nat_device *nat_dev, uint32_t outside_addr, uint32_t outside_addr_count, uint32_t shard_count);
+void restore_nat_device(nat_device *nat_dev);
+void nat_timer();
 
 #endif
@@ -0,0 +1,317 @@
+#include "nat_event.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <new>
+#include <thread>
+#include <unistd.h>
+#include "log.h"
+#include "napt.h"
+#include "utils.h"
+
+#ifdef CURO_ZLIB
+#include <zlib.h>
+#define NAT_EVENT_FILE_SUFFIX ".gz"
+typedef gzFile nat_event_file;
+#else
+#define NAT_EVENT_FILE_SUFFIX ""
+typedef FILE *nat_event_file;
+#endif
+
+#define NAT_EVENT_BATCH_SIZE 2048 // 1 回の書き込みにまとめるイベント数
+
+nat_event_worker nat_event_workers[WORKER_MAX];
+std::atomic<bool> nat_event_enabled{false};
+uint64_t nat_event_realtime_offset_ns = 0; // current_time_ns から UNIX 時刻への差
+
+char nat_event_path[NAT_EVENT_PATH_LEN];
+uint64_t nat_event_file_size = 0;
+uint32_t nat_event_file_count = 1;
+std::atomic<uint32_t> nat_event_file_index{0}; // 次に開くファイルの番号 (再起動しても続きから数える)
+uint32_t nat_event_first_file_index = 0; // このプロセスで最初に開いたファイルの番号
+nat_event_file nat_event_current_file = nullptr;
+uint64_t nat_event_current_bytes = 0; // 今のファイルに書き込んだ圧縮前の長さ
+std::atomic<uint64_t> nat_event_written{0};
+
+std::thread nat_event_thread;
+std::atomic<bool> nat_event_running{false};
+
+/**
+ * セッションの作成か削除をこのワーカーのリングに書き込む
+ * @param type
+ * @param entry
+ */
+void emit_nat_event(nat_event_type type, const nat_entry *entry)
+{
+	if (!nat_event_enabled.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+
+	nat_event_worker *worker = &nat_event_workers[worker_id];
+	nat_event *event = spsc_ring_reserve(worker->ring);
+	if (event == nullptr)
+	{
+		worker->dropped.store(worker->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	event->time_ns = current_time_ns() + nat_event_realtime_offset_ns;
+	event->local_addr = entry->local_addr;
+	event->global_addr = entry->global_addr;
+	event->local_port = entry->local_port;
+	event->global_port = entry->global_port;
+	event->proto = static_cast<uint8_t>(entry->proto);
+	event->type = type;
+	event->tcp_state = static_cast<uint8_t>(entry->tcp_state);
+	event->worker = worker_id;
+	spsc_ring_commit(worker->ring);
+	worker->emitted.store(worker->emitted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void write_nat_event_file(const void *data, size_t len)
+{
+#ifdef CURO_ZLIB
+	gzwrite(nat_event_current_file, data, len);
+#else
+	fwrite(data, 1, len, nat_event_current_file);
+#endif
+	nat_event_current_bytes += len;
+}
+
+void close_nat_event_file()
+{
+	if (nat_event_current_file == nullptr)
+	{
+		return;
+	}
+#ifdef CURO_ZLIB
+	gzclose(nat_event_current_file);
+#else
+	fclose(nat_event_current_file);
+#endif
+	nat_event_current_file = nullptr;
+}
+
+/**
+ * 前のプロセスが書き出したファイルのうち、一番大きい番号の次を返す
+ * 再起動したときに、前のプロセスの記録を上書きしないようにする
+ * @return ファイルがなければ 0
+ */
+uint32_t find_next_nat_event_file_index()
+{
+	char dir_path[NAT_EVENT_PATH_LEN];
+	const char *base = strrchr(nat_event_path, '/');
+	if (base == nullptr)
+	{
+		strcpy(dir_path, ".");
+		base = nat_event_path;
+	}
+	else
+	{
+		snprintf(dir_path, sizeof(dir_path), "%.*s", static_cast<int>(base - nat_event_path), nat_event_path);
+		if (dir_path[0] == '\0')
+		{
+			strcpy(dir_path, "/");
+		}
+		base++;
+	}
+
+	DIR *dir = opendir(dir_path);
+	if (dir == nullptr)
+	{
+		return 0;
+	}
+	uint32_t next = 0;
+	size_t base_len = strlen(base);
+	for (dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+	{
+		// <base>-<番号>.bin(.gz) だけを数える
+		const char *name = entry->d_name;
+		if (strncmp(name, base, base_len) != 0 or name[base_len] != '-' or name[base_len + 1] < '0' or name[base_len + 1] > '9')
+		{
+			continue;
+		}
+		char *end;
+		unsigned long index = strtoul(name + base_len + 1, &end, 10);
+		if (strcmp(end, ".bin" NAT_EVENT_FILE_SUFFIX) == 0 and index + 1 > next and index < UINT32_MAX)
+		{
+			next = index + 1;
+		}
+	}
+	closedir(dir);
+	return next;
+}
+
+/**
+ * 次の番号のファイルを開き、ヘッダを書き込む
+ * 残すファイルの数を超えたら、一番古いファイルを消す
+ * @return
+ */
+bool open_nat_event_file()
+{
+	close_nat_event_file();
+
+	char path[NAT_EVENT_PATH_LEN + 32];
+	uint32_t index = nat_event_file_index.fetch_add(1);
+	snprintf(path, sizeof(path), "%s-%u.bin" NAT_EVENT_FILE_SUFFIX, nat_event_path, index);
+	// 既にあるファイルは上書きしない
+#ifdef CURO_ZLIB
+	nat_event_current_file = gzopen(path, "wbx");
+#else
+	nat_event_current_file = fopen(path, "wbx");
+#endif
+	if (nat_event_current_file == nullptr)
+	{
+		LOG_ERROR("Failed to open NAT event file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	nat_event_current_bytes = 0;
+
+	if (index >= nat_event_file_count)
+	{
+		snprintf(path, sizeof(path), "%s-%u.bin" NAT_EVENT_FILE_SUFFIX, nat_event_path, index - nat_event_file_count);
+		unlink(path);
+	}
+
+	nat_event_file_header header{};
+	memcpy(header.magic, NAT_EVENT_MAGIC, sizeof(header.magic));
+	header.version = NAT_EVENT_VERSION;
+	header.event_size = sizeof(nat_event);
+	write_nat_event_file(&header, sizeof(header));
+	return true;
+}
+
+/**
+ * 全てのワーカーのリングからイベントを集め、まとめてファイルに書き出す
+ * @return 書き出したイベントの数
+ */
+uint32_t drain_nat_events()
+{
+	static nat_event batch[NAT_EVENT_BATCH_SIZE];
+	uint32_t drained = 0;
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		spsc_ring<nat_event, NAT_EVENT_RING_SIZE> *ring = nat_event_workers[i].ring;
+		uint32_t count = 0;
+		nat_event *event;
+		while ((event = spsc_ring_peek(ring)) != nullptr)
+		{
+			batch[count++] = *event;
+			spsc_ring_release(ring);
+			if (count == NAT_EVENT_BATCH_SIZE or spsc_ring_peek(ring) == nullptr)
+			{
+				if (nat_event_current_bytes >= nat_event_file_size)
+				{
+					open_nat_event_file();
+				}
+				if (nat_event_current_file != nullptr)
+				{
+					write_nat_event_file(batch, count * sizeof(nat_event));
+					nat_event_written.fetch_add(count, std::memory_order_relaxed);
+				}
+				drained += count;
+				count = 0;
+			}
+		}
+	}
+	return drained;
+}
+
+/**
+ * イベントの記録を開始する
+ * @param path ファイル名の前半。<path>-<番号>.bin(.gz) に書き出す。番号は前のプロセスのファイルの続きから数える
+ * @param file_size 圧縮前の長さがこれを超えたら次のファイルに切り替える
+ * @param file_count 残すファイルの数 (超えたら古いものから消す)
+ * @return
+ */
+bool nat_event_log_init(const char *path, uint64_t file_size, uint32_t file_count)
+{
+	strncpy(nat_event_path, path, NAT_EVENT_PATH_LEN - 1);
+	nat_event_file_size = file_size;
+	nat_event_file_count = file_count == 0 ? 1 : file_count;
+	nat_event_first_file_index = find_next_nat_event_file_index();
+	nat_event_file_index.store(nat_event_first_file_index);
+
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		void *memory = aligned_alloc(alignof(spsc_ring<nat_event, NAT_EVENT_RING_SIZE>), sizeof(spsc_ring<nat_event, NAT_EVENT_RING_SIZE>));
+		if (memory == nullptr)
+		{
+			return false;
+		}
+		nat_event_workers[i].ring = new (memory) spsc_ring<nat_event, NAT_EVENT_RING_SIZE>();
+	}
+
+	timespec realtime{};
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	nat_event_realtime_offset_ns = (uint64_t)realtime.tv_sec * 1000000000 + realtime.tv_nsec - current_time_ns();
+
+	if (!open_nat_event_file())
+	{
+		return false;
+	}
+
+	nat_event_running.store(true);
+	nat_event_thread = std::thread([] {
+		uint64_t last_flush_ms = current_time_ms();
+		while (nat_event_running.load(std::memory_order_relaxed))
+		{
+			if (drain_nat_events() == 0)
+			{
+				usleep(10 * 1000);
+			}
+			// 止まったときに失うイベントが多くならないよう、圧縮の途中でも書き出す
+			if (current_time_ms() - last_flush_ms >= NAT_EVENT_FLUSH_MS and nat_event_current_file != nullptr)
+			{
+#ifdef CURO_ZLIB
+				gzflush(nat_event_current_file, Z_SYNC_FLUSH);
+#else
+				fflush(nat_event_current_file);
+#endif
+				last_flush_ms = current_time_ms();
+			}
+		}
+	});
+	nat_event_enabled.store(true);
+	return true;
+}
+
+/**
+ * 記録用のスレッドを止めて、残っているイベントを書き出す
+ */
+void nat_event_log_shutdown()
+{
+	nat_event_enabled.store(false);
+	if (!nat_event_running.exchange(false))
+	{
+		return;
+	}
+	nat_event_thread.join();
+	drain_nat_events();
+	close_nat_event_file();
+}
+
+/**
+ * イベントの記録の統計を出力
+ */
+void dump_nat_event_stats()
+{
+	if (!nat_event_running.load())
+	{
+		printf("NAT event log is not configured\n");
+		return;
+	}
+
+	uint64_t emitted = 0, dropped = 0;
+	for (uint32_t i = 0; i < worker_count; ++i)
+	{
+		emitted += nat_event_workers[i].emitted.load(std::memory_order_relaxed);
+		dropped += nat_event_workers[i].dropped.load(std::memory_order_relaxed);
+	}
+	printf("NAT event log to %s-*.bin" NAT_EVENT_FILE_SUFFIX ": %lu emitted, %lu dropped, %lu written, %u files\n",
+				 nat_event_path, emitted, dropped, nat_event_written.load(), nat_event_file_index.load() - nat_event_first_file_index);
+}
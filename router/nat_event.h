@@ -0,0 +1,66 @@
+#ifndef CURO_NAT_EVENT_H
+#define CURO_NAT_EVENT_H
+
+#include <atomic>
+#include <cstdint>
+#include "spsc_ring.h"
+#include "worker.h"
+
+/**
+ * NAPT のセッションの作成と削除の記録
+ * ワーカーは固定長のイベントを自分のリングに書き込むだけで、
+ * 記録用のスレッドがまとめてファイルに書き出す (zlib があれば gzip で圧縮する)
+ * リングが溢れたら、待たずにそのイベントを捨てて数える
+ *
+ * ファイルは nat_event_file_header の後に nat_event が並ぶ。値はホストバイトオーダー
+ */
+
+#define NAT_EVENT_RING_SIZE 16384 // ワーカーごとのリングのイベント数 (2 のべき乗)
+#define NAT_EVENT_FLUSH_MS 1000 // 溜まったイベントをファイルに書き出す間隔
+#define NAT_EVENT_PATH_LEN 128
+#define NAT_EVENT_MAGIC "CURONATE"
+#define NAT_EVENT_VERSION 1
+
+enum class nat_event_type : uint8_t
+{
+	create,
+	remove,
+};
+
+struct nat_event
+{
+	uint64_t time_ns; // UNIX 時刻
+	uint32_t local_addr;
+	uint32_t global_addr;
+	uint16_t local_port;
+	uint16_t global_port;
+	uint8_t proto; // nat_protocol
+	nat_event_type type;
+	uint8_t tcp_state; // 削除したときの nat_tcp_state
+	uint8_t worker;
+};
+
+struct nat_event_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+};
+
+struct nat_entry;
+
+struct alignas(64) nat_event_worker
+{
+	spsc_ring<nat_event, NAT_EVENT_RING_SIZE> *ring;
+	std::atomic<uint64_t> emitted;
+	std::atomic<uint64_t> dropped; // リングが溢れて捨てた数
+};
+
+void emit_nat_event(nat_event_type type, const nat_entry *entry);
+
+bool nat_event_log_init(const char *path, uint64_t file_size, uint32_t file_count);
+void nat_event_log_shutdown();
+
+void dump_nat_event_stats();
+
+#endif // CURO_NAT_EVENT_H
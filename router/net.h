@@ -3,23 +3,56 @@
 
 #include <cstdint>
 #include <cstddef>
+#include "worker.h"
+
+#define NET_OFFLOAD_NEEDS_CSUM 0x01 // L4 チェックサムは疑似ヘッダの和だけが入っていて、送信時に計算する
+#define NET_OFFLOAD_DATA_VALID 0x02 // L4 チェックサムは検証済み
+
+#define NET_OFFLOAD_GSO_NONE 0
+#define NET_OFFLOAD_GSO_TCPV4 1
+#define NET_OFFLOAD_GSO_UDP 3
+
+#define NET_FRAME_MAX_SIZE 65550 // GSO でまとめられたフレームの最大長 (IP パケットの最大長 + イーサネットヘッダ)
+
+/**
+ * チェックサムのオフロードと GSO の情報 (virtio_net_hdr に対応)
+ * 位置は、この情報がついているバッファの先頭からのオフセット
+ * flags も gso_type も 0 なら、普通のフレームとして扱う
+ */
+struct net_offload
+{
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len; // ヘッダの長さ (L2 から L4 まで)
+	uint16_t gso_size; // 分割するときの 1 セグメントのペイロード長
+	uint16_t csum_start; // チェックサムの計算を始める位置
+	uint16_t csum_offset; // csum_start からのチェックサムのフィールドの位置
+};
 
 struct net_device;
 struct net_device_ops
 {
-	int (*transmit)(net_device *dev, uint8_t *buffer, size_t len);
+	int (*transmit)(net_device *dev, uint8_t *buffer, size_t len, const net_offload *offload);
 	int (*poll)(net_device *dev);
+	// 前回から今回までにカーネルが受信したパケット数と取りこぼした数を返す (nullable)
+	int (*read_kernel_stats)(net_device *dev, uint64_t *packets, uint64_t *drops);
 };
 
 struct ip_device;
+struct egress_queue;
+struct net_device_stats;
 
 struct net_device
 {
 	char name[32];
 	uint8_t mac_addr[6];
+	uint32_t ifindex; // カーネルのインターフェース番号 (カーネルのデバイスでなければ 0)
+	uint32_t worker; // 受信を担当するワーカー
 	net_device_ops ops;
 	net_device *next;
 	ip_device *ip_dev;
+	egress_queue *egress[WORKER_MAX]; // ワーカーごとの送信キュー (なければそのまま送信する)
+	net_device_stats *stats; // ワーカーごとのカウンタ (init_net_device_stats で確保する)
 	uint8_t data[];
 };
 
@@ -47,34 +47,28 @@ ip link set host2-router2 netns host2
 # host0のリンクの設定
 ip netns exec host0 ip addr add 192.168.1.3/24 dev host0-br0
 ip netns exec host0 ip link set host0-br0 up
-ip netns exec host0 ethtool -K host0-br0 rx off tx off
 ip netns exec host0 ip route add default via 192.168.1.1
 
 # host1のリンクの設定
 ip netns exec host1 ip addr add 192.168.1.2/24 dev host1-br0
 ip netns exec host1 ip link set host1-br0 up
-ip netns exec host1 ethtool -K host1-br0 rx off tx off
 ip netns exec host1 ip route add default via 192.168.1.1
 
 
 # router1のリンクの設定
 ip netns exec router1 ip link set router1-br0 up
-ip netns exec router1 ethtool -K router1-br0 rx off tx off
 ip netns exec router1 ip link set router1-router2 up
-ip netns exec router1 ethtool -K router1-router2 rx off tx off
+ip netns exec router1 ip link set lo up # フローの統計を同じ netns のコレクタに送る
 
 # router2のリンクの設定
 ip netns exec router2 ip addr add 192.168.0.2/24 dev router2-router1
 ip netns exec router2 ip link set router2-router1 up
-ip netns exec router2 ethtool -K router2-router1 rx off tx off
 ip netns exec router2 ip route add 192.168.1.0/24 via 192.168.0.1
 ip netns exec router2 ip addr add 192.168.2.1/24 dev router2-host2
 ip netns exec router2 ip link set router2-host2 up
-ip netns exec router2 ethtool -K router2-host2 rx off tx off
 ip netns exec router2 sysctl -w net.ipv4.ip_forward=1
 
 # host2のリンクの設定
 ip netns exec host2 ip addr add 192.168.2.2/24 dev host2-router2
 ip netns exec host2 ip link set host2-router2 up
-ip netns exec host2 ethtool -K host2-router2 rx off tx off
 ip netns exec host2 ip route add default via 192.168.2.1
@@ -0,0 +1,298 @@
+#include "packet_socket.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "ethernet.h"
+#include "latency.h"
+#include "log.h"
+#include "stats.h"
+
+int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len, const net_offload *offload);
+int net_device_poll(net_device *dev);
+int net_device_read_kernel_stats(net_device *dev, uint64_t *packets, uint64_t *drops);
+
+/**
+ * インターフェースのパケットソケットを開いて、デバイスを作る
+ * 受信したフレームは ethernet_input に渡す
+ * @param name インターフェース名
+ * @return 開けなければ nullptr
+ */
+net_device *create_packet_socket_device(const char *name)
+{
+	struct ifreq ifr
+	{
+	};
+	strcpy(ifr.ifr_name, name);
+
+	// open socket
+	int sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (sock == -1)
+	{
+		LOG_ERROR("socket open failed: %s\n", strerror(errno));
+		return nullptr;
+	}
+	// get interface index
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) == -1)
+	{
+		LOG_ERROR("ioctl SIOCGIFINDEX failed: %s\n", strerror(errno));
+		close(sock);
+		return nullptr;
+	}
+
+	// 受信したフレームのチェックサムオフロードと GSO の情報を受け取る
+	// これがないと、オフロードが有効な veth からのパケットはチェックサムが壊れて見えるので、デバイスを作らない
+	int vnet_hdr = 1;
+	if (setsockopt(sock, SOL_PACKET, PACKET_VNET_HDR, &vnet_hdr, sizeof(vnet_hdr)) == -1)
+	{
+		LOG_ERROR("setsockopt PACKET_VNET_HDR failed: %s\n", strerror(errno));
+		close(sock);
+		return nullptr;
+	}
+
+#ifdef CURO_LATENCY
+	// カーネルが受信した時刻を受け取り、ソケットで待っていた時間を計測する
+	int timestamp = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamp, sizeof(timestamp)) == -1)
+	{
+		LOG_ERROR("setsockopt SO_TIMESTAMPNS failed: %s\n", strerror(errno));
+	}
+#endif
+
+	// bind interface to socket
+	sockaddr_ll addr{};
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		LOG_ERROR("bind failed: %s\n", strerror(errno));
+		close(sock);
+		return nullptr;
+	}
+
+	// get interface MAC address
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0)
+	{
+		LOG_ERROR("ioctl SIOCGIFHWADDR failed: %s\n", strerror(errno));
+		close(sock);
+		return nullptr;
+	}
+
+	// create net_device struct
+	// allocate memory for net_device & net_device_data
+	net_device *dev;
+	dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(net_device_data));
+
+	// set transmit function
+	dev->ops.transmit = net_device_transmit;
+	// set poll function
+	dev->ops.poll = net_device_poll;
+	// set kernel statistics function
+	dev->ops.read_kernel_stats = net_device_read_kernel_stats;
+
+	// set interface name to net_device
+	strcpy(dev->name, name);
+	// set MAC address to net_device
+	memcpy(dev->mac_addr, &ifr.ifr_hwaddr.sa_data[0], 6);
+	dev->ifindex = addr.sll_ifindex;
+	((net_device_data *)dev->data)->fd = sock;
+	((net_device_data *)dev->data)->receive = ethernet_input;
+	init_net_device_stats(dev);
+
+	// set non blocking
+	// get File descriptor flag
+	int val = fcntl(sock, F_GETFL, 0);
+	// set non blocking bit
+	fcntl(sock, F_SETFL, val | O_NONBLOCK);
+	return dev;
+}
+
+/**
+ * 受信したフレームを ethernet_input 以外に渡す
+ * @param dev
+ * @param receive
+ * @param owner receive の中で使うデータ
+ */
+void packet_socket_set_receive_handler(net_device *dev, packet_socket_receive_handler receive, void *owner)
+{
+	auto *data = (net_device_data *)dev->data;
+	data->receive = receive;
+	data->owner = owner;
+}
+
+/**
+ * Transmission process for net devices
+ * @param dev device used for transmission
+ * @param buffer buffer to be transmitted
+ * @param len length of buffer
+ * @param offload checksum offload & GSO info of the frame (nullable)
+ */
+int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len, const net_offload *offload)
+{
+	LATENCY_STAGE(transmit);
+	auto *data = (net_device_data *)dev->data;
+
+	// フレームの前に vnet_header をつけて、チェックサムの計算や GSO の分割をカーネルに任せる
+	vnet_header vnet_hdr{};
+	if (offload != nullptr)
+	{
+		if (offload->flags & NET_OFFLOAD_NEEDS_CSUM)
+		{
+			vnet_hdr.flags = VNET_HDR_F_NEEDS_CSUM;
+			vnet_hdr.csum_start = htole16(offload->csum_start);
+			vnet_hdr.csum_offset = htole16(offload->csum_offset);
+		}
+		switch (offload->gso_type)
+		{
+		case NET_OFFLOAD_GSO_TCPV4:
+			vnet_hdr.gso_type = VNET_HDR_GSO_TCPV4;
+			break;
+		case NET_OFFLOAD_GSO_UDP:
+			vnet_hdr.gso_type = VNET_HDR_GSO_UDP;
+			break;
+		default:
+			vnet_hdr.gso_type = VNET_HDR_GSO_NONE;
+			break;
+		}
+		vnet_hdr.hdr_len = htole16(offload->hdr_len);
+		vnet_hdr.gso_size = htole16(offload->gso_size);
+	}
+
+	iovec iov[2];
+	iov[0].iov_base = &vnet_hdr;
+	iov[0].iov_len = sizeof(vnet_hdr);
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = len;
+	msghdr msg{};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (sendmsg(data->fd, &msg, 0) == -1)
+	{
+		LOG_ERROR("sendmsg to %s failed: %s\n", dev->name, strerror(errno));
+		LATENCY_END();
+		return -1;
+	}
+	LATENCY_END();
+	return 0;
+}
+
+/**
+ * Receiving process for net devices
+ * @param dev device attempting to receive
+ * @return 処理したフレーム数 (0 か 1)
+ */
+int net_device_poll(net_device *dev)
+{
+	// GSO でまとめられたフレームも受け取れるよう、最大長のバッファを用意する
+	static thread_local uint8_t recv_buffer[sizeof(vnet_header) + NET_FRAME_MAX_SIZE];
+	auto *data = (net_device_data *)dev->data;
+	// receive from socket
+#ifdef CURO_LATENCY
+	uint8_t control[CMSG_SPACE(sizeof(timespec))];
+	iovec iov{recv_buffer, sizeof(recv_buffer)};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n = recvmsg(data->fd, &msg, 0);
+#else
+	ssize_t n = recv(data->fd, recv_buffer, sizeof(recv_buffer), 0);
+#endif
+
+	if (n == -1)
+	{
+		if (errno == EAGAIN)
+		{
+			// no data
+			return 0;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	LATENCY_BEGIN(&msg);
+
+	uint8_t *frame = recv_buffer;
+	net_offload offload{};
+	if (n < static_cast<ssize_t>(sizeof(vnet_header)))
+	{
+		return 1;
+	}
+
+	auto *vnet_hdr = reinterpret_cast<vnet_header *>(recv_buffer);
+	if (vnet_hdr->flags & VNET_HDR_F_NEEDS_CSUM)
+	{
+		offload.flags |= NET_OFFLOAD_NEEDS_CSUM;
+	}
+	if (vnet_hdr->flags & VNET_HDR_F_DATA_VALID)
+	{
+		offload.flags |= NET_OFFLOAD_DATA_VALID;
+	}
+	switch (vnet_hdr->gso_type & ~VNET_HDR_GSO_ECN)
+	{
+	case VNET_HDR_GSO_TCPV4:
+		offload.gso_type = NET_OFFLOAD_GSO_TCPV4;
+		break;
+	case VNET_HDR_GSO_UDP:
+		offload.gso_type = NET_OFFLOAD_GSO_UDP;
+		break;
+	case VNET_HDR_GSO_NONE:
+		offload.gso_type = NET_OFFLOAD_GSO_NONE;
+		break;
+	default:
+		// IPv6 などは扱わない
+		return 1;
+	}
+	offload.hdr_len = le16toh(vnet_hdr->hdr_len);
+	offload.gso_size = le16toh(vnet_hdr->gso_size);
+	offload.csum_start = le16toh(vnet_hdr->csum_start);
+	offload.csum_offset = le16toh(vnet_hdr->csum_offset);
+
+	frame += sizeof(vnet_header);
+	n -= sizeof(vnet_header);
+
+	LOG_ETHERNET("Received %lu bytes from %s\n", n, dev->name);
+
+	// send received data to ethernet layer
+	data->receive(dev, frame, n, &offload);
+	// 送信せずに処理を終えたパケットの計測状態を、後で送信キューから送るフレームに持ち越さない
+	LATENCY_CLEAR();
+
+	return 1;
+}
+
+/**
+ * パケットソケットの統計 (PACKET_STATISTICS) を読む
+ * カーネルは読むたびに値をリセットするので、前回読んでからの値になる
+ * @param dev
+ * @param packets 受信したパケット数 (取りこぼしを含む)
+ * @param drops ソケットのバッファが溢れて取りこぼしたパケット数
+ * @return
+ */
+int net_device_read_kernel_stats(net_device *dev, uint64_t *packets, uint64_t *drops)
+{
+	auto *data = (net_device_data *)dev->data;
+	tpacket_stats stats{};
+	socklen_t len = sizeof(stats);
+	if (getsockopt(data->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == -1)
+	{
+		return -1;
+	}
+	*packets = stats.tp_packets;
+	*drops = stats.tp_drops;
+	return 0;
+}
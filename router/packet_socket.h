@@ -0,0 +1,48 @@
+#ifndef CURO_PACKET_SOCKET_H
+#define CURO_PACKET_SOCKET_H
+
+#include <cstdint>
+#include <sys/types.h>
+#include "net.h"
+
+/**
+ * パケットソケット (AF_PACKET) で、カーネルのインターフェースを送受信に使うデバイス
+ */
+
+// PACKET_VNET_HDR でフレームの前につくヘッダ (linux/virtio_net.h の virtio_net_hdr と同じ配置)
+// linux/virtio_net.h は C++ の予約語をメンバ名に使っていて include できないので、ここで定義する
+struct vnet_header
+{
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+#define VNET_HDR_F_NEEDS_CSUM 1
+#define VNET_HDR_F_DATA_VALID 2
+#define VNET_HDR_GSO_NONE 0
+#define VNET_HDR_GSO_TCPV4 1
+#define VNET_HDR_GSO_UDP 3
+#define VNET_HDR_GSO_ECN 0x80
+
+/**
+ * 受信したフレームを渡す関数
+ * ルータなら ethernet_input で、pktgen などは自分の処理に差し替える
+ */
+typedef void (*packet_socket_receive_handler)(net_device *dev, uint8_t *frame, ssize_t len, const net_offload *offload);
+
+struct net_device_data
+{
+	int fd;
+	packet_socket_receive_handler receive;
+	void *owner; // receive が使うデータ (nullable)
+};
+
+net_device *create_packet_socket_device(const char *name);
+
+void packet_socket_set_receive_handler(net_device *dev, packet_socket_receive_handler receive, void *owner);
+
+#endif // CURO_PACKET_SOCKET_H
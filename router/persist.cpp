@@ -0,0 +1,267 @@
+#include "persist.h"
+
+#include "arp.h"
+#include "log.h"
+#include "napt.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * mmap した領域のヘッダ
+ * 領域を使えなかったときは nullptr で、割り当てはヒープから行う
+ */
+persist_header *persist_segment = nullptr;
+
+/**
+ * 前のプロセスの状態を引き継いだか
+ */
+bool persist_restored = false;
+
+/**
+ * 解放済みの領域のリストと切り出し位置のロック
+ * 全てのワーカーが NAT セッションや ARP エントリを確保するので、確保と解放はこのロックを取って行う
+ */
+std::mutex persist_alloc_mutex;
+
+/**
+ * 領域に置く構造体のサイズから、レイアウトのハッシュを求める
+ * ビルドの違いで構造体が変わっていたら、古い状態は引き継がない
+ * @return
+ */
+uint32_t persist_layout_hash()
+{
+	const size_t sizes[] = {
+			sizeof(persist_header),
+			sizeof(arp_table_entry),
+			sizeof(nat_entry),
+			sizeof(nat_port_block),
+			sizeof(nat_subscriber),
+			sizeof(nat_entries),
+			sizeof(nat_device),
+	};
+
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (size_t size : sizes)
+	{
+		hash ^= static_cast<uint32_t>(size);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * 共有メモリの領域を固定アドレスに mmap する
+ * 前のプロセスが残した領域のヘッダが一致すればそのまま引き継ぎ、そうでなければ空にして使う
+ * 領域を同時に使うのは 1 プロセスだけなので、前のプロセスが終了するまで待つ
+ * @return 前のプロセスの状態を引き継いだら true
+ */
+bool persist_init()
+{
+	int fd = shm_open(PERSIST_SHM_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+	{
+		LOG_ERROR("shm_open %s failed: %s\n", PERSIST_SHM_NAME, strerror(errno));
+		return false;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+	{
+		printf("Waiting for the previous router to release %s\n", PERSIST_SHM_NAME);
+		flock(fd, LOCK_EX);
+	}
+
+	// mmap する前にヘッダを読んで、引き継げる領域か確かめる
+	persist_header header{};
+	bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) and
+							 header.magic == PERSIST_MAGIC and
+							 header.version == PERSIST_LAYOUT_VERSION and
+							 header.layout_hash == persist_layout_hash() and
+							 header.size == PERSIST_SEGMENT_SIZE;
+
+	if (!valid)
+	{
+		// 一度切り詰めて、中身がゼロの領域にする
+		if (ftruncate(fd, 0) == -1 or ftruncate(fd, PERSIST_SEGMENT_SIZE) == -1)
+		{
+			LOG_ERROR("ftruncate %s failed: %s\n", PERSIST_SHM_NAME, strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+
+	void *addr = mmap(reinterpret_cast<void *>(PERSIST_BASE_ADDRESS), PERSIST_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (addr == MAP_FAILED or addr != reinterpret_cast<void *>(PERSIST_BASE_ADDRESS))
+	{
+		LOG_ERROR("mmap %s at %llx failed: %s\n", PERSIST_SHM_NAME, PERSIST_BASE_ADDRESS, strerror(errno));
+		if (addr != MAP_FAILED)
+		{
+			munmap(addr, PERSIST_SEGMENT_SIZE);
+		}
+		close(fd);
+		return false;
+	}
+
+	// fd はロックを持ち続けるために閉じない
+	persist_segment = reinterpret_cast<persist_header *>(addr);
+	if (valid)
+	{
+		persist_restored = true;
+		printf("Restored state from %s (%lu bytes used)\n", PERSIST_SHM_NAME, persist_segment->used);
+		return true;
+	}
+
+	persist_segment->magic = PERSIST_MAGIC;
+	persist_segment->version = PERSIST_LAYOUT_VERSION;
+	persist_segment->layout_hash = persist_layout_hash();
+	persist_segment->size = PERSIST_SEGMENT_SIZE;
+	persist_segment->used = (sizeof(persist_header) + 63) & ~63ull;
+	printf("Created state segment %s\n", PERSIST_SHM_NAME);
+	return false;
+}
+
+/**
+ * 前のプロセスの状態を引き継いだか
+ * @return
+ */
+bool is_persist_restored()
+{
+	return persist_restored;
+}
+
+/**
+ * 引き継ぐ領域からメモリを確保する。calloc と同じく中身はゼロになる
+ * 2 のべき乗のサイズクラスごとに解放済みの領域を使い回す
+ * @param count
+ * @param size
+ * @return
+ */
+void *persist_calloc(size_t count, size_t size)
+{
+	if (persist_segment == nullptr)
+	{
+		return calloc(count, size);
+	}
+
+	size_t total = count * size + sizeof(persist_chunk);
+	uint64_t size_class = PERSIST_SIZE_CLASS_MIN;
+	while ((1ull << size_class) < total)
+	{
+		size_class++;
+	}
+	if (size_class >= PERSIST_SIZE_CLASS_NUM)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(persist_alloc_mutex);
+	persist_chunk *chunk = persist_segment->free_lists[size_class];
+	if (chunk != nullptr)
+	{
+		persist_segment->free_lists[size_class] = chunk->next_free;
+		memset(chunk, 0, 1ull << size_class);
+	}
+	else
+	{
+		if (persist_segment->used + (1ull << size_class) > persist_segment->size)
+		{
+			LOG_ERROR("State segment %s is full\n", PERSIST_SHM_NAME);
+			return nullptr;
+		}
+		// 切り出していない部分は ftruncate でゼロになっている
+		chunk = reinterpret_cast<persist_chunk *>(reinterpret_cast<uint8_t *>(persist_segment) + persist_segment->used);
+		persist_segment->used += 1ull << size_class;
+	}
+
+	chunk->size_class = size_class;
+	return chunk + 1;
+}
+
+/**
+ * persist_calloc で確保したメモリを解放する
+ * @param ptr
+ */
+void persist_free(void *ptr)
+{
+	if (ptr == nullptr)
+	{
+		return;
+	}
+
+	auto *p = reinterpret_cast<uint8_t *>(ptr);
+	auto *base = reinterpret_cast<uint8_t *>(persist_segment);
+	if (persist_segment == nullptr or p < base or p >= base + PERSIST_SEGMENT_SIZE)
+	{
+		free(ptr);
+		return;
+	}
+
+	persist_chunk *chunk = reinterpret_cast<persist_chunk *>(ptr) - 1;
+	std::lock_guard<std::mutex> lock(persist_alloc_mutex);
+	chunk->next_free = persist_segment->free_lists[chunk->size_class];
+	persist_segment->free_lists[chunk->size_class] = chunk;
+}
+
+/**
+ * 名前付きの起点を探す
+ * @param name
+ * @return 見つからなければ nullptr
+ */
+void *persist_get_root(const char *name)
+{
+	if (persist_segment == nullptr)
+	{
+		return nullptr;
+	}
+
+	for (int i = 0; i < PERSIST_ROOT_MAX; ++i)
+	{
+		if (strncmp(persist_segment->roots[i].name, name, PERSIST_ROOT_NAME_LEN) == 0)
+		{
+			return persist_segment->roots[i].ptr;
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * 名前付きの起点を登録する。同じ名前があれば置き換える
+ * @param name
+ * @param ptr
+ */
+void persist_set_root(const char *name, void *ptr)
+{
+	if (persist_segment == nullptr)
+	{
+		return;
+	}
+
+	persist_root *empty = nullptr;
+	for (int i = 0; i < PERSIST_ROOT_MAX; ++i)
+	{
+		persist_root *root = &persist_segment->roots[i];
+		if (strncmp(root->name, name, PERSIST_ROOT_NAME_LEN) == 0)
+		{
+			root->ptr = ptr;
+			return;
+		}
+		if (empty == nullptr and root->name[0] == '\0')
+		{
+			empty = root;
+		}
+	}
+
+	if (empty == nullptr)
+	{
+		LOG_ERROR("Too many state roots, %s is not persisted\n", name);
+		return;
+	}
+	strncpy(empty->name, name, PERSIST_ROOT_NAME_LEN - 1);
+	empty->ptr = ptr;
+}
@@ -0,0 +1,59 @@
+#ifndef CURO_PERSIST_H
+#define CURO_PERSIST_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * 再起動しても NAT セッションや ARP テーブルを引き継ぐための共有メモリ
+ * 固定アドレスに mmap するので、領域内のポインタは次のプロセスでもそのまま使える
+ */
+
+#define PERSIST_SHM_NAME "/curo-router-state"
+#define PERSIST_BASE_ADDRESS 0x7c0000000000ull // 領域を mmap するアドレス
+#define PERSIST_SEGMENT_SIZE (1ull << 30) // 触ったページだけ実メモリを使う
+#define PERSIST_MAGIC 0x4f5255432d544154ull
+#define PERSIST_LAYOUT_VERSION 1 // 領域に置く構造体を変えたら上げる
+
+#define PERSIST_ROOT_MAX 16
+#define PERSIST_ROOT_NAME_LEN 32
+#define PERSIST_SIZE_CLASS_MIN 5 // 最小の割り当て 32 byte
+#define PERSIST_SIZE_CLASS_NUM 31
+
+// 割り当てた領域の直前に置くヘッダ
+struct persist_chunk
+{
+	uint64_t size_class; // 2^size_class byte (ヘッダを含む)
+	persist_chunk *next_free; // 解放済みのときだけ使う
+};
+
+// 次のプロセスが探し出すための、名前付きの起点
+struct persist_root
+{
+	char name[PERSIST_ROOT_NAME_LEN];
+	void *ptr;
+};
+
+// 領域の先頭に置くヘッダ
+struct persist_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t layout_hash; // 構造体のサイズから求めたハッシュ。食い違ったら引き継がない
+	uint64_t size;
+	uint64_t used; // 先頭から切り出した量
+	persist_chunk *free_lists[PERSIST_SIZE_CLASS_NUM]; // サイズクラスごとの解放済みの領域
+	persist_root roots[PERSIST_ROOT_MAX];
+};
+
+bool persist_init();
+
+bool is_persist_restored();
+
+void *persist_calloc(size_t count, size_t size);
+void persist_free(void *ptr);
+
+void *persist_get_root(const char *name);
+void persist_set_root(const char *name, void *ptr);
+
+#endif // CURO_PERSIST_H
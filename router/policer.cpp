@@ -0,0 +1,186 @@
+#include "policer.h"
+
+#include "ip.h"
+#include "log.h"
+#include "net.h"
+#include "utils.h"
+#include <cstdlib>
+#include <new>
+
+/**
+ * レート制限を作る
+ * カウンタは POLICER_DECAY_MS ごとに半分になるので、一定のレートで数え続けると
+ * 推定値はレート × 間隔 × 2 に近づく。これを閾値にする
+ * @param packet_limit 送信元ごとのパケット数の上限 (/s)。0 なら制限しない
+ * @param session_limit 送信元ごとの新しい NAPT セッション数の上限 (/s)。0 なら制限しない
+ * @return
+ */
+src_policer *create_policer(uint32_t packet_limit, uint32_t session_limit)
+{
+	void *memory = calloc(1, sizeof(src_policer));
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+	auto *p = new (memory) src_policer();
+	p->packet_limit = packet_limit;
+	p->session_limit = session_limit;
+	p->packet_threshold = packet_limit * POLICER_DECAY_MS / 1000 * 2;
+	p->session_threshold = session_limit * POLICER_DECAY_MS / 1000 * 2;
+	// 間隔より少ない上限でも、1 つは通す
+	if (packet_limit != 0 and p->packet_threshold == 0)
+	{
+		p->packet_threshold = 1;
+	}
+	if (session_limit != 0 and p->session_threshold == 0)
+	{
+		p->session_threshold = 1;
+	}
+	p->last_decay_ms = current_time_ms();
+	return p;
+}
+
+/**
+ * アドレスから、行ごとのカウンタの位置を求める
+ * 2 つのハッシュ値の線形結合で行ごとのハッシュ関数を作る (Kirsch-Mitzenmacher)
+ * @param addr
+ * @param index
+ */
+void get_policer_sketch_index(uint32_t addr, uint32_t index[POLICER_SKETCH_DEPTH])
+{
+	uint64_t h = (static_cast<uint64_t>(addr) + 1) * 0x9e3779b97f4a7c15ull;
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 29;
+	uint32_t h1 = h;
+	uint32_t h2 = (h >> 32) | 1;
+	for (int i = 0; i < POLICER_SKETCH_DEPTH; ++i)
+	{
+		index[i] = (h1 + i * h2) & (POLICER_SKETCH_WIDTH - 1);
+	}
+}
+
+/**
+ * 推定値が閾値より小さければ数えて通す
+ * 数えるのは通したものだけなので、上限を超えて送り続ける送信元も上限のレートまでは通る
+ * 加算は推定値 (最小のカウンタ) を超えるカウンタだけを更新する (conservative update)
+ * @param sketch
+ * @param addr
+ * @param threshold
+ * @return
+ */
+bool policer_admit(policer_sketch *sketch, uint32_t addr, uint32_t threshold)
+{
+	uint32_t index[POLICER_SKETCH_DEPTH];
+	get_policer_sketch_index(addr, index);
+
+	uint32_t estimate = UINT32_MAX;
+	for (int i = 0; i < POLICER_SKETCH_DEPTH; ++i)
+	{
+		uint32_t count = sketch->counters[i][index[i]].load(std::memory_order_relaxed);
+		estimate = count < estimate ? count : estimate;
+	}
+	if (estimate >= threshold)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < POLICER_SKETCH_DEPTH; ++i)
+	{
+		std::atomic<uint32_t> *counter = &sketch->counters[i][index[i]];
+		if (counter->load(std::memory_order_relaxed) <= estimate)
+		{
+			counter->store(estimate + 1, std::memory_order_relaxed);
+		}
+	}
+	return true;
+}
+
+/**
+ * 送信元のパケットのレートを確認する
+ * @param policer
+ * @param src_addr
+ * @return 通してよければ true
+ */
+bool policer_admit_packet(src_policer *policer, uint32_t src_addr)
+{
+	if (policer->packet_limit == 0 or policer_admit(&policer->packets, src_addr, policer->packet_threshold))
+	{
+		return true;
+	}
+	policer->dropped_packets.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+/**
+ * 送信元が新しい NAPT セッションを作ってよいか確認する
+ * @param policer
+ * @param src_addr
+ * @return 作ってよければ true
+ */
+bool policer_admit_session(src_policer *policer, uint32_t src_addr)
+{
+	if (policer->session_limit == 0 or policer_admit(&policer->sessions, src_addr, policer->session_threshold))
+	{
+		return true;
+	}
+	policer->denied_sessions.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void decay_policer_sketch(policer_sketch *sketch)
+{
+	for (int i = 0; i < POLICER_SKETCH_DEPTH; ++i)
+	{
+		for (int j = 0; j < POLICER_SKETCH_WIDTH; ++j)
+		{
+			uint32_t count = sketch->counters[i][j].load(std::memory_order_relaxed);
+			if (count != 0)
+			{
+				sketch->counters[i][j].store(count / 2, std::memory_order_relaxed);
+			}
+		}
+	}
+}
+
+/**
+ * 一定時間ごとにカウンタを半分にする
+ */
+void policer_timer()
+{
+	uint64_t now = current_time_ms();
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev == nullptr or dev->ip_dev->policer == nullptr)
+		{
+			continue;
+		}
+
+		src_policer *p = dev->ip_dev->policer;
+		if (now - p->last_decay_ms >= POLICER_DECAY_MS)
+		{
+			decay_policer_sketch(&p->packets);
+			decay_policer_sketch(&p->sessions);
+			p->last_decay_ms = now;
+		}
+	}
+}
+
+/**
+ * デバイスごとのレート制限の統計を出力
+ */
+void dump_policer_stats()
+{
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->ip_dev == nullptr or dev->ip_dev->policer == nullptr)
+		{
+			continue;
+		}
+
+		src_policer *p = dev->ip_dev->policer;
+		printf("Policer on %s: %u packets/s, %u sessions/s per source (%zu bytes), %lu packets dropped, %lu sessions denied\n",
+					 dev->name, p->packet_limit, p->session_limit, sizeof(src_policer),
+					 p->dropped_packets.load(std::memory_order_relaxed), p->denied_sessions.load(std::memory_order_relaxed));
+	}
+}
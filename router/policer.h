@@ -0,0 +1,47 @@
+#ifndef CURO_POLICER_H
+#define CURO_POLICER_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * 送信元アドレスごとのレート制限
+ * パケット数と新しい NAPT セッション数を、送信元ごとに count-min sketch で数える
+ * 送信元がいくつあってもメモリは一定で、推定値は実際より大きくなることはあっても小さくはならない
+ * カウンタは一定時間ごとに半分にして、最近のレートを表すようにする
+ */
+
+#define POLICER_SKETCH_DEPTH 4 // ハッシュ関数の数
+#define POLICER_SKETCH_WIDTH 2048 // ハッシュ関数ごとのカウンタ数 (2 のべき乗)
+#define POLICER_DECAY_MS 100 // カウンタを半分にする間隔
+
+struct policer_sketch
+{
+	// ワーカー間で競合した加算は失われてもよいので、relaxed の load と store で更新する
+	std::atomic<uint32_t> counters[POLICER_SKETCH_DEPTH][POLICER_SKETCH_WIDTH];
+};
+
+struct src_policer
+{
+	policer_sketch packets;
+	policer_sketch sessions;
+	uint32_t packet_threshold; // 推定値がこれ以上の送信元のパケットは捨てる
+	uint32_t session_threshold;
+	uint32_t packet_limit; // 設定したレート (/s)
+	uint32_t session_limit;
+	uint64_t last_decay_ms;
+
+	std::atomic<uint64_t> dropped_packets;
+	std::atomic<uint64_t> denied_sessions;
+};
+
+src_policer *create_policer(uint32_t packet_limit, uint32_t session_limit);
+
+bool policer_admit_packet(src_policer *policer, uint32_t src_addr);
+bool policer_admit_session(src_policer *policer, uint32_t src_addr);
+
+void policer_timer();
+
+void dump_policer_stats();
+
+#endif // CURO_POLICER_H
@@ -0,0 +1,150 @@
+#ifndef CURO_PORT_POOL_H
+#define CURO_PORT_POOL_H
+
+#include <cstdint>
+
+/**
+ * ポート番号などの空き番号を管理する 2 段のビットマップ
+ * 下段は 1 bit が 1 つの番号 (1 なら使用中)、上段は 1 bit が下段の 64 bit (1 なら全て使用中) を表す
+ * calloc でゼロ初期化すれば全て空きの状態になる
+ * @tparam SIZE 管理する番号の数 (最大 65536)
+ */
+template <uint32_t SIZE>
+struct port_pool
+{
+	static constexpr uint32_t WORDS = (SIZE + 63) / 64;
+	static constexpr uint32_t SUMMARY_WORDS = (WORDS + 63) / 64;
+
+	uint64_t used_bits[WORDS];
+	uint64_t full_words[SUMMARY_WORDS];
+	uint32_t used;
+};
+
+/**
+ * from 以降で最初に見つかる空き番号を探す
+ * @tparam SIZE
+ * @param pool
+ * @param from
+ * @return 空き番号。なければ -1
+ */
+template <uint32_t SIZE>
+int32_t port_pool_find_free(port_pool<SIZE> *pool, uint32_t from)
+{
+	if (from >= SIZE)
+	{
+		return -1;
+	}
+
+	// from を含む word の中で探す
+	uint32_t word = from / 64;
+	uint64_t bits = ~pool->used_bits[word] & (~0ull << (from % 64));
+	if (bits != 0)
+	{
+		uint32_t index = word * 64 + __builtin_ctzll(bits);
+		return index < SIZE ? index : -1;
+	}
+
+	// 上段のビットマップで空きのある word を探す
+	uint32_t next = word + 1;
+	for (uint32_t summary = next / 64; summary < port_pool<SIZE>::SUMMARY_WORDS; ++summary)
+	{
+		uint64_t not_full = ~pool->full_words[summary];
+		if (summary == next / 64)
+		{
+			not_full &= ~0ull << (next % 64);
+		}
+		if (not_full == 0)
+		{
+			continue;
+		}
+
+		word = summary * 64 + __builtin_ctzll(not_full);
+		if (word >= port_pool<SIZE>::WORDS)
+		{
+			return -1;
+		}
+		uint32_t index = word * 64 + __builtin_ctzll(~pool->used_bits[word]);
+		return index < SIZE ? index : -1;
+	}
+	return -1;
+}
+
+/**
+ * 空き番号を確保する
+ * hint の位置から探し始め、末尾まで空きがなければ先頭から探す
+ * hint に乱数を渡すと、確保する番号をランダムにできる
+ * @tparam SIZE
+ * @param pool
+ * @param hint
+ * @return 確保した番号。空きがなければ -1
+ */
+template <uint32_t SIZE>
+int32_t port_pool_alloc(port_pool<SIZE> *pool, uint32_t hint)
+{
+	int32_t index = port_pool_find_free(pool, hint % SIZE);
+	if (index == -1)
+	{
+		index = port_pool_find_free(pool, 0);
+		if (index == -1)
+		{
+			return -1;
+		}
+	}
+
+	uint32_t word = index / 64;
+	pool->used_bits[word] |= 1ull << (index % 64);
+	if (pool->used_bits[word] == ~0ull)
+	{
+		pool->full_words[word / 64] |= 1ull << (word % 64);
+	}
+	pool->used++;
+	return index;
+}
+
+/**
+ * 指定した番号を使用中にする
+ * 割り当ての対象から外したい番号を予約するのに使う
+ * @tparam SIZE
+ * @param pool
+ * @param index
+ */
+template <uint32_t SIZE>
+void port_pool_mark_used(port_pool<SIZE> *pool, uint32_t index)
+{
+	uint32_t word = index / 64;
+	uint64_t bit = 1ull << (index % 64);
+	if (index >= SIZE or (pool->used_bits[word] & bit))
+	{
+		return;
+	}
+
+	pool->used_bits[word] |= bit;
+	if (pool->used_bits[word] == ~0ull)
+	{
+		pool->full_words[word / 64] |= 1ull << (word % 64);
+	}
+	pool->used++;
+}
+
+/**
+ * 番号を解放する
+ * @tparam SIZE
+ * @param pool
+ * @param index
+ */
+template <uint32_t SIZE>
+void port_pool_release(port_pool<SIZE> *pool, uint32_t index)
+{
+	uint32_t word = index / 64;
+	uint64_t bit = 1ull << (index % 64);
+	if (index >= SIZE or !(pool->used_bits[word] & bit))
+	{
+		return;
+	}
+
+	pool->used_bits[word] &= ~bit;
+	pool->full_words[word / 64] &= ~(1ull << (word % 64));
+	pool->used--;
+}
+
+#endif // CURO_PORT_POOL_H
@@ -0,0 +1,514 @@
+#include "replay.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <x86intrin.h>
+#include "arp.h"
+#include "config.h"
+#include "ethernet.h"
+#include "flow_cache.h"
+#include "ip.h"
+#include "latency.h"
+#include "log.h"
+#include "napt.h"
+#include "stats.h"
+#include "utils.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_RECORD_SNAPLEN 65535
+
+int replay_device_transmit(net_device *dev, uint8_t *buffer, size_t len, const net_offload *offload);
+int replay_device_poll(net_device *dev);
+
+/**
+ * 読み込んだフレームを解放する
+ * @param data
+ */
+void free_replay_frames(replay_device_data *data)
+{
+	free(data->frames);
+	free(data->index);
+	data->frames = nullptr;
+	data->index = nullptr;
+	data->frame_count = 0;
+}
+
+/**
+ * pcap ファイルのフレームを読み込む
+ * ユニキャストのフレームは、宛先 MAC アドレスをデバイスのアドレスに書き換えて、どのトレースでも受け取れるようにする
+ * @param data
+ * @param mac_addr デバイスの MAC アドレス
+ * @param path
+ * @return
+ */
+bool load_replay_pcap(replay_device_data *data, const uint8_t *mac_addr, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == nullptr)
+	{
+		LOG_ERROR("Failed to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	auto *content = (uint8_t *)malloc(size > 0 ? size : 1);
+	if (content == nullptr or fread(content, 1, size, file) != static_cast<size_t>(size))
+	{
+		LOG_ERROR("Failed to read %s\n", path);
+		free(content);
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+
+	// マジックナンバーを読む前に、ヘッダの分の長さがあるか確かめる
+	if (size < PCAP_HEADER_SIZE)
+	{
+		LOG_ERROR("%s is not a pcap file\n", path);
+		free(content);
+		return false;
+	}
+	uint32_t magic;
+	memcpy(&magic, content, 4);
+	bool swapped = magic == __builtin_bswap32(PCAP_MAGIC_US) or magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	auto read_u32 = [&](size_t offset) {
+		uint32_t value;
+		memcpy(&value, content + offset, 4);
+		return swapped ? __builtin_bswap32(value) : value;
+	};
+	if (read_u32(0) != PCAP_MAGIC_US and read_u32(0) != PCAP_MAGIC_NS)
+	{
+		LOG_ERROR("%s is not a pcap file\n", path);
+		free(content);
+		return false;
+	}
+	if ((read_u32(20) & 0xffff) != PCAP_LINKTYPE_ETHERNET)
+	{
+		LOG_ERROR("%s is not an Ethernet capture (link type %u)\n", path, read_u32(20));
+		free(content);
+		return false;
+	}
+
+	// フレームの合計はファイルより小さく、数はレコードヘッダの数より少ない
+	data->frames = (uint8_t *)malloc(size);
+	data->index = (replay_frame *)calloc(size / PCAP_RECORD_HEADER_SIZE + 1, sizeof(replay_frame));
+	if (data->frames == nullptr or data->index == nullptr)
+	{
+		free(content);
+		free_replay_frames(data);
+		return false;
+	}
+
+	uint32_t offset = 0, skipped = 0;
+	for (size_t pos = PCAP_HEADER_SIZE; pos + PCAP_RECORD_HEADER_SIZE <= static_cast<size_t>(size);)
+	{
+		uint32_t cap_len = read_u32(pos + 8);
+		uint32_t orig_len = read_u32(pos + 12);
+		pos += PCAP_RECORD_HEADER_SIZE;
+		if (pos + cap_len > static_cast<size_t>(size))
+		{
+			break;
+		}
+
+		// 途中までしか記録されていないフレームは、ルータが捨てるだけなので使わない
+		if (cap_len < ETHERNET_HEADER_SIZE or cap_len > REPLAY_FRAME_MAX_SIZE or cap_len < orig_len)
+		{
+			skipped++;
+			pos += cap_len;
+			continue;
+		}
+
+		uint8_t *frame = data->frames + offset;
+		memcpy(frame, content + pos, cap_len);
+		if ((frame[0] & 0x01) == 0)
+		{
+			memcpy(frame, mac_addr, ETHERNET_ADDRESS_LEN);
+		}
+		data->index[data->frame_count].offset = offset;
+		data->index[data->frame_count].len = cap_len;
+		data->frame_count++;
+		offset += cap_len;
+		pos += cap_len;
+	}
+	free(content);
+
+	printf("Loaded %u frames (%u bytes) from %s, skipped %u\n", data->frame_count, offset, path, skipped);
+	if (data->frame_count == 0)
+	{
+		free_replay_frames(data);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * pcap ファイルを受信するデバイスを作る
+ * @param name
+ * @param mac_addr
+ * @param pcap_path 受信するフレームの pcap ファイル (nullptr なら受信しない)
+ * @return
+ */
+net_device *create_replay_device(const char *name, const uint8_t *mac_addr, const char *pcap_path)
+{
+	auto *dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(replay_device_data));
+	if (dev == nullptr)
+	{
+		return nullptr;
+	}
+	dev->ops.transmit = replay_device_transmit;
+	dev->ops.poll = replay_device_poll;
+	strncpy(dev->name, name, sizeof(dev->name) - 1);
+	memcpy(dev->mac_addr, mac_addr, ETHERNET_ADDRESS_LEN);
+	init_net_device_stats(dev);
+
+	auto *data = new (dev->data) replay_device_data();
+	if (pcap_path != nullptr and !load_replay_pcap(data, mac_addr, pcap_path))
+	{
+		data->~replay_device_data();
+		free(dev->stats);
+		free(dev);
+		return nullptr;
+	}
+	return dev;
+}
+
+/**
+ * 送信したフレームを pcap ファイルに書き出すようにする
+ * @param dev
+ * @param path
+ * @return
+ */
+bool replay_device_record(net_device *dev, const char *path)
+{
+	auto *data = (replay_device_data *)dev->data;
+	data->record = fopen(path, "wb");
+	if (data->record == nullptr)
+	{
+		LOG_ERROR("Failed to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	uint32_t header[6] = {PCAP_MAGIC_NS, 2 | 4 << 16, 0, 0, PCAP_RECORD_SNAPLEN, PCAP_LINKTYPE_ETHERNET};
+	fwrite(header, sizeof(header), 1, data->record);
+	return true;
+}
+
+/**
+ * 全てのワーカーが送信したフレーム数
+ * @param dev
+ * @return
+ */
+uint64_t replay_device_tx_packets(net_device *dev)
+{
+	auto *data = (replay_device_data *)dev->data;
+	uint64_t packets = 0;
+	for (uint32_t i = 0; i < WORKER_MAX; ++i)
+	{
+		packets += data->tx[i].packets.load(std::memory_order_relaxed);
+	}
+	return packets;
+}
+
+/**
+ * ARP リクエストに、問い合わせたアドレスのホストとして応答する
+ * 応答は次の poll で受信する。data->lock を取ってから呼ぶ
+ * @param data
+ * @param request
+ */
+void replay_arp_reply(replay_device_data *data, const uint8_t *request)
+{
+	auto *request_arp = reinterpret_cast<const arp_ip_to_ethernet *>(request + ETHERNET_HEADER_SIZE);
+	if (ntohs(request_arp->op) != ARP_OPERATION_CODE_REQUEST or data->pending_count == REPLAY_PENDING_SIZE)
+	{
+		return;
+	}
+
+	// MAC アドレスは 02:00 と IP アドレスから作る
+	uint8_t host_mac[ETHERNET_ADDRESS_LEN] = {0x02, 0x00};
+	memcpy(host_mac + 2, &request_arp->tpa, 4);
+
+	uint32_t count = data->pending_count.load(std::memory_order_relaxed);
+	uint8_t *reply = data->pending[count];
+	memset(reply, 0, REPLAY_ARP_FRAME_SIZE);
+	auto *header = reinterpret_cast<ethernet_header *>(reply);
+	memcpy(header->dest_addr, request_arp->sha, ETHERNET_ADDRESS_LEN);
+	memcpy(header->src_addr, host_mac, ETHERNET_ADDRESS_LEN);
+	header->type = htons(ETHER_TYPE_ARP);
+
+	auto *reply_arp = reinterpret_cast<arp_ip_to_ethernet *>(reply + ETHERNET_HEADER_SIZE);
+	reply_arp->htype = htons(ARP_HTYPE_ETHERNET);
+	reply_arp->ptype = htons(ETHER_TYPE_IP);
+	reply_arp->hlen = ETHERNET_ADDRESS_LEN;
+	reply_arp->plen = 4;
+	reply_arp->op = htons(ARP_OPERATION_CODE_REPLY);
+	memcpy(reply_arp->sha, host_mac, ETHERNET_ADDRESS_LEN);
+	reply_arp->spa = request_arp->tpa;
+	memcpy(reply_arp->tha, request_arp->sha, ETHERNET_ADDRESS_LEN);
+	reply_arp->tpa = request_arp->spa;
+	data->pending_count.store(count + 1, std::memory_order_release);
+	data->arp_replies++;
+}
+
+/**
+ * 送信したフレームを数え、ARP リクエストなら応答を用意する
+ */
+int replay_device_transmit(net_device *dev, uint8_t *buffer, size_t len, const net_offload *)
+{
+	LATENCY_STAGE(transmit);
+	auto *data = (replay_device_data *)dev->data;
+	replay_tx_counters *tx = &data->tx[worker_id];
+	tx->packets.store(tx->packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	tx->bytes.store(tx->bytes.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+
+	bool is_arp = len >= ETHERNET_HEADER_SIZE + sizeof(arp_ip_to_ethernet) and
+								ntohs(reinterpret_cast<ethernet_header *>(buffer)->type) == ETHER_TYPE_ARP;
+	if (data->record == nullptr and !is_arp)
+	{
+		LATENCY_END();
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(data->lock);
+	if (data->record != nullptr)
+	{
+		uint64_t now = current_time_ns();
+		uint32_t cap_len = len < PCAP_RECORD_SNAPLEN ? len : PCAP_RECORD_SNAPLEN;
+		uint32_t header[4] = {static_cast<uint32_t>(now / 1000000000), static_cast<uint32_t>(now % 1000000000), cap_len, static_cast<uint32_t>(len)};
+		fwrite(header, sizeof(header), 1, data->record);
+		fwrite(buffer, 1, cap_len, data->record);
+	}
+
+	if (is_arp)
+	{
+		replay_arp_reply(data, buffer);
+	}
+	LATENCY_END();
+	return 0;
+}
+
+/**
+ * 用意した ARP 応答と、読み込んだフレームを REPLAY_BATCH_SIZE 個まで受信する
+ * ルータはフレームを書き換えるので、コピーしてから渡す
+ */
+int replay_device_poll(net_device *dev)
+{
+	static thread_local uint8_t buffer[REPLAY_FRAME_MAX_SIZE];
+	auto *data = (replay_device_data *)dev->data;
+
+	if (data->pending_count.load(std::memory_order_acquire) != 0)
+	{
+		// 受信した応答を処理する間に次のリクエストを送ることがあるので、先に取り出しておく
+		uint8_t replies[REPLAY_PENDING_SIZE][REPLAY_ARP_FRAME_SIZE];
+		uint32_t count;
+		{
+			std::lock_guard<std::mutex> lock(data->lock);
+			count = data->pending_count.load(std::memory_order_relaxed);
+			memcpy(replies, data->pending, count * REPLAY_ARP_FRAME_SIZE);
+			data->pending_count.store(0, std::memory_order_relaxed);
+		}
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			ethernet_input(dev, replies[i], REPLAY_ARP_FRAME_SIZE);
+		}
+	}
+
+	if (data->frame_count == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < REPLAY_BATCH_SIZE; ++i)
+	{
+		replay_frame *frame = &data->index[data->next];
+		memcpy(buffer, data->frames + frame->offset, frame->len);
+		LATENCY_BEGIN(nullptr);
+		ethernet_input(dev, buffer, frame->len);
+		LATENCY_CLEAR();
+		data->rx_packets.store(data->rx_packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		data->rx_bytes.store(data->rx_bytes.load(std::memory_order_relaxed) + frame->len, std::memory_order_relaxed);
+		if (++data->next == data->frame_count)
+		{
+			data->next = 0;
+			data->loops.store(data->loops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+	}
+	return REPLAY_BATCH_SIZE;
+}
+
+/**
+ * 読み込んだフレームのうち、送信元の IP アドレスで part_count 個に分けた part 番目だけを残す
+ * ワーカーごとのデバイスにトレースを分けるのに使う。NIC の受信キューへの振り分けと同じく、NAPT のシャードは考えない
+ * IP 以外のフレームは 0 番目に残す
+ * @param data
+ * @param part
+ * @param part_count
+ */
+void split_replay_frames(replay_device_data *data, uint32_t part, uint32_t part_count)
+{
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < data->frame_count; ++i)
+	{
+		const uint8_t *frame = data->frames + data->index[i].offset;
+		uint32_t frame_part = 0;
+		if (data->index[i].len >= ETHERNET_HEADER_SIZE + sizeof(ip_header) and
+				ntohs(reinterpret_cast<const ethernet_header *>(frame)->type) == ETHER_TYPE_IP)
+		{
+			auto *ip_packet = reinterpret_cast<const ip_header *>(frame + ETHERNET_HEADER_SIZE);
+			frame_part = ntohl(ip_packet->src_addr) % part_count;
+		}
+		if (frame_part == part)
+		{
+			data->index[kept++] = data->index[i];
+		}
+	}
+	data->frame_count = kept;
+}
+
+/**
+ * pcap ファイルを内側のデバイスで繰り返し受信し、NAPT して外側のデバイスに送る性能を測る
+ * 内側 192.168.1.1/24、外側 192.168.0.1/24 で、デフォルトルートの 192.168.0.2 に転送する
+ * ワーカーが複数なら、ワーカーごとに内側のデバイスを作ってトレースを分け、1 つの NAT テーブルを共有する
+ * このスレッドはワーカー 0 として、内側の 0 番目と外側のデバイスを処理する
+ * @param pcap_path
+ * @param seconds 計測する時間
+ * @param output_path 外側に送信したフレームを書き出す pcap ファイル (nullable)
+ * @param workers ワーカーの数
+ * @return
+ */
+int run_replay_bench(const char *pcap_path, uint32_t seconds, const char *output_path, uint32_t workers)
+{
+	if (workers == 0 or workers > WORKER_MAX)
+	{
+		LOG_ERROR("Invalid worker count %u (1 to %u)\n", workers, WORKER_MAX);
+		return EXIT_FAILURE;
+	}
+
+	const uint8_t outside_mac[] = {0x02, 0x00, 0x00, 0x00, 0x01, 0x02};
+	net_device *inside[WORKER_MAX];
+	net_device *outside = create_replay_device("bench-outside", outside_mac, nullptr);
+	if (outside == nullptr or (output_path != nullptr and !replay_device_record(outside, output_path)))
+	{
+		return EXIT_FAILURE;
+	}
+	net_dev_list = outside;
+	for (uint32_t i = workers; i-- > 0;)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), workers == 1 ? "bench-inside" : "bench-inside%u", i);
+		const uint8_t inside_mac[] = {0x02, 0x00, 0x00, 0x00, 0x01, static_cast<uint8_t>(i == 0 ? 0x01 : 0x10 + i)};
+		inside[i] = create_replay_device(name, inside_mac, pcap_path);
+		if (inside[i] == nullptr)
+		{
+			return EXIT_FAILURE;
+		}
+		auto *data = (replay_device_data *)inside[i]->data;
+		split_replay_frames(data, i, workers);
+		if (data->frame_count == 0)
+		{
+			LOG_ERROR("No frames in %s for %s\n", pcap_path, name);
+			return EXIT_FAILURE;
+		}
+		inside[i]->next = net_dev_list;
+		net_dev_list = inside[i];
+	}
+
+	// 内側の i 番目のデバイスをワーカー i が受信し、外側のデバイスはワーカー 0 が受信する
+	configure_workers(workers);
+	init_arp_table();
+	ip_fib = (binary_trie_node<ip_route_entry> *)calloc(1, sizeof(binary_trie_node<ip_route_entry>));
+	for (uint32_t i = 0; i < workers; ++i)
+	{
+		configure_ip_address(inside[i], IP_ADDRESS(192, 168, 1, 1), IP_ADDRESS(255, 255, 255, 0));
+	}
+	configure_ip_address(outside, IP_ADDRESS(192, 168, 0, 1), IP_ADDRESS(255, 255, 255, 0));
+	configure_ip_net_route(IP_ADDRESS(0, 0, 0, 0), 0, IP_ADDRESS(192, 168, 0, 2));
+	configure_ip_napt(inside[0], outside);
+	// 内側のデバイスは 1 つのインターフェースの受信キューを分けたものとして、同じ NAT テーブルを使う
+	for (uint32_t i = 1; i < workers; ++i)
+	{
+		inside[i]->ip_dev->nat_dev = inside[0]->ip_dev->nat_dev;
+	}
+	latency_init();
+	worker_start();
+
+	// 1 周流して、NAPT のセッションと ARP のエントリを作っておく
+	auto *outside_data = (replay_device_data *)outside->data;
+	auto inside_loops = [&]() {
+		uint64_t loops = UINT64_MAX;
+		for (uint32_t i = 0; i < workers; ++i)
+		{
+			uint64_t device_loops = ((replay_device_data *)inside[i]->data)->loops.load(std::memory_order_relaxed);
+			loops = device_loops < loops ? device_loops : loops;
+		}
+		return loops;
+	};
+	auto inside_counters = [&](uint64_t *packets, uint64_t *bytes) {
+		*packets = 0;
+		*bytes = 0;
+		for (uint32_t i = 0; i < workers; ++i)
+		{
+			auto *data = (replay_device_data *)inside[i]->data;
+			*packets += data->rx_packets.load(std::memory_order_relaxed);
+			*bytes += data->rx_bytes.load(std::memory_order_relaxed);
+		}
+	};
+	while (inside_loops() == 0)
+	{
+		worker_iteration();
+	}
+	uint64_t start_rx_packets, start_rx_bytes;
+	inside_counters(&start_rx_packets, &start_rx_bytes);
+	uint64_t start_tx_packets = replay_device_tx_packets(outside);
+
+	uint64_t start_ns = current_time_ns();
+	uint64_t start_tsc = __rdtsc();
+	uint64_t end_ns = start_ns + static_cast<uint64_t>(seconds) * 1000000000;
+	uint64_t now_ns;
+	do
+	{
+		for (int i = 0; i < 64; ++i)
+		{
+			worker_iteration();
+		}
+	} while ((now_ns = current_time_ns()) < end_ns);
+	uint64_t cycles = __rdtsc() - start_tsc;
+	uint64_t end_rx_packets, end_rx_bytes;
+	inside_counters(&end_rx_packets, &end_rx_bytes);
+	uint64_t end_tx_packets = replay_device_tx_packets(outside);
+	worker_shutdown();
+
+	double elapsed = (now_ns - start_ns) / 1e9;
+	uint64_t packets = end_rx_packets - start_rx_packets;
+	uint64_t bytes = end_rx_bytes - start_rx_bytes;
+	uint64_t forwarded = end_tx_packets - start_tx_packets;
+	// サイクル数は全てのワーカーで使った分
+	printf("Replayed %lu packets (%lu bytes) in %.2f s with %u workers: %.3f Mpps, %.3f Gbps, %.1f cycles/packet\n",
+				 packets, bytes, elapsed, workers, packets / elapsed / 1e6, bytes * 8 / elapsed / 1e9, static_cast<double>(cycles) * workers / packets);
+	printf("Forwarded %lu packets to %s (%.1f%%): %.3f Mpps, %lu ARP replies\n",
+				 forwarded, outside->name, packets != 0 ? forwarded * 100.0 / packets : 0, forwarded / elapsed / 1e6, outside_data->arp_replies);
+	if (workers > 1)
+	{
+		uint64_t handoffs = 0, handoff_drops = 0;
+		for (uint32_t i = 0; i < workers; ++i)
+		{
+			handoffs += nat_handoff_count[i];
+			handoff_drops += nat_handoff_drop_count[i];
+		}
+		printf("Handed off %lu packets to the worker owning the NAT shard, dropped %lu on full rings\n", handoffs, handoff_drops);
+	}
+	dump_stats();
+	dump_flow_cache_stats();
+#ifdef CURO_LATENCY
+	dump_latency_stats();
+#endif
+
+	if (outside_data->record != nullptr)
+	{
+		fclose(outside_data->record);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+#ifndef CURO_REPLAY_H
+#define CURO_REPLAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include "net.h"
+
+/**
+ * pcap ファイルのフレームを受信したことにするデバイス
+ * 読み込んだフレームを poll のたびに先頭から順に ethernet_input に渡し、最後まで行ったら先頭に戻る
+ * 送信したフレームは数えるだけで、指定すれば pcap ファイルに書き出す
+ * ARP リクエストには、問い合わせたアドレスのホストがいることにして応答を返す
+ * 受信は 1 つのワーカーだけが行うが、送信は全てのワーカーから呼ばれる
+ * root 権限もネットワークもなしに、ルータの処理だけの性能を測るのに使う
+ */
+
+#define REPLAY_BATCH_SIZE 32 // 1 回の poll で渡すフレーム数
+#define REPLAY_FRAME_MAX_SIZE 9018 // 読み込むフレームの最大長 (ジャンボフレーム)
+#define REPLAY_PENDING_SIZE 16 // 次の poll で渡す ARP 応答の数
+#define REPLAY_ARP_FRAME_SIZE 60 // パディングを含めた ARP 応答のフレーム長
+
+struct replay_frame
+{
+	uint32_t offset; // replay_device_data::frames の中の位置
+	uint32_t len;
+};
+
+// 1 つのワーカーが送信した数。他のワーカーと同じキャッシュラインに載らないようにする
+struct alignas(64) replay_tx_counters
+{
+	std::atomic<uint64_t> packets;
+	std::atomic<uint64_t> bytes;
+};
+
+struct replay_device_data
+{
+	uint8_t *frames; // 読み込んだフレームを詰めて並べたもの
+	replay_frame *index;
+	uint32_t frame_count;
+	uint32_t next; // 次に渡すフレーム
+	FILE *record; // 送信したフレームを書き出す pcap ファイル (nullable)
+
+	std::mutex lock; // record と pending を守る
+	uint8_t pending[REPLAY_PENDING_SIZE][REPLAY_ARP_FRAME_SIZE];
+	std::atomic<uint32_t> pending_count; // poll はロックを取らずに 0 か確かめる
+
+	// 統計 (計測中に他のスレッドから読む)
+	std::atomic<uint64_t> loops; // 最後まで渡して先頭に戻った回数
+	std::atomic<uint64_t> rx_packets;
+	std::atomic<uint64_t> rx_bytes;
+	replay_tx_counters tx[WORKER_MAX];
+	uint64_t arp_replies;
+};
+
+net_device *create_replay_device(const char *name, const uint8_t *mac_addr, const char *pcap_path);
+
+bool replay_device_record(net_device *dev, const char *path);
+
+uint64_t replay_device_tx_packets(net_device *dev);
+
+int run_replay_bench(const char *pcap_path, uint32_t seconds, const char *output_path, uint32_t workers);
+
+#endif // CURO_REPLAY_H
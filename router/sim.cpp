@@ -0,0 +1,432 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <x86intrin.h>
+#include "arp.h"
+#include "config.h"
+#include "egress_queue.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "log.h"
+#include "napt.h"
+#include "stats.h"
+#include "utils.h"
+#include "vwire.h"
+
+#define SIM_UDP_HEADER_SIZE 8
+#define SIM_ECHO_PORT 7
+#define SIM_SOURCE_PORT_BASE 10000
+#define SIM_ARP_RETRY_MS 100
+
+/**
+ * ルータを作る。デバイスは router_instance_add_device で追加する
+ * @param name
+ * @return
+ */
+router_instance *create_router_instance(const char *name)
+{
+	auto *router = (router_instance *)calloc(1, sizeof(router_instance));
+	if (router == nullptr)
+	{
+		return nullptr;
+	}
+	strncpy(router->name, name, SIM_NAME_LEN - 1);
+	router->fib = (binary_trie_node<ip_route_entry> *)calloc(1, sizeof(binary_trie_node<ip_route_entry>));
+
+	router_instance_enter(router);
+	init_arp_table();
+	router_instance_leave(router);
+	return router;
+}
+
+/**
+ * ルータの状態をグローバル変数に戻す。config.cpp の関数や poll は、この間だけ呼ぶ
+ * @param router
+ */
+void router_instance_enter(router_instance *router)
+{
+	net_dev_list = router->dev_list;
+	ip_fib = router->fib;
+	arp_table = router->arp_table;
+	arp_incomplete_list = router->arp_incomplete_list;
+}
+
+/**
+ * グローバル変数の状態をルータに保存する
+ * @param router
+ */
+void router_instance_leave(router_instance *router)
+{
+	router->dev_list = net_dev_list;
+	router->fib = ip_fib;
+	router->arp_table = arp_table;
+	router->arp_incomplete_list = arp_incomplete_list;
+}
+
+void router_instance_add_device(router_instance *router, net_device *dev)
+{
+	dev->next = router->dev_list;
+	router->dev_list = dev;
+}
+
+/**
+ * ルータのデバイスとタイマーを 1 回ずつ処理する。main のループと同じ順序
+ * @param router
+ */
+void router_instance_poll(router_instance *router)
+{
+	router_instance_enter(router);
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		dev->ops.poll(dev);
+	}
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		egress_queue_poll(dev);
+	}
+	arp_timer();
+	nat_timer();
+	router_instance_leave(router);
+}
+
+/**
+ * ホストから ARP のパケットを送信する
+ */
+void sim_host_send_arp(sim_host *host, uint16_t op, const uint8_t *dest_mac, uint32_t target_addr)
+{
+	uint8_t frame[ETHERNET_HEADER_SIZE + sizeof(arp_ip_to_ethernet)];
+	auto *header = reinterpret_cast<ethernet_header *>(frame);
+	memcpy(header->dest_addr, dest_mac, ETHERNET_ADDRESS_LEN);
+	memcpy(header->src_addr, host->dev->mac_addr, ETHERNET_ADDRESS_LEN);
+	header->type = htons(ETHER_TYPE_ARP);
+
+	auto *arp = reinterpret_cast<arp_ip_to_ethernet *>(frame + ETHERNET_HEADER_SIZE);
+	arp->htype = htons(ARP_HTYPE_ETHERNET);
+	arp->ptype = htons(ETHER_TYPE_IP);
+	arp->hlen = ETHERNET_ADDRESS_LEN;
+	arp->plen = IP_ADDRESS_LEN;
+	arp->op = htons(op);
+	memcpy(arp->sha, host->dev->mac_addr, ETHERNET_ADDRESS_LEN);
+	arp->spa = htonl(host->addr);
+	memcpy(arp->tha, op == ARP_OPERATION_CODE_REPLY ? dest_mac : ETHERNET_ADDRESS_BROADCAST, ETHERNET_ADDRESS_LEN);
+	arp->tpa = htonl(target_addr);
+	host->dev->ops.transmit(host->dev, frame, sizeof(frame), nullptr);
+}
+
+/**
+ * 送信時刻を書いた UDP パケットを、ゲートウェイ経由で送信する
+ * @param host
+ * @param src_port
+ */
+void sim_host_send_udp(sim_host *host, uint16_t src_port)
+{
+	uint8_t frame[VWIRE_FRAME_MAX_SIZE];
+	size_t udp_len = SIM_UDP_HEADER_SIZE + host->payload_len;
+	size_t len = ETHERNET_HEADER_SIZE + sizeof(ip_header) + udp_len;
+
+	auto *header = reinterpret_cast<ethernet_header *>(frame);
+	memcpy(header->dest_addr, host->gateway_mac, ETHERNET_ADDRESS_LEN);
+	memcpy(header->src_addr, host->dev->mac_addr, ETHERNET_ADDRESS_LEN);
+	header->type = htons(ETHER_TYPE_IP);
+
+	auto *ip_packet = reinterpret_cast<ip_header *>(frame + ETHERNET_HEADER_SIZE);
+	memset(ip_packet, 0, sizeof(ip_header));
+	ip_packet->version = 4;
+	ip_packet->header_len = sizeof(ip_header) >> 2;
+	ip_packet->total_len = htons(sizeof(ip_header) + udp_len);
+	ip_packet->identify = htons(host->sent);
+	ip_packet->ttl = 64;
+	ip_packet->protocol = IP_PROTOCOL_NUM_UDP;
+	ip_packet->src_addr = htonl(host->addr);
+	ip_packet->dest_addr = htonl(host->peer_addr);
+	ip_packet->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(frame + ETHERNET_HEADER_SIZE), sizeof(ip_header), 0);
+
+	// UDP のチェックサムは省略する (0)
+	uint8_t *udp = frame + ETHERNET_HEADER_SIZE + sizeof(ip_header);
+	uint16_t ports[4] = {htons(src_port), htons(SIM_ECHO_PORT), htons(udp_len), 0};
+	memcpy(udp, ports, SIM_UDP_HEADER_SIZE);
+	memset(udp + SIM_UDP_HEADER_SIZE, 0, host->payload_len);
+	uint64_t now = current_time_ns();
+	memcpy(udp + SIM_UDP_HEADER_SIZE, &now, sizeof(now));
+
+	host->dev->ops.transmit(host->dev, frame, len, nullptr);
+}
+
+/**
+ * ホストが受信したフレームを処理する
+ * ARP に応答し、UDP は送り返すか、往復時間を記録する
+ */
+void sim_host_input(net_device *dev, uint8_t *frame, size_t len)
+{
+	auto *host = (sim_host *)((vwire_device_data *)dev->data)->owner;
+	if (len < ETHERNET_HEADER_SIZE)
+	{
+		return;
+	}
+	auto *header = reinterpret_cast<ethernet_header *>(frame);
+	if (memcmp(header->dest_addr, dev->mac_addr, ETHERNET_ADDRESS_LEN) != 0 and memcmp(header->dest_addr, ETHERNET_ADDRESS_BROADCAST, ETHERNET_ADDRESS_LEN) != 0)
+	{
+		return;
+	}
+
+	if (ntohs(header->type) == ETHER_TYPE_ARP)
+	{
+		if (len < ETHERNET_HEADER_SIZE + sizeof(arp_ip_to_ethernet))
+		{
+			return;
+		}
+		auto *arp = reinterpret_cast<arp_ip_to_ethernet *>(frame + ETHERNET_HEADER_SIZE);
+		if (ntohl(arp->spa) == host->gateway)
+		{
+			memcpy(host->gateway_mac, arp->sha, ETHERNET_ADDRESS_LEN);
+			host->gateway_resolved = true;
+		}
+		if (ntohs(arp->op) == ARP_OPERATION_CODE_REQUEST and ntohl(arp->tpa) == host->addr)
+		{
+			sim_host_send_arp(host, ARP_OPERATION_CODE_REPLY, arp->sha, ntohl(arp->spa));
+		}
+		return;
+	}
+
+	if (ntohs(header->type) != ETHER_TYPE_IP or len < ETHERNET_HEADER_SIZE + sizeof(ip_header) + SIM_UDP_HEADER_SIZE + sizeof(uint64_t))
+	{
+		return;
+	}
+	auto *ip_packet = reinterpret_cast<ip_header *>(frame + ETHERNET_HEADER_SIZE);
+	if (ip_packet->header_len != (sizeof(ip_header) >> 2) or ip_packet->protocol != IP_PROTOCOL_NUM_UDP or ntohl(ip_packet->dest_addr) != host->addr)
+	{
+		return;
+	}
+	auto *ports = reinterpret_cast<uint16_t *>(frame + ETHERNET_HEADER_SIZE + sizeof(ip_header));
+
+	if (host->echo)
+	{
+		// 受け取ったフレームをそのまま書き換えて、送ってきたルータに返す
+		memcpy(header->dest_addr, header->src_addr, ETHERNET_ADDRESS_LEN);
+		memcpy(header->src_addr, dev->mac_addr, ETHERNET_ADDRESS_LEN);
+		uint32_t src_addr = ip_packet->src_addr;
+		ip_packet->src_addr = ip_packet->dest_addr;
+		ip_packet->dest_addr = src_addr;
+		std::swap(ports[0], ports[1]);
+		ports[3] = 0;
+		ip_packet->ttl = 64;
+		ip_packet->header_checksum = 0;
+		ip_packet->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(frame + ETHERNET_HEADER_SIZE), sizeof(ip_header), 0);
+		dev->ops.transmit(dev, frame, len, nullptr);
+		host->echoed++;
+		return;
+	}
+
+	uint64_t sent_ns;
+	memcpy(&sent_ns, frame + ETHERNET_HEADER_SIZE + sizeof(ip_header) + SIM_UDP_HEADER_SIZE, sizeof(sent_ns));
+	uint64_t rtt = current_time_ns() - sent_ns;
+	host->latency_samples[host->latency_count++ % SIM_LATENCY_SAMPLES] = rtt;
+	host->latency_sum_ns += rtt;
+	host->received++;
+	host->last_receive_ms = current_time_ms();
+	if (host->in_flight > 0)
+	{
+		host->in_flight--;
+	}
+}
+
+/**
+ * ホストを作る。送信する側にするなら、作った後で peer_addr などを設定する
+ * @param name
+ * @param dev ホストの vwire のデバイス
+ * @param addr
+ * @param gateway
+ * @return
+ */
+sim_host *create_sim_host(const char *name, net_device *dev, uint32_t addr, uint32_t gateway)
+{
+	auto *host = (sim_host *)calloc(1, sizeof(sim_host));
+	if (host == nullptr)
+	{
+		return nullptr;
+	}
+	host->latency_samples = (uint64_t *)calloc(SIM_LATENCY_SAMPLES, sizeof(uint64_t));
+	if (host->latency_samples == nullptr)
+	{
+		free(host);
+		return nullptr;
+	}
+	strncpy(host->name, name, SIM_NAME_LEN - 1);
+	host->dev = dev;
+	host->addr = addr;
+	host->gateway = gateway;
+	host->payload_len = sizeof(uint64_t);
+	host->window = 1;
+	host->flow_count = 1;
+	vwire_set_receive_handler(dev, sim_host_input, host);
+	return host;
+}
+
+/**
+ * ホストの受信を処理し、ゲートウェイの解決と、送信中のパケットが window になるまでの送信をする
+ * @param host
+ */
+void sim_host_poll(sim_host *host)
+{
+	host->dev->ops.poll(host->dev);
+
+	uint64_t now = current_time_ms();
+	if (!host->gateway_resolved)
+	{
+		if (now - host->last_arp_ms >= SIM_ARP_RETRY_MS)
+		{
+			sim_host_send_arp(host, ARP_OPERATION_CODE_REQUEST, ETHERNET_ADDRESS_BROADCAST, host->gateway);
+			host->last_arp_ms = now;
+		}
+		return;
+	}
+	if (host->peer_addr == 0)
+	{
+		return;
+	}
+
+	// 途中で捨てられたパケットの応答は来ないので、しばらく何も返ってこなければ数え直す
+	if (host->in_flight > 0 and now - host->last_receive_ms >= SIM_LOSS_TIMEOUT_MS)
+	{
+		host->lost += host->in_flight;
+		host->in_flight = 0;
+	}
+	if (host->in_flight == 0)
+	{
+		host->last_receive_ms = now;
+	}
+	while (host->in_flight < host->window)
+	{
+		sim_host_send_udp(host, SIM_SOURCE_PORT_BASE + host->sent % host->flow_count);
+		host->sent++;
+		host->in_flight++;
+	}
+}
+
+void reset_sim_host_stats(sim_host *host)
+{
+	host->sent = host->in_flight;
+	host->received = 0;
+	host->echoed = 0;
+	host->lost = 0;
+	host->latency_sum_ns = 0;
+	host->latency_count = 0;
+}
+
+/**
+ * netns/create_vnet_with_bridge.sh と同じ構成を 1 つのプロセスの中に作り、
+ * host0 から router1 (NAPT) と router2 を通って host2 まで UDP を往復させる性能を測る
+ *
+ * host0 (192.168.1.3) - router1 (192.168.1.1 | NAPT | 192.168.0.1) - router2 (192.168.0.2 | 192.168.2.1) - host2 (192.168.2.2)
+ *
+ * @param seconds 計測する時間
+ * @return
+ */
+int run_sim_bench(uint32_t seconds)
+{
+	// NAPT のポートの割り当てなどで使う乱数を固定し、実行ごとの差が出ないようにする
+	random_seed(SIM_RANDOM_SEED);
+
+	const uint8_t host0_mac[] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x03};
+	const uint8_t router1_br0_mac[] = {0x02, 0x00, 0x00, 0x00, 0x01, 0x01};
+	const uint8_t router1_router2_mac[] = {0x02, 0x00, 0x00, 0x00, 0x01, 0x02};
+	const uint8_t router2_router1_mac[] = {0x02, 0x00, 0x00, 0x00, 0x02, 0x01};
+	const uint8_t router2_host2_mac[] = {0x02, 0x00, 0x00, 0x00, 0x02, 0x02};
+	const uint8_t host2_mac[] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x22};
+
+	net_device *host0_br0, *router1_br0, *router1_router2, *router2_router1, *router2_host2, *host2_router2;
+	if (!create_vwire("host0-br0", host0_mac, "router1-br0", router1_br0_mac, &host0_br0, &router1_br0) or
+			!create_vwire("router1-router2", router1_router2_mac, "router2-router1", router2_router1_mac, &router1_router2, &router2_router1) or
+			!create_vwire("router2-host2", router2_host2_mac, "host2-router2", host2_mac, &router2_host2, &host2_router2))
+	{
+		LOG_ERROR("Failed to create virtual wires\n");
+		return EXIT_FAILURE;
+	}
+
+	router_instance *router1 = create_router_instance("router1");
+	router_instance *router2 = create_router_instance("router2");
+	sim_host *host0 = create_sim_host("host0", host0_br0, IP_ADDRESS(192, 168, 1, 3), IP_ADDRESS(192, 168, 1, 1));
+	sim_host *host2 = create_sim_host("host2", host2_router2, IP_ADDRESS(192, 168, 2, 2), IP_ADDRESS(192, 168, 2, 1));
+	if (router1 == nullptr or router2 == nullptr or host0 == nullptr or host2 == nullptr)
+	{
+		return EXIT_FAILURE;
+	}
+
+	router_instance_add_device(router1, router1_br0);
+	router_instance_add_device(router1, router1_router2);
+	router_instance_enter(router1);
+	configure_ip_address(router1_br0, IP_ADDRESS(192, 168, 1, 1), IP_ADDRESS(255, 255, 255, 0));
+	configure_ip_address(router1_router2, IP_ADDRESS(192, 168, 0, 1), IP_ADDRESS(255, 255, 255, 0));
+	configure_ip_net_route(IP_ADDRESS(192, 168, 2, 0), 24, IP_ADDRESS(192, 168, 0, 2));
+	configure_ip_napt(router1_br0, router1_router2);
+	router_instance_leave(router1);
+
+	router_instance_add_device(router2, router2_router1);
+	router_instance_add_device(router2, router2_host2);
+	router_instance_enter(router2);
+	configure_ip_address(router2_router1, IP_ADDRESS(192, 168, 0, 2), IP_ADDRESS(255, 255, 255, 0));
+	configure_ip_address(router2_host2, IP_ADDRESS(192, 168, 2, 1), IP_ADDRESS(255, 255, 255, 0));
+	router_instance_leave(router2);
+
+	host0->peer_addr = IP_ADDRESS(192, 168, 2, 2);
+	host0->flow_count = 64;
+	host0->payload_len = 18; // 60 byte のフレーム
+	host0->window = 64;
+	host2->echo = true;
+
+	auto step = [&]() {
+		sim_host_poll(host0);
+		router_instance_poll(router1);
+		router_instance_poll(router2);
+		sim_host_poll(host2);
+	};
+
+	// ARP の解決と NAPT のセッションの作成が済むまで流してから測る
+	uint64_t warmup_end_ms = current_time_ms() + 200;
+	while (current_time_ms() < warmup_end_ms)
+	{
+		step();
+	}
+	reset_sim_host_stats(host0);
+	reset_sim_host_stats(host2);
+
+	uint64_t start_ns = current_time_ns();
+	uint64_t start_tsc = __rdtsc();
+	uint64_t end_ns = start_ns + static_cast<uint64_t>(seconds) * 1000000000;
+	uint64_t now_ns;
+	do
+	{
+		for (int i = 0; i < 64; ++i)
+		{
+			step();
+		}
+	} while ((now_ns = current_time_ns()) < end_ns);
+	uint64_t cycles = __rdtsc() - start_tsc;
+
+	// 1 往復でルータを 4 回通る
+	double elapsed = (now_ns - start_ns) / 1e9;
+	uint64_t forwards = host0->received * 4;
+	printf("Simulated %lu round trips in %.2f s: %.3f M round trips/s, %.3f Mpps forwarded, %.1f cycles/forwarded packet\n",
+				 host0->received, elapsed, host0->received / elapsed / 1e6, forwards / elapsed / 1e6, forwards != 0 ? static_cast<double>(cycles) / forwards : 0);
+
+	uint32_t samples = std::min<uint32_t>(host0->latency_count, SIM_LATENCY_SAMPLES);
+	if (samples != 0)
+	{
+		std::sort(host0->latency_samples, host0->latency_samples + samples);
+		printf("Round trip time (last %u): avg %.0fns p50 %luns p99 %luns max %luns\n",
+					 samples, static_cast<double>(host0->latency_sum_ns) / host0->latency_count,
+					 host0->latency_samples[samples / 2], host0->latency_samples[samples * 99 / 100], host0->latency_samples[samples - 1]);
+	}
+	printf("%s sent %lu, received %lu, lost %lu; %s echoed %lu\n", host0->name, host0->sent, host0->received, host0->lost, host2->name, host2->echoed);
+
+	for (router_instance *router : {router1, router2})
+	{
+		printf("== %s ==\n", router->name);
+		router_instance_enter(router);
+		dump_stats();
+		router_instance_leave(router);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#ifndef CURO_SIM_H
+#define CURO_SIM_H
+
+#include <cstdint>
+#include "binary_trie.h"
+#include "net.h"
+
+/**
+ * 1 つのプロセスの中で、複数のルータとホストを仮想的なケーブル (vwire) でつないで動かすシミュレーション
+ * ルータの状態 (デバイスのリスト、FIB、ARP テーブル) はモジュールのグローバル変数にあるので、
+ * ルータごとに保存しておき、そのルータを処理する間だけグローバル変数に戻す
+ * NAPT、ACL、送信キューなどはデバイスが持つので、そのまま別々になる
+ * 1 スレッドで決まった順に処理するので、パケットの順序は毎回同じになる
+ */
+
+#define SIM_NAME_LEN 32
+#define SIM_LATENCY_SAMPLES 65536 // 往復時間の分布を求めるために記録する数
+#define SIM_LOSS_TIMEOUT_MS 10 // この間応答がなければ、送信中のパケットは失われたとみなす
+#define SIM_RANDOM_SEED 0x5eed // 実行するたびに同じ乱数列で計測する
+
+struct arp_table_entry;
+struct ip_route_entry;
+
+struct router_instance
+{
+	char name[SIM_NAME_LEN];
+	net_device *dev_list;
+	binary_trie_node<ip_route_entry> *fib;
+	arp_table_entry *arp_table;
+	arp_table_entry *arp_incomplete_list;
+};
+
+/**
+ * UDP を送って、返ってきたパケットで往復時間を測るか、受け取った UDP を送り返すホスト
+ */
+struct sim_host
+{
+	char name[SIM_NAME_LEN];
+	net_device *dev;
+	uint32_t addr; // ホストバイトオーダー
+	uint32_t gateway;
+	uint8_t gateway_mac[6];
+	bool gateway_resolved;
+	uint64_t last_arp_ms;
+	bool echo; // 受け取った UDP を送り返す
+
+	// 送信する側の設定
+	uint32_t peer_addr;
+	uint16_t flow_count; // 送信元ポートを変えて、この数のフローに分ける
+	uint16_t payload_len;
+	uint32_t window; // 応答を待たずに送るパケット数
+
+	// 統計
+	uint64_t sent;
+	uint64_t received;
+	uint64_t echoed;
+	uint64_t lost;
+	uint64_t in_flight;
+	uint64_t last_receive_ms;
+	uint64_t latency_sum_ns;
+	uint32_t latency_count;
+	uint64_t *latency_samples;
+};
+
+router_instance *create_router_instance(const char *name);
+void router_instance_enter(router_instance *router);
+void router_instance_leave(router_instance *router);
+void router_instance_add_device(router_instance *router, net_device *dev);
+void router_instance_poll(router_instance *router);
+
+sim_host *create_sim_host(const char *name, net_device *dev, uint32_t addr, uint32_t gateway);
+void sim_host_poll(sim_host *host);
+
+int run_sim_bench(uint32_t seconds);
+
+#endif // CURO_SIM_H
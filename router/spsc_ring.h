@@ -0,0 +1,80 @@
+#ifndef CURO_SPSC_RING_H
+#define CURO_SPSC_RING_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * 書き込み側と読み出し側が 1 スレッドずつのロックフリーなリングバッファ
+ * スロットを直接書き換えてから commit するので、要素のコピーは 1 回で済む
+ * @tparam T スロットの型
+ * @tparam SIZE スロット数 (2 のべき乗)
+ */
+template <typename T, uint32_t SIZE>
+struct spsc_ring
+{
+	static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+
+	alignas(64) std::atomic<uint32_t> head; // 次に書き込む位置 (書き込み側だけが更新)
+	alignas(64) std::atomic<uint32_t> tail; // 次に読み出す位置 (読み出し側だけが更新)
+	alignas(64) T slots[SIZE];
+};
+
+/**
+ * 書き込むスロットを取得する
+ * @return スロット。満杯なら nullptr
+ */
+template <typename T, uint32_t SIZE>
+T *spsc_ring_reserve(spsc_ring<T, SIZE> *ring)
+{
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) == SIZE)
+	{
+		return nullptr;
+	}
+	return &ring->slots[head & (SIZE - 1)];
+}
+
+/**
+ * spsc_ring_reserve で取得したスロットを読み出し側に公開する
+ */
+template <typename T, uint32_t SIZE>
+void spsc_ring_commit(spsc_ring<T, SIZE> *ring)
+{
+	ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/**
+ * 次に読み出すスロットを取得する
+ * @return スロット。空なら nullptr
+ */
+template <typename T, uint32_t SIZE>
+T *spsc_ring_peek(spsc_ring<T, SIZE> *ring)
+{
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	if (tail == ring->head.load(std::memory_order_acquire))
+	{
+		return nullptr;
+	}
+	return &ring->slots[tail & (SIZE - 1)];
+}
+
+/**
+ * spsc_ring_peek で取得したスロットを書き込み側に返す
+ */
+template <typename T, uint32_t SIZE>
+void spsc_ring_release(spsc_ring<T, SIZE> *ring)
+{
+	ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/**
+ * リングに入っている要素数
+ */
+template <typename T, uint32_t SIZE>
+uint32_t spsc_ring_count(spsc_ring<T, SIZE> *ring)
+{
+	return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+}
+
+#endif // CURO_SPSC_RING_H
@@ -0,0 +1,332 @@
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include "log.h"
+#include "utils.h"
+
+net_device_counters router_counters[WORKER_MAX];
+
+stats_page *stats_shm_page = nullptr; // 書き出し先の共有メモリ (nullable)
+int stats_listen_fd = -1;
+
+std::thread stats_thread;
+std::atomic<bool> stats_running{false};
+std::mutex stats_collect_mutex; // 統計用のスレッドと dump_stats が、カーネルの統計を同時に読んで足さないようにする
+
+const char *drop_reason_name(drop_reason reason)
+{
+	switch (reason)
+	{
+	case drop_reason::short_packet:
+		return "short_packet";
+	case drop_reason::bad_checksum:
+		return "bad_checksum";
+	case drop_reason::unsupported:
+		return "unsupported";
+	case drop_reason::acl_deny:
+		return "acl_deny";
+	case drop_reason::rate_limited:
+		return "rate_limited";
+	case drop_reason::no_route:
+		return "no_route";
+	case drop_reason::ttl_exceeded:
+		return "ttl_exceeded";
+	case drop_reason::arp_miss:
+		return "arp_miss";
+	case drop_reason::nat_full:
+		return "nat_full";
+	case drop_reason::queue_drop:
+		return "queue_drop";
+	case drop_reason::handoff_full:
+		return "handoff_full";
+	}
+	return "unknown";
+}
+
+/**
+ * デバイスのカウンタを確保する
+ * デバイスを作ったら、パケットを送受信する前に呼ぶ
+ * @param dev
+ */
+void init_net_device_stats(net_device *dev)
+{
+	void *memory = aligned_alloc(alignof(net_device_stats), sizeof(net_device_stats));
+	if (memory == nullptr)
+	{
+		LOG_ERROR("Failed to allocate stats for %s\n", dev->name);
+		exit(EXIT_FAILURE);
+	}
+	memset(memory, 0, sizeof(net_device_stats));
+	dev->stats = new (memory) net_device_stats();
+}
+
+/**
+ * ワーカーごとのカウンタを合計する
+ * @param counters
+ * @param snapshot
+ */
+void sum_counters(const net_device_counters counters[WORKER_MAX], device_stats_snapshot *snapshot)
+{
+	for (uint32_t i = 0; i < WORKER_MAX; ++i)
+	{
+		snapshot->rx_packets += counters[i].rx_packets.load(std::memory_order_relaxed);
+		snapshot->rx_bytes += counters[i].rx_bytes.load(std::memory_order_relaxed);
+		snapshot->tx_packets += counters[i].tx_packets.load(std::memory_order_relaxed);
+		snapshot->tx_bytes += counters[i].tx_bytes.load(std::memory_order_relaxed);
+		snapshot->tx_errors += counters[i].tx_errors.load(std::memory_order_relaxed);
+		for (int j = 0; j < DROP_REASON_NUM; ++j)
+		{
+			snapshot->drops[j] += counters[i].drops[j].load(std::memory_order_relaxed);
+		}
+	}
+}
+
+/**
+ * 全てのデバイスのカウンタを集計する
+ * カーネルの統計は読むとリセットされるので、読んだ分をデバイスの累計に足す
+ * @param page
+ */
+void collect_stats(stats_page *page)
+{
+	std::lock_guard<std::mutex> lock(stats_collect_mutex);
+	device_stats_snapshot router{};
+	sum_counters(router_counters, &router);
+	memcpy(page->drops, router.drops, sizeof(page->drops));
+
+	page->device_count = 0;
+	for (net_device *dev = net_dev_list; dev and page->device_count < STATS_DEVICE_MAX; dev = dev->next)
+	{
+		if (dev->stats == nullptr)
+		{
+			continue;
+		}
+
+		uint64_t kernel_packets, kernel_drops;
+		if (dev->ops.read_kernel_stats != nullptr and dev->ops.read_kernel_stats(dev, &kernel_packets, &kernel_drops) == 0)
+		{
+			dev->stats->kernel_packets += kernel_packets;
+			dev->stats->kernel_drops += kernel_drops;
+		}
+
+		device_stats_snapshot *snapshot = &page->devices[page->device_count++];
+		memset(snapshot, 0, sizeof(device_stats_snapshot));
+		strncpy(snapshot->name, dev->name, sizeof(snapshot->name) - 1);
+		sum_counters(dev->stats->workers, snapshot);
+		snapshot->kernel_packets = dev->stats->kernel_packets;
+		snapshot->kernel_drops = dev->stats->kernel_drops;
+	}
+	page->updated_ns = current_time_ns();
+}
+
+/**
+ * 集計値をテキストにする
+ * 1 行に 1 つの値を "名前{ラベル} 値" の形式で書く
+ * @param page
+ * @param buffer
+ * @param size
+ * @return 書き込んだ長さ
+ */
+size_t format_stats(const stats_page *page, char *buffer, size_t size)
+{
+	size_t len = 0;
+#define STATS_APPEND(...)                                                        \
+	do                                                                             \
+	{                                                                              \
+		if (len < size)                                                              \
+		{                                                                            \
+			int n = snprintf(buffer + len, size - len, __VA_ARGS__);                   \
+			len = n < 0 ? len : (len + n < size ? len + n : size - 1);                 \
+		}                                                                            \
+	} while (0)
+
+	for (uint32_t i = 0; i < page->device_count; ++i)
+	{
+		const device_stats_snapshot *dev = &page->devices[i];
+		STATS_APPEND("curo_rx_packets{device=\"%s\"} %lu\n", dev->name, dev->rx_packets);
+		STATS_APPEND("curo_rx_bytes{device=\"%s\"} %lu\n", dev->name, dev->rx_bytes);
+		STATS_APPEND("curo_tx_packets{device=\"%s\"} %lu\n", dev->name, dev->tx_packets);
+		STATS_APPEND("curo_tx_bytes{device=\"%s\"} %lu\n", dev->name, dev->tx_bytes);
+		STATS_APPEND("curo_tx_errors{device=\"%s\"} %lu\n", dev->name, dev->tx_errors);
+		STATS_APPEND("curo_kernel_packets{device=\"%s\"} %lu\n", dev->name, dev->kernel_packets);
+		STATS_APPEND("curo_kernel_drops{device=\"%s\"} %lu\n", dev->name, dev->kernel_drops);
+		for (int j = 0; j < DROP_REASON_NUM; ++j)
+		{
+			STATS_APPEND("curo_drops{device=\"%s\",reason=\"%s\"} %lu\n", dev->name, drop_reason_name(static_cast<drop_reason>(j)), dev->drops[j]);
+		}
+	}
+	for (int j = 0; j < DROP_REASON_NUM; ++j)
+	{
+		STATS_APPEND("curo_drops{reason=\"%s\"} %lu\n", drop_reason_name(static_cast<drop_reason>(j)), page->drops[j]);
+	}
+#undef STATS_APPEND
+	return len;
+}
+
+/**
+ * 集計値を共有メモリのページに書き出す
+ * 書き込む間は sequence を奇数にしておき、読む側に読み直させる
+ */
+void update_stats_page()
+{
+	static stats_page collected;
+	collect_stats(&collected);
+
+	uint32_t sequence = stats_shm_page->sequence.load(std::memory_order_relaxed);
+	stats_shm_page->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	stats_shm_page->device_count = collected.device_count;
+	stats_shm_page->updated_ns = collected.updated_ns;
+	memcpy(stats_shm_page->drops, collected.drops, sizeof(collected.drops));
+	memcpy(stats_shm_page->devices, collected.devices, sizeof(device_stats_snapshot) * collected.device_count);
+
+	stats_shm_page->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+/**
+ * Unix ソケットに接続してきたクライアントに、その時点の集計値を返す
+ */
+void serve_stats_client()
+{
+	int client = accept4(stats_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client == -1)
+	{
+		return;
+	}
+
+	static stats_page collected;
+	static char text[STATS_TEXT_SIZE];
+	collect_stats(&collected);
+	size_t len = format_stats(&collected, text, sizeof(text));
+	// クライアントが読まなくても待たない。ソケットのバッファに入りきらなかった分は捨てる
+	send(client, text, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(client);
+}
+
+/**
+ * 統計用のスレッド
+ * 共有メモリのページを STATS_UPDATE_MS ごとに更新し、その間は Unix ソケットへの接続を待つ
+ */
+void stats_thread_main()
+{
+	uint64_t last_update_ms = 0;
+	while (stats_running.load(std::memory_order_relaxed))
+	{
+		uint64_t now = current_time_ms();
+		if (stats_shm_page != nullptr and now - last_update_ms >= STATS_UPDATE_MS)
+		{
+			update_stats_page();
+			last_update_ms = now;
+		}
+
+		// 次の更新まで接続を待つ。止めるときも STATS_UPDATE_MS 以内に気づく
+		uint64_t elapsed = current_time_ms() - last_update_ms;
+		int timeout = stats_shm_page == nullptr ? STATS_UPDATE_MS : (elapsed < STATS_UPDATE_MS ? STATS_UPDATE_MS - elapsed : 0);
+		pollfd pfd = {stats_listen_fd, POLLIN, 0};
+		if (poll(&pfd, stats_listen_fd != -1 ? 1 : 0, timeout) > 0 and (pfd.revents & POLLIN))
+		{
+			serve_stats_client();
+		}
+	}
+}
+
+/**
+ * 統計の出力先の共有メモリと Unix ソケットを用意し、統計用のスレッドを起動する
+ * 用意できなくても、ルータの動作は続ける
+ */
+void stats_init()
+{
+	int fd = shm_open(STATS_SHM_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		LOG_ERROR("shm_open %s failed: %s\n", STATS_SHM_NAME, strerror(errno));
+	}
+	else
+	{
+		if (ftruncate(fd, sizeof(stats_page)) == -1)
+		{
+			LOG_ERROR("ftruncate %s failed: %s\n", STATS_SHM_NAME, strerror(errno));
+		}
+		else
+		{
+			void *addr = mmap(nullptr, sizeof(stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (addr == MAP_FAILED)
+			{
+				LOG_ERROR("mmap %s failed: %s\n", STATS_SHM_NAME, strerror(errno));
+			}
+			else
+			{
+				stats_shm_page = new (addr) stats_page();
+				stats_shm_page->magic = STATS_PAGE_MAGIC;
+				stats_shm_page->version = STATS_PAGE_VERSION;
+			}
+		}
+		close(fd);
+	}
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, STATS_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	unlink(STATS_SOCKET_PATH);
+	stats_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (stats_listen_fd == -1)
+	{
+		LOG_ERROR("socket for %s failed: %s\n", STATS_SOCKET_PATH, strerror(errno));
+	}
+	else if (bind(stats_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 or listen(stats_listen_fd, 4) == -1)
+	{
+		LOG_ERROR("bind %s failed: %s\n", STATS_SOCKET_PATH, strerror(errno));
+		close(stats_listen_fd);
+		stats_listen_fd = -1;
+	}
+
+	if (stats_shm_page == nullptr and stats_listen_fd == -1)
+	{
+		return;
+	}
+	stats_running.store(true);
+	stats_thread = std::thread(stats_thread_main);
+	printf("Exporting stats to /dev/shm%s and %s\n", STATS_SHM_NAME, STATS_SOCKET_PATH);
+}
+
+/**
+ * 統計用のスレッドを止める
+ */
+void stats_shutdown()
+{
+	if (!stats_running.exchange(false))
+	{
+		return;
+	}
+	stats_thread.join();
+	if (stats_listen_fd != -1)
+	{
+		close(stats_listen_fd);
+		stats_listen_fd = -1;
+		unlink(STATS_SOCKET_PATH);
+	}
+}
+
+/**
+ * 集計値を出力
+ */
+void dump_stats()
+{
+	static stats_page collected;
+	static char text[STATS_TEXT_SIZE];
+	collect_stats(&collected);
+	size_t len = format_stats(&collected, text, sizeof(text));
+	fwrite(text, 1, len, stdout);
+}
@@ -0,0 +1,149 @@
+#ifndef CURO_STATS_H
+#define CURO_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "net.h"
+
+/**
+ * デバイスごと、ワーカーごとのカウンタ
+ * カウンタはワーカーごとにキャッシュラインを分けて持ち、書き込むのはそのワーカーだけなので、
+ * データパスはロックも不可分な加算も使わずに数える
+ * 集計は統計用のスレッドで行い、共有メモリのページと Unix ソケットに出力する
+ * (カウンタは relaxed で読めるので、データパスのスレッドは集計にも読み出しの要求にも関わらない)
+ */
+
+#define STATS_SHM_NAME "/curo-router-stats"
+#define STATS_SOCKET_PATH "/tmp/curo-router-stats.sock"
+#define STATS_PAGE_MAGIC 0x53525543 // "CURS"
+#define STATS_PAGE_VERSION 2
+#define STATS_DEVICE_MAX 32 // 共有メモリのページに載せるデバイス数
+#define STATS_UPDATE_MS 100 // 共有メモリのページを更新する間隔
+#define STATS_TEXT_SIZE 65536
+
+// パケットを捨てた理由
+enum class drop_reason : uint8_t
+{
+	short_packet, // ヘッダより短い、長さのフィールドが不正
+	bad_checksum,
+	unsupported, // IP オプションなど、扱えないパケット
+	acl_deny,
+	rate_limited, // 送信元ごとのレート制限
+	no_route,
+	ttl_exceeded,
+	arp_miss, // 次のホップの MAC アドレスが解決できなかった
+	nat_full, // NAPT のポートが割り当てられなかった
+	queue_drop, // 送信キューが溢れた、滞留した
+	handoff_full, // NAPT のセッションを担当するワーカーに渡せなかった
+};
+
+#define DROP_REASON_NUM 11
+
+const char *drop_reason_name(drop_reason reason);
+
+// 1 つのワーカーのカウンタ。他のワーカーと同じキャッシュラインに載らないようにする
+struct alignas(64) net_device_counters
+{
+	std::atomic<uint64_t> rx_packets;
+	std::atomic<uint64_t> rx_bytes;
+	std::atomic<uint64_t> tx_packets;
+	std::atomic<uint64_t> tx_bytes;
+	std::atomic<uint64_t> tx_errors;
+	std::atomic<uint64_t> drops[DROP_REASON_NUM];
+};
+
+struct net_device_stats
+{
+	net_device_counters workers[WORKER_MAX];
+	// カーネルのソケットの受信数と取りこぼし数 (PACKET_STATISTICS) の累計。集計するときにロックを持って更新する
+	uint64_t kernel_packets;
+	uint64_t kernel_drops;
+};
+
+// デバイスによらない破棄 (自分が送信するパケットの経路がないなど) のカウンタ
+extern net_device_counters router_counters[WORKER_MAX];
+
+/**
+ * 共有メモリのページに書き出すデバイスごとの集計値
+ */
+struct device_stats_snapshot
+{
+	char name[32];
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_errors;
+	uint64_t drops[DROP_REASON_NUM];
+	uint64_t kernel_packets;
+	uint64_t kernel_drops;
+};
+
+/**
+ * 共有メモリのページの配置
+ * 読む側は sequence が偶数で、読む前後で変わっていなければ一貫した値として使う (seqlock)
+ */
+struct stats_page
+{
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> sequence; // 更新中は奇数
+	uint32_t device_count;
+	uint64_t updated_ns;
+	uint64_t drops[DROP_REASON_NUM]; // デバイスによらない破棄
+	device_stats_snapshot devices[STATS_DEVICE_MAX];
+};
+
+/**
+ * 単一のワーカーだけが書き込むカウンタに加算する
+ * 読み出す側と不可分に読み書きできればよいので、lock prefix のつく加算は使わない
+ */
+inline void counter_add(std::atomic<uint64_t> *counter, uint64_t value)
+{
+	counter->store(counter->load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline net_device_counters *get_counters(net_device *dev)
+{
+	return dev != nullptr ? &dev->stats->workers[worker_id] : &router_counters[worker_id];
+}
+
+inline void count_rx(net_device *dev, size_t len)
+{
+	net_device_counters *counters = get_counters(dev);
+	counter_add(&counters->rx_packets, 1);
+	counter_add(&counters->rx_bytes, len);
+}
+
+inline void count_tx(net_device *dev, size_t len)
+{
+	net_device_counters *counters = get_counters(dev);
+	counter_add(&counters->tx_packets, 1);
+	counter_add(&counters->tx_bytes, len);
+}
+
+inline void count_tx_error(net_device *dev)
+{
+	counter_add(&get_counters(dev)->tx_errors, 1);
+}
+
+/**
+ * パケットを捨てた理由を数える
+ * @param dev パケットを受信したデバイス。デバイスによらなければ nullptr
+ * @param reason
+ */
+inline void count_drop(net_device *dev, drop_reason reason)
+{
+	counter_add(&get_counters(dev)->drops[static_cast<uint8_t>(reason)], 1);
+}
+
+void init_net_device_stats(net_device *dev);
+
+void stats_init();
+
+void stats_shutdown();
+
+void dump_stats();
+
+#endif // CURO_STATS_H
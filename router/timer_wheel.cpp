@@ -0,0 +1,150 @@
+#include "timer_wheel.h"
+
+#include <cstring>
+
+/**
+ * タイミングホイールの初期化
+ * @param wheel
+ * @param tick 現在の tick
+ */
+void timer_wheel_init(timer_wheel *wheel, uint64_t tick)
+{
+	memset(wheel, 0, sizeof(timer_wheel));
+	wheel->current_tick = tick;
+}
+
+/**
+ * スロットの連結リストの先頭に追加
+ * @param slot
+ * @param node
+ */
+void timer_slot_push(timer_node **slot, timer_node *node)
+{
+	node->next = *slot;
+	if (*slot != nullptr)
+	{
+		(*slot)->pprev = &node->next;
+	}
+	*slot = node;
+	node->pprev = slot;
+}
+
+/**
+ * 満了までの残り tick 数から入れるレベルを決めてスロットに入れる
+ * @param wheel
+ * @param node
+ */
+void timer_wheel_place(timer_wheel *wheel, timer_node *node)
+{
+	uint64_t delta = node->expire - wheel->current_tick;
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+	{
+		uint64_t range = 1ull << (TIMER_WHEEL_SLOT_BITS * (level + 1));
+		if (delta < range or level == TIMER_WHEEL_LEVELS - 1)
+		{
+			// 最上位レベルの範囲を超える場合は一番遠いスロットに入れ、振り分け直しのたびに先送りする
+			uint64_t slot_tick = delta < range ? node->expire : wheel->current_tick + range - 1;
+			uint32_t index = (slot_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+			timer_slot_push(&wheel->slots[level][index], node);
+			return;
+		}
+	}
+}
+
+/**
+ * タイマーを登録する
+ * 登録済みの場合は満了時刻を付け替える
+ * @param wheel
+ * @param node
+ * @param expire 満了する tick
+ */
+void timer_wheel_add(timer_wheel *wheel, timer_node *node, uint64_t expire)
+{
+	timer_wheel_remove(node);
+
+	// 既に満了している場合は次の tick で満了させる
+	if (expire <= wheel->current_tick)
+	{
+		expire = wheel->current_tick + 1;
+	}
+	node->expire = expire;
+	timer_wheel_place(wheel, node);
+}
+
+/**
+ * タイマーを解除する
+ * @param node
+ */
+void timer_wheel_remove(timer_node *node)
+{
+	if (node->pprev == nullptr)
+	{
+		return;
+	}
+
+	*node->pprev = node->next;
+	if (node->next != nullptr)
+	{
+		node->next->pprev = node->pprev;
+	}
+	node->next = nullptr;
+	node->pprev = nullptr;
+}
+
+/**
+ * スロットのリストを丸ごと取り出す
+ * @param slot
+ * @return
+ */
+timer_node *timer_slot_detach(timer_node **slot)
+{
+	timer_node *head = *slot;
+	*slot = nullptr;
+	return head;
+}
+
+/**
+ * 現在の tick まで時間を進め、満了したタイマーのコールバックを呼ぶ
+ * 1 tick あたりの処理はスロット 1 つ分なので、タイマーの総数によらない
+ * @param wheel
+ * @param tick 現在の tick
+ * @param callback 満了時に呼ぶ関数。コールバックの中で再登録してもよい
+ * @param arg コールバックに渡す引数
+ */
+void timer_wheel_advance(timer_wheel *wheel, uint64_t tick, void (*callback)(timer_node *node, void *arg), void *arg)
+{
+	while (wheel->current_tick < tick)
+	{
+		wheel->current_tick++;
+		uint64_t now = wheel->current_tick;
+
+		// 下位のスロットが一周したら、上位のスロットを下位に振り分け直す
+		for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+		{
+			if ((now & ((1ull << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0)
+			{
+				break;
+			}
+
+			uint32_t index = (now >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+			timer_node *node = timer_slot_detach(&wheel->slots[level][index]);
+			while (node != nullptr)
+			{
+				timer_node *next = node->next;
+				node->pprev = nullptr;
+				timer_wheel_place(wheel, node);
+				node = next;
+			}
+		}
+
+		timer_node *node = timer_slot_detach(&wheel->slots[0][now & TIMER_WHEEL_SLOT_MASK]);
+		while (node != nullptr)
+		{
+			timer_node *next = node->next;
+			node->next = nullptr;
+			node->pprev = nullptr;
+			callback(node, arg);
+			node = next;
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef CURO_TIMER_WHEEL_H
+#define CURO_TIMER_WHEEL_H
+
+#include <cstdint>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * タイマーに登録する要素
+ * 管理したい構造体に埋め込んで使う
+ */
+struct timer_node
+{
+	timer_node *next;
+	timer_node **pprev; // 前の要素の next (リストに入っていなければ nullptr)
+	uint64_t expire;		// 満了する tick
+};
+
+/**
+ * 階層型タイミングホイール
+ * レベル 0 は 1 tick 単位、レベル n は 64^n tick 単位のスロットを持ち、
+ * 上位のスロットは満了が近づいたときに下位へ振り分け直す
+ */
+struct timer_wheel
+{
+	uint64_t current_tick;
+	timer_node *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t tick);
+
+void timer_wheel_add(timer_wheel *wheel, timer_node *node, uint64_t expire);
+
+void timer_wheel_remove(timer_node *node);
+
+void timer_wheel_advance(timer_wheel *wheel, uint64_t tick, void (*callback)(timer_node *node, void *arg), void *arg);
+
+#endif // CURO_TIMER_WHEEL_H
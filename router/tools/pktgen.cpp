@@ -0,0 +1,597 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "arp.h"
+#include "checksum.h"
+#include "ethernet.h"
+#include "icmp.h"
+#include "ip.h"
+#include "log.h"
+#include "my_buf.h"
+#include "net.h"
+#include "packet_socket.h"
+#include "utils.h"
+
+/**
+ * ルータのデバイスとヘッダの組み立てを使って、netns の構成にパケットを流すトラフィックジェネレータ
+ *
+ * 送信元を増やせば NAPT のテーブルを、宛先を増やせば FIB を試せる
+ * 送信したパケットには時刻を書いておき、返ってきたパケットで損失と往復時間を測る
+ * ICMP なら宛先のホストのカーネルが応答する。UDP なら、宛先側で --reflect の pktgen を動かして送り返す
+ *
+ * 例 (create_vnet_with_bridge.sh の構成)
+ *   ip netns exec host0 ./build/pktgen host0-br0 --src 192.168.1.100 --sources 50 --rate 100000
+ *   ip netns exec host2 ./build/pktgen host2-router2 --reflect --src 192.168.2.100 --sources 10
+ *   ip netns exec host0 ./build/pktgen host0-br0 --proto udp --dst 192.168.2.100 --destinations 10 --flows 100
+ */
+
+#define PKTGEN_MAGIC 0x6375726f // "curo"
+#define PKTGEN_MAX_SIZES 16
+#define PKTGEN_LATENCY_SAMPLES (1 << 20) // 往復時間の分布を求めるために残す数 (リザーバサンプリング)
+#define PKTGEN_ARP_RETRY_MS 1000
+#define PKTGEN_ARP_TIMEOUT_MS 5000
+#define PKTGEN_DRAIN_MS 1000 // 送信を終えてから、返ってくるパケットを待つ時間
+#define PKTGEN_BATCH_SIZE 32
+#define PKTGEN_UDP_HEADER_SIZE 8
+#define PKTGEN_PORT_BASE 10000
+#define PKTGEN_DEST_PORT 9
+
+// 送信するパケットのペイロードの先頭
+struct pktgen_payload
+{
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t send_ns;
+} __attribute__((packed));
+
+struct pktgen_size
+{
+	uint16_t len; // フレーム長 (FCS を除く)
+	uint32_t weight;
+};
+
+struct pktgen
+{
+	net_device *dev;
+	bool reflect;
+	uint8_t protocol;
+	uint32_t src_addr; // 送信元の最初のアドレス
+	uint32_t sources;
+	uint32_t dest_addr;
+	uint32_t destinations;
+	uint32_t flows; // 送信元と宛先の組ごとのフロー数 (ICMP の識別子か UDP の送信元ポートを変える)
+	uint32_t gateway;
+	uint64_t rate; // 1 秒あたりのパケット数。0 なら制限しない
+	uint32_t duration;
+	pktgen_size sizes[PKTGEN_MAX_SIZES];
+	uint32_t size_count;
+	uint32_t weight_sum;
+
+	uint8_t gateway_mac[ETHERNET_ADDRESS_LEN];
+	bool gateway_resolved;
+
+	// 統計
+	uint64_t sent;
+	uint64_t sent_bytes;
+	uint64_t received;
+	uint64_t received_bytes;
+	uint64_t reflected;
+	uint64_t latency_count;
+	uint64_t latency_sum_ns;
+	uint64_t latency_min_ns;
+	uint64_t latency_max_ns;
+	uint64_t *latency_samples;
+	uint64_t random_state;
+};
+
+uint64_t pktgen_random(pktgen *gen)
+{
+	// xorshift64 で、実行ごとに同じ順序になるようにする
+	gen->random_state ^= gen->random_state << 13;
+	gen->random_state ^= gen->random_state >> 7;
+	gen->random_state ^= gen->random_state << 17;
+	return gen->random_state;
+}
+
+bool is_pktgen_address(pktgen *gen, uint32_t addr)
+{
+	return addr - gen->src_addr < gen->sources;
+}
+
+/**
+ * ARP のパケットを送信する
+ */
+void pktgen_send_arp(pktgen *gen, uint16_t op, const uint8_t *dest_mac, uint32_t sender_addr, uint32_t target_addr)
+{
+	my_buf *arp_mybuf = my_buf::create(sizeof(arp_ip_to_ethernet));
+	auto *arp = reinterpret_cast<arp_ip_to_ethernet *>(arp_mybuf->buffer);
+	arp->htype = htons(ARP_HTYPE_ETHERNET);
+	arp->ptype = htons(ETHER_TYPE_IP);
+	arp->hlen = ETHERNET_ADDRESS_LEN;
+	arp->plen = IP_ADDRESS_LEN;
+	arp->op = htons(op);
+	memcpy(arp->sha, gen->dev->mac_addr, ETHERNET_ADDRESS_LEN);
+	arp->spa = htonl(sender_addr);
+	memcpy(arp->tha, op == ARP_OPERATION_CODE_REPLY ? dest_mac : ETHERNET_ADDRESS_BROADCAST, ETHERNET_ADDRESS_LEN);
+	arp->tpa = htonl(target_addr);
+	ethernet_encapsulate_output(gen->dev, dest_mac, arp_mybuf, ETHER_TYPE_ARP);
+}
+
+void pktgen_record_latency(pktgen *gen, uint64_t rtt)
+{
+	if (gen->latency_count < PKTGEN_LATENCY_SAMPLES)
+	{
+		gen->latency_samples[gen->latency_count] = rtt;
+	}
+	else
+	{
+		uint64_t index = pktgen_random(gen) % (gen->latency_count + 1);
+		if (index < PKTGEN_LATENCY_SAMPLES)
+		{
+			gen->latency_samples[index] = rtt;
+		}
+	}
+	gen->latency_count++;
+	gen->latency_sum_ns += rtt;
+	gen->latency_min_ns = std::min(gen->latency_min_ns, rtt);
+	gen->latency_max_ns = std::max(gen->latency_max_ns, rtt);
+}
+
+/**
+ * 受け取った UDP の宛先と送信元を入れ替えて、送ってきたルータに返す
+ */
+void pktgen_reflect(pktgen *gen, uint8_t *frame, ssize_t len, ip_header *ip_packet)
+{
+	auto *header = reinterpret_cast<ethernet_header *>(frame);
+	memcpy(header->dest_addr, header->src_addr, ETHERNET_ADDRESS_LEN);
+	memcpy(header->src_addr, gen->dev->mac_addr, ETHERNET_ADDRESS_LEN);
+
+	uint32_t src_addr = ip_packet->src_addr;
+	ip_packet->src_addr = ip_packet->dest_addr;
+	ip_packet->dest_addr = src_addr;
+	ip_packet->ttl = 64;
+	ip_packet->header_checksum = 0;
+	ip_packet->header_checksum = checksum_16(reinterpret_cast<uint16_t *>(frame + ETHERNET_HEADER_SIZE), sizeof(ip_header), 0);
+
+	auto *ports = reinterpret_cast<uint16_t *>(frame + ETHERNET_HEADER_SIZE + sizeof(ip_header));
+	std::swap(ports[0], ports[1]);
+	ports[3] = 0; // UDP のチェックサムは省略する
+
+	gen->dev->ops.transmit(gen->dev, frame, len, nullptr);
+	gen->reflected++;
+}
+
+/**
+ * デバイスが受信したフレームの処理
+ * 送信元のアドレスの ARP に応答し、返ってきたパケットで往復時間を測る
+ */
+void pktgen_input(net_device *dev, uint8_t *frame, ssize_t len, const net_offload *)
+{
+	auto *gen = (pktgen *)((net_device_data *)dev->data)->owner;
+	if (len < ETHERNET_HEADER_SIZE)
+	{
+		return;
+	}
+	size_t frame_len = len; // 負でないことを確かめたので、以降はヘッダの長さと符号なしで比べる
+	auto *header = reinterpret_cast<ethernet_header *>(frame);
+	if (memcmp(header->dest_addr, dev->mac_addr, ETHERNET_ADDRESS_LEN) != 0 and memcmp(header->dest_addr, ETHERNET_ADDRESS_BROADCAST, ETHERNET_ADDRESS_LEN) != 0)
+	{
+		return;
+	}
+
+	if (ntohs(header->type) == ETHER_TYPE_ARP)
+	{
+		if (frame_len < ETHERNET_HEADER_SIZE + sizeof(arp_ip_to_ethernet))
+		{
+			return;
+		}
+		auto *arp = reinterpret_cast<arp_ip_to_ethernet *>(frame + ETHERNET_HEADER_SIZE);
+		if (ntohl(arp->spa) == gen->gateway)
+		{
+			memcpy(gen->gateway_mac, arp->sha, ETHERNET_ADDRESS_LEN);
+			gen->gateway_resolved = true;
+		}
+		if (ntohs(arp->op) == ARP_OPERATION_CODE_REQUEST and is_pktgen_address(gen, ntohl(arp->tpa)))
+		{
+			pktgen_send_arp(gen, ARP_OPERATION_CODE_REPLY, arp->sha, ntohl(arp->tpa), ntohl(arp->spa));
+		}
+		return;
+	}
+
+	if (ntohs(header->type) != ETHER_TYPE_IP or frame_len < ETHERNET_HEADER_SIZE + sizeof(ip_header))
+	{
+		return;
+	}
+	auto *ip_packet = reinterpret_cast<ip_header *>(frame + ETHERNET_HEADER_SIZE);
+	if (ip_packet->header_len != (sizeof(ip_header) >> 2) or !is_pktgen_address(gen, ntohl(ip_packet->dest_addr)))
+	{
+		return;
+	}
+
+	uint8_t *l4 = frame + ETHERNET_HEADER_SIZE + sizeof(ip_header);
+	size_t payload_offset;
+	if (ip_packet->protocol == IP_PROTOCOL_NUM_UDP)
+	{
+		if (gen->reflect)
+		{
+			if (frame_len >= ETHERNET_HEADER_SIZE + sizeof(ip_header) + PKTGEN_UDP_HEADER_SIZE)
+			{
+				pktgen_reflect(gen, frame, len, ip_packet);
+			}
+			return;
+		}
+		payload_offset = PKTGEN_UDP_HEADER_SIZE;
+	}
+	else if (ip_packet->protocol == IP_PROTOCOL_NUM_ICMP and reinterpret_cast<icmp_header *>(l4)->type == ICMP_TYPE_ECHO_REPLY)
+	{
+		payload_offset = sizeof(icmp_header) + sizeof(icmp_echo);
+	}
+	else
+	{
+		return;
+	}
+	if (frame_len < ETHERNET_HEADER_SIZE + sizeof(ip_header) + payload_offset + sizeof(pktgen_payload))
+	{
+		return;
+	}
+
+	auto *payload = reinterpret_cast<pktgen_payload *>(l4 + payload_offset);
+	if (payload->magic != htonl(PKTGEN_MAGIC))
+	{
+		return;
+	}
+	pktgen_record_latency(gen, current_time_ns() - payload->send_ns);
+	gen->received++;
+	gen->received_bytes += len;
+}
+
+/**
+ * sequence 番目のパケットを組み立てて送信する
+ * フローは送信元、宛先、識別子 (ポート) の順に変えて、順番に回す
+ */
+void pktgen_send(pktgen *gen, uint32_t sequence)
+{
+	uint64_t flow = sequence % (static_cast<uint64_t>(gen->sources) * gen->destinations * gen->flows);
+	uint32_t src_addr = gen->src_addr + flow % gen->sources;
+	uint32_t dest_addr = gen->dest_addr + flow / gen->sources % gen->destinations;
+	uint16_t id = PKTGEN_PORT_BASE + flow / (static_cast<uint64_t>(gen->sources) * gen->destinations);
+
+	// 重みに従ってフレーム長を選ぶ
+	uint16_t frame_len = gen->sizes[0].len;
+	if (gen->size_count > 1)
+	{
+		uint32_t pick = pktgen_random(gen) % gen->weight_sum;
+		for (uint32_t i = 0; i < gen->size_count; ++i)
+		{
+			if (pick < gen->sizes[i].weight)
+			{
+				frame_len = gen->sizes[i].len;
+				break;
+			}
+			pick -= gen->sizes[i].weight;
+		}
+	}
+	size_t l4_len = frame_len - ETHERNET_HEADER_SIZE - sizeof(ip_header);
+
+	my_buf *l4_mybuf = my_buf::create(l4_len);
+	pktgen_payload *payload;
+	if (gen->protocol == IP_PROTOCOL_NUM_ICMP)
+	{
+		auto *icmp_msg = reinterpret_cast<icmp_message *>(l4_mybuf->buffer);
+		icmp_msg->header.type = ICMP_TYPE_ECHO_REQUEST;
+		icmp_msg->echo.identify = htons(id);
+		icmp_msg->echo.sequence = htons(sequence);
+		payload = reinterpret_cast<pktgen_payload *>(icmp_msg->echo.data);
+	}
+	else
+	{
+		uint16_t ports[4] = {htons(id), htons(PKTGEN_DEST_PORT), htons(l4_len), 0};
+		memcpy(l4_mybuf->buffer, ports, PKTGEN_UDP_HEADER_SIZE);
+		payload = reinterpret_cast<pktgen_payload *>(l4_mybuf->buffer + PKTGEN_UDP_HEADER_SIZE);
+	}
+	payload->magic = htonl(PKTGEN_MAGIC);
+	payload->sequence = sequence;
+	payload->send_ns = current_time_ns();
+	if (gen->protocol == IP_PROTOCOL_NUM_ICMP)
+	{
+		auto *icmp_msg = reinterpret_cast<icmp_message *>(l4_mybuf->buffer);
+		icmp_msg->header.checksum = checksum_16(reinterpret_cast<uint16_t *>(l4_mybuf->buffer), l4_len, 0);
+	}
+
+	my_buf *ip_mybuf = my_buf::create(IP_HEADER_SIZE);
+	l4_mybuf->add_header(ip_mybuf);
+	ip_set_header(reinterpret_cast<ip_header *>(ip_mybuf->buffer), dest_addr, src_addr, l4_len, gen->protocol);
+	ethernet_encapsulate_output(gen->dev, gen->gateway_mac, ip_mybuf, ETHER_TYPE_IP);
+
+	gen->sent++;
+	gen->sent_bytes += frame_len;
+}
+
+/**
+ * 受信キューにあるフレームを処理する
+ * net_device_poll は 1 回で 1 フレームしか読まないので、キューが空になるまで続けて呼ぶ
+ */
+void pktgen_poll(pktgen *gen)
+{
+	for (int i = 0; i < PKTGEN_BATCH_SIZE; ++i)
+	{
+		if (gen->dev->ops.poll(gen->dev) <= 0)
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * ゲートウェイの MAC アドレスを ARP で解決する
+ * @return 解決できなければ false
+ */
+bool pktgen_resolve_gateway(pktgen *gen)
+{
+	uint64_t start = current_time_ms();
+	uint64_t last_request = 0;
+	while (!gen->gateway_resolved)
+	{
+		uint64_t now = current_time_ms();
+		if (now - start >= PKTGEN_ARP_TIMEOUT_MS)
+		{
+			return false;
+		}
+		if (last_request == 0 or now - last_request >= PKTGEN_ARP_RETRY_MS)
+		{
+			pktgen_send_arp(gen, ARP_OPERATION_CODE_REQUEST, ETHERNET_ADDRESS_BROADCAST, gen->src_addr, gen->gateway);
+			last_request = now;
+		}
+		pktgen_poll(gen);
+	}
+	return true;
+}
+
+void dump_pktgen_result(pktgen *gen, double elapsed)
+{
+	uint64_t lost = gen->sent > gen->received ? gen->sent - gen->received : 0;
+	printf("Sent %lu packets (%lu bytes) in %.2f s: %.3f Mpps, %.1f Mbps\n",
+				 gen->sent, gen->sent_bytes, elapsed, gen->sent / elapsed / 1e6, gen->sent_bytes * 8 / elapsed / 1e6);
+	printf("Received %lu packets (%lu bytes), lost %lu (%.3f%%)\n",
+				 gen->received, gen->received_bytes, lost, gen->sent != 0 ? 100.0 * lost / gen->sent : 0);
+	if (gen->latency_count == 0)
+	{
+		return;
+	}
+
+	uint64_t samples = std::min<uint64_t>(gen->latency_count, PKTGEN_LATENCY_SAMPLES);
+	std::sort(gen->latency_samples, gen->latency_samples + samples);
+	printf("Round trip time: min %luns avg %.0fns p50 %luns p90 %luns p99 %luns p99.9 %luns max %luns\n",
+				 gen->latency_min_ns, static_cast<double>(gen->latency_sum_ns) / gen->latency_count,
+				 gen->latency_samples[samples / 2], gen->latency_samples[samples * 90 / 100],
+				 gen->latency_samples[samples * 99 / 100], gen->latency_samples[samples * 999 / 1000], gen->latency_max_ns);
+}
+
+/**
+ * 送信元のアドレスで返ってくるパケットを待ち、UDP を送り返し続ける
+ */
+int run_pktgen_reflect(pktgen *gen)
+{
+	printf("Reflecting UDP to %s and %u following addresses on %s\n", ip_htoa(gen->src_addr), gen->sources - 1, gen->dev->name);
+	uint64_t end_ms = gen->duration != 0 ? current_time_ms() + gen->duration * 1000ull : UINT64_MAX;
+	while (current_time_ms() < end_ms)
+	{
+		pktgen_poll(gen);
+	}
+	printf("Reflected %lu packets\n", gen->reflected);
+	return EXIT_SUCCESS;
+}
+
+int run_pktgen(pktgen *gen)
+{
+	if (!pktgen_resolve_gateway(gen))
+	{
+		LOG_ERROR("Failed to resolve gateway %s\n", ip_htoa(gen->gateway));
+		return EXIT_FAILURE;
+	}
+	printf("Sending %s from %s (%u addresses) to %s (%u addresses), %u flows per pair, rate %lu pps\n",
+				 gen->protocol == IP_PROTOCOL_NUM_ICMP ? "ICMP" : "UDP", ip_htoa(gen->src_addr), gen->sources,
+				 ip_htoa(gen->dest_addr), gen->destinations, gen->flows, gen->rate);
+
+	uint64_t start_ns = current_time_ns();
+	uint64_t end_ns = start_ns + gen->duration * 1000000000ull;
+	uint64_t interval_ns = gen->rate != 0 ? 1000000000ull / gen->rate : 0;
+	uint64_t next_ns = start_ns;
+	uint32_t sequence = 0;
+	uint64_t now_ns;
+	while ((now_ns = current_time_ns()) < end_ns)
+	{
+		// 遅れた分はまとめて送るが、一度に送るのは PKTGEN_BATCH_SIZE までにする
+		for (int i = 0; i < PKTGEN_BATCH_SIZE and next_ns <= now_ns; ++i)
+		{
+			pktgen_send(gen, sequence++);
+			next_ns += interval_ns;
+		}
+		if (next_ns + interval_ns * PKTGEN_BATCH_SIZE < now_ns)
+		{
+			next_ns = now_ns;
+		}
+		pktgen_poll(gen);
+	}
+	double elapsed = (now_ns - start_ns) / 1e9;
+
+	uint64_t drain_end_ms = current_time_ms() + PKTGEN_DRAIN_MS;
+	while (current_time_ms() < drain_end_ms and gen->received < gen->sent)
+	{
+		pktgen_poll(gen);
+	}
+	dump_pktgen_result(gen, elapsed);
+	return EXIT_SUCCESS;
+}
+
+bool parse_address(const char *str, uint32_t *addr)
+{
+	in_addr in{};
+	if (inet_pton(AF_INET, str, &in) != 1)
+	{
+		LOG_ERROR("Invalid address %s\n", str);
+		return false;
+	}
+	*addr = ntohl(in.s_addr);
+	return true;
+}
+
+/**
+ * 64,576:4,1500 のような、フレーム長と重みのリストを読む
+ */
+bool parse_sizes(pktgen *gen, const char *str)
+{
+	gen->size_count = 0;
+	gen->weight_sum = 0;
+	const size_t min_len = ETHERNET_HEADER_SIZE + sizeof(ip_header) + std::max(sizeof(icmp_header) + sizeof(icmp_echo), (size_t)PKTGEN_UDP_HEADER_SIZE) + sizeof(pktgen_payload);
+	while (*str != '\0')
+	{
+		if (gen->size_count == PKTGEN_MAX_SIZES)
+		{
+			LOG_ERROR("Too many sizes\n");
+			return false;
+		}
+		char *end;
+		unsigned long len = strtoul(str, &end, 10);
+		unsigned long weight = 1;
+		if (*end == ':')
+		{
+			weight = strtoul(end + 1, &end, 10);
+		}
+		if (len < min_len or len > ETHERNET_HEADER_SIZE + 1500 or weight == 0 or (*end != ',' and *end != '\0'))
+		{
+			LOG_ERROR("Invalid size %s (frame length must be %zu-%d)\n", str, min_len, ETHERNET_HEADER_SIZE + 1500);
+			return false;
+		}
+		gen->sizes[gen->size_count++] = {static_cast<uint16_t>(len), static_cast<uint32_t>(weight)};
+		gen->weight_sum += weight;
+		str = *end == ',' ? end + 1 : end;
+	}
+	return gen->size_count != 0;
+}
+
+void usage()
+{
+	fprintf(stderr,
+					"usage: pktgen <interface> [options]\n"
+					"  --proto icmp|udp      protocol to send (default icmp)\n"
+					"  --src ADDR            first source address (default 192.168.1.100)\n"
+					"  --sources N           number of source addresses (default 1)\n"
+					"  --dst ADDR            first destination address (default 192.168.2.2)\n"
+					"  --destinations N      number of destination addresses (default 1)\n"
+					"  --flows N             ICMP ids / UDP source ports per source and destination (default 1)\n"
+					"  --gateway ADDR        next hop to resolve (default 192.168.1.1)\n"
+					"  --rate PPS            packets per second, 0 for unlimited (default 10000)\n"
+					"  --sizes LEN[:W],...   frame lengths and weights (default 64)\n"
+					"  --duration SECONDS    (default 5, 0 runs --reflect forever)\n"
+					"  --reflect             send UDP to --src addresses back instead of generating\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	pktgen gen{};
+	gen.protocol = IP_PROTOCOL_NUM_ICMP;
+	gen.src_addr = IP_ADDRESS(192, 168, 1, 100);
+	gen.sources = 1;
+	gen.dest_addr = IP_ADDRESS(192, 168, 2, 2);
+	gen.destinations = 1;
+	gen.flows = 1;
+	gen.gateway = IP_ADDRESS(192, 168, 1, 1);
+	gen.rate = 10000;
+	gen.duration = 5;
+	gen.sizes[0] = {64, 1};
+	gen.size_count = 1;
+	gen.weight_sum = 1;
+	gen.latency_min_ns = UINT64_MAX;
+	gen.random_state = 0x9e3779b97f4a7c15;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		const char *option = argv[i];
+		if (strcmp(option, "--reflect") == 0)
+		{
+			gen.reflect = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			usage();
+			return EXIT_FAILURE;
+		}
+		const char *value = argv[++i];
+		bool ok = true;
+		if (strcmp(option, "--proto") == 0)
+		{
+			ok = strcmp(value, "icmp") == 0 or strcmp(value, "udp") == 0;
+			gen.protocol = strcmp(value, "udp") == 0 ? IP_PROTOCOL_NUM_UDP : IP_PROTOCOL_NUM_ICMP;
+		}
+		else if (strcmp(option, "--src") == 0)
+		{
+			ok = parse_address(value, &gen.src_addr);
+		}
+		else if (strcmp(option, "--sources") == 0)
+		{
+			gen.sources = atoi(value);
+		}
+		else if (strcmp(option, "--dst") == 0)
+		{
+			ok = parse_address(value, &gen.dest_addr);
+		}
+		else if (strcmp(option, "--destinations") == 0)
+		{
+			gen.destinations = atoi(value);
+		}
+		else if (strcmp(option, "--flows") == 0)
+		{
+			gen.flows = atoi(value);
+		}
+		else if (strcmp(option, "--gateway") == 0)
+		{
+			ok = parse_address(value, &gen.gateway);
+		}
+		else if (strcmp(option, "--rate") == 0)
+		{
+			gen.rate = strtoull(value, nullptr, 10);
+		}
+		else if (strcmp(option, "--sizes") == 0)
+		{
+			ok = parse_sizes(&gen, value);
+		}
+		else if (strcmp(option, "--duration") == 0)
+		{
+			gen.duration = atoi(value);
+		}
+		else
+		{
+			ok = false;
+		}
+		if (!ok)
+		{
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (gen.sources == 0 or gen.destinations == 0 or gen.flows == 0 or gen.flows > 65536 - PKTGEN_PORT_BASE)
+	{
+		LOG_ERROR("--sources, --destinations and --flows must be positive (--flows up to %d)\n", 65536 - PKTGEN_PORT_BASE);
+		return EXIT_FAILURE;
+	}
+
+	gen.dev = create_packet_socket_device(argv[1]);
+	gen.latency_samples = (uint64_t *)calloc(PKTGEN_LATENCY_SAMPLES, sizeof(uint64_t));
+	if (gen.dev == nullptr or gen.latency_samples == nullptr)
+	{
+		return EXIT_FAILURE;
+	}
+	packet_socket_set_receive_handler(gen.dev, pktgen_input, &gen);
+
+	return gen.reflect ? run_pktgen_reflect(&gen) : run_pktgen(&gen);
+}
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <ctime>
+#include <sys/random.h>
 #include <iostream>
 
 /**
@@ -37,10 +39,9 @@ uint32_t htonl(uint32_t v)
 	return swap_byte_order_32(v);
 }
 
-uint8_t ip_string_pool_index = 0;
-
-// 16 byte の領域を4つ確保
-char ip_string_pool[4][16];
+// 16 byte の領域を4つ確保 (ワーカーが同時に使うので、スレッドごとに持つ)
+thread_local uint8_t ip_string_pool_index = 0;
+thread_local char ip_string_pool[4][16];
 
 /**
  * IP アドレスから文字列へ変換
@@ -65,9 +66,9 @@ const char *ip_htoa(uint32_t in)
 	return ip_ntoa(htonl(in));
 }
 
-uint8_t mac_addr_string_pool_index = 0;
-// 18 byte の領域を4つ確保
-char mac_addr_string_pool[4][18];
+// 18 byte の領域を4つ確保 (スレッドごと)
+thread_local uint8_t mac_addr_string_pool_index = 0;
+thread_local char mac_addr_string_pool[4][18];
 
 /**
  * Mac Address から文字列に変換
@@ -83,35 +84,57 @@ const char *mac_addr_toa(const uint8_t *addr)
 }
 
 /**
- * Checksum の計算
- * @param buffer
- * @param count
- * @param start
+ * 単調増加する現在時刻をミリ秒で返す
+ * タイマー処理の基準として使う
  * @return
  */
-uint16_t checksum_16(uint16_t *buffer, size_t count, uint16_t start)
+uint64_t current_time_ms()
 {
-	uint32_t sum = start;
+	timespec ts{};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	// まず16bit 毎に加算
-	while (count > 1)
-	{
-		sum += *buffer++;
-		count -= 2;
-	}
+/**
+ * 単調増加する現在時刻をナノ秒で返す
+ * 処理時間の計測に使う
+ * @return
+ */
+uint64_t current_time_ns()
+{
+	timespec ts{};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	// 16bit に収まらない場合は、1byte だけ残るので、それを加算
-	if (count > 0)
-	{
-		sum += *(uint8_t *)buffer;
-	}
+thread_local uint64_t random_state = 0;
 
-	// 溢れた桁を折り返して足す
-	while (sum >> 16)
+/**
+ * 32bit の乱数を返す (xorshift64*)
+ * 状態はスレッドごとに持ち、スレッドの初回呼び出し時にカーネルの乱数でシードを設定する
+ * @return
+ */
+uint32_t random_u32()
+{
+	while (random_state == 0)
 	{
-		sum = (sum & 0xffff) + (sum >> 16);
+		if (getrandom(&random_state, sizeof(random_state), 0) != sizeof(random_state))
+		{
+			random_state = current_time_ms() | 1;
+		}
 	}
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return (random_state * 0x2545f4914f6cdd1dull) >> 32;
+}
 
-	// 論理否定をとって返す
-	return ~sum;
+/**
+ * このスレッドの乱数のシードを決めた値にする
+ * 同じ結果を再現したい計測で使う
+ * @param seed 0 の状態からは抜け出せないので、0 なら 1 にする
+ */
+void random_seed(uint64_t seed)
+{
+	random_state = seed == 0 ? 1 : seed;
 }
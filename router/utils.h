@@ -16,4 +16,10 @@ const char *mac_addr_toa(const uint8_t *addr);
 
 uint16_t checksum_16(uint16_t *buffer, size_t count, uint16_t start = 0);
 
+uint64_t current_time_ms();
+uint64_t current_time_ns();
+
+uint32_t random_u32();
+void random_seed(uint64_t seed);
+
 #endif // CURO_UTILS_H
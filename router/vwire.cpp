@@ -0,0 +1,130 @@
+#include "vwire.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "ethernet.h"
+#include "latency.h"
+#include "stats.h"
+
+int vwire_device_transmit(net_device *dev, uint8_t *buffer, size_t len, const net_offload *offload);
+int vwire_device_poll(net_device *dev);
+
+void vwire_ethernet_input(net_device *dev, uint8_t *frame, size_t len)
+{
+	ethernet_input(dev, frame, len);
+}
+
+vwire_ring *create_vwire_ring()
+{
+	void *memory = aligned_alloc(alignof(vwire_ring), sizeof(vwire_ring));
+	if (memory == nullptr)
+	{
+		return nullptr;
+	}
+	return new (memory) vwire_ring();
+}
+
+net_device *create_vwire_device(const char *name, const uint8_t *mac_addr)
+{
+	auto *dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(vwire_device_data));
+	if (dev == nullptr)
+	{
+		return nullptr;
+	}
+	dev->ops.transmit = vwire_device_transmit;
+	dev->ops.poll = vwire_device_poll;
+	strncpy(dev->name, name, sizeof(dev->name) - 1);
+	memcpy(dev->mac_addr, mac_addr, ETHERNET_ADDRESS_LEN);
+	init_net_device_stats(dev);
+	((vwire_device_data *)dev->data)->receive = vwire_ethernet_input;
+	return dev;
+}
+
+/**
+ * 仮想的なケーブルでつながったデバイスの組を作る
+ * 受信したフレームは ethernet_input に渡すので、そのままルータのデバイスとして使える
+ * @param name_a
+ * @param mac_a
+ * @param name_b
+ * @param mac_b
+ * @param a
+ * @param b
+ * @return
+ */
+bool create_vwire(const char *name_a, const uint8_t *mac_a, const char *name_b, const uint8_t *mac_b, net_device **a, net_device **b)
+{
+	*a = create_vwire_device(name_a, mac_a);
+	*b = create_vwire_device(name_b, mac_b);
+	vwire_ring *a_to_b = create_vwire_ring();
+	vwire_ring *b_to_a = create_vwire_ring();
+	if (*a == nullptr or *b == nullptr or a_to_b == nullptr or b_to_a == nullptr)
+	{
+		return false;
+	}
+
+	auto *a_data = (vwire_device_data *)(*a)->data;
+	auto *b_data = (vwire_device_data *)(*b)->data;
+	a_data->tx = a_to_b;
+	a_data->rx = b_to_a;
+	a_data->peer = *b;
+	b_data->tx = b_to_a;
+	b_data->rx = a_to_b;
+	b_data->peer = *a;
+	return true;
+}
+
+/**
+ * 受信したフレームを ethernet_input 以外に渡す
+ * @param dev
+ * @param receive
+ * @param owner receive の中で使うデータ
+ */
+void vwire_set_receive_handler(net_device *dev, vwire_receive_handler receive, void *owner)
+{
+	auto *data = (vwire_device_data *)dev->data;
+	data->receive = receive;
+	data->owner = owner;
+}
+
+/**
+ * 相手の受信リングにフレームをコピーする
+ * オフロードの情報は渡せないので、GSO のフレームは送れない
+ */
+int vwire_device_transmit(net_device *dev, uint8_t *buffer, size_t len, const net_offload *)
+{
+	LATENCY_STAGE(transmit);
+	auto *data = (vwire_device_data *)dev->data;
+	vwire_frame *frame = len <= VWIRE_FRAME_MAX_SIZE ? spsc_ring_reserve(data->tx) : nullptr;
+	if (frame == nullptr)
+	{
+		data->tx_drops++;
+		LATENCY_END();
+		return -1;
+	}
+	frame->len = len;
+	memcpy(frame->data, buffer, len);
+	spsc_ring_commit(data->tx);
+	LATENCY_END();
+	return 0;
+}
+
+/**
+ * 受信リングのフレームを VWIRE_BATCH_SIZE 個まで処理する
+ * フレームはリングのスロットのまま渡し、処理が終わってから返す
+ */
+int vwire_device_poll(net_device *dev)
+{
+	auto *data = (vwire_device_data *)dev->data;
+	int count = 0;
+	vwire_frame *frame;
+	while (count < VWIRE_BATCH_SIZE and (frame = spsc_ring_peek(data->rx)) != nullptr)
+	{
+		LATENCY_BEGIN(nullptr);
+		data->receive(dev, frame->data, frame->len);
+		LATENCY_CLEAR();
+		spsc_ring_release(data->rx);
+		count++;
+	}
+	return count;
+}
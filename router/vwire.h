@@ -0,0 +1,50 @@
+#ifndef CURO_VWIRE_H
+#define CURO_VWIRE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "net.h"
+#include "spsc_ring.h"
+
+/**
+ * プロセスの中の仮想的なケーブル
+ * 2 つのデバイスを向きごとのリングでつなぎ、片方で送信したフレームをもう片方の poll で受信する
+ * リングは書き込み側と読み出し側が 1 スレッドずつならロックなしで使えるので、
+ * 1 スレッドで順に処理しても、両端を別のスレッドで処理してもよい
+ */
+
+#define VWIRE_RING_SIZE 1024 // 向きごとのリングのフレーム数 (2 のべき乗)
+#define VWIRE_FRAME_MAX_SIZE 2048 // これより長いフレームは送信できない
+#define VWIRE_BATCH_SIZE 32 // 1 回の poll で受信するフレーム数
+
+struct vwire_frame
+{
+	uint32_t len;
+	uint8_t data[VWIRE_FRAME_MAX_SIZE];
+};
+
+typedef spsc_ring<vwire_frame, VWIRE_RING_SIZE> vwire_ring;
+
+/**
+ * 受信したフレームを渡す関数
+ * ルータのデバイスなら ethernet_input で、シミュレーションのホストなどは自分の処理に差し替える
+ */
+typedef void (*vwire_receive_handler)(net_device *dev, uint8_t *frame, size_t len);
+
+struct vwire_device_data
+{
+	vwire_ring *rx; // 相手が送信したフレーム
+	vwire_ring *tx; // 相手の rx
+	net_device *peer;
+	vwire_receive_handler receive;
+	void *owner; // receive が使うデータ (nullable)
+
+	// 統計
+	uint64_t tx_drops; // リングが満杯か、長すぎて送れなかった数
+};
+
+bool create_vwire(const char *name_a, const uint8_t *mac_a, const char *name_b, const uint8_t *mac_b, net_device **a, net_device **b);
+
+void vwire_set_receive_handler(net_device *dev, vwire_receive_handler receive, void *owner);
+
+#endif // CURO_VWIRE_H
@@ -0,0 +1,102 @@
+#include "worker.h"
+
+#include "arp.h"
+#include "egress_queue.h"
+#include "flow_export.h"
+#include "napt.h"
+#include "net.h"
+#include "policer.h"
+#include <atomic>
+#include <thread>
+
+uint32_t worker_count = 1;
+
+thread_local uint32_t worker_id = 0;
+
+// ワーカー 0 は main のスレッドで、それ以外のワーカーのスレッド
+std::thread worker_threads[WORKER_MAX];
+std::atomic<bool> worker_running{false};
+
+/**
+ * このワーカーの処理を 1 回ずつ行う
+ * 受信は担当のデバイスだけ、送信キューはワーカーごとなので全てのデバイスを処理する
+ */
+void worker_iteration()
+{
+	// poll communication from device
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		if (dev->worker == worker_id)
+		{
+			dev->ops.poll(dev);
+		}
+	}
+
+	// 送信キューに溜まっているフレームの送信
+	for (net_device *dev = net_dev_list; dev; dev = dev->next)
+	{
+		egress_queue_poll(dev);
+	}
+
+	// 他のワーカーから渡された NAPT のパケットの処理
+	nat_handoff_poll();
+
+	// NAT セッションのタイムアウト (担当のシャードだけ)
+	nat_timer();
+	// サンプリングしたフローの送出
+	flow_export_timer();
+
+	// 全てのワーカーで共有している状態のタイマーは、ワーカー 0 だけが処理する
+	if (worker_id == 0)
+	{
+		// ARP リクエストの再送
+		arp_timer();
+		// レート制限のカウンタの減衰
+		policer_timer();
+	}
+}
+
+/**
+ * ワーカーのスレッドのメイン
+ * @param id
+ */
+void worker_main(uint32_t id)
+{
+	worker_id = id;
+	while (worker_running.load(std::memory_order_relaxed))
+	{
+		worker_iteration();
+	}
+}
+
+/**
+ * ワーカー 1 以降のスレッドを起動する。ワーカー 0 は呼び出したスレッドが worker_iteration を呼んで処理する
+ * 設定を全て済ませてから呼ぶ
+ */
+void worker_start()
+{
+	if (worker_count <= 1)
+	{
+		return;
+	}
+	worker_running.store(true);
+	for (uint32_t i = 1; i < worker_count; ++i)
+	{
+		worker_threads[i] = std::thread(worker_main, i);
+	}
+}
+
+/**
+ * ワーカーのスレッドを止めて、終了を待つ
+ */
+void worker_shutdown()
+{
+	if (!worker_running.exchange(false))
+	{
+		return;
+	}
+	for (uint32_t i = 1; i < worker_count; ++i)
+	{
+		worker_threads[i].join();
+	}
+}
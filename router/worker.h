@@ -0,0 +1,25 @@
+#ifndef CURO_WORKER_H
+#define CURO_WORKER_H
+
+#include <cstdint>
+
+#define WORKER_MAX 16
+
+/**
+ * パケットを処理するワーカーの数
+ * ワーカーごとに NAPT のシャードなどの状態を持ち、ロックなしで処理する
+ */
+extern uint32_t worker_count;
+
+/**
+ * このスレッドが担当するワーカーの番号
+ */
+extern thread_local uint32_t worker_id;
+
+void worker_iteration();
+
+void worker_start();
+
+void worker_shutdown();
+
+#endif // CURO_WORKER_H